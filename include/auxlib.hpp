@@ -0,0 +1,41 @@
+#pragma once
+
+#include <object.hpp>
+#include <vm.hpp>
+#include <memory>
+#include <string>
+
+namespace luao {
+
+/*
+    Helpers shared by the native libraries, after lauxlib.h: reading the
+    arguments of a native call at stack[base_reg], reporting bad ones, and
+    building result values.
+*/
+
+// the n-th argument (1-based), or nil when fewer were passed
+inline const LuaValue& arg_at(VM& vm, int base_reg, int num_args, int n) {
+    static const LuaValue nil_value;
+    if (n > num_args) return nil_value;
+    return *vm.get_stack()[base_reg + n - 1];
+}
+
+// the type name of the n-th argument for error messages, "no value" when missing
+inline std::string arg_typename(VM& vm, int base_reg, int num_args, int n) {
+    if (n > num_args) return "no value";
+    return arg_at(vm, base_reg, num_args, n).typeName();
+}
+
+[[noreturn]] inline void arg_error(int n, const char* fname, const std::string& msg) {
+    throw LuaError("bad argument #" + std::to_string(n) + " to '" + fname + "' (" + msg + ")");
+}
+
+inline LuaValue make_int(luaInt v) {
+    return LuaValue(std::make_shared<LuaInteger>(v), LuaType::NUMBER);
+}
+
+inline LuaValue make_string(std::string s) {
+    return LuaValue(std::make_shared<LuaString>(std::move(s)), LuaType::STRING);
+}
+
+} // namespace luao
@@ -1,83 +1,353 @@
 #pragma once
 
 #include "parser.hpp"
+#include "typecheck.hpp"
 #include "opcodes.hpp"
+#include <function.hpp>
 #include <vector>
 #include <string>
+#include <string_view>
 #include <memory>
 #include <map>
-#include <variant>
+#include <set>
 
 namespace luao {
 
-// Represents a constant value in the chunk
-using Value = std::variant<std::nullptr_t, bool, double, std::string>;
-
-// Represents a compiled function prototype
-struct FunctionProto {
-    std::vector<Instruction> code;
-    std::vector<Value> constants;
-    std::vector<std::unique_ptr<FunctionProto>> protos;
-    int num_params = 0;
-    int max_stack_size = 0;
-    bool is_vararg = false;
-    // Debug info
-    std::vector<int> line_info;
-};
-
-// Forward declaration
-class AstVisitor;
+/*
+    Compiles a parsed chunk to Lua 5.4 register bytecode.
 
-// Main class to generate bytecode from an AST
+    Expressions are compiled to expression descriptors (ExpDesc) that are
+    only materialised into a register when the consumer needs one, so
+    locals, constants and upvalues are used in place and temporaries live in
+    a stack-disciplined register window above the active locals. Conditions
+    compile to jump lists that are patched once their targets are known.
+    The structure follows lcode.c/lparser.c, walking the AST instead of the
+    token stream.
+*/
 class BytecodeGenerator {
 public:
-    std::unique_ptr<FunctionProto> generate(const Block& ast);
+    // optlevel 0 keeps the code exactly as generated; 1 and up inline small
+    // local functions and run the peephole pass (peephole.hpp) over every
+    // finished function; 2 also runs the SSA passes (ssa.hpp) before the
+    // peephole pass.
+    // `inline_globals` (optlevel 1 and up) also inlines global functions
+    // defined once at the top level of the chunk. That assumes nothing
+    // else assigns them, which a store through _G, an alias of _ENV or
+    // another chunk can break unseen, so no optlevel implies it.
+    explicit BytecodeGenerator(int optlevel = 1, bool inline_globals = false)
+        : optlevel_(optlevel), inline_globals_(inline_globals) {}
+
+    // `source` is used in error messages and recorded in the prototypes.
+    // The chunk is type checked first (typecheck.hpp), which annotates it.
+    std::shared_ptr<LuaFunction> generate(Block& ast, const std::string& source = "?");
 
 private:
-    // Per-function state during compilation
-    struct FunctionState {
-        FunctionProto* proto = nullptr;
-        FunctionState* parent = nullptr;
+    enum ExpKind {
+        VVOID,      /* empty expression list */
+        VNIL,
+        VTRUE,
+        VFALSE,
+        VK,         /* constant; info = index in K */
+        VKFLT,      /* float constant; nval */
+        VKINT,      /* integer constant; ival */
+        VKSTR,      /* string constant; strval */
+        VNONRELOC,  /* value in a fixed register; info = register */
+        VLOCAL,     /* local variable; ridx = register, vidx = index in actvars */
+        VUPVAL,     /* upvalue; info = index in upvals */
+        VCONST,     /* compile-time <const>; info = index in actvars, ind_t = functions up */
+        VINDEXED,   /* t[k]; ind_t = table register, ind_idx = key register */
+        VINDEXUP,   /* upvalue[K]; ind_t = upvalue, ind_idx = string constant */
+        VINDEXI,    /* t[i]; ind_idx = integer key */
+        VINDEXSTR,  /* t.name; ind_idx = string constant */
+        VJMP,       /* test/comparison; info = pc of its jump */
+        VRELOC,     /* result can go to any register; info = pc of the instruction */
+        VCALL,      /* info = pc of CALL */
+        VVARARG,    /* info = pc of VARARG */
+    };
+
+    struct ExpDesc {
+        ExpKind k = VVOID;
+        int info = 0;
+        luaInt ival = 0;
+        luaNumber nval = 0;
+        std::string strval;
+        int ind_t = 0;
+        int ind_idx = 0;
+        int ridx = 0;
+        int vidx = 0;
+        int t = -1;  /* patch list of 'exit when true' */
+        int f = -1;  /* patch list of 'exit when false' */
+        bool known_table = false;  /* VINDEXSTR on a value proven to be a table */
+    };
+
+    enum VarKind {
+        VDKREG,     /* regular local */
+        RDKCONST,   /* <const> local: assignments are rejected */
+        RDKCTC,     /* <const> local with a constant value: no register */
+    };
 
-        // Symbol table for local variables
-        std::map<std::string, int> locals;
-        int stack_top = 0;
+    struct VarDesc {
+        std::string name;
+        VarKind kind = VDKREG;
+        int ridx = 0;  /* register holding the variable */
+        int pidx = 0;  /* index in the prototype's locvars */
+        ExpDesc k;     /* value of a compile-time constant */
+        const FunctionDef* fn = nullptr;  /* function of a never-assigned local */
+        int fnvars = 0;  /* active locals where `fn` was defined */
+    };
+
+    // what inlining needs to know about a function body
+    struct InlineInfo {
+        bool inlinable = false;
+        int size = 0;                /* AST nodes in the body */
+        std::set<std::string> free;  /* names it takes from its surroundings */
+    };
+
+    // a stable global function defined at the top level of the main chunk
+    struct GlobalFunction {
+        const FunctionDef* def;
+        int nvars;  /* active locals of the main function at its definition */
+    };
 
-        void enterScope();
-        void leaveScope();
+    // labels and pending gotos (and breaks, which are gotos to "break")
+    struct LabelDesc {
+        std::string name;
+        int pc;
+        int line;
+        int nactvar;  /* active locals at that position */
+        bool close;   /* goto that escapes upvalues */
     };
 
-    FunctionState* current_function_ = nullptr;
-
-    void enterFunction();
-    void leaveFunction();
-
-    // Visitor methods for each AST node type
-    void visit(const Statement* stmt);
-    void visit(const Expression* expr);
-
-    void visitBlock(const Block* node);
-    void visitAssignStatement(const AssignStatement* node);
-    void visitLocalStatement(const LocalStatement* node);
-    void visitIfStatement(const IfStatement* node);
-    void visitWhileStatement(const WhileStatement* node);
-    void visitExprStatement(const ExprStatement* node);
-    void visitReturnStatement(const ReturnStatement* node);
-
-    void visitBinaryExpr(const BinaryExpr* node);
-    void visitUnaryExpr(const UnaryExpr* node);
-    void visitNumberLiteral(const NumberLiteral* node);
-    void visitStringLiteral(const StringLiteral* node);
-    void visitBoolLiteral(const BoolLiteral* node);
-    void visitNilLiteral(const NilLiteral* node);
-    void visitIdentifier(const Identifier* node);
-    void visitFunctionCall(const FunctionCall* node);
-
-    // Helpers
-    int emit(Instruction i);
-    int addConstant(const Value& v);
-    int resolveLocal(const std::string& name);
-    int newLocal(const std::string& name);
+    struct BlockScope {
+        BlockScope* previous = nullptr;
+        int firstlabel = 0;
+        int firstgoto = 0;
+        int nactvar = 0;     /* active locals outside the block */
+        bool upval = false;  /* some local of the block is an upvalue */
+        bool isloop = false;
+    };
+
+    struct FunctionState {
+        FunctionState* prev = nullptr;
+        const FunctionDef* def = nullptr;  /* nullptr for the main chunk */
+        BlockScope* bl = nullptr;
+        std::vector<Instruction> code;
+        std::vector<Lineinfo> lineinfo;
+        std::vector<LuaValue> k;
+        std::map<std::string, int> kcache;  /* constant key -> index in k */
+        std::vector<LuaValue> protos;
+        std::vector<UpvalDesc> upvals;
+        std::vector<VarKind> upvalkinds;
+        std::vector<LocalVarinfo> locvars;
+        std::vector<VarDesc> actvars;  /* active locals, then ones being declared */
+        std::vector<LabelDesc> labels;
+        std::vector<LabelDesc> gotos;
+        int nactvar = 0;
+        int numparams = 0;
+        bool is_vararg = false;
+        int lasttarget = 0;  /* pc of the last jump target */
+        int freereg = 0;     /* first free register */
+        int maxstacksize = 2;
+        int linedefined = 0;
+        int lastlinedefined = 0;
+    };
+
+    FunctionState* fs_ = nullptr;
+    std::string source_;
+    int optlevel_;
+    bool inline_globals_;
+    int line_ = 0;  /* line recorded for emitted instructions */
+    std::map<const FunctionDef*, InlineInfo> inline_info_;
+    std::map<std::string_view, GlobalFunction> global_fns_;
+    std::vector<const FunctionDef*> inlining_;  /* bodies being inlined, innermost last */
+
+    [[noreturn]] void error(const std::string& message, int line = -1);
+
+    // --- functions and blocks ---
+    void openFunction(FunctionState& fs, BlockScope& bl, int line);
+    std::shared_ptr<LuaFunction> closeFunction();
+    void enterBlock(BlockScope& bl, bool isloop);
+    void leaveBlock();
+    void compileBlock(const Block& block);
+    void compileStatementList(const AstList<Statement*>& stmts, size_t first = 0, bool until_follows = false);
+    void compileFunction(const FunctionDef& def, ExpDesc& e);
+
+    // --- variables ---
+    int newLocalVar(std::string_view name);
+    void adjustLocalVars(int nvars, int reglevel = -1);
+    void removeVars(int tolevel);
+    int regLevel(int nvar) const;
+    int nvarStack() const;
+    LocalVarinfo* localDebugInfo(int vidx);
+    int searchVar(FunctionState* fs, const std::string& name, ExpDesc& var);
+    void markUpval(FunctionState* fs, int level);
+    int searchUpvalue(FunctionState* fs, const std::string& name);
+    int newUpvalue(FunctionState* fs, const std::string& name, const ExpDesc& var);
+    void singleVarAux(FunctionState* fs, const std::string& name, ExpDesc& var, bool base);
+    void singleVar(const std::string& name, ExpDesc& var);
+    void checkReadonly(const ExpDesc& e);
+    void adjustAssign(int nvars, int nexps, ExpDesc& e);
+    const VarDesc& constVar(const ExpDesc& e) const;
+    bool findConstant(std::string_view name, ExpDesc& k) const;
+
+    // --- labels and gotos ---
+    int newLabelEntry(std::vector<LabelDesc>& list, std::string_view name, int line, int pc);
+    int newGotoEntry(std::string_view name, int line, int pc);
+    const LabelDesc* findLabel(std::string_view name) const;
+    bool createLabel(std::string_view name, int line, bool last);
+    bool solveGotos(const LabelDesc& lb);
+    void solveGoto(int g, const LabelDesc& label);
+    void moveGotosOut(const BlockScope& bl);
+    [[noreturn]] void undefGoto(const LabelDesc& gt);
+
+    // --- statements ---
+    void compileStatement(const Statement* stmt, bool last_label);
+    void compileLocal(const LocalStatement* stmt);
+    void compileLocalFunction(const FunctionStatement* stmt);
+    void compileFunctionStatement(const FunctionStatement* stmt);
+    void compileAssign(const AssignStatement* stmt);
+    void checkConflict(std::vector<ExpDesc>& lhs, size_t n, const ExpDesc& v);
+    void compileExprStatement(const ExprStatement* stmt);
+    void compileIf(const IfStatement* stmt);
+    void testThenBlock(const IfClause& clause, bool more, int& escapelist);
+    void compileWhile(const WhileStatement* stmt);
+    void compileRepeat(const RepeatUntilStatement* stmt);
+    void compileNumericFor(const NumericForStatement* stmt);
+    void compileGenericFor(const GenericForStatement* stmt);
+    void forBody(const Block& body, int base, int line, int nvars, bool isgen);
+    void fixForJump(int pc, int dest, bool back);
+    void compileReturn(const ReturnStatement* stmt);
+    void compileGoto(const GotoStatement* stmt);
+    void compileLabel(const LabelStatement* stmt, bool last);
+    int condition(const Expression* expr);
+
+    // --- expressions ---
+    void compileExpr(const Expression* expr, ExpDesc& e);
+    int compileExprList(const AstList<Expression*>& exprs, ExpDesc& e);
+    void compileExprToNextReg(const Expression* expr);
+    void compileNumber(const NumberLiteral* lit, ExpDesc& e);
+    void compileNumeral(const NumberLiteral* lit, ExpDesc& e);
+    void compileCall(const FunctionCall* call, ExpDesc& e);
+    void compileTable(const TableConstructor* table, ExpDesc& e);
+    void compileBinary(const BinaryExpr* bin, ExpDesc& e);
+    void compileUnary(const UnaryExpr* un, ExpDesc& e);
+    void compileCast(const FunctionCall* call, ExpDesc& e);
+
+    // --- static types ---
+    void specializeBinary(const BinaryExpr* bin, ExpDesc& e);
+    void checkType(int reg, StaticType type);
+    void guardStore(const Expression* target, const Expression* value, ExpDesc& ex);
+
+    // --- inlining ---
+    bool inlineCall(const FunctionCall* call, ExpDesc& e, bool want_value);
+    const FunctionDef* inlineTarget(const FunctionCall* call);
+    const InlineInfo& inlineInfo(const FunctionDef& def);
+    bool inLoop() const;
+
+    // --- code emission ---
+    int code(Instruction i);
+    int codeABCk(OpCode o, int a, int b, int c, int k);
+    int codeABC(OpCode o, int a, int b, int c) { return codeABCk(o, a, b, c, 0); }
+    int codeABx(OpCode o, int a, int bx);
+    int codeAsBx(OpCode o, int a, int sbx);
+    int codesJ(OpCode o, int sj);
+    int codeExtraArg(int ax);
+    int codeK(int reg, int k);
+    void fixLine(int line);
+    Instruction& getInstruction(const ExpDesc& e) { return fs_->code[e.info]; }
+    Instruction* previousInstruction();
+    void removeLastInstruction();
+
+    // --- jumps ---
+    int getJump(int pc);
+    void fixJump(int pc, int dest);
+    void concatJumps(int& l1, int l2);
+    int jump();
+    void ret(int first, int nret);
+    int condJump(OpCode o, int a, int b, int c, int k);
+    int getLabel();
+    Instruction* getJumpControl(int pc);
+    bool patchTestReg(int node, int reg);
+    void removeValues(int list);
+    void patchListAux(int list, int vtarget, int reg, int dtarget);
+    void patchList(int list, int target);
+    void patchToHere(int list);
+
+    // --- registers ---
+    void checkStack(int n);
+    void reserveRegs(int n);
+    void freeReg(int reg);
+    void freeRegs(int r1, int r2);
+    void freeExp(const ExpDesc& e);
+    void freeExps(const ExpDesc& e1, const ExpDesc& e2);
+
+    // --- constants ---
+    int addK(const std::string& key, const LuaValue& v);
+    int stringK(const std::string& s);
+    int intK(luaInt n);
+    int numberK(luaNumber r);
+    int boolK(bool b);
+    int nilK();
+    void loadNil(int from, int n);
+    void loadInt(int reg, luaInt i);
+    void loadFloat(int reg, luaNumber f);
+    void str2K(ExpDesc& e);
+
+    // --- expression descriptors ---
+    void setReturns(ExpDesc& e, int nresults);
+    void setMultRet(ExpDesc& e) { setReturns(e, -1); }
+    void setOneRet(ExpDesc& e);
+    void dischargeVars(ExpDesc& e);
+    void discharge2Reg(ExpDesc& e, int reg);
+    void discharge2AnyReg(ExpDesc& e);
+    int codeLoadBool(int a, OpCode op);
+    bool needValue(int list);
+    void exp2Reg(ExpDesc& e, int reg);
+    void exp2NextReg(ExpDesc& e);
+    int exp2AnyReg(ExpDesc& e);
+    void exp2AnyRegUp(ExpDesc& e);
+    void exp2Val(ExpDesc& e);
+    bool exp2K(ExpDesc& e);
+    bool exp2RK(ExpDesc& e);
+    void codeABRK(OpCode o, int a, int b, ExpDesc& ec);
+    void storeVar(const ExpDesc& var, ExpDesc& ex);
+    void codeSelf(ExpDesc& e, ExpDesc& key);
+    void indexed(ExpDesc& t, ExpDesc& k);
+    bool isKstr(const ExpDesc& e) const;
+    bool isNumeral(const ExpDesc& e) const;
+    bool isCint(const ExpDesc& e) const;
+    bool isSCint(const ExpDesc& e) const;
+    bool isSCnumber(const ExpDesc& e, int& pi) const;
+    bool exp2Const(const ExpDesc& e, ExpDesc& k) const;
+
+    // --- constant folding ---
+    bool constFolding(OpCode op, ExpDesc& e1, const ExpDesc& e2);
+    bool foldComparison(Token op, ExpDesc& e1, const ExpDesc& e2);
+    bool constString(const Expression* expr, std::string& s);
+
+    // --- conditions ---
+    void negateCondition(ExpDesc& e);
+    int jumpOnCond(ExpDesc& e, bool cond);
+    void goIfTrue(ExpDesc& e);
+    void goIfFalse(ExpDesc& e);
+    void codeNot(ExpDesc& e);
+
+    // --- operators ---
+    void prefix(Token op, ExpDesc& e, int line);
+    void infix(Token op, ExpDesc& v);
+    void posfix(Token op, ExpDesc& e1, ExpDesc& e2, int line);
+    void codeUnExpVal(OpCode op, ExpDesc& e, int line);
+    void finishBinExpVal(ExpDesc& e1, ExpDesc& e2, OpCode op, int v2, bool flip, int line);
+    void codeBinExpVal(Token opr, ExpDesc& e1, ExpDesc& e2, int line);
+    void codeBinI(OpCode op, ExpDesc& e1, ExpDesc& e2, bool flip, int line);
+    void codeBinK(Token opr, ExpDesc& e1, ExpDesc& e2, bool flip, int line);
+    void codeBinNoK(Token opr, ExpDesc& e1, ExpDesc& e2, bool flip, int line);
+    void codeArith(Token opr, ExpDesc& e1, ExpDesc& e2, bool flip, int line);
+    void codeCommutative(Token opr, ExpDesc& e1, ExpDesc& e2, int line);
+    void codeBitwise(Token opr, ExpDesc& e1, ExpDesc& e2, int line);
+    void codeOrder(Token opr, ExpDesc& e1, ExpDesc& e2);
+    void codeEq(Token opr, ExpDesc& e1, ExpDesc& e2);
+    void codeConcat(ExpDesc& e1, ExpDesc& e2, int line);
 };
 
 } // namespace luao
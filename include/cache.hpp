@@ -0,0 +1,46 @@
+#pragma once
+
+#include <function.hpp>
+#include <filesystem>
+#include <memory>
+#include <string>
+#include <string_view>
+
+namespace luao {
+
+/*
+    A directory of compiled chunks, so re-running an unchanged script skips
+    the compiler.
+
+    Each entry is named by a 64-bit FNV-1a hash of the compiler version,
+    the compile options, the chunk name and the source text. It holds
+    those inputs in full, followed by the binary chunk (debug information
+    included) compiled from them; a hit must match the stored inputs, so
+    two keys sharing a hash never return each other's code. An
+    entry is written to a temporary file and renamed into place, so
+    processes sharing the directory never see a partial chunk. Two
+    processes missing the same entry both compile it, and the later rename
+    wins. The cache is best effort: an unreadable, unwritable or
+    incompatible entry is treated as a miss.
+*/
+class CompileCache {
+public:
+    explicit CompileCache(std::filesystem::path dir) : dir_(std::move(dir)) {}
+
+    // the cached function for `source`, or nullptr on a miss; a hit is
+    // mapped and runs in place (see load_function)
+    std::shared_ptr<LuaFunction> load(std::string_view source, const std::string& chunkname, int optlevel,
+                                      bool inline_globals = false) const;
+
+    // saves `f`, compiled from `source`; returns false when it could not be written
+    bool store(std::string_view source, const std::string& chunkname, int optlevel, const LuaFunction& f,
+               bool inline_globals = false) const;
+
+    std::filesystem::path entry(std::string_view source, const std::string& chunkname, int optlevel,
+                                bool inline_globals = false) const;
+
+private:
+    std::filesystem::path dir_;
+};
+
+} // namespace luao
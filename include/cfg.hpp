@@ -0,0 +1,45 @@
+#pragma once
+
+#include <opcodes.hpp>
+#include <function.hpp>
+#include <vector>
+
+namespace luao {
+
+/*
+    Control flow of finished bytecode, shared by the passes that rewrite a
+    function after code generation (peephole.hpp, ssa.hpp).
+*/
+
+// comparisons and tests: they skip the next instruction (a JMP) or not
+bool is_test_mode(OpCode op);
+
+// instructions that skip the next one; that one cannot be removed or moved
+bool skips_next(OpCode op);
+
+// pc a JMP at `pc` lands on
+int jump_dest(const std::vector<Instruction>& code, int pc);
+
+// appends the pcs control can reach right after executing `pc`
+void successors(const std::vector<Instruction>& code, int pc, std::vector<int>& out);
+
+// absolute target of a pc-relative instruction, or -1
+int branch_target(const std::vector<Instruction>& code, int pc);
+void set_branch_target(Instruction& i, int pc, int target);
+
+// An instruction of the re-laid-out code: the old `pc` it comes from and
+// the old position it stands in. Branches to position p land on the first
+// instruction whose anchor is p or later, so an instruction moved in front
+// of p (anchor p) runs on every path that reached p.
+struct Placement {
+    int pc;
+    int anchor;
+};
+
+// Rebuilds the code in `order` (anchors must not decrease); instructions
+// left out are dropped. Branch offsets, line info and local variable
+// ranges are rewritten for the new positions.
+void relayout(std::vector<Instruction>& code, std::vector<Lineinfo>& lineinfo,
+              std::vector<LocalVarinfo>& locvars, const std::vector<Placement>& order);
+
+} // namespace luao
@@ -0,0 +1,76 @@
+#pragma once
+
+#include <function.hpp>
+#include <memory>
+#include <string>
+#include <string_view>
+
+namespace luao {
+
+/*
+    Binary chunks: a compiled function tree saved to bytes and read back,
+    so deployed scripts skip lexing, parsing and code generation.
+
+    The layout follows ldump.c. A header (LUAO_BMAGIC, LUAO_BVERSION, a
+    format byte, a corruption check and the sizes and encodings of
+    instructions, integers and floats) is followed by the main function.
+    Each function is written as:
+
+        source, linedefined, lastlinedefined, numparams, is_vararg,
+        maxstacksize, code, constants, upvalues, nested protos,
+        line info, local variables, upvalue names
+
+    with each nested function prefixed by its length in bytes.
+
+    Counts and integers are unsigned LEB128 varints, and instructions and
+    floats are stored raw in the host's byte order. Each code array is
+    padded to the alignment of Instruction, so a mapped chunk can be run
+    in place. The header rejects chunks from a host with a different
+    layout. A stripped chunk has no
+    source, line info, local names or upvalue names; the VM needs none of
+    them to run the code. As with luac output, loaded code is trusted: its
+    instructions are not verified.
+*/
+
+// A file mapped read-only into memory, or read into a buffer where mmap is
+// unavailable. Processes mapping the same chunk share its pages.
+class MappedFile {
+public:
+    // throws std::runtime_error when the file cannot be opened or mapped
+    static std::shared_ptr<const MappedFile> open(const std::string& path);
+    ~MappedFile();
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    std::string_view data() const { return {data_, size_}; }
+
+private:
+    MappedFile() = default;
+
+    const char* data_ = nullptr;
+    size_t size_ = 0;
+    bool mapped_ = false;
+    std::string buffer_;
+};
+
+// true when `data` starts with the binary chunk signature
+bool is_binary_chunk(std::string_view data);
+
+std::string dump_function(const LuaFunction& f, bool strip = false);
+
+// Rebuilds the function tree of a chunk written by dump_function. Throws
+// std::runtime_error naming `chunkname` when the chunk is truncated,
+// corrupt or from an incompatible build.
+std::shared_ptr<LuaFunction> load_function(std::string_view chunk, const std::string& chunkname = "?");
+
+// Like the above, but without copying the code: every loaded function runs
+// its instructions straight from `file` and keeps the file alive. Nested
+// functions are deserialized the first time a closure is made from them,
+// so functions a run never reaches are never built. The chunk starts
+// `offset` bytes into the file, which must be a multiple of
+// alignof(Instruction) for the code to run in place.
+std::shared_ptr<LuaFunction> load_function(std::shared_ptr<const MappedFile> file, const std::string& chunkname,
+                                           size_t offset = 0);
+
+} // namespace luao
@@ -0,0 +1,150 @@
+#pragma once
+
+#include <object.hpp>
+#include <table.hpp>
+#include <string>
+#include <vector>
+#include <map>
+#include <unordered_map>
+#include <memory>
+#include <cstdint>
+
+namespace luao {
+
+class LuaClass;
+class LuaInstance;
+
+/*
+    Hidden class describing the field layout of a class instance.
+    Shapes are immutable: adding a field moves the instance to a child shape,
+    and the transition is remembered by the parent so that instances which
+    gain the same fields in the same order end up sharing one shape.
+*/
+class Shape : public std::enable_shared_from_this<Shape> {
+public:
+    static std::shared_ptr<Shape> makeRoot();
+
+    // unique for the lifetime of the process, used as the inline cache guard
+    uint64_t getId() const { return id; }
+    int getSlotCount() const { return static_cast<int>(fields.size()); }
+    const std::string& getFieldName(int slot) const { return fields[slot]; }
+
+    // slot index of `name`, or -1 if the shape has no such field
+    int lookup(const std::string& name) const;
+
+    // shape with `name` appended as the last slot
+    std::shared_ptr<Shape> addField(const std::string& name);
+
+private:
+    Shape();
+
+    uint64_t id;
+    std::vector<std::string> fields;
+    std::unordered_map<std::string, int> slots;
+    std::map<std::string, std::shared_ptr<Shape>> transitions;
+};
+
+enum class MethodKind {
+    NORMAL,   /* function name() */
+    VIRTUAL,  /* function name<virtual>()  -- declared, no body */
+    IMPL,     /* function name<impl>()     -- must override a virtual/inherited method */
+    META,     /* function __add<meta>(a, b) -- goes to the instance metatable */
+};
+
+/* Luao class/object declaration (LuaType::OBJECT) */
+class LuaClass : public LuaGCObject {
+public:
+    explicit LuaClass(std::string name, std::shared_ptr<LuaClass> parent = nullptr);
+
+    LuaType getType() const override { return LuaType::OBJECT; }
+    std::string typeName() const override { return "class"; }
+    std::string toString() const override { return "class: " + name; }
+
+    // unique for the lifetime of the process, used as the inline cache guard
+    uint64_t getId() const { return id; }
+    const std::string& getName() const { return name; }
+    std::shared_ptr<LuaClass> getParent() const { return parent; }
+
+    void setAbstract(bool value) { is_abstract = value; }  /* class Name<virtual> */
+    void setInterface(bool value) { is_interface = value; } /* class Name<interface> */
+    bool isAbstract() const { return is_abstract; }
+    bool isInterface() const { return is_interface; }
+    void addInterface(std::shared_ptr<LuaClass> iface);
+
+    // declared fields (`self x: int`) are laid out before any dynamic field
+    void declareField(const std::string& field);
+    const std::shared_ptr<Shape>& getInstanceShape() const { return instance_shape; }
+
+    void defineMethod(const std::string& method, const LuaValue& fn, MethodKind kind = MethodKind::NORMAL);
+
+    // Resolves the flattened method table: the parent's vtable, then
+    // interface methods, then this class's overrides and new methods.
+    // Called implicitly by anything that needs the vtable.
+    void finalize();
+    bool isFinalized() const { return finalized; }
+
+    // vtable slot of `method`, or -1; slots are stable down the hierarchy
+    int getMethodSlot(const std::string& method);
+    const LuaValue& getMethod(int slot) const { return vtable[slot]; }
+
+    // methods, then static members searched through the parent chain
+    LuaValue getMember(const LuaValue& key) const;
+    void setMember(const LuaValue& key, const LuaValue& value);
+
+    std::shared_ptr<LuaInstance> newInstance();
+
+private:
+    struct MethodDecl {
+        std::string name;
+        LuaValue fn;
+        MethodKind kind;
+    };
+
+    uint64_t id;
+    std::string name;
+    std::shared_ptr<LuaClass> parent;
+    std::vector<std::shared_ptr<LuaClass>> interfaces;
+    std::shared_ptr<Shape> instance_shape;
+    std::shared_ptr<LuaTable> members;
+    bool is_abstract = false;
+    bool is_interface = false;
+
+    std::vector<MethodDecl> method_decls;
+    std::vector<std::pair<std::string, LuaValue>> meta_methods; /* inherited ones first */
+    bool finalized = false;
+    std::vector<LuaValue> vtable;             /* nil slot = unimplemented virtual */
+    std::vector<std::string> vtable_names;
+    std::unordered_map<std::string, int> vtable_index;
+};
+
+/* instance of a Luao class (LuaType::INSTANCE): a shape plus a dense slot vector */
+class LuaInstance : public LuaGCObject {
+public:
+    explicit LuaInstance(std::shared_ptr<LuaClass> klass);
+
+    LuaType getType() const override { return LuaType::INSTANCE; }
+    std::string typeName() const override { return "instance"; }
+    std::string toString() const override;
+
+    const std::shared_ptr<LuaClass>& getClass() const { return klass; }
+    const std::shared_ptr<Shape>& getShape() const { return shape; }
+
+    LuaValue& getSlot(int slot) { return slots[slot]; }
+
+    // fields first, then class members
+    LuaValue get(const LuaValue& key) const;
+    LuaValue getField(const std::string& field) const;
+    void set(const LuaValue& key, const LuaValue& value);
+    // returns the slot the value was stored in
+    int setField(const std::string& field, const LuaValue& value);
+
+    // append a field through a transition that is already known
+    void addSlot(std::shared_ptr<Shape> new_shape, const LuaValue& value);
+
+private:
+    std::shared_ptr<LuaClass> klass;
+    std::shared_ptr<Shape> shape;
+    std::vector<LuaValue> slots;
+};
+
+} // namespace luao
@@ -7,13 +7,14 @@
 
 namespace luao {
 
+// a prototype plus the upvalues and inline caches of one instance of it
 class LuaClosure : public LuaGCObject {
 public:
-    explicit LuaClosure(std::shared_ptr<LuaFunction> function) : function_(function) {}
+    explicit LuaClosure(std::shared_ptr<const LuaFunction> function) : function_(std::move(function)) {}
 
     ~LuaClosure() = default;
 
-    std::shared_ptr<LuaFunction> getFunction() const {
+    const std::shared_ptr<const LuaFunction>& getFunction() const {
         return function_;
     }
 
@@ -25,12 +26,24 @@ public:
         upvalues_[index] = upvalue;
     }
 
+    FieldCache& getFieldCache(int pc) {
+        if (field_caches_.empty()) field_caches_.resize(function_->getBytecode().size());
+        return field_caches_[pc];
+    }
+
+    MethodCache& getMethodCache(int pc) {
+        if (method_caches_.empty()) method_caches_.resize(function_->getBytecode().size());
+        return method_caches_[pc];
+    }
+
     LuaType getType() const override { return LuaType::FUNCTION; }
     std::string typeName() const override { return "function"; }
 
 private:
-    std::shared_ptr<LuaFunction> function_;
+    std::shared_ptr<const LuaFunction> function_;
     std::vector<std::shared_ptr<UpValue>> upvalues_;
+    std::vector<FieldCache> field_caches_;
+    std::vector<MethodCache> method_caches_;
 };
 
 } // namespace luao
@@ -1,3 +1,11 @@
+#pragma once
+
 #define LUAI_MAXSTACK 1000000
 #define LUAI_MAXCCALLS 200
-#define LUAI_MAXCALLS 1000
\ No newline at end of file
+#define LUAI_MAXCALLS 1000
+#define LUAI_MAXREGS 255
+#define LUAI_MINSTACK 20 /* free slots kept above a Lua frame for native calls */
+
+#if defined(__linux__)
+#define LUAO_USE_EPOLL /* the sched library and its event loop (scheduler.hpp) */
+#endif
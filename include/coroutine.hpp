@@ -0,0 +1,64 @@
+#pragma once
+
+#include <object.hpp>
+#include <upvalue.hpp>
+#include <vm.hpp>
+#include <deque>
+#include <list>
+#include <memory>
+#include <optional>
+#include <vector>
+
+namespace luao {
+
+/*
+    A coroutine: a function with its own value stack, CallInfo stack and
+    open upvalues.
+
+    VM::resume swaps these with the VM's and runs the interpreter on them;
+    VM::yield sets a flag that makes the interpreter return to that resume,
+    leaving the coroutine's frames where they are. Lua calls inside a
+    coroutine run in the same interpreter loop as everywhere else, so a
+    yield from any depth of Lua frames unwinds one C++ call. Native code
+    that calls back into Lua (metamethods, table.sort comparators) runs its
+    own interpreter loop, and a yield is refused under it.
+
+    A new coroutine allocates no stacks. The first resume sizes the value
+    stack for the function's registers, and it grows like the main stack.
+    A dead coroutine releases both.
+*/
+class LuaCoroutine : public LuaGCObject {
+public:
+    enum class Status { SUSPENDED, RUNNING, NORMAL, DEAD };
+
+    explicit LuaCoroutine(LuaValue function) : function_(std::move(function)) {}
+
+    // a suspended coroutine that is dropped keeps the values its closures see
+    ~LuaCoroutine() {
+        for (auto& uv : open_upvalues_) uv->detach();
+    }
+
+    Status getStatus() const { return status_; }
+
+    LuaType getType() const override { return LuaType::THREAD; }
+    std::string typeName() const override { return "thread"; }
+
+private:
+    friend class VM;
+
+    LuaValue function_;          // until the first resume starts it
+    Status status_ = Status::SUSPENDED;
+    // the coroutine's thread state, swapped into the VM while it runs
+    std::vector<std::shared_ptr<LuaValue>> stack_;
+    std::optional<std::deque<CallInfo>> call_stack_; // a deque allocates when built
+    int top_ = 0;
+    std::list<std::shared_ptr<UpValue>> open_upvalues_;
+
+    int native_calls_ = 0;       // VM::native_calls while it runs; yields need a match
+    int pending_func_ = -1;      // slot of the yield call the next resume completes
+    int pending_results_ = -1;   // results that call expects, -1 for all
+    int yield_first_ = 0;        // values handed to resume by the last yield
+    int yield_count_ = 0;
+};
+
+} // namespace luao
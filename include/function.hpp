@@ -4,11 +4,14 @@
 #include <luao.hpp>
 #include <vector>
 #include <functional>
+#include <span>
+#include <mutex>
 #include <opcodes.hpp>
 
 namespace luao {
 
 class VM; // forward declaration for native function callback
+class Shape;
 
 struct UpvalDesc {
     std::string name;
@@ -33,6 +36,34 @@ struct LocalVarinfo {
         : name(name), startpc(start), endpc(end) {}
 };
 
+// inline cache for GETFIELD/SETFIELD on class instances, one per instruction
+// of a closure (prototypes are shared and never written while running)
+struct FieldCache {
+    uint64_t shape_id = 0;             // shape the cached slot belongs to
+    int slot = -1;
+    std::shared_ptr<Shape> transition; // SETFIELD only: shape after adding the field
+};
+
+// polymorphic inline cache for SELF on class instances: class id -> vtable slot
+struct MethodCache {
+    static constexpr int MAX_ENTRIES = 4;
+    struct Entry {
+        uint64_t class_id = 0;
+        uint64_t shape_id = 0;  // instance fields shadow methods
+        int slot = -1;
+    };
+    Entry entries[MAX_ENTRIES];
+    int count = 0;  // entries in use; a full cache replaces round-robin
+    int next = 0;
+};
+
+/*
+    A compiled prototype: bytecode, constants, nested prototypes and debug
+    info. Once built (or loaded) it is not modified, so closures in any
+    number of VMs, on any threads, can share one copy. State that changes
+    while code runs lives elsewhere: varargs in the CallInfo of the call,
+    inline caches in the LuaClosure.
+*/
 class LuaFunction : public LuaGCObject {
 public:
     LuaFunction(
@@ -48,6 +79,7 @@ public:
           upvalDescs(std::move(upvalDescs)),
           localvars(std::move(localvars)) 
     {
+        code = this->bytecode;
         source = "<none>";
         lineinfos = {};
         linedefined = 0;
@@ -75,36 +107,83 @@ public:
           linedefined(linedefined),
           lastlinedefined(lastlinedefined)
     {
-        
+        code = this->bytecode;
     }
 
 
     LuaType getType() const override { return LuaType::FUNCTION; }
     std::string typeName() const override { return "prototype"; }
 
-    const std::vector<Instruction>& getBytecode() const { return bytecode; }
+    std::span<const Instruction> getBytecode() const { return code; }
     const std::vector<LuaValue>& getConstants() const { return constants; }
-    const std::vector<LuaValue>& getProtos() const { return protos; }
+    // all nested prototypes, building any that are still lazy
+    const std::vector<LuaValue>& getProtos() const {
+        if (proto_loader) {
+            for (size_t n = 0; n < protos.size(); n++) getProto(n);
+        }
+        return protos;
+    }
+    // nested prototype `n`, built on first use when a loader is set; safe
+    // to call from several threads sharing the prototype
+    const LuaValue& getProto(size_t n) const {
+        if (proto_loader) {
+            std::call_once(proto_once[n], [&] {
+                if (protos[n].getType() == LuaType::NIL) {
+                    protos[n] = LuaValue(proto_loader(n), LuaType::FUNCTION);
+                }
+            });
+        }
+        return protos[n];
+    }
     const std::vector<UpvalDesc>& getUpvalDescs() const { return upvalDescs; }
-    const std::vector<LuaValue>& getVarargs() const { return varargs; }
+    const std::vector<LocalVarinfo>& getLocalVars() const { return localvars; }
     std::string getSource() const { return source; }
     const std::vector<Lineinfo>& getLineinfos() const { return lineinfos; }
     const int& getLinedefined() const { return linedefined; }
     const int& getLastlinedefined() const { return lastlinedefined; }
-    
-    void setVarargs(const std::vector<LuaValue>& args) { varargs = args; }
+
+    // nested prototypes left nil are built by `loader` the first time they
+    // are needed (a chunk loader deserializing them on demand)
+    using ProtoLoader = std::function<std::shared_ptr<LuaFunction>(size_t n)>;
+    void setProtoLoader(ProtoLoader loader) {
+        proto_loader = std::move(loader);
+        proto_once = std::make_unique<std::once_flag[]>(protos.size());
+    }
+
+    // runs `instructions` in place instead of an owned copy; `owner` (a
+    // mapped chunk file) keeps them alive for as long as the function
+    void setCode(std::span<const Instruction> instructions, std::shared_ptr<const void> owner) {
+        bytecode.clear();
+        code = instructions;
+        code_owner = std::move(owner);
+    }
+
+    // fixed parameters; missing arguments are filled with nil on entry
+    int getNumParams() const { return numparams; }
+    void setNumParams(int n) { numparams = n; }
+    bool isVararg() const { return is_vararg; }
+    void setVararg(bool v) { is_vararg = v; }
+    // registers used by the function; 0 when unknown (hand-built bytecode)
+    int getMaxStackSize() const { return max_stack_size; }
+    void setMaxStackSize(int n) { max_stack_size = n; }
 
 private:
     std::vector<Instruction> bytecode;
+    std::span<const Instruction> code;     // bytecode, or instructions owned by code_owner
+    std::shared_ptr<const void> code_owner;
     std::vector<LuaValue> constants;
-    std::vector<LuaValue> protos;
+    mutable std::vector<LuaValue> protos;
+    ProtoLoader proto_loader;
+    std::unique_ptr<std::once_flag[]> proto_once; // one per nested prototype
     std::vector<UpvalDesc> upvalDescs;
-    std::vector<LuaValue> varargs;
     std::vector<LocalVarinfo> localvars;
     std::string source;
     std::vector<Lineinfo> lineinfos;
     int linedefined;
     int lastlinedefined;
+    int numparams = 0;
+    bool is_vararg = false;
+    int max_stack_size = 0;
 };
 
 } // namespace luao
@@ -0,0 +1,82 @@
+#pragma once
+
+#include <snapshot.hpp>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace luao {
+
+/*
+    Runs independent scripts in parallel, one VM per worker thread.
+
+    A VM and everything reachable from it belong to one thread at a time.
+    A job either carries a compiled prototype or source that the worker
+    compiles (or loads, for a binary chunk). Prototypes are immutable, so
+    any number of jobs can share one; jobs never share tables or closures.
+    Values that several VMs do share are immutable: prototypes, library
+    functions, and strings from a snapshot the pool was given. The
+    metamethod keys (tm_name) are per thread, and each VM has its own
+    boolean singletons.
+
+    A job's print output is collected in its result rather than written
+    to std::cout.
+
+    Values are held through shared_ptr, whose reference counts libstdc++
+    only updates with atomic operations once the process has a second
+    thread. A single job therefore runs slower on the pool than in a
+    plain `luao script`; the pool pays off from two cores up.
+*/
+struct IsolateJob {
+    std::string chunkname;
+    std::string source;     // Lua source or a binary chunk
+    int optlevel = 1;
+    std::shared_ptr<const LuaFunction> function; // when set, run instead of source
+    bool inline_globals = false;                 // see BytecodeGenerator
+};
+
+struct IsolateResult {
+    bool ok = false;
+    std::string output;     // what the script printed
+    std::string error;      // the error message when !ok
+};
+
+class IsolatePool {
+public:
+    // `workers` threads (at least one); VMs start from `snapshot` when given
+    explicit IsolatePool(unsigned workers = std::thread::hardware_concurrency(),
+                         std::shared_ptr<const VMSnapshot> snapshot = nullptr);
+    // finishes the queued jobs, then stops the workers
+    ~IsolatePool();
+
+    IsolatePool(const IsolatePool&) = delete;
+    IsolatePool& operator=(const IsolatePool&) = delete;
+
+    std::future<IsolateResult> submit(IsolateJob job);
+
+    // runs every job and returns the results in the same order
+    std::vector<IsolateResult> run_all(std::vector<IsolateJob> jobs);
+
+    unsigned size() const { return static_cast<unsigned>(workers_.size()); }
+
+private:
+    using Task = std::packaged_task<IsolateResult(VM&)>;
+
+    std::shared_ptr<const VMSnapshot> snapshot_;
+    std::vector<std::thread> workers_;
+    std::deque<Task> queue_;
+    std::mutex mutex_;
+    std::condition_variable ready_;
+    bool stopping_ = false;
+
+    void work();
+    IsolateResult run(VM& vm, const IsolateJob& job) const;
+};
+
+} // namespace luao
@@ -2,6 +2,8 @@
 
 #include <luao.hpp>
 #include <string>
+#include <string_view>
+#include <deque>
 #include <vector>
 #include <stdexcept>
 
@@ -21,6 +23,8 @@ enum class Token
     EQ, NE, LT, LE, GT, GE, ASSIGN, LPAREN, RPAREN,
     LBRACE, RBRACE, LBRACKET, RBRACKET, SEMICOLON, COLON,
     COLON_DB, COMMA, DOT, CONCAT, VARARG,
+    /* type annotations */
+    ARROW, BANG,
     /* others */
     INT, FLOAT, STRING, IDENTIFIER, EOS
 };
@@ -34,26 +38,32 @@ constexpr const char* TokenNames[] = {
     "EQ","NE","LT","LE","GT","GE","ASSIGN","LPAREN","RPAREN",
     "LBRACE","RBRACE","LBRACKET","RBRACKET","SEMICOLON","COLON",
     "COLON_DB","COMMA","DOT","CONCAT","VARARG",
+    "ARROW","BANG",
     "INT","FLOAT","STRING","IDENTIFIER","EOS"
 };
 
+// `value` is a slice of the source, except for keywords and symbols
+// (static spellings) and strings with escape sequences (decoded into
+// storage the lexer owns); it lives as long as both.
 struct TokenInfo {
     Token type;
-    std::string value;
+    std::string_view value;
     int line;
 };
 
+// Scans a borrowed buffer: `source` must outlive the lexer and its tokens.
 class Lexer {
 public:
-    Lexer(const std::string& source);
+    explicit Lexer(std::string_view source);
     
     TokenInfo nextToken();
     TokenInfo peek();
 
 private:
-    std::string source_;
+    std::string_view source_;
     size_t pos_;
     int line_;
+    std::deque<std::string> decoded_; // strings with escapes; a deque keeps them in place
 
     void advance();
     char peekChar() const;
@@ -63,6 +73,7 @@ private:
     TokenInfo readIdentifierOrKeyword();
     TokenInfo readNumber();
     TokenInfo readString();
+    TokenInfo readLongString();
     void throwError(const std::string& msg);
     bool isAlpha(char c) const;
     bool isDigit(char c) const;
@@ -0,0 +1,39 @@
+#pragma once
+
+#include <cstddef>
+
+namespace luao {
+
+/*
+    Byte-class scanners for the lexer. Each looks at [p, p + n) and returns
+    the offset of the first byte that ends the run (n when none does).
+
+    The kernels classify 32 bytes at a time with AVX2 or 16 with SSE2; the
+    best set the CPU supports is picked at startup, with a scalar
+    fallback on other targets. The first 16 bytes are always checked one
+    at a time: most runs end there and are not worth a vector step.
+*/
+
+enum class ScanIsa { SCALAR, SSE2, AVX2 };
+
+// ' ', \t, \n, \v, \f and \r
+size_t span_whitespace(const char* p, size_t n);
+
+// letters, digits and '_'
+size_t span_identifier(const char* p, size_t n);
+
+// next ']' or '\n', inside long strings and comments
+size_t find_bracket_or_newline(const char* p, size_t n);
+
+// next `quote`, '\\' or '\n', inside a short string
+size_t find_string_stop(const char* p, size_t n, char quote);
+
+// number of '\n' bytes
+size_t count_newlines(const char* p, size_t n);
+
+ScanIsa scan_isa();
+// switches the kernels (for benchmarks); false when the CPU lacks `isa`
+bool set_scan_isa(ScanIsa isa);
+const char* scan_isa_name(ScanIsa isa);
+
+} // namespace luao
@@ -1,8 +1,36 @@
 #pragma once
 
 #include <map>
+#include <config.hpp>
 #include <object.hpp>
 
 using namespace luao;
 
-extern std::map<LuaString, LuaValue> getbaselib();
\ No newline at end of file
+// base functions, set as globals in every new VM
+extern std::map<LuaString, LuaValue> getbaselib();
+
+// builds the `table` module
+extern LuaValue opentablelib();
+
+// builds the `coroutine` module
+extern LuaValue opencorolib();
+
+#ifdef LUAO_USE_EPOLL
+// builds the `sched` module, an epoll event loop for coroutines (scheduler.hpp)
+extern LuaValue openschedlib();
+#endif
+
+// library modules a VM opens into _ENV the first time a lookup of their
+// name misses there (see VM::open_module)
+struct LuaModule {
+    const char* name;
+    LuaValue (*open)();
+};
+
+inline constexpr LuaModule LUA_MODULES[] = {
+    {"table", opentablelib},
+    {"coroutine", opencorolib},
+#ifdef LUAO_USE_EPOLL
+    {"sched", openschedlib},
+#endif
+};
\ No newline at end of file
@@ -1,9 +1,11 @@
 #pragma once
 
 #include <luao.hpp>
+#include <tm.hpp>
 #include <string>
 #include <vector>
 #include <sstream>
+#include <cstdio>
 #include <memory>
 
 namespace luao {
@@ -39,7 +41,9 @@ public:
     std::shared_ptr<class LuaTable> getMetatable() const { return metatable; }
     void setMetatable(std::shared_ptr<class LuaTable> mt) { metatable = mt; }
 
-    LuaValue getMetamethod(const LuaValue& key) const;
+    // nil when there is no metatable or it has no handler for `event`
+    LuaValue getMetamethod(TMS event) const;
+    bool hasMetamethod(TMS event) const;
 
 private:
     std::shared_ptr<class LuaTable> metatable = nullptr;
@@ -64,7 +68,14 @@ public:
     luaNumber getValue() const { return value; }
     void setValue(luaNumber v) { value = v; }
     LuaType getType() const override { return LuaType::NUMBER; }
-    std::string toString() const override { return std::to_string(value); }
+    // "%.14g" like Lua, keeping a ".0" on integral values so they still read as floats
+    std::string toString() const override {
+        char buf[64];
+        std::snprintf(buf, sizeof(buf), "%.14g", value);
+        std::string s(buf);
+        if (s.find_first_of(".eEn") == std::string::npos) s += ".0";
+        return s;
+    }
     std::string typeName() const override { return "number"; }
 private:
     luaNumber value;
@@ -120,7 +131,7 @@ public:
     }
 
     LuaType getType() const { return type; }
-    std::shared_ptr<LuaObject> getObject() const { return obj; }
+    const std::shared_ptr<LuaObject>& getObject() const { return obj; }
 
     std::string typeName() const {
         return obj ? obj->typeName() : "nil";
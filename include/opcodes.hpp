@@ -14,7 +14,9 @@ namespace luao {
         "BAND", "BOR", "BXOR", "SHL", "SHR", "MMBIN", "MMBINI", "MMBINK", "UNM", "BNOT", "NOT", "LEN",
         "CONCAT", "CLOSE", "TBC", "JMP", "EQ", "LT", "LE", "EQK", "EQI", "LTI", "LEI", "GTI", "GEI",
         "TEST", "TESTSET", "CALL", "TAILCALL", "RETURN", "RETURN0", "RETURN1", "FORLOOP", "FORPREP",
-        "TFORPREP", "TFORCALL", "TFORLOOP", "SETLIST", "CLOSURE", "VARARG", "VARARGPREP", "EXTRAARG"
+        "TFORPREP", "TFORCALL", "TFORLOOP", "SETLIST", "CLOSURE", "VARARG", "VARARGPREP", "EXTRAARG",
+        "ADDINT", "ADDIINT", "SUBINT", "MULINT", "ADDFLT", "SUBFLT", "MULFLT", "DIVFLT",
+        "LTINT", "LEINT", "GETFIELDT", "SETFIELDT", "CHECKTYPE"
     };
 
     enum class OpMode {
@@ -50,17 +52,17 @@ namespace luao {
         SETFIELD,     /* A B C   R[A][K[B]:shortstring] := RK(C)                 */
         NEWTABLE,     /* A B C k R[A] := {}                                      */
         SELF,         /* A B C   R[A+1] := R[B]; R[A] := R[B][RK(C):string]      */
-        ADDI,         /* A B sC  R[A] := R[B] + sC                               */
-        ADDK,         /* A B C   R[A] := R[B] + K[C]:number                      */
+        ADDI,         /* A B sC k R[A] := R[B] + sC                              */
+        ADDK,         /* A B C k R[A] := R[B] + K[C]:number                      */
         SUBK,         /* A B C   R[A] := R[B] - K[C]:number                      */
-        MULK,         /* A B C   R[A] := R[B] * K[C]:number                      */
+        MULK,         /* A B C k R[A] := R[B] * K[C]:number                      */
         MODK,         /* A B C   R[A] := R[B] % K[C]:number                      */
         POWK,         /* A B C   R[A] := R[B] ^ K[C]:number                      */
         DIVK,         /* A B C   R[A] := R[B] / K[C]:number                      */
         IDIVK,        /* A B C   R[A] := R[B] // K[C]:number                     */
-        BANDK,        /* A B C   R[A] := R[B] & K[C]:integer                     */
-        BORK,         /* A B C   R[A] := R[B] | K[C]:integer                     */
-        BXORK,        /* A B C   R[A] := R[B] ~ K[C]:integer                     */
+        BANDK,        /* A B C k R[A] := R[B] & K[C]:integer                     */
+        BORK,         /* A B C k R[A] := R[B] | K[C]:integer                     */
+        BXORK,        /* A B C k R[A] := R[B] ~ K[C]:integer                     */
         SHRI,         /* A B sC  R[A] := R[B] >> sC                              */
         SHLI,         /* A B sC  R[A] := sC << R[B]                              */
         ADD,          /* A B C   R[A] := R[B] + R[C]                             */
@@ -105,16 +107,84 @@ namespace luao {
         FORLOOP,      /* A Bx    update counters; if loop continues then pc-=Bx; */
         FORPREP,      /* A Bx    <check values and prepare counters>;
                                 if not to run then pc+=Bx+1;                    */
-        TFORPREP,     /* A Bx    create upvalue for R[A + 3]; pc+=Bx             */
+        TFORPREP,     /* A Bx    pc+=Bx                                          */
         TFORCALL,     /* A C     R[A+4], ... ,R[A+3+C] := R[A](R[A+1], R[A+2]);  */
-        TFORLOOP,     /* A Bx    if R[A+2] ~= nil then { R[A]=R[A+2]; pc -= Bx } */
+        TFORLOOP,     /* A Bx    if R[A+4] ~= nil then { R[A+2]=R[A+4]; pc -= Bx } */
         SETLIST,      /* A B C k R[A][C+i] := R[A+i], 1 <= i <= B                */
         CLOSURE,      /* A Bx    R[A] := closure(KPROTO[Bx])                     */
         VARARG,       /* A C     R[A], R[A+1], ..., R[A+C-2] = vararg            */
         VARARGPREP,   /* A       (adjust vararg parameters)                      */
-        EXTRAARG      /* Ax      extra (larger) argument for previous opcode     */
+        EXTRAARG,     /* Ax      extra (larger) argument for previous opcode     */
+
+        /* type-specialized forms, emitted only where the type checker proved
+           the operand types; they do no type dispatch and no metamethods */
+        ADDINT,       /* A B C   R[A] := R[B] + R[C]          (integers)         */
+        ADDIINT,      /* A B sC  R[A] := R[B] + sC            (integer)          */
+        SUBINT,       /* A B C   R[A] := R[B] - R[C]          (integers)         */
+        MULINT,       /* A B C   R[A] := R[B] * R[C]          (integers)         */
+        ADDFLT,       /* A B C   R[A] := R[B] + R[C]          (floats)           */
+        SUBFLT,       /* A B C   R[A] := R[B] - R[C]          (floats)           */
+        MULFLT,       /* A B C   R[A] := R[B] * R[C]          (floats)           */
+        DIVFLT,       /* A B C   R[A] := R[B] / R[C]          (floats)           */
+        LTINT,        /* A B k   if ((R[A] <  R[B]) ~= k) then pc++  (integers)  */
+        LEINT,        /* A B k   if ((R[A] <= R[B]) ~= k) then pc++  (integers)  */
+        GETFIELDT,    /* A B C   R[A] := R[B][K[C]:shortstring]  (R[B] a table)  */
+        SETFIELDT,    /* A B C   R[A][K[B]:shortstring] := RK(C) (R[A] a table)  */
+        CHECKTYPE     /* A B     error unless R[A] has type B (a CheckTag)       */
+    };
+
+    // operand B of CHECKTYPE: the representation a typed variable requires
+    enum class CheckTag {
+        INTEGER,
+        FLOAT,
+        STRING,
+        BOOLEAN,
+        TABLE,
+        FUNCTION
     };
 
+    /*
+        Instruction layout (Lua 5.4):
+          iABC   C(8) | B(8) | k(1) | A(8) | Op(7)
+          iABx        Bx(17)      | A(8) | Op(7)
+          iAsBx      sBx(17)      | A(8) | Op(7)
+          iAx            Ax(25)          | Op(7)
+          isJ            sJ(25)          | Op(7)
+        sB/sC are two's complement bytes. For the arithmetic opcodes with a
+        constant or immediate operand, k set means the operands were swapped
+        by the compiler and the metamethod must see them in source order.
+    */
+    #define MAXARG_A        255
+    #define MAXARG_B        255
+    #define MAXARG_C        255
+    #define MAXARG_Bx       ((1 << 17) - 1)
+    #define OFFSET_sBx      65535
+    #define MAXARG_Ax       ((1 << 25) - 1)
+    #define MAXARG_sJ       ((1 << 25) - 1)
+    #define OFFSET_sJ       (MAXARG_sJ >> 1)
+
+    #define GET_OPCODE(i)   (static_cast<OpCode>(((i) >> 0) & 0x7F))
+    #define GETARG_A(i)     (((i) >> 7) & 0xFF)
+    #define GETARG_B(i)     (((i) >> 16) & 0xFF)
+    #define GETARG_sB(i)    (static_cast<int8_t>(GETARG_B(i)))
+    #define GETARG_C(i)     (((i) >> 24) & 0xFF)
+    #define GETARG_sC(i)    (static_cast<int8_t>(GETARG_C(i)))
+    #define GETARG_k(i)     (((i) >> 15) & 0x1)
+    #define GETARG_Bx(i)    ((i) >> 15)
+    #define GETARG_sBx(i)   (static_cast<int>(GETARG_Bx(i)) - OFFSET_sBx)
+    #define GETARG_Ax(i)    ((i) >> 7)
+    #define GETARG_sJ(i)    (static_cast<int>(GETARG_Ax(i)) - OFFSET_sJ)
+
+    #define SET_FIELD(i, v, pos, mask) \
+        ((i) = ((i) & ~(static_cast<Instruction>(mask) << (pos))) | ((static_cast<Instruction>(v) & (mask)) << (pos)))
+    #define SET_OPCODE(i, o)    SET_FIELD(i, static_cast<Instruction>(o), 0, 0x7F)
+    #define SETARG_A(i, v)      SET_FIELD(i, v, 7, 0xFF)
+    #define SETARG_B(i, v)      SET_FIELD(i, v, 16, 0xFF)
+    #define SETARG_C(i, v)      SET_FIELD(i, v, 24, 0xFF)
+    #define SETARG_k(i, v)      SET_FIELD(i, v, 15, 0x1)
+    #define SETARG_Bx(i, v)     SET_FIELD(i, v, 15, MAXARG_Bx)
+    #define SETARG_sJ(i, v)     SET_FIELD(i, (v) + OFFSET_sJ, 7, MAXARG_sJ)
+
     inline std::string_view to_string(OpCode op) {
         int idx = static_cast<int>(op);
         if (idx < 0 || idx >= static_cast<int>(std::size(op_names))) return "";
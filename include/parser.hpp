@@ -1,207 +1,371 @@
 #pragma once
 
 #include "lexer.hpp"
+#include <cstdint>
+#include <cstring>
 #include <memory>
+#include <new>
+#include <type_traits>
 #include <string>
 #include <vector>
 #include <map>
 
+// Value type the type checker proved for an expression. Int and Long share
+// the 64-bit integer representation; they differ only in the conversions
+// the checker accepts (int widens to long, long needs a cast).
+enum class StaticType { Any, Nil, Boolean, Int, Long, Float, String, Table, Function };
+
+// --- Arena ---
+
+// Bump allocator for one compilation's tree. Nodes are carved out of large
+// chunks and never destroyed one by one: everything they point to (child
+// nodes, child lists, the source and lexer strings their views slice) lives
+// in the arena or outlives it, so dropping the chunks frees the whole tree.
+class AstArena {
+public:
+    AstArena() = default;
+    AstArena(const AstArena&) = delete;
+    AstArena& operator=(const AstArena&) = delete;
+
+    void* allocate(size_t size, size_t align);
+    std::string_view copy(std::string_view s); // for strings built while parsing
+
+    template <typename T, typename... Args>
+    T* make(Args&&... args) {
+        static_assert(std::is_trivially_destructible_v<T>, "arena nodes are never destroyed");
+        return new (allocate(sizeof(T), alignof(T))) T(std::forward<Args>(args)...);
+    }
+
+    size_t bytesUsed() const { return used_; }
+
+private:
+    static constexpr size_t CHUNK_SIZE = 64 * 1024;
+    std::vector<std::unique_ptr<char[]>> chunks_;
+    char* next_ = nullptr;
+    char* limit_ = nullptr;
+    size_t used_ = 0;
+};
+
+// Growable array in an arena; growing copies into a fresh block and leaves
+// the old one to the arena. Only for trivially copyable elements.
+template <typename T>
+class AstList {
+    static_assert(std::is_trivially_copyable_v<T>);
+public:
+    void push_back(AstArena& arena, const T& value) {
+        if (size_ == capacity_) {
+            uint32_t capacity = capacity_ ? capacity_ * 2 : 4;
+            T* data = static_cast<T*>(arena.allocate(capacity * sizeof(T), alignof(T)));
+            if (size_) std::memcpy(data, data_, size_ * sizeof(T));
+            data_ = data;
+            capacity_ = capacity;
+        }
+        data_[size_++] = value;
+    }
+
+    size_t size() const { return size_; }
+    bool empty() const { return size_ == 0; }
+    T& operator[](size_t n) { return data_[n]; }
+    const T& operator[](size_t n) const { return data_[n]; }
+    T& back() { return data_[size_ - 1]; }
+    const T& back() const { return data_[size_ - 1]; }
+    T* begin() { return data_; }
+    T* end() { return data_ + size_; }
+    const T* begin() const { return data_; }
+    const T* end() const { return data_ + size_; }
+
+private:
+    T* data_ = nullptr;
+    uint32_t size_ = 0;
+    uint32_t capacity_ = 0;
+};
+
 // --- Base Classes ---
+
+// One tag per concrete node class, for `switch` dispatch.
+enum class NodeKind : uint8_t {
+    /* expressions */
+    NilLiteral, BoolLiteral, NumberLiteral, StringLiteral, VarargLiteral, ParenExpr,
+    Identifier, FunctionDef, BinaryExpr, UnaryExpr, FunctionCall, TableAccess, IndexAccess,
+    TableConstructor,
+    /* statements */
+    Block, AssignStatement, LocalStatement, ExprStatement, IfStatement, WhileStatement,
+    DoStatement, RepeatUntilStatement, BreakStatement, ReturnStatement, GotoStatement,
+    LabelStatement, NumericForStatement, GenericForStatement, FunctionStatement,
+};
+
 class AstNode {
 public:
-    virtual ~AstNode() = default;
+    const NodeKind kind_;
+    int line_ = 0; // source line the node starts on, for line info
+protected:
+    explicit AstNode(NodeKind kind) : kind_(kind) {}
 };
-class Expression : public AstNode {};
-class Statement : public AstNode {};
+class Expression : public AstNode {
+public:
+    StaticType static_type_ = StaticType::Any; // filled in by the type checker
+protected:
+    using AstNode::AstNode;
+};
+class Statement : public AstNode {
+protected:
+    using AstNode::AstNode;
+};
+
+// `node` as a T when it is one, like dynamic_cast without RTTI
+template <typename T, typename N>
+auto ast_cast(N* node) -> std::conditional_t<std::is_const_v<N>, const T*, T*> {
+    return node && node->kind_ == T::KIND ? static_cast<std::conditional_t<std::is_const_v<N>, const T*, T*>>(node) : nullptr;
+}
+
+#define LUAO_AST_NODE(name, base) \
+    static constexpr NodeKind KIND = NodeKind::name; \
+    name() : base(KIND) {}
 
 class Block : public Statement {
 public:
-    std::vector<std::unique_ptr<Statement>> statements_;
+    LUAO_AST_NODE(Block, Statement)
+    AstList<Statement*> statements_;
 };
 
 // --- Literals ---
-class NilLiteral : public Expression {};
+class NilLiteral : public Expression {
+public:
+    LUAO_AST_NODE(NilLiteral, Expression)
+};
 class BoolLiteral : public Expression {
 public:
+    static constexpr NodeKind KIND = NodeKind::BoolLiteral;
     bool value_;
-    explicit BoolLiteral(bool value) : value_(value) {}
+    explicit BoolLiteral(bool value) : Expression(KIND), value_(value) {}
 };
 class NumberLiteral : public Expression {
 public:
-    std::string value_; // Keep as string to preserve hex/dec format
-    explicit NumberLiteral(const std::string& value) : value_(value) {}
+    static constexpr NodeKind KIND = NodeKind::NumberLiteral;
+    std::string_view value_; // Keep as string to preserve hex/dec format
+    explicit NumberLiteral(std::string_view value) : Expression(KIND), value_(value) {}
 };
 class StringLiteral : public Expression {
 public:
-    std::string value_;
-    explicit StringLiteral(const std::string& value) : value_(value) {}
+    static constexpr NodeKind KIND = NodeKind::StringLiteral;
+    std::string_view value_;
+    explicit StringLiteral(std::string_view value) : Expression(KIND), value_(value) {}
+};
+class VarargLiteral : public Expression {
+public:
+    LUAO_AST_NODE(VarargLiteral, Expression)
+};
+
+// `(expr)`: truncates calls and varargs to a single value
+class ParenExpr : public Expression {
+public:
+    static constexpr NodeKind KIND = NodeKind::ParenExpr;
+    Expression* expr_;
+    explicit ParenExpr(Expression* expr) : Expression(KIND), expr_(expr) {}
 };
-class VarargLiteral : public Expression {};
 
 // --- Expressions ---
 class Identifier : public Expression {
 public:
-    std::string name_;
-    std::string attribute_;
-    explicit Identifier(const std::string& name, std::string attribute = "") : name_(name), attribute_(std::move(attribute)) {}
+    static constexpr NodeKind KIND = NodeKind::Identifier;
+    std::string_view name_;
+    std::string_view attribute_;
+    std::string_view type_; // declared type (`int`, `!str`, a class name); empty when untyped
+    explicit Identifier(std::string_view name, std::string_view attribute = {})
+        : Expression(KIND), name_(name), attribute_(attribute) {}
 };
 
 class FunctionDef : public Expression {
 public:
-    std::vector<std::unique_ptr<Identifier>> params_;
-    bool is_vararg_;
-    std::unique_ptr<Block> body_;
+    LUAO_AST_NODE(FunctionDef, Expression)
+    AstList<Identifier*> params_; // methods get an implicit leading `self`
+    bool is_vararg_ = false;
+    std::string_view vararg_type_;
+    AstList<std::string_view> return_types_; // `-> int` or `-> (int, str)`
+    Block* body_ = nullptr;
+    int end_line_ = 0;
+    bool returns_proven_ = false; // type checker: every call yields return_types_[0]
+    bool stable_ = false; // type checker: the name it is bound to is never assigned again
 };
 
 class BinaryExpr : public Expression {
 public:
-    std::unique_ptr<Expression> left_;
+    static constexpr NodeKind KIND = NodeKind::BinaryExpr;
+    Expression* left_;
     TokenInfo op_;
-    std::unique_ptr<Expression> right_;
-    BinaryExpr(std::unique_ptr<Expression> left, TokenInfo op, std::unique_ptr<Expression> right)
-        : left_(std::move(left)), op_(op), right_(std::move(right)) {}
+    Expression* right_;
+    BinaryExpr(Expression* left, TokenInfo op, Expression* right)
+        : Expression(KIND), left_(left), op_(op), right_(right) {}
 };
 
 class UnaryExpr : public Expression {
 public:
+    static constexpr NodeKind KIND = NodeKind::UnaryExpr;
     TokenInfo op_;
-    std::unique_ptr<Expression> operand_;
-    UnaryExpr(TokenInfo op, std::unique_ptr<Expression> operand)
-        : op_(op), operand_(std::move(operand)) {}
+    Expression* operand_;
+    UnaryExpr(TokenInfo op, Expression* operand) : Expression(KIND), op_(op), operand_(operand) {}
 };
 
 class FunctionCall : public Expression {
 public:
-    std::unique_ptr<Expression> prefix_expr_;
-    std::vector<std::unique_ptr<Expression>> args_;
-    std::unique_ptr<StringLiteral> method_name_; // for method calls like `a:b()`
-    FunctionCall(std::unique_ptr<Expression> prefix, std::vector<std::unique_ptr<Expression>> args)
-        : prefix_expr_(std::move(prefix)), args_(std::move(args)), method_name_(nullptr) {}
+    static constexpr NodeKind KIND = NodeKind::FunctionCall;
+    Expression* prefix_expr_;
+    AstList<Expression*> args_;
+    StringLiteral* method_name_ = nullptr; // for method calls like `a:b()`
+    std::string_view cast_type_; // type checker: the call is `cast(value, type)`
+    explicit FunctionCall(Expression* prefix) : Expression(KIND), prefix_expr_(prefix) {}
 };
 
 class TableAccess : public Expression {
 public:
-    std::unique_ptr<Expression> prefix_expr_;
-    std::unique_ptr<Identifier> field_name_;
-    TableAccess(std::unique_ptr<Expression> prefix, std::unique_ptr<Identifier> field)
-        : prefix_expr_(std::move(prefix)), field_name_(std::move(field)) {}
+    static constexpr NodeKind KIND = NodeKind::TableAccess;
+    Expression* prefix_expr_;
+    Identifier* field_name_;
+    TableAccess(Expression* prefix, Identifier* field)
+        : Expression(KIND), prefix_expr_(prefix), field_name_(field) {}
 };
 
 class IndexAccess : public Expression {
 public:
-    std::unique_ptr<Expression> prefix_expr_;
-    std::unique_ptr<Expression> index_expr_;
-    IndexAccess(std::unique_ptr<Expression> prefix, std::unique_ptr<Expression> index)
-        : prefix_expr_(std::move(prefix)), index_expr_(std::move(index)) {}
+    static constexpr NodeKind KIND = NodeKind::IndexAccess;
+    Expression* prefix_expr_;
+    Expression* index_expr_;
+    IndexAccess(Expression* prefix, Expression* index)
+        : Expression(KIND), prefix_expr_(prefix), index_expr_(index) {}
 };
 
 struct TableField {
-    std::unique_ptr<Expression> key; // Can be nullptr for list part
-    std::unique_ptr<Expression> value;
+    Expression* key; // Can be nullptr for list part
+    Expression* value;
 };
 
 class TableConstructor : public Expression {
 public:
-    std::vector<TableField> fields_;
+    LUAO_AST_NODE(TableConstructor, Expression)
+    AstList<TableField> fields_;
 };
 
 // --- Statements ---
 class AssignStatement : public Statement {
 public:
-    std::vector<std::unique_ptr<Expression>> targets_;
-    std::vector<std::unique_ptr<Expression>> values_;
+    LUAO_AST_NODE(AssignStatement, Statement)
+    AstList<Expression*> targets_;
+    AstList<Expression*> values_;
 };
 
 class LocalStatement : public Statement {
 public:
-    std::vector<std::unique_ptr<Identifier>> names_;
-    std::vector<std::unique_ptr<Expression>> values_;
+    LUAO_AST_NODE(LocalStatement, Statement)
+    AstList<Identifier*> names_;
+    AstList<Expression*> values_;
 };
 
 class ExprStatement : public Statement {
 public:
-    std::unique_ptr<Expression> expr_;
-    explicit ExprStatement(std::unique_ptr<Expression> expr) : expr_(std::move(expr)) {}
+    static constexpr NodeKind KIND = NodeKind::ExprStatement;
+    Expression* expr_;
+    explicit ExprStatement(Expression* expr) : Statement(KIND), expr_(expr) {}
 };
 
 struct IfClause {
-    std::unique_ptr<Expression> condition;
-    std::unique_ptr<Block> body;
+    Expression* condition;
+    Block* body;
 };
 
 class IfStatement : public Statement {
 public:
-    std::vector<IfClause> if_clauses_;
-    std::unique_ptr<Block> else_body_; // Can be nullptr
+    LUAO_AST_NODE(IfStatement, Statement)
+    AstList<IfClause> if_clauses_;
+    Block* else_body_ = nullptr; // Can be nullptr
 };
 
 class WhileStatement : public Statement {
 public:
-    std::unique_ptr<Expression> condition_;
-    std::unique_ptr<Block> body_;
+    LUAO_AST_NODE(WhileStatement, Statement)
+    Expression* condition_ = nullptr;
+    Block* body_ = nullptr;
 };
 
 class DoStatement : public Statement {
 public:
-    std::unique_ptr<Block> body_;
+    LUAO_AST_NODE(DoStatement, Statement)
+    Block* body_ = nullptr;
 };
 
 class RepeatUntilStatement : public Statement {
 public:
-    std::unique_ptr<Block> body_;
-    std::unique_ptr<Expression> condition_;
+    LUAO_AST_NODE(RepeatUntilStatement, Statement)
+    Block* body_ = nullptr;
+    Expression* condition_ = nullptr;
 };
 
-class BreakStatement : public Statement {};
+class BreakStatement : public Statement {
+public:
+    LUAO_AST_NODE(BreakStatement, Statement)
+};
 
 class ReturnStatement : public Statement {
 public:
-    std::vector<std::unique_ptr<Expression>> exprs_;
+    LUAO_AST_NODE(ReturnStatement, Statement)
+    AstList<Expression*> exprs_;
 };
 
 class GotoStatement : public Statement {
 public:
-    std::string name_;
-    explicit GotoStatement(std::string name) : name_(std::move(name)) {}
+    static constexpr NodeKind KIND = NodeKind::GotoStatement;
+    std::string_view name_;
+    explicit GotoStatement(std::string_view name) : Statement(KIND), name_(name) {}
 };
 
 class LabelStatement : public Statement {
 public:
-    std::string name_;
-    explicit LabelStatement(std::string name) : name_(std::move(name)) {}
+    static constexpr NodeKind KIND = NodeKind::LabelStatement;
+    std::string_view name_;
+    explicit LabelStatement(std::string_view name) : Statement(KIND), name_(name) {}
 };
 
 class NumericForStatement : public Statement {
 public:
-    std::unique_ptr<Identifier> var_;
-    std::unique_ptr<Expression> start_;
-    std::unique_ptr<Expression> end_;
-    std::unique_ptr<Expression> step_; // Can be nullptr
-    std::unique_ptr<Block> body_;
+    LUAO_AST_NODE(NumericForStatement, Statement)
+    Identifier* var_ = nullptr;
+    Expression* start_ = nullptr;
+    Expression* end_ = nullptr;
+    Expression* step_ = nullptr; // Can be nullptr
+    Block* body_ = nullptr;
 };
 
 class GenericForStatement : public Statement {
 public:
-    std::vector<std::unique_ptr<Identifier>> names_;
-    std::vector<std::unique_ptr<Expression>> exprs_;
-    std::unique_ptr<Block> body_;
+    LUAO_AST_NODE(GenericForStatement, Statement)
+    AstList<Identifier*> names_;
+    AstList<Expression*> exprs_;
+    Block* body_ = nullptr;
 };
 
 class FunctionStatement : public Statement {
 public:
-    std::unique_ptr<Expression> name_;
-    std::unique_ptr<FunctionDef> def_;
-    bool is_local_;
+    LUAO_AST_NODE(FunctionStatement, Statement)
+    Expression* name_ = nullptr; // Identifier, or a TableAccess chain for `a.b.c`
+    FunctionDef* def_ = nullptr;
+    bool is_local_ = false;
 };
 
+#undef LUAO_AST_NODE
+
 // --- Parser ---
 class Parser {
 public:
-    explicit Parser(const std::string& source);
-    std::unique_ptr<Block> parse();
+    // `source` must outlive the parser. The tree lives in the parser's arena
+    // and its strings are views of `source` and the lexer's storage, so it
+    // is freed, all at once, with the parser.
+    explicit Parser(std::string_view source);
+    Block* parse();
+
+    const AstArena& arena() const { return arena_; }
 
 private:
     Lexer lexer_;
+    AstArena arena_;
     TokenInfo current_token_;
     TokenInfo lookahead_token_;
 
@@ -212,30 +376,33 @@ private:
     void error(const std::string& message);
 
     // Statement Parsers
-    std::unique_ptr<Block> parseBlock();
-    std::unique_ptr<Statement> parseStatement();
-    std::vector<std::unique_ptr<Statement>> parseStatementList();
-    std::unique_ptr<Statement> parseLocalStatement();
-    std::unique_ptr<Statement> parseFunctionStatement();
-    std::unique_ptr<Statement> parseIfStatement();
-    std::unique_ptr<Statement> parseWhileStatement();
-    std::unique_ptr<Statement> parseDoStatement();
-    std::unique_ptr<Statement> parseForStatement();
-    std::unique_ptr<Statement> parseRepeatStatement();
-    std::unique_ptr<Statement> parseReturnStatement();
-    std::unique_ptr<Statement> parseBreakStatement();
-    std::unique_ptr<Statement> parseGotoStatement();
-    std::unique_ptr<Statement> parseLabelStatement();
-    std::unique_ptr<Statement> parseAssignOrCallStatement();
+    Block* parseBlock();
+    Statement* parseStatement();
+    void parseStatementList(AstList<Statement*>& stmts);
+    Statement* parseLocalStatement();
+    Statement* parseFunctionStatement();
+    Statement* parseIfStatement();
+    Statement* parseWhileStatement();
+    Statement* parseDoStatement();
+    Statement* parseForStatement();
+    Statement* parseRepeatStatement();
+    Statement* parseReturnStatement();
+    Statement* parseBreakStatement();
+    Statement* parseGotoStatement();
+    Statement* parseLabelStatement();
+    Statement* parseAssignOrCallStatement();
 
     // Expression Parsers
-    std::unique_ptr<Expression> parseExpression(int precedence = 0);
-    std::unique_ptr<Expression> parsePrefixExpression();
-    std::unique_ptr<Expression> parseSimpleExpression();
-    std::unique_ptr<Expression> parseSuffixedExpression(std::unique_ptr<Expression> prefix);
-    std::unique_ptr<FunctionDef> parseFunctionDef();
-    void parseFunctionArgs(std::vector<std::unique_ptr<Expression>>& args);
-    std::unique_ptr<TableConstructor> parseTableConstructor();
-    std::unique_ptr<Identifier> parseIdentifier(bool can_have_attr = false);
-    std::string parseAttribute();
-};
\ No newline at end of file
+    Expression* parseExpression(int precedence = 0);
+    Expression* parsePrefixExpression();
+    Expression* parseSimpleExpression();
+    Expression* parsePrimaryExpression();
+    Expression* parseSuffixedExpression();
+    FunctionDef* parseFunctionDef();
+    FunctionDef* parseFunctionBody(int line, bool is_method);
+    void parseFunctionArgs(AstList<Expression*>& args);
+    TableConstructor* parseTableConstructor();
+    Identifier* parseIdentifier(bool can_have_attr = false, bool can_have_type = false);
+    std::string_view parseAttribute();
+    std::string_view parseTypeName();
+};
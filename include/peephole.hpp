@@ -0,0 +1,21 @@
+#pragma once
+
+#include <opcodes.hpp>
+#include <function.hpp>
+#include <vector>
+
+namespace luao {
+
+/*
+    Peephole pass over the finished code of one function.
+
+    Threads jumps to their final targets, fuses short instruction pairs
+    (LOADK + arithmetic, redundant MOVEs, CALL + RETURN) and drops code no
+    path can reach. Every surviving instruction keeps its own Lineinfo
+    entry, and jump offsets and local variable ranges are rewritten for the
+    compacted code. `k` is only read: fusions never add constants.
+*/
+void optimize_code(std::vector<Instruction>& code, std::vector<Lineinfo>& lineinfo,
+                   std::vector<LocalVarinfo>& locvars, const std::vector<LuaValue>& k);
+
+} // namespace luao
@@ -0,0 +1,132 @@
+#pragma once
+
+#include <config.hpp>
+#include <coroutine.hpp>
+#include <object.hpp>
+#include <chrono>
+#include <deque>
+#include <map>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#ifdef LUAO_USE_EPOLL
+
+namespace luao {
+
+class VM;
+
+/*
+    The event loop behind the `sched` module: runs coroutines as tasks on
+    one thread and resumes each when what it waits for is ready.
+
+    A task waits by registering what it needs (a file descriptor becoming
+    readable or writable, or a deadline) and then yielding. run() resumes
+    every ready task in turn, then blocks in epoll_wait until a descriptor
+    is ready or the earliest deadline passes. A task that yields without
+    registering anything (a plain coroutine.yield) goes to the back of the
+    ready queue.
+
+    A read or write is tried at once. When it would block, the loop
+    finishes it once the descriptor is ready and hands the outcome to the
+    task as the results of its yield, so the native function that started
+    it never runs again. Descriptors are switched to non-blocking mode on
+    first use. At most one task waits to read and one to write on each
+    descriptor.
+*/
+class Scheduler {
+public:
+    using Clock = std::chrono::steady_clock;
+
+    // what a task waits for on a descriptor
+    enum class IoOp { READABLE, WRITABLE, READ, WRITE };
+
+    // throws std::runtime_error when epoll is unavailable
+    Scheduler();
+    ~Scheduler();
+
+    Scheduler(const Scheduler&) = delete;
+    Scheduler& operator=(const Scheduler&) = delete;
+
+    // queues `co` to start with `args` on the next pass of run()
+    void spawn(std::shared_ptr<LuaCoroutine> co, std::vector<LuaValue> args);
+
+    // Runs tasks until none are left. Uses stack[scratch] and above to
+    // pass values to resumed tasks. An error in a task propagates from
+    // here; the other tasks stay queued for the next run().
+    void run(VM& vm, int scratch);
+
+    // true when the running coroutine is a task that may yield to the loop
+    bool in_task(const VM& vm) const;
+
+    // One non-blocking attempt at a READ or WRITE. Returns true with the
+    // results when it is done, false when it would block; a partial write
+    // drops what was written from `data` and adds it to `written`.
+    static bool attempt(int fd, IoOp op, size_t max, std::string& data, size_t& written,
+                        std::vector<LuaValue>& results);
+
+    // Called by the running task just before it yields; throws LuaError
+    // outside a task. The next resume gets:
+    //  sleep: nothing;
+    //  READABLE/WRITABLE: true, or false and "timeout";
+    //  READ: up to `max` bytes, or nil and "closed" at end of file, or nil
+    //        and an error ("timeout" included);
+    //  WRITE: the number of bytes written, all of them unless an error
+    //        stopped it, then followed by the error.
+    // A negative timeout waits for ever.
+    void sleep(VM& vm, double seconds);
+    void wait(VM& vm, int fd, IoOp op, double timeout, size_t max = 0,
+              std::string data = std::string(), size_t written = 0);
+
+    // wakes the tasks waiting on `fd` as if it had failed with "closed"
+    // and stops watching it; call before closing it
+    void forget(VM& vm, int fd);
+
+    // seconds on the loop's monotonic clock
+    static double now();
+
+private:
+    struct Task {
+        std::shared_ptr<LuaCoroutine> co;
+        std::vector<LuaValue> args;  // what the next resume passes it
+        bool waiting = false;
+        int fd = -1;
+        IoOp op = IoOp::READABLE;
+        size_t max = 0;
+        std::string data;            // WRITE: bytes still to write
+        size_t written = 0;
+        std::multimap<Clock::time_point, std::shared_ptr<Task>>::iterator timer;
+        bool timed = false;
+    };
+    using TaskRef = std::shared_ptr<Task>;
+
+    struct Watch {
+        TaskRef reader;
+        TaskRef writer;
+        uint32_t events = 0;         // interest registered with epoll
+    };
+
+    int epfd_ = -1;
+    bool running_ = false;
+    TaskRef current_;                // the task being resumed
+    std::deque<TaskRef> ready_;
+    std::multimap<Clock::time_point, TaskRef> timers_;
+    std::unordered_map<int, Watch> watches_;
+    size_t io_waits_ = 0;            // tasks waiting on a descriptor
+
+    const TaskRef& current(VM& vm, const char* what) const;
+    void add_timer(const TaskRef& task, double seconds);
+    // registers the interest of the tasks watching `fd` with epoll
+    void update_watch(int fd);
+    // ends the task's wait; `results` are what its yield returns
+    void wake(const TaskRef& task, std::vector<LuaValue> results);
+    // ends the task's wait with `error` (a timeout, or its fd closed)
+    void fail(VM& vm, const TaskRef& task, const char* error);
+    void on_ready(VM& vm, int fd, uint32_t events);
+    void resume(VM& vm, const TaskRef& task, int scratch);
+};
+
+} // namespace luao
+
+#endif // LUAO_USE_EPOLL
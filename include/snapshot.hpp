@@ -0,0 +1,42 @@
+#pragma once
+
+#include <function.hpp>
+#include <table.hpp>
+#include <memory>
+
+namespace luao {
+
+/*
+    The globals of a VM whose libraries are loaded and whose prelude has
+    run, kept so new VMs can start from that state without redoing the
+    work.
+
+    capture() runs the prelude in a scratch VM and keeps the _ENV table it
+    leaves behind. VM::load(main, snapshot) gives each VM a private copy of
+    that object graph. Tables, Lua closures and their upvalues are copied,
+    and values reached along several paths (or through cycles) are copied
+    once. Strings, numbers, booleans, native functions and prototypes are
+    immutable, so the copies share them with the snapshot.
+
+    The image stays in memory rather than in a file: native functions are
+    host code and cannot be written out and relocated. Classes and
+    instances carry host-side state, so capture() rejects a prelude that
+    leaves them in reach of the globals.
+*/
+class VMSnapshot {
+public:
+    // Runs `prelude` (nothing when null) against the standard libraries.
+    // Throws std::runtime_error when it fails or leaves a value the
+    // snapshot cannot copy.
+    static std::shared_ptr<const VMSnapshot> capture(std::shared_ptr<LuaFunction> prelude = nullptr);
+
+    // a private copy of the captured globals, for a new VM's _ENV
+    std::shared_ptr<LuaTable> instantiate() const;
+
+private:
+    explicit VMSnapshot(std::shared_ptr<LuaTable> env) : env_(std::move(env)) {}
+
+    std::shared_ptr<LuaTable> env_;
+};
+
+} // namespace luao
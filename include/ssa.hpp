@@ -0,0 +1,113 @@
+#pragma once
+
+#include <opcodes.hpp>
+#include <function.hpp>
+#include "cfg.hpp"
+#include <vector>
+
+namespace luao {
+
+/*
+    SSA form of one function's finished register bytecode.
+
+    Every register write defines a new value and join points get phi
+    values, so each operand of an instruction names exactly one
+    definition. The form keeps the registers the code generator allocated:
+    lowering back to bytecode only drops, rewrites or moves instructions
+    and re-lays the code out (cfg.hpp). Registers captured by closures can
+    change behind any call, so their values are never optimized.
+
+    Escape analysis finds the tables made by NEWTABLE that stay in this
+    function's registers: never passed, returned, stored, captured or
+    merged with other values at a join. Nothing else can reach them, so
+    they have no metatable and only this code reads or writes them. Those
+    only ever indexed by constant keys are scalar-replaced: each field gets
+    a register above the frame and the table is never built.
+*/
+class SsaFunction {
+public:
+    SsaFunction(const std::vector<Instruction>& code, const std::vector<LuaValue>& protos, int nregs);
+
+    // GETFIELD/GETI on an unescaped table becomes a MOVE (or LOADK) of the
+    // value last stored or loaded under the same key, when no store can
+    // come in between on any path and that value is still in its
+    // register. Returns the number of loads replaced.
+    int forwardFields(std::vector<Instruction>& code) const;
+
+    // instructions to drop: pure ones whose values are never used, and
+    // stores into unescaped tables that nothing reads back
+    std::vector<bool> deadStores() const;
+
+    // placement that moves pure instructions whose operands come from
+    // outside a numeric `for` loop in front of its FORPREP; empty when
+    // nothing moves
+    std::vector<Placement> hoistInvariants() const;
+
+    // NEWTABLE pcs of the unescaped tables only ever copied, or read and
+    // written under constant keys (GETFIELD/GETI/SETFIELD/SETI)
+    std::vector<int> replaceableTables() const;
+
+    // pcs of the loads and stores on the table made at NEWTABLE `pc`
+    std::vector<int> tableAccesses(int pc) const;
+
+    // instructions whose write to `reg` can reach `pc` (-1 for the value
+    // the register had on entry)
+    std::vector<int> reachingDefs(int pc, int reg) const;
+
+private:
+    struct Value {
+        int reg;
+        int def = -1;  /* defining instruction; -1 for phis and entry values */
+        int block = 0;
+        bool phi = false;
+        std::vector<int> args;  /* phi operands, one per predecessor */
+    };
+
+    struct Insn {
+        int block = -1;          /* -1 when unreachable */
+        std::vector<int> reads;  /* registers read; a table operand comes first */
+        std::vector<int> uses;   /* value read from each of them */
+        std::vector<int> writes; /* registers written */
+        std::vector<int> defs;   /* value defined in each of them */
+    };
+
+    struct Block {
+        int first = 0;
+        int last = 0;
+        std::vector<int> preds;
+        std::vector<int> succs;
+        int idom = -1;
+        std::vector<int> children;  /* in the dominator tree */
+        std::vector<int> phis;
+        std::vector<int> entry;     /* value of each register on entry */
+    };
+
+    std::vector<Instruction> code_;
+    int nregs_;
+    std::vector<bool> pinned_;  /* captured by a closure */
+    std::vector<Insn> insns_;
+    std::vector<Value> values_;
+    std::vector<Block> blocks_;
+    std::vector<int> rpo_;       /* reachable blocks in reverse postorder */
+    std::vector<int> alloc_;     /* per value: the NEWTABLE value it holds, or -1 */
+    std::vector<bool> escapes_;  /* per NEWTABLE value */
+    std::vector<std::vector<int>> stores_;  /* per NEWTABLE value: pcs storing into it */
+    std::vector<std::vector<int>> loads_;   /* ... and reading from it */
+
+    void buildBlocks();
+    void buildDominators();
+    void placePhis();
+    void rename(int b, std::vector<int> current);
+    void analyzeEscapes();
+    int valueBefore(int pc, int reg) const;
+    int unescaped(int value) const;
+};
+
+// Runs the SSA passes over one function: field forwarding, scalar
+// replacement, dead-store elimination, then loop-invariant code motion.
+// `nregs` is the function's frame size; it grows by the registers given to
+// scalar-replaced fields.
+void optimize_ssa(std::vector<Instruction>& code, std::vector<Lineinfo>& lineinfo,
+                  std::vector<LocalVarinfo>& locvars, const std::vector<LuaValue>& protos, int& nregs);
+
+} // namespace luao
@@ -3,6 +3,8 @@
 #include <object.hpp>
 #include <string>
 #include <vector>
+#include <cstdint>
+#include <functional>
 
 namespace luao {
 
@@ -21,8 +23,22 @@ public:
     // index access for SETI
     void set(int index, const LuaValue& value);
 
+    // metamethod lookup when this table is used as a metatable; misses are
+    // remembered in `tm_absent` until the next write to the hash part
+    LuaValue getTM(TMS event) const;
+    bool isTMAbsent(TMS event) const { return (tm_absent >> event) & 1u; }
+
     LuaValue vlen() const;
     int ilen() const;
+
+    // makes this (empty) table a copy of `from` with every key, value and
+    // the metatable passed through `map`, which must return nil, booleans,
+    // numbers and strings unchanged
+    void copyFrom(const LuaTable& from, const std::function<LuaValue(const LuaValue&)>& map);
+
+    // direct access to the array part (used by the table library)
+    std::vector<LuaValue>& getArray() { return m_array; }
+    const std::vector<LuaValue>& getArray() const { return m_array; }
 private:
     struct Node {
         LuaValue key;
@@ -36,14 +52,19 @@ private:
     std::vector<LuaValue> m_array;
     std::vector<Node> m_nodes;
     size_t m_last_free_hint = 0;
+    mutable uint32_t tm_absent = 0; // bit e set: no metamethod for event e
 
     // private helpers
     Node* main_position(const LuaValue& key);
     const Node* main_position(const LuaValue& key) const;
     size_t hash(const LuaValue& key) const;
     Node* get_free_node();
-    void rehash();
+    // resizes both parts for the current keys plus `extra`, the key about
+    // to be inserted
+    void rehash(const LuaValue& extra);
     void raw_insert(const LuaValue& key, const LuaValue& value);
+    // the array slot of `key`, or nullptr when it is not stored there
+    LuaValue* array_slot(const LuaValue& key);
 };
 
 } // namespace luao
\ No newline at end of file
@@ -0,0 +1,54 @@
+#pragma once
+
+#include <cstdint>
+
+namespace luao {
+
+class LuaValue;
+
+/*
+    Metamethod events. The order follows ltm.h; Luao's own events come last.
+    Metatables cache the absence of each event as one bit (see
+    LuaTable::getTM), so there must be at most 32 of them.
+*/
+enum TMS : uint8_t {
+    TM_INDEX,
+    TM_NEWINDEX,
+    TM_GC,
+    TM_MODE,
+    TM_LEN,
+    TM_EQ,
+    TM_ADD,
+    TM_SUB,
+    TM_MUL,
+    TM_MOD,
+    TM_POW,
+    TM_DIV,
+    TM_IDIV,
+    TM_BAND,
+    TM_BOR,
+    TM_BXOR,
+    TM_SHL,
+    TM_SHR,
+    TM_UNM,
+    TM_BNOT,
+    TM_LT,
+    TM_LE,
+    TM_CONCAT,
+    TM_CALL,
+    TM_CLOSE,
+    TM_TOSTRING,
+    TM_METATABLE,
+    TM_NAME,
+    TM_PAIRS,
+    TM_ITERATOR,
+    TM_NEWINSTANCE,
+    TM_N /* number of elements in the enum */
+};
+
+static_assert(TM_N <= 32, "metatable absence flags are 32 bits wide");
+
+// interned "__xxx" key for an event, one copy per thread
+const LuaValue& tm_name(TMS event);
+
+} // namespace luao
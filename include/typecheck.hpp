@@ -0,0 +1,90 @@
+#pragma once
+
+#include "parser.hpp"
+#include <map>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace luao {
+
+// representation a declared type name guarantees; Any for types the VM
+// cannot check (number, obj, nullable and class types)
+StaticType declared_static_type(std::string_view type);
+
+// true when a value of type `actual` is known to have representation
+// `declared` without a runtime check
+bool static_type_proven(StaticType declared, StaticType actual);
+
+/*
+    Checks a chunk against its type annotations and records what it proves.
+
+    Every expression gets the static type it is proven to have (Any when
+    nothing is known) in Expression::static_type_. Declared types are
+    enforced at their boundaries: initialisers, assignments, call arguments
+    of known functions and return values must have a compatible type.
+    Values the checker cannot see (globals, calls, varargs) are accepted and
+    guarded at run time by the code generator, so a typed variable always
+    holds a value of its type and the generator may rely on it.
+
+    Untyped locals that are never assigned after their declaration take the
+    type of their initialiser; calls to such local functions yield their
+    declared return type when every return is proven. Assignments are only
+    known once the whole chunk has been seen, so the chunk is walked twice.
+    The second walk also marks functions bound to a local that is never
+    assigned, or to a global with a single definition, as stable (inlining
+    relies on it).
+*/
+class TypeChecker {
+public:
+    explicit TypeChecker(std::string source = "?") : source_(std::move(source)) {}
+
+    void check(Block& chunk);
+
+private:
+    struct Symbol {
+        const Identifier* decl;
+        StaticType type;
+        const FunctionDef* fn; // set for `local function`
+    };
+
+    struct FunctionScope {
+        const FunctionDef* def; // nullptr for the main chunk
+        bool returns_proven;
+    };
+
+    std::string source_;
+    bool second_pass_ = false;
+    std::vector<std::vector<Symbol>> scopes_;
+    std::vector<FunctionScope> functions_;
+    std::map<const Identifier*, bool> reassigned_;         // locals assigned after their declaration
+    std::map<std::string_view, const FunctionDef*> globals_; // `function name(...)` signatures
+    std::map<std::string_view, int> global_stores_;          // assignments to each global name
+
+    [[noreturn]] void error(const std::string& message, int line);
+
+    void openScope() { scopes_.emplace_back(); }
+    void closeScope() { scopes_.pop_back(); }
+    Symbol* findLocal(std::string_view name);
+    void declare(const Identifier* id, StaticType inferred, const FunctionDef* fn = nullptr);
+
+    void checkBlock(Block& block);
+    void checkStatement(Statement* stmt);
+    void checkLocal(LocalStatement* stmt);
+    void checkAssign(AssignStatement* stmt);
+    void checkFunctionStatement(FunctionStatement* stmt);
+    void checkReturn(ReturnStatement* stmt);
+    void checkFunction(FunctionDef& def);
+
+    StaticType infer(Expression* expr);
+    StaticType inferBinary(BinaryExpr* bin);
+    StaticType inferUnary(UnaryExpr* un);
+    StaticType inferCall(FunctionCall* call);
+    void checkArguments(const FunctionDef& def, FunctionCall* call, std::string_view name);
+
+    // checks that `value` (nullptr: nil, `multi`: an extra call result) fits
+    // `declared`; integer literals become floats where a float is expected
+    void expect(std::string_view declared, Expression* value, bool multi, int line, const std::string& what);
+};
+
+} // namespace luao
@@ -10,10 +10,15 @@ class VM;
 
 class UpValue : public LuaObject {
 public:
-    UpValue(VM* vm, std::shared_ptr<LuaValue> location)
-        : vm(vm), location_(location), open_(true) {}
+    // `index` is the stack slot of an open upvalue, used to close it
+    UpValue(VM* vm, std::shared_ptr<LuaValue> location, int index = -1)
+        : vm(vm), location_(location), index_(index), open_(true) {}
+
+    // an upvalue already closed over `value`
+    explicit UpValue(const LuaValue& value) : vm(nullptr), closed_(value), index_(-1), open_(false) {}
 
     bool isOpen() const { return open_; }
+    int getIndex() const { return index_; }
 
     std::weak_ptr<LuaValue> getLocation() {
         return location_;
@@ -30,6 +35,13 @@ public:
     }
 
     void close();
+    // closes over the slot's current value without unlinking the upvalue
+    // from its list, for a list that is about to go away
+    void detach() {
+        if (auto loc = location_.lock()) closed_ = *loc;
+        location_.reset();
+        open_ = false;
+    }
 
     LuaType getType() const override { return LuaType::USERDATA; }
     std::string typeName() const override { return "upvalue"; }
@@ -46,6 +58,7 @@ private:
     VM* vm;
     std::weak_ptr<LuaValue> location_;
     LuaValue closed_;
+    int index_;
     bool open_;
     std::list<std::shared_ptr<UpValue>>::iterator open_upval_iter;
 };
@@ -1,56 +1,26 @@
 #pragma once
 
+#include <config.hpp>
 #include <opcodes.hpp>
 #include <closure.hpp>
 #include <object.hpp>
 #include <vector>
+#include <deque>
 #include <memory>
 #include <list>
+#include <iostream>
+#include <cstdint>
 
 #define CRITICAL_DUMP_CONTEXT_LINES 5
-
-// metamethod key shortcuts
-namespace mm {
-    extern const luao::LuaValue __add         ;
-    extern const luao::LuaValue __sub         ;
-    extern const luao::LuaValue __mul         ;
-    extern const luao::LuaValue __div         ;
-    extern const luao::LuaValue __unm         ;
-    extern const luao::LuaValue __mod         ;
-    extern const luao::LuaValue __pow         ;
-    extern const luao::LuaValue __idiv        ;
-    extern const luao::LuaValue __band        ;
-    extern const luao::LuaValue __bor         ;
-    extern const luao::LuaValue __bxor        ;
-    extern const luao::LuaValue __bnot        ;
-    extern const luao::LuaValue __shl         ;
-    extern const luao::LuaValue __shr         ;
-    extern const luao::LuaValue __eq          ;
-    extern const luao::LuaValue __lt          ;
-    extern const luao::LuaValue __le          ;
-    extern const luao::LuaValue __concat      ;
-    extern const luao::LuaValue __len         ;
-    extern const luao::LuaValue __tostring    ;
-    extern const luao::LuaValue __metatable   ;
-    extern const luao::LuaValue __name        ;
-    extern const luao::LuaValue __pairs       ;
-    extern const luao::LuaValue __ipairs      ; /* deprecated */
-    extern const luao::LuaValue __index       ;
-    extern const luao::LuaValue __newindex    ;
-    extern const luao::LuaValue __call        ;
-    extern const luao::LuaValue __mode        ;
-    extern const luao::LuaValue __close       ;
-    extern const luao::LuaValue __gc          ;
-    extern const luao::LuaValue __iterator    ;
-    extern const luao::LuaValue __newinstance ;
-}
+#define BASIC_STACK_SLOTS 1024
+#define MAX_STACK_SLOTS 20000
 
 namespace luao {
-    static std::shared_ptr<LuaBool> TRUE_OBJ = std::make_shared<LuaBool>(true);
-    static std::shared_ptr<LuaBool> FALSE_OBJ = std::make_shared<LuaBool>(false);
-
     struct CallInfo;
     class VM;
+    class VMSnapshot;
+    class LuaCoroutine;
+    class Scheduler;
     class UpValue;
     class LuaValue;
 
@@ -59,10 +29,13 @@ namespace luao {
     struct CallInfo {
         std::shared_ptr<LuaClosure> closure;
         const Instruction* pc;
-        int stack_base;
+        int stack_base; /* R0; the function itself sits at stack_base - 1 */
+        int top;        /* end of the register window, scratch space starts here */
+        int nresults;   /* results the caller expects, -1 for all of them */
+        std::vector<LuaValue> varargs; /* extra arguments of a vararg function */
 
-        CallInfo(std::shared_ptr<LuaClosure> closure, const Instruction* pc, int stack_base)
-        : closure(std::move(closure)), pc(pc), stack_base(stack_base) {}
+        CallInfo(std::shared_ptr<LuaClosure> closure, const Instruction* pc, int stack_base, int top = 0, int nresults = -1)
+        : closure(std::move(closure)), pc(pc), stack_base(stack_base), top(top), nresults(nresults) {}
     };
 
     struct LuaError : public std::exception {
@@ -74,7 +47,10 @@ namespace luao {
     class VM {
     public:
         VM();
+        // prepares `main_closure` to run with a new _ENV holding the standard
+        // libraries, or with a private copy of the globals in `snapshot`
         void load(std::shared_ptr<LuaClosure> main_closure);
+        void load(std::shared_ptr<LuaClosure> main_closure, const VMSnapshot& snapshot);
         void run();
         LuaValue get_stack_top();
         void set_top(int new_top);
@@ -82,12 +58,51 @@ namespace luao {
         const std::vector<std::shared_ptr<LuaValue>>& get_stack() const;
         std::vector<std::shared_ptr<LuaValue>>& get_stack_mutable();
         void set_trace(bool trace);
+        // where print writes; std::cout unless redirected
+        void set_output(std::ostream* out) { output = out; }
+        std::ostream& get_output() { return *output; }
         bool as_bool(const LuaValue& value);
-        const std::vector<CallInfo>& get_call_stack() const;
-        std::vector<CallInfo>& get_call_stack_mutable();
+        // this VM's shared true or false value
+        const LuaValue& boolean(bool b) const { return b ? true_value : false_value; }
+        const std::deque<CallInfo>& get_call_stack() const;
+        std::deque<CallInfo>& get_call_stack_mutable();
         const CallInfo& get_call_stack_top() const;
         const Instruction* get_current_pc();
         LuaValue get_upval_table(int upval_index, const LuaValue& key);
+
+        // Calls the function at stack[func] with the `nargs` values above it
+        // and runs it to completion, re-entering the interpreter for Lua
+        // functions. Results are left at stack[func], stack[func+1], ...;
+        // nresults < 0 keeps all of them. Returns the number of results.
+        int call(int func, int nargs, int nresults);
+        // first stack slot not used by the running frame or native function
+        int get_frame_top() const;
+        // grows the stack to at least `size` slots; false past the limit
+        bool ensure_stack(int size);
+        // Called when a lookup of `key` in `t` finds nothing: when `t` is
+        // this VM's _ENV and `key` names a library module not opened yet
+        // (LUA_MODULES), opens it into _ENV and returns it; nil otherwise.
+        // Each module is opened at most once, so a later `table = nil`
+        // sticks.
+        LuaValue open_module(const LuaValue& t, const LuaValue& key);
+
+        // Runs `co` with the `nargs` values at stack[first_arg] until it
+        // yields, returns or fails. What it yields or returns replaces the
+        // arguments, starting at stack[first_arg]; returns how many values.
+        // An error inside the coroutine kills it and propagates.
+        int resume(LuaCoroutine& co, int first_arg, int nargs);
+        // Suspends the running coroutine, handing the `n` values at
+        // stack[first] to its resume. Returns to the interpreter, which
+        // unwinds to that resume without running further instructions.
+        int yield(int first, int n);
+        LuaCoroutine* running_coroutine() const { return running; }
+        // inside a coroutine and not under a native call made from it
+        bool is_yieldable() const;
+#ifdef LUAO_USE_EPOLL
+        // the event loop of the sched library, made on first use; a new
+        // main chunk starts with none (scheduler.hpp)
+        Scheduler& get_scheduler();
+#endif
         
         // Arithmetic operations with metamethod support
         LuaValue add(const LuaValue& a, const LuaValue& b);
@@ -123,10 +138,33 @@ namespace luao {
 
         friend class UpValue;
     private:
-        std::vector<CallInfo> call_stack;
+        void reset_stack();
+        void start(std::shared_ptr<LuaClosure> main_closure, std::shared_ptr<LuaTable> env_table);
+        bool precall(int func, int nargs, int nresults);
+        void poscall(int func, int first_result, int n, int nresults);
+        void execute(size_t base_depth);
+        // checks and prepares the numeric for loop at stack[ra]; false to skip it
+        bool forprep(int ra);
+        // exchanges the running thread's stacks and open upvalues with `co`'s
+        void swap_state(LuaCoroutine& co);
+
+        std::deque<CallInfo> call_stack; /* a deque keeps CallInfo pointers valid as it grows */
         std::vector<std::shared_ptr<LuaValue>> stack;
         int top;
         bool trace_execution = false;
+        LuaTable* globals = nullptr;     /* the main chunk's _ENV, owned by stack[0] */
+        std::ostream* output = &std::cout;
+        // booleans produced by comparisons and NOT; each VM has its own so
+        // VMs on different threads never share a reference count
+        LuaValue true_value{std::make_shared<LuaBool>(true), LuaType::BOOLEAN};
+        LuaValue false_value{std::make_shared<LuaBool>(false), LuaType::BOOLEAN};
+        uint32_t unopened_modules = 0;   /* bit n: LUA_MODULES[n] not opened yet */
+        int native_calls = 0; /* nested VM::call activations on the C++ stack */
+        LuaCoroutine* running = nullptr; /* null while the main thread runs */
+        bool yielding = false;           /* set by yield until its resume returns */
+#ifdef LUAO_USE_EPOLL
+        std::shared_ptr<Scheduler> scheduler;
+#endif
     };
 
 } // namespace luao
\ No newline at end of file
@@ -8,11 +8,15 @@
 using namespace luao;
 
 static int baselib_print(VM& vm, int base_reg, int num_args) {
+    // one write per line, so lines from VMs on other threads do not interleave
+    std::string line;
     for (int i = 0; i < num_args; ++i) {
         const auto& val = *vm.get_stack()[base_reg + i];
-        std::cout << val.toString() << "\t";
+        line += val.toString();
+        line += '\t';
     }
-    std::cout << std::endl;
+    line += '\n';
+    vm.get_output() << line << std::flush;
     return 0;
 }
 
@@ -1,216 +1,2655 @@
 #include "bytecode.hpp"
 #include "opcodes.hpp"
+#include "peephole.hpp"
+#include "ssa.hpp"
+#include <config.hpp>
 #include <stdexcept>
+#include <cstring>
+#include <cerrno>
+#include <cmath>
+#include <cstdlib>
+#include <climits>
+#include <algorithm>
 
 namespace luao {
 
-// Helper to create instructions
-// NOTE: These are placeholders. The real implementation needs bitwise manipulation.
-Instruction create_iABC(OpCode op, int a, int b, int c) {
-    return static_cast<uint32_t>(op) | (a << 8) | (b << 16) | (c << 24);
+#define NO_JUMP (-1)
+#define NO_REG MAXARG_A
+#define MAXVARS 200
+#define MAXUPVAL 255
+#define MAXINDEXRK MAXARG_B
+#define LFIELDS_PER_FLUSH 50
+#define LUA_MULTRET (-1)
+#define INLINE_MAX_SIZE 16   /* AST nodes of a body inlined anywhere */
+#define INLINE_LOOP_SIZE 40  /* ... and of one called inside a loop */
+#define INLINE_MAX_DEPTH 3   /* inlined bodies nested in each other */
+
+#define hasjumps(e) ((e).t != (e).f)
+#define hasmultret(k) ((k) == VCALL || (k) == VVARARG)
+#define vkisindexed(k) (VINDEXED <= (k) && (k) <= VINDEXSTR)
+#define vkisvar(k) (VLOCAL <= (k) && (k) <= VINDEXSTR)
+
+static Instruction create_abck(OpCode o, int a, int b, int c, int k) {
+    return static_cast<Instruction>(o)
+        | (static_cast<Instruction>(a) << 7)
+        | (static_cast<Instruction>(k) << 15)
+        | (static_cast<Instruction>(b) << 16)
+        | (static_cast<Instruction>(c) << 24);
+}
+
+static Instruction create_abx(OpCode o, int a, unsigned int bx) {
+    return static_cast<Instruction>(o)
+        | (static_cast<Instruction>(a) << 7)
+        | (static_cast<Instruction>(bx) << 15);
+}
+
+static Instruction create_ax(OpCode o, unsigned int ax) {
+    return static_cast<Instruction>(o) | (static_cast<Instruction>(ax) << 7);
+}
+
+// signed 8-bit operands (sB, sC) are stored in two's complement
+static bool fits_c(luaInt i) { return i >= -128 && i <= 127; }
+static int int2sc(luaInt i) { return static_cast<int>(i) & 0xFF; }
+
+static bool fits_bx(luaInt i) { return -OFFSET_sBx <= i && i <= MAXARG_Bx - OFFSET_sBx; }
+
+// float with an exact integer value
+static bool float_to_int(luaNumber f, luaInt& i) {
+    if (std::floor(f) != f || !(f >= -9223372036854775808.0 && f < 9223372036854775808.0)) return false;
+    i = static_cast<luaInt>(f);
+    return true;
+}
+
+// a numeric operand or result of constant folding
+struct Numeral {
+    bool isint;
+    luaInt i;
+    luaNumber n;
+};
+
+static luaNumber numeral_float(const Numeral& v) {
+    return v.isint ? static_cast<luaNumber>(v.i) : v.n;
+}
+
+static bool numeral_int(const Numeral& v, luaInt& i) {
+    if (v.isint) {
+        i = v.i;
+        return true;
+    }
+    return float_to_int(v.n, i);
+}
+
+// logical shift; shifts of 64 or more bits give 0, negative ones go right
+static luaInt shift_left(luaInt x, luaInt y) {
+    if (y <= -64 || y >= 64) return 0;
+    if (y < 0) return static_cast<luaInt>(static_cast<uint64_t>(x) >> -y);
+    return static_cast<luaInt>(static_cast<uint64_t>(x) << y);
+}
+
+// Evaluates `a op b` (`op a` for UNM and BNOT) with Lua semantics: integer
+// arithmetic wraps around and / and ^ always give floats. Returns false for
+// operations that would raise an error at run time, which are left to the VM.
+static bool fold_arith(OpCode op, const Numeral& a, const Numeral& b, Numeral& r) {
+    switch (op) {
+        case OpCode::BAND: case OpCode::BOR: case OpCode::BXOR:
+        case OpCode::SHL: case OpCode::SHR: case OpCode::BNOT: {
+            luaInt x, y;
+            if (!numeral_int(a, x) || !numeral_int(b, y)) return false;
+            r.isint = true;
+            switch (op) {
+                case OpCode::BAND: r.i = x & y; break;
+                case OpCode::BOR: r.i = x | y; break;
+                case OpCode::BXOR: r.i = x ^ y; break;
+                case OpCode::SHL: r.i = shift_left(x, y); break;
+                case OpCode::SHR: r.i = shift_left(x, y == LLONG_MIN ? LLONG_MAX : -y); break;
+                default: r.i = ~x; break;
+            }
+            return true;
+        }
+        case OpCode::DIV: case OpCode::IDIV: case OpCode::MOD:
+            if (numeral_float(b) == 0) return false; // division by zero
+            break;
+        default:
+            break;
+    }
+    if (a.isint && b.isint && op != OpCode::DIV && op != OpCode::POW) {
+        uint64_t x = static_cast<uint64_t>(a.i), y = static_cast<uint64_t>(b.i);
+        r.isint = true;
+        switch (op) {
+            case OpCode::ADD: r.i = static_cast<luaInt>(x + y); break;
+            case OpCode::SUB: r.i = static_cast<luaInt>(x - y); break;
+            case OpCode::MUL: r.i = static_cast<luaInt>(x * y); break;
+            case OpCode::UNM: r.i = static_cast<luaInt>(0u - x); break;
+            case OpCode::IDIV:
+                if (b.i == -1) {
+                    r.i = static_cast<luaInt>(0u - x); // avoids overflow of LLONG_MIN // -1
+                } else {
+                    r.i = a.i / b.i;
+                    if ((a.i ^ b.i) < 0 && a.i % b.i != 0) r.i -= 1; // round towards minus infinity
+                }
+                break;
+            case OpCode::MOD:
+                if (b.i == -1) {
+                    r.i = 0;
+                } else {
+                    r.i = a.i % b.i;
+                    if (r.i != 0 && (r.i ^ b.i) < 0) r.i += b.i; // result takes the divisor's sign
+                }
+                break;
+            default:
+                return false;
+        }
+        return true;
+    }
+    luaNumber x = numeral_float(a), y = numeral_float(b);
+    r.isint = false;
+    switch (op) {
+        case OpCode::ADD: r.n = x + y; break;
+        case OpCode::SUB: r.n = x - y; break;
+        case OpCode::MUL: r.n = x * y; break;
+        case OpCode::DIV: r.n = x / y; break;
+        case OpCode::POW: r.n = (y == 2) ? x * x : std::pow(x, y); break;
+        case OpCode::IDIV: r.n = std::floor(x / y); break;
+        case OpCode::UNM: r.n = -x; break;
+        case OpCode::MOD:
+            r.n = std::fmod(x, y);
+            if ((r.n > 0) ? y < 0 : (r.n < 0 && y != r.n)) r.n += y;
+            break;
+        default:
+            return false;
+    }
+    return true;
+}
+
+// Orders two numerals exactly, even integers beyond a double's precision:
+// -1, 0 or 1, or 2 when unordered (NaN).
+static int numeral_compare(const Numeral& a, const Numeral& b) {
+    if (a.isint && b.isint) return (a.i < b.i) ? -1 : (a.i > b.i);
+    if (!a.isint && !b.isint) {
+        if (std::isnan(a.n) || std::isnan(b.n)) return 2;
+        return (a.n < b.n) ? -1 : (a.n > b.n);
+    }
+    if (!a.isint) {
+        int c = numeral_compare(b, a);
+        return c == 2 ? 2 : -c;
+    }
+    luaInt i = a.i;
+    luaNumber f = b.n;
+    if (std::isnan(f)) return 2;
+    if (f >= 9223372036854775808.0) return -1;
+    if (f < -9223372036854775808.0) return 1;
+    luaNumber fl = std::floor(f);
+    luaInt fi = static_cast<luaInt>(fl);
+    if (i != fi) return (i < fi) ? -1 : 1;
+    return (f > fl) ? -1 : 0;
+}
+
+// register opcode for an arithmetic or bitwise operator token
+static OpCode arith_op(Token op) {
+    switch (op) {
+        case Token::PLUS: return OpCode::ADD;
+        case Token::MINUS: return OpCode::SUB;
+        case Token::MULTIPLY: return OpCode::MUL;
+        case Token::MODULO: return OpCode::MOD;
+        case Token::POW: return OpCode::POW;
+        case Token::DIVIDE: return OpCode::DIV;
+        case Token::IDIV: return OpCode::IDIV;
+        case Token::BAND: return OpCode::BAND;
+        case Token::BOR: return OpCode::BOR;
+        case Token::BXOR: return OpCode::BXOR;
+        case Token::SHL: return OpCode::SHL;
+        case Token::SHR: return OpCode::SHR;
+        default: throw std::logic_error("not an arithmetic operator");
+    }
+}
+
+// constant-operand opcode for an arithmetic or bitwise operator token
+static OpCode arith_k_op(Token op) {
+    switch (op) {
+        case Token::PLUS: return OpCode::ADDK;
+        case Token::MINUS: return OpCode::SUBK;
+        case Token::MULTIPLY: return OpCode::MULK;
+        case Token::MODULO: return OpCode::MODK;
+        case Token::POW: return OpCode::POWK;
+        case Token::DIVIDE: return OpCode::DIVK;
+        case Token::IDIV: return OpCode::IDIVK;
+        case Token::BAND: return OpCode::BANDK;
+        case Token::BOR: return OpCode::BORK;
+        case Token::BXOR: return OpCode::BXORK;
+        default: throw std::logic_error("operator has no constant form");
+    }
+}
+
+// calls and `...` supply every value left when they end a list
+static bool is_multi(const Expression* e) {
+    return e->kind_ == NodeKind::FunctionCall || e->kind_ == NodeKind::VarargLiteral;
+}
+
+// Walks a function body for inlining: counts its nodes, collects the names
+// it does not declare itself and rejects what an inlined copy cannot
+// reproduce (closures, `...`, gotos and labels, a return before the end).
+struct BodyScan {
+    int size = 0;
+    bool ok = true;
+    std::set<std::string> free;
+    std::vector<std::string_view> bound;
+
+    void name(std::string_view n) {
+        if (std::find(bound.rbegin(), bound.rend(), n) == bound.rend()) free.emplace(n);
+    }
+
+    void block(const AstList<Statement*>& stmts, bool body) {
+        size_t mark = bound.size();
+        for (size_t n = 0; n < stmts.size() && ok; n++) {
+            statement(stmts[n], body && n + 1 == stmts.size());
+        }
+        bound.resize(mark);
+    }
+
+    void statement(const Statement* stmt, bool last) {
+        size++;
+        switch (stmt->kind_) {
+            case NodeKind::LocalStatement: {
+                auto s = static_cast<const LocalStatement*>(stmt);
+                for (auto v : s->values_) expr(v);
+                for (auto id : s->names_) bound.push_back(id->name_);
+                break;
+            }
+            case NodeKind::AssignStatement: {
+                auto s = static_cast<const AssignStatement*>(stmt);
+                for (auto t : s->targets_) expr(t);
+                for (auto v : s->values_) expr(v);
+                break;
+            }
+            case NodeKind::ExprStatement:
+                expr(static_cast<const ExprStatement*>(stmt)->expr_);
+                break;
+            case NodeKind::IfStatement: {
+                auto s = static_cast<const IfStatement*>(stmt);
+                for (const auto& clause : s->if_clauses_) {
+                    expr(clause.condition);
+                    block(clause.body->statements_, false);
+                }
+                if (s->else_body_) block(s->else_body_->statements_, false);
+                break;
+            }
+            case NodeKind::WhileStatement: {
+                auto s = static_cast<const WhileStatement*>(stmt);
+                expr(s->condition_);
+                block(s->body_->statements_, false);
+                break;
+            }
+            case NodeKind::DoStatement:
+                block(static_cast<const DoStatement*>(stmt)->body_->statements_, false);
+                break;
+            case NodeKind::RepeatUntilStatement: {
+                auto s = static_cast<const RepeatUntilStatement*>(stmt);
+                size_t mark = bound.size(); // the condition sees the body's locals
+                for (auto inner : s->body_->statements_) statement(inner, false);
+                expr(s->condition_);
+                bound.resize(mark);
+                break;
+            }
+            case NodeKind::NumericForStatement: {
+                auto s = static_cast<const NumericForStatement*>(stmt);
+                expr(s->start_);
+                expr(s->end_);
+                if (s->step_) expr(s->step_);
+                bound.push_back(s->var_->name_);
+                block(s->body_->statements_, false);
+                bound.pop_back();
+                break;
+            }
+            case NodeKind::GenericForStatement: {
+                auto s = static_cast<const GenericForStatement*>(stmt);
+                for (auto e : s->exprs_) expr(e);
+                size_t mark = bound.size();
+                for (auto id : s->names_) bound.push_back(id->name_);
+                block(s->body_->statements_, false);
+                bound.resize(mark);
+                break;
+            }
+            case NodeKind::ReturnStatement:
+                if (!last) ok = false;
+                for (auto e : static_cast<const ReturnStatement*>(stmt)->exprs_) expr(e);
+                break;
+            case NodeKind::Block:
+                block(static_cast<const Block*>(stmt)->statements_, false);
+                break;
+            case NodeKind::BreakStatement:
+                break;
+            default:
+                ok = false; // functions, gotos and labels
+                break;
+        }
+    }
+
+    void expr(const Expression* e) {
+        size++;
+        switch (e->kind_) {
+            case NodeKind::Identifier:
+                name(static_cast<const Identifier*>(e)->name_);
+                break;
+            case NodeKind::ParenExpr:
+                expr(static_cast<const ParenExpr*>(e)->expr_);
+                break;
+            case NodeKind::TableAccess:
+                expr(static_cast<const TableAccess*>(e)->prefix_expr_);
+                break;
+            case NodeKind::IndexAccess: {
+                auto access = static_cast<const IndexAccess*>(e);
+                expr(access->prefix_expr_);
+                expr(access->index_expr_);
+                break;
+            }
+            case NodeKind::FunctionCall: {
+                auto call = static_cast<const FunctionCall*>(e);
+                expr(call->prefix_expr_);
+                for (auto arg : call->args_) expr(arg);
+                break;
+            }
+            case NodeKind::TableConstructor:
+                for (const auto& field : static_cast<const TableConstructor*>(e)->fields_) {
+                    if (field.key) expr(field.key);
+                    expr(field.value);
+                }
+                break;
+            case NodeKind::BinaryExpr: {
+                auto bin = static_cast<const BinaryExpr*>(e);
+                expr(bin->left_);
+                expr(bin->right_);
+                break;
+            }
+            case NodeKind::UnaryExpr:
+                expr(static_cast<const UnaryExpr*>(e)->operand_);
+                break;
+            case NodeKind::VarargLiteral:
+            case NodeKind::FunctionDef:
+                ok = false;
+                break;
+            default:
+                break;
+        }
+    }
+};
+
+void BytecodeGenerator::error(const std::string& message, int line) {
+    throw std::runtime_error("luaoc: " + source_ + ":" + std::to_string(line < 0 ? line_ : line) + ": " + message);
+}
+
+// --- Entry point ---
+
+std::shared_ptr<LuaFunction> BytecodeGenerator::generate(Block& ast, const std::string& source) {
+    TypeChecker(source).check(ast);
+    source_ = source;
+    line_ = 0;
+    fs_ = nullptr;
+    inline_info_.clear();
+    global_fns_.clear();
+    inlining_.clear();
+
+    FunctionState fs;
+    BlockScope bl;
+    openFunction(fs, bl, 0);
+    fs.is_vararg = true; // the main chunk is always vararg
+    fs.upvals.push_back({LUAO_ENV, true, 0});
+    fs.upvalkinds.push_back(VDKREG);
+    compileStatementList(ast.statements_);
+    fs.lastlinedefined = 0;
+    return closeFunction();
+}
+
+// --- Functions and blocks ---
+
+void BytecodeGenerator::openFunction(FunctionState& fs, BlockScope& bl, int line) {
+    fs.prev = fs_;
+    fs.linedefined = line;
+    fs_ = &fs;
+    enterBlock(bl, false);
+}
+
+std::shared_ptr<LuaFunction> BytecodeGenerator::closeFunction() {
+    FunctionState* fs = fs_;
+    ret(nvarStack(), 0); // final return
+    leaveBlock();
+    if (optlevel_ > 1) {
+        optimize_ssa(fs->code, fs->lineinfo, fs->locvars, fs->protos, fs->maxstacksize);
+    }
+    if (optlevel_ > 0) {
+        optimize_code(fs->code, fs->lineinfo, fs->locvars, fs->k);
+    }
+
+    auto proto = std::make_shared<LuaFunction>(
+        std::move(fs->code), std::move(fs->k), std::move(fs->protos), std::move(fs->upvals),
+        std::move(fs->locvars), source_, std::move(fs->lineinfo), fs->linedefined, fs->lastlinedefined);
+    proto->setNumParams(fs->numparams);
+    proto->setVararg(fs->is_vararg);
+    proto->setMaxStackSize(fs->maxstacksize);
+    fs_ = fs->prev;
+    return proto;
+}
+
+void BytecodeGenerator::enterBlock(BlockScope& bl, bool isloop) {
+    bl.isloop = isloop;
+    bl.nactvar = fs_->nactvar;
+    bl.firstlabel = static_cast<int>(fs_->labels.size());
+    bl.firstgoto = static_cast<int>(fs_->gotos.size());
+    bl.upval = false;
+    bl.previous = fs_->bl;
+    fs_->bl = &bl;
+}
+
+void BytecodeGenerator::leaveBlock() {
+    FunctionState* fs = fs_;
+    BlockScope* bl = fs->bl;
+    bool hasclose = false;
+    int stklevel = regLevel(bl->nactvar); // level outside the block
+    removeVars(bl->nactvar);
+    if (bl->isloop) { // fix pending breaks
+        hasclose = createLabel("break", 0, false);
+    }
+    if (!hasclose && bl->previous && bl->upval) {
+        codeABC(OpCode::CLOSE, stklevel, 0, 0);
+    }
+    fs->freereg = stklevel;
+    fs->labels.resize(bl->firstlabel); // remove local labels
+    fs->bl = bl->previous;
+    if (bl->previous) {
+        moveGotosOut(*bl);
+    } else if (bl->firstgoto < static_cast<int>(fs->gotos.size())) {
+        undefGoto(fs->gotos[bl->firstgoto]);
+    }
+}
+
+void BytecodeGenerator::compileBlock(const Block& block) {
+    BlockScope bl;
+    enterBlock(bl, false);
+    compileStatementList(block.statements_);
+    leaveBlock();
+}
+
+// A label followed only by other labels is the last statement of its block,
+// so gotos to it may leave the block's locals. Not so inside `repeat`, whose
+// condition still sees them.
+void BytecodeGenerator::compileStatementList(const AstList<Statement*>& stmts, size_t first, bool until_follows) {
+    for (size_t n = first; n < stmts.size(); n++) {
+        bool last_label = !until_follows;
+        for (size_t m = n + 1; m < stmts.size() && last_label; m++) {
+            last_label = stmts[m]->kind_ == NodeKind::LabelStatement;
+        }
+        compileStatement(stmts[n], last_label);
+    }
+}
+
+void BytecodeGenerator::compileFunction(const FunctionDef& def, ExpDesc& e) {
+    FunctionState fs;
+    BlockScope bl;
+    openFunction(fs, bl, def.line_);
+    fs.def = &def;
+    for (const auto& param : def.params_) {
+        newLocalVar(param->name_);
+    }
+    adjustLocalVars(static_cast<int>(def.params_.size()));
+    fs.numparams = fs.nactvar;
+    fs.is_vararg = def.is_vararg_;
+    reserveRegs(fs.nactvar);
+    // callers are not checked, so typed parameters are checked on entry
+    for (size_t n = 0; n < def.params_.size(); n++) {
+        checkType(static_cast<int>(n), declared_static_type(def.params_[n]->type_));
+    }
+    compileStatementList(def.body_->statements_);
+    fs.lastlinedefined = def.end_line_;
+    line_ = def.end_line_;
+    auto proto = closeFunction();
+
+    FunctionState* parent = fs_;
+    parent->protos.emplace_back(proto, LuaType::FUNCTION);
+    line_ = def.line_;
+    e.t = e.f = NO_JUMP;
+    e.k = VRELOC;
+    e.info = codeABx(OpCode::CLOSURE, 0, static_cast<int>(parent->protos.size()) - 1);
+    exp2NextReg(e); // fix it at the last register
+}
+
+// --- Variables ---
+
+int BytecodeGenerator::newLocalVar(std::string_view name) {
+    FunctionState* fs = fs_;
+    if (static_cast<int>(fs->actvars.size()) + 1 > MAXVARS) {
+        error("too many local variables (limit is " + std::to_string(MAXVARS) + ") in " +
+              (fs->linedefined == 0 ? std::string("main function") : "function at line " + std::to_string(fs->linedefined)));
+    }
+    VarDesc var;
+    var.name = name;
+    fs->actvars.push_back(var);
+    return static_cast<int>(fs->actvars.size()) - 1;
+}
+
+// activates the last `nvars` declared variables, in consecutive registers
+// from `reglevel` (by default right above the active locals)
+void BytecodeGenerator::adjustLocalVars(int nvars, int reglevel) {
+    FunctionState* fs = fs_;
+    if (reglevel < 0) reglevel = nvarStack();
+    for (int n = 0; n < nvars; n++) {
+        VarDesc& var = fs->actvars[fs->nactvar++];
+        var.ridx = reglevel++;
+        var.pidx = static_cast<int>(fs->locvars.size());
+        fs->locvars.emplace_back(var.name, static_cast<int>(fs->code.size()), 0);
+    }
+}
+
+void BytecodeGenerator::removeVars(int tolevel) {
+    FunctionState* fs = fs_;
+    int pc = static_cast<int>(fs->code.size());
+    while (fs->nactvar > tolevel) {
+        const VarDesc& vd = fs->actvars[--fs->nactvar];
+        if (vd.kind != RDKCTC) fs->locvars[vd.pidx].endpc = pc;
+    }
+    fs->actvars.resize(fs->nactvar);
+}
+
+// number of registers used by the first `nvar` active locals
+int BytecodeGenerator::regLevel(int nvar) const {
+    while (nvar-- > 0) {
+        const VarDesc& vd = fs_->actvars[nvar];
+        if (vd.kind != RDKCTC) return vd.ridx + 1; // compile-time constants take no register
+    }
+    return 0;
+}
+
+int BytecodeGenerator::nvarStack() const {
+    return regLevel(fs_->nactvar);
+}
+
+LocalVarinfo* BytecodeGenerator::localDebugInfo(int vidx) {
+    return &fs_->locvars[fs_->actvars[vidx].pidx];
+}
+
+int BytecodeGenerator::searchVar(FunctionState* fs, const std::string& name, ExpDesc& var) {
+    for (int n = fs->nactvar - 1; n >= 0; n--) {
+        const VarDesc& vd = fs->actvars[n];
+        if (vd.name == name) {
+            var = ExpDesc();
+            if (vd.kind == RDKCTC) {
+                var.k = VCONST;
+                var.info = n;
+                var.ind_t = 0;
+            } else {
+                var.k = VLOCAL;
+                var.ridx = vd.ridx;
+                var.vidx = n;
+            }
+            return var.k;
+        }
+    }
+    return -1;
+}
+
+// marks the block where local `level` was defined as holding an upvalue
+void BytecodeGenerator::markUpval(FunctionState* fs, int level) {
+    BlockScope* bl = fs->bl;
+    while (bl->nactvar > level) {
+        bl = bl->previous;
+    }
+    bl->upval = true;
+}
+
+int BytecodeGenerator::searchUpvalue(FunctionState* fs, const std::string& name) {
+    for (size_t n = 0; n < fs->upvals.size(); n++) {
+        if (fs->upvals[n].name == name) return static_cast<int>(n);
+    }
+    return -1;
+}
+
+int BytecodeGenerator::newUpvalue(FunctionState* fs, const std::string& name, const ExpDesc& var) {
+    if (static_cast<int>(fs->upvals.size()) + 1 > MAXUPVAL) {
+        error("too many upvalues (limit is " + std::to_string(MAXUPVAL) + ") in " +
+              (fs->linedefined == 0 ? std::string("main function") : "function at line " + std::to_string(fs->linedefined)));
+    }
+    FunctionState* prev = fs->prev;
+    if (var.k == VLOCAL) {
+        fs->upvals.push_back({name, true, var.ridx});
+        fs->upvalkinds.push_back(prev->actvars[var.vidx].kind);
+    } else {
+        fs->upvals.push_back({name, false, var.info});
+        fs->upvalkinds.push_back(prev->upvalkinds[var.info]);
+    }
+    return static_cast<int>(fs->upvals.size()) - 1;
+}
+
+// Finds `name` as a local of `fs`, an upvalue, or in an enclosing function
+// (creating upvalues along the way). VVOID means it is a global.
+void BytecodeGenerator::singleVarAux(FunctionState* fs, const std::string& name, ExpDesc& var, bool base) {
+    if (fs == nullptr) {
+        var = ExpDesc();
+        return;
+    }
+    int kind = searchVar(fs, name, var);
+    if (kind == VLOCAL) {
+        if (!base) markUpval(fs, var.vidx); // local will be used as an upvalue
+        return;
+    }
+    if (kind == VCONST) return; // constants are never captured
+    int idx = searchUpvalue(fs, name);
+    if (idx < 0) {
+        singleVarAux(fs->prev, name, var, false);
+        if (var.k == VCONST) { // constant of an enclosing function
+            var.ind_t++;
+            return;
+        }
+        if (var.k != VLOCAL && var.k != VUPVAL) return; // global
+        idx = newUpvalue(fs, name, var);
+    }
+    var = ExpDesc();
+    var.k = VUPVAL;
+    var.info = idx;
+}
+
+void BytecodeGenerator::singleVar(const std::string& name, ExpDesc& var) {
+    singleVarAux(fs_, name, var, true);
+    if (var.k == VVOID) { // global name: _ENV[name]
+        ExpDesc key;
+        singleVarAux(fs_, LUAO_ENV, var, true);
+        exp2AnyRegUp(var);
+        key.k = VKSTR;
+        key.strval = name;
+        indexed(var, key);
+    }
+}
+
+void BytecodeGenerator::checkReadonly(const ExpDesc& e) {
+    const std::string* varname = nullptr;
+    if (e.k == VCONST) {
+        varname = &constVar(e).name;
+    } else if (e.k == VLOCAL) {
+        const VarDesc& vd = fs_->actvars[e.vidx];
+        if (vd.kind != VDKREG) varname = &vd.name;
+    } else if (e.k == VUPVAL) {
+        if (fs_->upvalkinds[e.info] != VDKREG) varname = &fs_->upvals[e.info].name;
+    }
+    if (varname) {
+        error("attempt to assign to const variable '" + *varname + "'");
+    }
+}
+
+// Adjusts the values of an expression list to `nvars` registers.
+void BytecodeGenerator::adjustAssign(int nvars, int nexps, ExpDesc& e) {
+    int needed = nvars - nexps;
+    if (hasmultret(e.k)) {
+        int extra = needed + 1; // the last expression provides the difference
+        if (extra < 0) extra = 0;
+        setReturns(e, extra);
+    } else {
+        if (e.k != VVOID) exp2NextReg(e);
+        if (needed > 0) loadNil(fs_->freereg, needed);
+    }
+    if (needed > 0) {
+        reserveRegs(needed);
+    } else {
+        fs_->freereg += needed; // remove extra values
+    }
+}
+
+const BytecodeGenerator::VarDesc& BytecodeGenerator::constVar(const ExpDesc& e) const {
+    const FunctionState* fs = fs_;
+    for (int n = 0; n < e.ind_t; n++) {
+        fs = fs->prev;
+    }
+    return fs->actvars[e.info];
+}
+
+// Value of `name` if it resolves to a compile-time constant. Emits nothing,
+// unlike singleVar, so it can be asked before committing to a code shape.
+bool BytecodeGenerator::findConstant(std::string_view name, ExpDesc& k) const {
+    for (const FunctionState* fs = fs_; fs != nullptr; fs = fs->prev) {
+        for (int n = fs->nactvar - 1; n >= 0; n--) {
+            const VarDesc& vd = fs->actvars[n];
+            if (vd.name == name) {
+                if (vd.kind != RDKCTC) return false;
+                k = vd.k;
+                return true;
+            }
+        }
+        for (const auto& uv : fs->upvals) {
+            if (uv.name == name) return false;
+        }
+    }
+    return false; // global
+}
+
+// --- Labels and gotos ---
+
+int BytecodeGenerator::newLabelEntry(std::vector<LabelDesc>& list, std::string_view name, int line, int pc) {
+    list.push_back({std::string(name), pc, line, fs_->nactvar, false});
+    return static_cast<int>(list.size()) - 1;
+}
+
+int BytecodeGenerator::newGotoEntry(std::string_view name, int line, int pc) {
+    return newLabelEntry(fs_->gotos, name, line, pc);
+}
+
+const BytecodeGenerator::LabelDesc* BytecodeGenerator::findLabel(std::string_view name) const {
+    for (const auto& lb : fs_->labels) {
+        if (lb.name == name) return &lb;
+    }
+    return nullptr;
+}
+
+// Creates a label at the current position and resolves the pending gotos
+// to it. Returns true when a CLOSE was emitted for them.
+bool BytecodeGenerator::createLabel(std::string_view name, int line, bool last) {
+    FunctionState* fs = fs_;
+    int l = newLabelEntry(fs->labels, name, line, getLabel());
+    if (last) { // locals are already out of scope at a block's last label
+        fs->labels[l].nactvar = fs->bl->nactvar;
+    }
+    LabelDesc lb = fs->labels[l];
+    if (solveGotos(lb)) {
+        codeABC(OpCode::CLOSE, nvarStack(), 0, 0);
+        return true;
+    }
+    return false;
+}
+
+bool BytecodeGenerator::solveGotos(const LabelDesc& lb) {
+    auto& gotos = fs_->gotos;
+    size_t n = fs_->bl->firstgoto;
+    bool needsclose = false;
+    while (n < gotos.size()) {
+        if (gotos[n].name == lb.name) {
+            needsclose |= gotos[n].close;
+            solveGoto(static_cast<int>(n), lb); // removes it from the list
+        } else {
+            n++;
+        }
+    }
+    return needsclose;
+}
+
+void BytecodeGenerator::solveGoto(int g, const LabelDesc& label) {
+    auto& gotos = fs_->gotos;
+    const LabelDesc& gt = gotos[g];
+    if (gt.nactvar < label.nactvar) { // jumps into the scope of a local
+        error("<goto " + gt.name + "> at line " + std::to_string(gt.line) +
+              " jumps into the scope of local '" + fs_->actvars[gt.nactvar].name + "'", gt.line);
+    }
+    patchList(gt.pc, label.pc);
+    gotos.erase(gotos.begin() + g);
+}
+
+// pending gotos of a closing block now belong to the enclosing one
+void BytecodeGenerator::moveGotosOut(const BlockScope& bl) {
+    for (size_t n = bl.firstgoto; n < fs_->gotos.size(); n++) {
+        LabelDesc& gt = fs_->gotos[n];
+        if (regLevel(gt.nactvar) > regLevel(bl.nactvar)) {
+            gt.close |= bl.upval; // leaving a variable scope
+        }
+        gt.nactvar = bl.nactvar;
+    }
+}
+
+void BytecodeGenerator::undefGoto(const LabelDesc& gt) {
+    if (gt.name == "break") {
+        error("break outside a loop at line " + std::to_string(gt.line), gt.line);
+    }
+    error("no visible label '" + gt.name + "' for <goto> at line " + std::to_string(gt.line), gt.line);
+}
+
+// --- Statements ---
+
+void BytecodeGenerator::compileStatement(const Statement* stmt, bool last_label) {
+    if (stmt->line_) line_ = stmt->line_;
+
+    switch (stmt->kind_) {
+        case NodeKind::LocalStatement: compileLocal(static_cast<const LocalStatement*>(stmt)); break;
+        case NodeKind::AssignStatement: compileAssign(static_cast<const AssignStatement*>(stmt)); break;
+        case NodeKind::ExprStatement: compileExprStatement(static_cast<const ExprStatement*>(stmt)); break;
+        case NodeKind::FunctionStatement: {
+            auto s = static_cast<const FunctionStatement*>(stmt);
+            if (s->is_local_) compileLocalFunction(s);
+            else compileFunctionStatement(s);
+            break;
+        }
+        case NodeKind::IfStatement: compileIf(static_cast<const IfStatement*>(stmt)); break;
+        case NodeKind::WhileStatement: compileWhile(static_cast<const WhileStatement*>(stmt)); break;
+        case NodeKind::DoStatement: compileBlock(*static_cast<const DoStatement*>(stmt)->body_); break;
+        case NodeKind::RepeatUntilStatement: compileRepeat(static_cast<const RepeatUntilStatement*>(stmt)); break;
+        case NodeKind::NumericForStatement: compileNumericFor(static_cast<const NumericForStatement*>(stmt)); break;
+        case NodeKind::GenericForStatement: compileGenericFor(static_cast<const GenericForStatement*>(stmt)); break;
+        case NodeKind::ReturnStatement: compileReturn(static_cast<const ReturnStatement*>(stmt)); break;
+        case NodeKind::BreakStatement: newGotoEntry("break", line_, jump()); break;
+        case NodeKind::GotoStatement: compileGoto(static_cast<const GotoStatement*>(stmt)); break;
+        case NodeKind::LabelStatement: compileLabel(static_cast<const LabelStatement*>(stmt), last_label); break;
+        case NodeKind::Block: compileBlock(*static_cast<const Block*>(stmt)); break;
+        default: error("unsupported statement");
+    }
+
+    fs_->freereg = nvarStack(); // free registers
+}
+
+void BytecodeGenerator::compileLocal(const LocalStatement* stmt) {
+    int nvars = 0;
+    int firstvar = static_cast<int>(fs_->actvars.size());
+    for (const auto& name : stmt->names_) {
+        int vidx = newLocalVar(name->name_);
+        if (name->attribute_ == "const") {
+            fs_->actvars[vidx].kind = RDKCONST;
+        } else if (name->attribute_ == "close") {
+            error("to-be-closed variables are not supported");
+        } else if (!name->attribute_.empty()) {
+            error("unknown attribute '" + std::string(name->attribute_) + "'");
+        }
+        nvars++;
+    }
+    ExpDesc e;
+    int nexps = compileExprList(stmt->values_, e);
+    VarDesc& var = fs_->actvars.back(); // last variable
+    if (nvars == nexps && var.kind == RDKCONST && exp2Const(e, var.k)) {
+        // a constant initializer: the variable is replaced by its value
+        var.kind = RDKCTC;
+        adjustLocalVars(nvars - 1);
+        fs_->nactvar++;
+    } else {
+        adjustAssign(nvars, nexps, e);
+        adjustLocalVars(nvars);
+    }
+    // typed locals whose initial value the checker could not prove
+    for (int n = 0; n < nvars; n++) {
+        VarDesc& v = fs_->actvars[firstvar + n];
+        auto def = n < nexps ? ast_cast<FunctionDef>(stmt->values_[n]) : nullptr;
+        if (def && def->stable_) { // the body cannot see the variables being declared
+            v.fn = def;
+            v.fnvars = firstvar;
+        }
+        if (v.kind == RDKCTC) continue;
+        StaticType type = declared_static_type(stmt->names_[n]->type_);
+        if (n >= nexps || !static_type_proven(type, stmt->values_[n]->static_type_)) {
+            checkType(v.ridx, type);
+        }
+    }
+}
+
+// the variable is in scope inside the body, so the function can recurse
+void BytecodeGenerator::compileLocalFunction(const FunctionStatement* stmt) {
+    auto* name = static_cast<const Identifier*>(stmt->name_);
+    int fvar = fs_->nactvar;
+    newLocalVar(name->name_);
+    adjustLocalVars(1);
+    ExpDesc b;
+    compileFunction(*stmt->def_, b);
+    // debug information only sees the variable after this point
+    localDebugInfo(fvar)->startpc = static_cast<int>(fs_->code.size());
+    if (stmt->def_->stable_) {
+        fs_->actvars[fvar].fn = stmt->def_;
+        fs_->actvars[fvar].fnvars = fvar + 1;
+    }
+}
+
+void BytecodeGenerator::compileFunctionStatement(const FunctionStatement* stmt) {
+    int line = stmt->line_;
+    ExpDesc v, b;
+    compileExpr(stmt->name_, v);
+    compileFunction(*stmt->def_, b);
+    checkReadonly(v);
+    guardStore(stmt->name_, stmt->def_, b);
+    // a global defined at the top level of the chunk keeps its surroundings
+    // for the rest of it, so its body can be inlined after this point
+    auto id = ast_cast<Identifier>(stmt->name_);
+    if (inline_globals_ && id && stmt->def_->stable_ && v.k == VINDEXUP && !fs_->prev && !fs_->bl->previous) {
+        global_fns_[id->name_] = {stmt->def_, fs_->nactvar};
+    }
+    storeVar(v, b);
+    fixLine(line); // the definition "happens" on the first line
+}
+
+// Stores are done right to left once every value is in a register. Targets
+// whose table or key is a local assigned by the same statement read a copy
+// made before any store (see checkConflict).
+void BytecodeGenerator::compileAssign(const AssignStatement* stmt) {
+    std::vector<ExpDesc> lhs(stmt->targets_.size());
+    for (size_t n = 0; n < stmt->targets_.size(); n++) {
+        compileExpr(stmt->targets_[n], lhs[n]);
+        if (!vkisvar(lhs[n].k)) error("syntax error");
+        checkReadonly(lhs[n]);
+        if (n > 0 && !vkisindexed(lhs[n].k)) {
+            checkConflict(lhs, n, lhs[n]);
+        }
+    }
+
+    int nvars = static_cast<int>(lhs.size());
+    ExpDesc e;
+    int nexps = compileExprList(stmt->values_, e);
+    int n = nvars - 1;
+    auto value = [&](int i) { return i < nexps ? stmt->values_[i] : nullptr; };
+    if (nexps != nvars) {
+        adjustAssign(nvars, nexps, e);
+    } else {
+        setOneRet(e);
+        guardStore(stmt->targets_[n], value(n), e);
+        storeVar(lhs[n--], e);
+    }
+    for (; n >= 0; n--) {
+        ExpDesc top;
+        top.k = VNONRELOC;
+        top.info = fs_->freereg - 1;
+        guardStore(stmt->targets_[n], value(n), top);
+        storeVar(lhs[n], top);
+    }
+}
+
+// If an earlier target indexes through the local or upvalue `v` (assigned
+// by the same statement), copy `v` to a temporary and use that instead.
+void BytecodeGenerator::checkConflict(std::vector<ExpDesc>& lhs, size_t n, const ExpDesc& v) {
+    int extra = fs_->freereg;
+    bool conflict = false;
+    for (size_t m = 0; m < n; m++) {
+        ExpDesc& lh = lhs[m];
+        if (!vkisindexed(lh.k)) continue;
+        if (lh.k == VINDEXUP) {
+            if (v.k == VUPVAL && lh.ind_t == v.info) {
+                conflict = true;
+                lh.k = VINDEXSTR;
+                lh.ind_t = extra;
+            }
+        } else {
+            if (v.k == VLOCAL && lh.ind_t == v.ridx) {
+                conflict = true;
+                lh.ind_t = extra;
+            }
+            if (lh.k == VINDEXED && v.k == VLOCAL && lh.ind_idx == v.ridx) {
+                conflict = true;
+                lh.ind_idx = extra;
+            }
+        }
+    }
+    if (conflict) {
+        if (v.k == VLOCAL) {
+            codeABC(OpCode::MOVE, extra, v.ridx, 0);
+        } else {
+            codeABC(OpCode::GETUPVAL, extra, v.info, 0);
+        }
+        reserveRegs(1);
+    }
+}
+
+void BytecodeGenerator::compileExprStatement(const ExprStatement* stmt) {
+    ExpDesc v;
+    auto call = ast_cast<FunctionCall>(stmt->expr_);
+    if (call && inlineCall(call, v, false)) return;
+    compileExpr(stmt->expr_, v);
+    if (v.k != VCALL) error("syntax error");
+    SETARG_C(getInstruction(v), 1); // call statement uses no results
+}
+
+void BytecodeGenerator::compileIf(const IfStatement* stmt) {
+    int escapelist = NO_JUMP;
+    for (size_t n = 0; n < stmt->if_clauses_.size(); n++) {
+        bool more = n + 1 < stmt->if_clauses_.size() || stmt->else_body_;
+        testThenBlock(stmt->if_clauses_[n], more, escapelist);
+    }
+    if (stmt->else_body_) {
+        compileBlock(*stmt->else_body_);
+    }
+    patchToHere(escapelist);
+}
+
+void BytecodeGenerator::testThenBlock(const IfClause& clause, bool more, int& escapelist) {
+    BlockScope bl;
+    ExpDesc v;
+    int jf;
+    size_t first = 0;
+    const auto& stmts = clause.body->statements_;
+    compileExpr(clause.condition, v);
+    if (!stmts.empty() && ast_cast<BreakStatement>(stmts[0])) {
+        // `if x then break`: jump straight out of the loop when x is true
+        int line = stmts[0]->line_;
+        goIfFalse(v);
+        enterBlock(bl, false);
+        newGotoEntry("break", line, v.t);
+        if (stmts.size() == 1) { // 'then' part has only the break
+            leaveBlock();
+            return;
+        }
+        jf = jump(); // skip the rest of the 'then' part
+        first = 1;
+    } else {
+        goIfTrue(v);
+        enterBlock(bl, false);
+        jf = v.f;
+    }
+    compileStatementList(stmts, first);
+    leaveBlock();
+    if (more) {
+        concatJumps(escapelist, jump());
+    }
+    patchToHere(jf);
+}
+
+// jump list taken when `expr` is false
+int BytecodeGenerator::condition(const Expression* expr) {
+    ExpDesc v;
+    compileExpr(expr, v);
+    if (v.k == VNIL) v.k = VFALSE; // 'falses' are all equal here
+    goIfTrue(v);
+    return v.f;
+}
+
+void BytecodeGenerator::compileWhile(const WhileStatement* stmt) {
+    BlockScope bl;
+    int whileinit = getLabel();
+    int condexit = condition(stmt->condition_);
+    enterBlock(bl, true);
+    compileBlock(*stmt->body_);
+    patchList(jump(), whileinit);
+    leaveBlock();
+    patchToHere(condexit);
+}
+
+void BytecodeGenerator::compileRepeat(const RepeatUntilStatement* stmt) {
+    BlockScope bl1, bl2;
+    int repeat_init = getLabel();
+    enterBlock(bl1, true);  // loop block
+    enterBlock(bl2, false); // scope block
+    compileStatementList(stmt->body_->statements_, 0, true);
+    int condexit = condition(stmt->condition_); // inside the scope block
+    leaveBlock();
+    if (bl2.upval) { // the repetition must close the body's upvalues
+        int exit = jump();
+        patchToHere(condexit);
+        codeABC(OpCode::CLOSE, regLevel(bl2.nactvar), 0, 0);
+        condexit = jump();
+        patchToHere(exit);
+    }
+    patchList(condexit, repeat_init);
+    leaveBlock();
+}
+
+void BytecodeGenerator::compileNumericFor(const NumericForStatement* stmt) {
+    BlockScope bl;
+    int line = stmt->line_;
+    enterBlock(bl, true); // scope for loop and control variables
+    int base = fs_->freereg;
+    newLocalVar("(for state)");
+    newLocalVar("(for state)");
+    newLocalVar("(for state)");
+    newLocalVar(stmt->var_->name_);
+    compileExprToNextReg(stmt->start_);
+    compileExprToNextReg(stmt->end_);
+    if (stmt->step_) {
+        compileExprToNextReg(stmt->step_);
+    } else {
+        loadInt(fs_->freereg, 1);
+        reserveRegs(1);
+    }
+    adjustLocalVars(3); // control variables
+    forBody(*stmt->body_, base, line, 1, false);
+    leaveBlock();
+}
+
+void BytecodeGenerator::compileGenericFor(const GenericForStatement* stmt) {
+    BlockScope bl;
+    int line = stmt->line_;
+    enterBlock(bl, true);
+    int base = fs_->freereg;
+    // generator, state, control and the closing slot
+    newLocalVar("(for state)");
+    newLocalVar("(for state)");
+    newLocalVar("(for state)");
+    newLocalVar("(for state)");
+    for (const auto& name : stmt->names_) {
+        newLocalVar(name->name_);
+    }
+    ExpDesc e;
+    int nexps = compileExprList(stmt->exprs_, e);
+    adjustAssign(4, nexps, e);
+    adjustLocalVars(4);
+    checkStack(3); // extra space to call the generator
+    forBody(*stmt->body_, base, line, static_cast<int>(stmt->names_.size()), true);
+    leaveBlock();
+}
+
+void BytecodeGenerator::forBody(const Block& body, int base, int line, int nvars, bool isgen) {
+    BlockScope bl;
+    int prep = codeABx(isgen ? OpCode::TFORPREP : OpCode::FORPREP, base, 0);
+    enterBlock(bl, false); // scope for the declared variables
+    adjustLocalVars(nvars);
+    reserveRegs(nvars);
+    compileBlock(body);
+    leaveBlock();
+    fixForJump(prep, getLabel(), false);
+    line_ = line;
+    if (isgen) {
+        codeABC(OpCode::TFORCALL, base, 0, nvars);
+    }
+    int endfor = codeABx(isgen ? OpCode::TFORLOOP : OpCode::FORLOOP, base, 0);
+    fixForJump(endfor, prep + 1, true);
+}
+
+void BytecodeGenerator::fixForJump(int pc, int dest, bool back) {
+    int offset = dest - (pc + 1);
+    if (back) offset = -offset;
+    if (offset > MAXARG_Bx) error("control structure too long");
+    SETARG_Bx(fs_->code[pc], offset);
+}
+
+void BytecodeGenerator::compileReturn(const ReturnStatement* stmt) {
+    ExpDesc e;
+    int first = nvarStack(); // first slot to be returned
+    int nret = compileExprList(stmt->exprs_, e);
+    if (nret > 0) {
+        if (hasmultret(e.k)) {
+            setMultRet(e);
+            if (e.k == VCALL && nret == 1) { // tail call
+                SET_OPCODE(getInstruction(e), OpCode::TAILCALL);
+            }
+            nret = LUA_MULTRET;
+        } else if (nret == 1) {
+            first = exp2AnyReg(e); // can use the original slot
+        } else {
+            exp2NextReg(e); // values must be consecutive
+        }
+    }
+    ret(first, nret);
+}
+
+void BytecodeGenerator::compileGoto(const GotoStatement* stmt) {
+    int line = stmt->line_;
+    const LabelDesc* lb = findLabel(stmt->name_);
+    if (lb == nullptr) { // forward jump, resolved when the label is declared
+        newGotoEntry(stmt->name_, line, jump());
+        return;
+    }
+    // backward jump, resolved here
+    int lblevel = regLevel(lb->nactvar);
+    int target = lb->pc;
+    if (nvarStack() > lblevel) { // leaving the scope of a variable
+        codeABC(OpCode::CLOSE, lblevel, 0, 0);
+    }
+    patchList(jump(), target);
+}
+
+void BytecodeGenerator::compileLabel(const LabelStatement* stmt, bool last) {
+    if (const LabelDesc* lb = findLabel(stmt->name_)) {
+        error("label '" + std::string(stmt->name_) + "' already defined on line " + std::to_string(lb->line));
+    }
+    createLabel(stmt->name_, stmt->line_, last);
+}
+
+// --- Expressions ---
+
+void BytecodeGenerator::compileExpr(const Expression* expr, ExpDesc& e) {
+    int saved_line = line_;
+    if (expr->line_) line_ = expr->line_;
+    e = ExpDesc();
+
+    switch (expr->kind_) {
+        case NodeKind::NilLiteral:
+            e.k = VNIL;
+            break;
+        case NodeKind::BoolLiteral:
+            e.k = static_cast<const BoolLiteral*>(expr)->value_ ? VTRUE : VFALSE;
+            break;
+        case NodeKind::NumberLiteral:
+            compileNumber(static_cast<const NumberLiteral*>(expr), e);
+            break;
+        case NodeKind::StringLiteral:
+            e.k = VKSTR;
+            e.strval = static_cast<const StringLiteral*>(expr)->value_;
+            break;
+        case NodeKind::VarargLiteral:
+            if (!fs_->is_vararg) error("cannot use '...' outside a vararg function");
+            e.k = VVARARG;
+            e.info = codeABC(OpCode::VARARG, 0, 0, 1);
+            break;
+        case NodeKind::Identifier:
+            singleVar(std::string(static_cast<const Identifier*>(expr)->name_), e);
+            break;
+        case NodeKind::ParenExpr:
+            compileExpr(static_cast<const ParenExpr*>(expr)->expr_, e);
+            dischargeVars(e); // truncates calls and varargs to one value
+            break;
+        case NodeKind::TableAccess: {
+            auto access = static_cast<const TableAccess*>(expr);
+            ExpDesc key;
+            compileExpr(access->prefix_expr_, e);
+            exp2AnyRegUp(e);
+            key.k = VKSTR;
+            key.strval = access->field_name_->name_;
+            indexed(e, key);
+            e.known_table = access->prefix_expr_->static_type_ == StaticType::Table;
+            break;
+        }
+        case NodeKind::IndexAccess: {
+            auto access = static_cast<const IndexAccess*>(expr);
+            ExpDesc key;
+            compileExpr(access->prefix_expr_, e);
+            exp2AnyRegUp(e);
+            compileExpr(access->index_expr_, key);
+            exp2Val(key);
+            indexed(e, key);
+            break;
+        }
+        case NodeKind::FunctionCall:
+            compileCall(static_cast<const FunctionCall*>(expr), e);
+            break;
+        case NodeKind::FunctionDef:
+            compileFunction(*static_cast<const FunctionDef*>(expr), e);
+            break;
+        case NodeKind::TableConstructor:
+            compileTable(static_cast<const TableConstructor*>(expr), e);
+            break;
+        case NodeKind::BinaryExpr:
+            compileBinary(static_cast<const BinaryExpr*>(expr), e);
+            break;
+        case NodeKind::UnaryExpr:
+            compileUnary(static_cast<const UnaryExpr*>(expr), e);
+            break;
+        default:
+            error("unsupported expression");
+    }
+
+    line_ = saved_line;
+}
+
+// Compiles a list leaving all but the last value in consecutive registers;
+// the last one stays in `e` so the caller can adjust it. Returns the count.
+int BytecodeGenerator::compileExprList(const AstList<Expression*>& exprs, ExpDesc& e) {
+    e = ExpDesc();
+    for (size_t n = 0; n < exprs.size(); n++) {
+        if (n > 0) exp2NextReg(e);
+        compileExpr(exprs[n], e);
+    }
+    return static_cast<int>(exprs.size());
+}
+
+void BytecodeGenerator::compileExprToNextReg(const Expression* expr) {
+    ExpDesc e;
+    compileExpr(expr, e);
+    exp2NextReg(e);
+}
+
+// Decimal integers that overflow become floats; hex integers wrap around.
+// Integer literals the type checker retyped as float are loaded as floats.
+void BytecodeGenerator::compileNumber(const NumberLiteral* lit, ExpDesc& e) {
+    compileNumeral(lit, e);
+    if (e.k == VKINT && lit->static_type_ == StaticType::Float) {
+        e.k = VKFLT;
+        e.nval = static_cast<luaNumber>(e.ival);
+    }
+}
+
+void BytecodeGenerator::compileNumeral(const NumberLiteral* lit, ExpDesc& e) {
+    const std::string s(lit->value_);
+    if (s.size() > 2 && s[0] == '0' && (s[1] == 'x' || s[1] == 'X')) {
+        unsigned long long v = 0;
+        for (size_t n = 2; n < s.size(); n++) {
+            char c = s[n];
+            int digit = (c >= '0' && c <= '9') ? c - '0' : (c | 0x20) - 'a' + 10;
+            v = v * 16 + static_cast<unsigned long long>(digit);
+        }
+        e.k = VKINT;
+        e.ival = static_cast<luaInt>(v);
+        return;
+    }
+    if (s.find_first_of(".eE") == std::string::npos) {
+        errno = 0;
+        long long v = std::strtoll(s.c_str(), nullptr, 10);
+        if (errno != ERANGE) {
+            e.k = VKINT;
+            e.ival = v;
+            return;
+        }
+    }
+    e.k = VKFLT;
+    e.nval = std::strtod(s.c_str(), nullptr);
+}
+
+void BytecodeGenerator::compileCall(const FunctionCall* call, ExpDesc& e) {
+    if (!call->cast_type_.empty()) {
+        compileCast(call, e);
+        return;
+    }
+    if (inlineCall(call, e, true)) return;
+    int line = line_;
+    compileExpr(call->prefix_expr_, e);
+    if (call->method_name_) {
+        ExpDesc key;
+        key.k = VKSTR;
+        key.strval = call->method_name_->value_;
+        codeSelf(e, key);
+    } else {
+        exp2NextReg(e);
+    }
+
+    ExpDesc args;
+    int nargs = compileExprList(call->args_, args);
+    if (nargs > 0 && hasmultret(args.k)) {
+        setMultRet(args);
+    }
+    int base = e.info; // base register for the call
+    int nparams;
+    if (hasmultret(args.k)) {
+        nparams = LUA_MULTRET; // open call
+    } else {
+        if (args.k != VVOID) exp2NextReg(args); // close the last argument
+        nparams = fs_->freereg - (base + 1);
+    }
+    e = ExpDesc();
+    e.k = VCALL;
+    e.info = codeABC(OpCode::CALL, base, nparams + 1, 2);
+    fixLine(line);
+    fs_->freereg = base + 1; // the call leaves one result (unless changed later)
+}
+
+// List items are flushed to the table with SETLIST every LFIELDS_PER_FLUSH
+// values; a trailing call or vararg supplies all of its results.
+void BytecodeGenerator::compileTable(const TableConstructor* table, ExpDesc& t) {
+    t = ExpDesc();
+    t.k = VNONRELOC;
+    t.info = fs_->freereg; // the table will be at the stack top
+    codeABC(OpCode::NEWTABLE, t.info, 0, 0);
+    reserveRegs(1);
+
+    ExpDesc v; // last list item read
+    int na = 0;
+    int tostore = 0;
+
+    auto setlist = [this](int base, int nelems, int count) {
+        if (count == LUA_MULTRET) count = 0;
+        if (nelems <= MAXARG_C) {
+            codeABC(OpCode::SETLIST, base, count, nelems);
+        } else {
+            int extra = nelems / (MAXARG_C + 1);
+            nelems %= (MAXARG_C + 1);
+            codeABCk(OpCode::SETLIST, base, count, nelems, 1);
+            codeExtraArg(extra);
+        }
+        fs_->freereg = base + 1; // free registers with list values
+    };
+
+    for (const auto& field : table->fields_) {
+        if (v.k != VVOID) { // close the previous list item
+            exp2NextReg(v);
+            v.k = VVOID;
+            if (tostore == LFIELDS_PER_FLUSH) {
+                setlist(t.info, na, tostore);
+                na += tostore;
+                tostore = 0;
+            }
+        }
+        if (field.key) {
+            int reg = fs_->freereg;
+            ExpDesc tab = t, key, val;
+            compileExpr(field.key, key);
+            exp2Val(key);
+            indexed(tab, key);
+            compileExpr(field.value, val);
+            storeVar(tab, val);
+            fs_->freereg = reg;
+        } else {
+            compileExpr(field.value, v);
+            tostore++;
+        }
+    }
+
+    if (tostore > 0) {
+        if (hasmultret(v.k)) {
+            setMultRet(v);
+            setlist(t.info, na, LUA_MULTRET);
+        } else {
+            if (v.k != VVOID) exp2NextReg(v);
+            setlist(t.info, na, tostore);
+        }
+    }
+}
+
+void BytecodeGenerator::compileBinary(const BinaryExpr* bin, ExpDesc& e) {
+    int line = bin->line_ ? bin->line_ : line_;
+    ExpDesc e2;
+    if (bin->op_.type == Token::CONCAT && constString(bin, e.strval)) {
+        e.k = VKSTR;
+        return;
+    }
+    compileExpr(bin->left_, e);
+    infix(bin->op_.type, e);
+    compileExpr(bin->right_, e2);
+    posfix(bin->op_.type, e, e2, line);
+    specializeBinary(bin, e);
+}
+
+void BytecodeGenerator::compileUnary(const UnaryExpr* un, ExpDesc& e) {
+    int line = un->line_ ? un->line_ : line_;
+    compileExpr(un->operand_, e);
+    prefix(un->op_.type, e, line);
+}
+
+// cast(value, type): the value, checked unless its type is already proven
+void BytecodeGenerator::compileCast(const FunctionCall* call, ExpDesc& e) {
+    const Expression* value = call->args_[0];
+    StaticType type = declared_static_type(call->cast_type_);
+    compileExpr(value, e);
+    dischargeVars(e); // one value, like a parenthesized expression
+    if (!static_type_proven(type, value->static_type_)) {
+        checkType(exp2AnyReg(e), type);
+    }
+}
+
+// --- Static types ---
+
+// With both operand types proven, the generic instruction just emitted for
+// an arithmetic or order operator is swapped for its typed form.
+void BytecodeGenerator::specializeBinary(const BinaryExpr* bin, ExpDesc& e) {
+    StaticType t1 = bin->left_->static_type_;
+    StaticType t2 = bin->right_->static_type_;
+    bool ints = (t1 == StaticType::Int || t1 == StaticType::Long) &&
+                (t2 == StaticType::Int || t2 == StaticType::Long);
+    bool floats = t1 == StaticType::Float && t2 == StaticType::Float;
+    if (!ints && !floats) return;
+    Instruction* i;
+    switch (bin->op_.type) {
+        case Token::PLUS: case Token::MINUS: case Token::MULTIPLY: case Token::DIVIDE:
+            if (e.k != VRELOC) return; // folded
+            i = &getInstruction(e);
+            break;
+        case Token::LT: case Token::LE: case Token::GT: case Token::GE:
+            if (e.k != VJMP) return;
+            i = getJumpControl(e.info);
+            break;
+        default:
+            return;
+    }
+    OpCode op = GET_OPCODE(*i);
+    OpCode typed = op;
+    if (ints) {
+        switch (op) {
+            case OpCode::ADD: typed = OpCode::ADDINT; break;
+            case OpCode::ADDI: typed = OpCode::ADDIINT; break;
+            case OpCode::SUB: typed = OpCode::SUBINT; break;
+            case OpCode::MUL: typed = OpCode::MULINT; break;
+            case OpCode::LT: typed = OpCode::LTINT; break;
+            case OpCode::LE: typed = OpCode::LEINT; break;
+            default: break;
+        }
+    } else {
+        switch (op) {
+            case OpCode::ADD: typed = OpCode::ADDFLT; break;
+            case OpCode::SUB: typed = OpCode::SUBFLT; break;
+            case OpCode::MUL: typed = OpCode::MULFLT; break;
+            case OpCode::DIV: typed = OpCode::DIVFLT; break;
+            default: break;
+        }
+    }
+    SET_OPCODE(*i, typed);
+}
+
+// run-time check that `reg` holds a value of `type`; nothing for Any
+void BytecodeGenerator::checkType(int reg, StaticType type) {
+    CheckTag tag;
+    switch (type) {
+        case StaticType::Int: case StaticType::Long: tag = CheckTag::INTEGER; break;
+        case StaticType::Float: tag = CheckTag::FLOAT; break;
+        case StaticType::String: tag = CheckTag::STRING; break;
+        case StaticType::Boolean: tag = CheckTag::BOOLEAN; break;
+        case StaticType::Table: tag = CheckTag::TABLE; break;
+        case StaticType::Function: tag = CheckTag::FUNCTION; break;
+        default: return;
+    }
+    codeABC(OpCode::CHECKTYPE, reg, static_cast<int>(tag), 0);
+}
+
+// Checks `ex` before it is stored into a typed variable, unless the type
+// checker proved `value` (nullptr: an extra call result) already fits.
+void BytecodeGenerator::guardStore(const Expression* target, const Expression* value, ExpDesc& ex) {
+    auto id = ast_cast<Identifier>(target);
+    if (!id || id->static_type_ == StaticType::Any) return;
+    if (value && static_type_proven(id->static_type_, value->static_type_)) return;
+    checkType(exp2AnyReg(ex), id->static_type_);
+}
+
+// --- Inlining ---
+
+// Compiles `f(args)` as the body of f when f is small and bound to a name
+// that is never assigned again. The frame mirrors a call: a result slot in
+// place of the function, then the parameters as locals bound like `local`
+// binds its values, and the body in a block of its own. A body is only
+// inlined where it ends in the single return it has; where the call's value
+// is used, that return must give exactly one value, so the inlined call
+// yields as many values as the real one would.
+bool BytecodeGenerator::inlineCall(const FunctionCall* call, ExpDesc& e, bool want_value) {
+    const FunctionDef* def = inlineTarget(call);
+    if (!def) return false;
+    const auto& stmts = def->body_->statements_;
+    auto ret = stmts.empty() ? nullptr : ast_cast<ReturnStatement>(stmts.back());
+    if (want_value && !(ret && ret->exprs_.size() == 1 && !is_multi(ret->exprs_[0]))) return false;
+
+    FunctionState* fs = fs_;
+    int line = line_;
+    int base = fs->freereg;
+    int nparams = static_cast<int>(def->params_.size());
+    // locals of an enclosing `local` statement are declared but not active
+    // yet; they are set aside so only the frame's variables get activated
+    std::vector<VarDesc> pending(fs->actvars.begin() + fs->nactvar, fs->actvars.end());
+    fs->actvars.resize(fs->nactvar);
+
+    BlockScope bl;
+    enterBlock(bl, false);
+    newLocalVar("(inline)");
+    for (const auto& param : def->params_) {
+        newLocalVar(param->name_);
+    }
+    reserveRegs(1);
+    ExpDesc args;
+    int nargs = compileExprList(call->args_, args);
+    adjustAssign(nparams, nargs, args);
+    adjustLocalVars(nparams + 1, base);
+    for (int n = 0; n < nparams; n++) {
+        StaticType type = declared_static_type(def->params_[n]->type_);
+        if (n >= nargs || !static_type_proven(type, call->args_[n]->static_type_)) {
+            checkType(base + 1 + n, type);
+        }
+    }
+
+    inlining_.push_back(def);
+    size_t nstmts = stmts.size() - (ret ? 1 : 0);
+    for (size_t n = 0; n < nstmts; n++) {
+        compileStatement(stmts[n], false);
+    }
+    if (ret) {
+        if (ret->line_) line_ = ret->line_;
+        ExpDesc v;
+        if (want_value) {
+            compileExpr(ret->exprs_[0], v);
+            exp2Reg(v, base);
+        } else if (compileExprList(ret->exprs_, v) > 0) { // evaluated for their effects
+            if (v.k == VCALL) SETARG_C(getInstruction(v), 1);
+            else exp2NextReg(v);
+        }
+    }
+    inlining_.pop_back();
+    leaveBlock();
+
+    fs->actvars.insert(fs->actvars.end(), pending.begin(), pending.end());
+    fs->freereg = want_value ? base + 1 : base;
+    line_ = line;
+    e = ExpDesc();
+    if (want_value) {
+        e.k = VNONRELOC;
+        e.info = base;
+    }
+    return true;
+}
+
+// The function a call may be inlined from, or nullptr. Every name the body
+// takes from its surroundings must still mean what it meant where the
+// function was defined: no variable declared since then may use one.
+const FunctionDef* BytecodeGenerator::inlineTarget(const FunctionCall* call) {
+    auto callee = ast_cast<Identifier>(call->prefix_expr_);
+    if (optlevel_ < 1 || !callee || call->method_name_) return nullptr;
+
+    const FunctionDef* def = nullptr;
+    FunctionState* deffs = nullptr;
+    int nvars = 0;
+    for (FunctionState* fs = fs_; fs && !deffs; fs = fs->prev) {
+        for (int n = fs->nactvar - 1; n >= 0; n--) {
+            const VarDesc& vd = fs->actvars[n];
+            if (vd.name != callee->name_) continue;
+            if (!vd.fn) return nullptr;
+            def = vd.fn;
+            deffs = fs;
+            nvars = vd.fnvars;
+            break;
+        }
+    }
+    if (!deffs) { // a global
+        auto global = global_fns_.find(callee->name_);
+        if (global == global_fns_.end()) return nullptr;
+        def = global->second.def;
+        nvars = global->second.nvars;
+        for (deffs = fs_; deffs->prev; deffs = deffs->prev) {}
+    }
+
+    const InlineInfo& info = inlineInfo(*def);
+    if (!info.inlinable || info.size > (inLoop() ? INLINE_LOOP_SIZE : INLINE_MAX_SIZE)) return nullptr;
+    // recursion: never inside its own body, compiled or inlined
+    if (static_cast<int>(inlining_.size()) >= INLINE_MAX_DEPTH ||
+        std::find(inlining_.begin(), inlining_.end(), def) != inlining_.end()) return nullptr;
+    for (FunctionState* fs = fs_; fs; fs = fs->prev) {
+        if (fs->def == def) return nullptr;
+    }
+    for (FunctionState* fs = fs_;; fs = fs->prev) {
+        for (int n = fs == deffs ? nvars : 0; n < fs->nactvar; n++) {
+            if (info.free.count(fs->actvars[n].name)) return nullptr;
+        }
+        if (fs == deffs) break;
+    }
+    return def;
+}
+
+const BytecodeGenerator::InlineInfo& BytecodeGenerator::inlineInfo(const FunctionDef& def) {
+    auto cached = inline_info_.find(&def);
+    if (cached != inline_info_.end()) return cached->second;
+    BodyScan scan;
+    for (const auto& param : def.params_) {
+        scan.bound.push_back(param->name_);
+    }
+    scan.block(def.body_->statements_, true);
+    InlineInfo& info = inline_info_[&def];
+    info.inlinable = scan.ok;
+    info.size = scan.size;
+    info.free = std::move(scan.free);
+    info.free.insert(LUAO_ENV); // globals in the body
+    return info;
+}
+
+// calls in loops are worth inlining bigger bodies
+bool BytecodeGenerator::inLoop() const {
+    for (const BlockScope* bl = fs_->bl; bl; bl = bl->previous) {
+        if (bl->isloop) return true;
+    }
+    return false;
+}
+
+// --- Code emission ---
+
+int BytecodeGenerator::code(Instruction i) {
+    FunctionState* fs = fs_;
+    fs->code.push_back(i);
+    int pc = static_cast<int>(fs->code.size()) - 1;
+    fs->lineinfo.push_back({pc, line_});
+    return pc;
+}
+
+int BytecodeGenerator::codeABCk(OpCode o, int a, int b, int c, int k) {
+    return code(create_abck(o, a, b, c, k));
+}
+
+int BytecodeGenerator::codeABx(OpCode o, int a, int bx) {
+    return code(create_abx(o, a, static_cast<unsigned int>(bx)));
 }
-Instruction create_iABx(OpCode op, int a, int bx) {
-    return static_cast<uint32_t>(op) | (a << 8) | (bx << 16);
+
+int BytecodeGenerator::codeAsBx(OpCode o, int a, int sbx) {
+    return code(create_abx(o, a, static_cast<unsigned int>(sbx + OFFSET_sBx)));
+}
+
+int BytecodeGenerator::codesJ(OpCode o, int sj) {
+    return code(create_ax(o, static_cast<unsigned int>(sj + OFFSET_sJ)));
+}
+
+int BytecodeGenerator::codeExtraArg(int ax) {
+    return code(create_ax(OpCode::EXTRAARG, static_cast<unsigned int>(ax)));
+}
+
+int BytecodeGenerator::codeK(int reg, int k) {
+    if (k <= MAXARG_Bx) {
+        return codeABx(OpCode::LOADK, reg, k);
+    }
+    int p = codeABx(OpCode::LOADKX, reg, 0);
+    codeExtraArg(k);
+    return p;
+}
+
+// changes the line of the last emitted instruction
+void BytecodeGenerator::fixLine(int line) {
+    if (!fs_->lineinfo.empty()) fs_->lineinfo.back().line = line;
+}
+
+// the previous instruction, unless it is a jump target and must be kept
+Instruction* BytecodeGenerator::previousInstruction() {
+    static Instruction invalid = ~static_cast<Instruction>(0);
+    if (static_cast<int>(fs_->code.size()) > fs_->lasttarget) {
+        return &fs_->code.back();
+    }
+    invalid = ~static_cast<Instruction>(0);
+    return &invalid;
+}
+
+void BytecodeGenerator::removeLastInstruction() {
+    fs_->code.pop_back();
+    fs_->lineinfo.pop_back();
+}
+
+// --- Jumps ---
+
+int BytecodeGenerator::getJump(int pc) {
+    int offset = GETARG_sJ(fs_->code[pc]);
+    if (offset == NO_JUMP) return NO_JUMP; // end of list
+    return (pc + 1) + offset;
 }
-Instruction create_iAsBx(OpCode op, int a, int sbx) {
-    return create_iABx(op, a, sbx + 131071); // offset for sBx
+
+void BytecodeGenerator::fixJump(int pc, int dest) {
+    int offset = dest - (pc + 1);
+    if (!(-OFFSET_sJ <= offset && offset <= MAXARG_sJ - OFFSET_sJ)) {
+        error("control structure too long");
+    }
+    SETARG_sJ(fs_->code[pc], offset);
 }
 
-// --- BytecodeGenerator ---
+// appends jump list l2 to l1
+void BytecodeGenerator::concatJumps(int& l1, int l2) {
+    if (l2 == NO_JUMP) return;
+    if (l1 == NO_JUMP) {
+        l1 = l2;
+        return;
+    }
+    int list = l1;
+    int next;
+    while ((next = getJump(list)) != NO_JUMP) {
+        list = next;
+    }
+    fixJump(list, l2);
+}
 
-std::unique_ptr<FunctionProto> BytecodeGenerator::generate(const Block& ast) {
-    auto main_proto = std::make_unique<FunctionProto>();
-    FunctionState main_func;
-    main_func.proto = main_proto.get();
-    main_func.parent = nullptr;
+int BytecodeGenerator::jump() {
+    return codesJ(OpCode::JMP, NO_JUMP);
+}
 
-    current_function_ = &main_func;
+void BytecodeGenerator::ret(int first, int nret) {
+    OpCode op = nret == 0 ? OpCode::RETURN0 : nret == 1 ? OpCode::RETURN1 : OpCode::RETURN;
+    codeABC(op, first, nret + 1, 0);
+}
 
-    visitBlock(&ast);
+int BytecodeGenerator::condJump(OpCode o, int a, int b, int c, int k) {
+    codeABCk(o, a, b, c, k);
+    return jump();
+}
 
-    // Implicit return at the end of the chunk
-    emit(create_iABC(OpCode::RETURN0, 0, 0, 0));
+// marks the current pc as a jump target
+int BytecodeGenerator::getLabel() {
+    fs_->lasttarget = static_cast<int>(fs_->code.size());
+    return fs_->lasttarget;
+}
 
-    return main_proto;
+// the instruction controlling a jump (its condition), or the jump itself
+Instruction* BytecodeGenerator::getJumpControl(int pc) {
+    Instruction* pi = &fs_->code[pc];
+    if (pc >= 1 && is_test_mode(GET_OPCODE(*(pi - 1)))) return pi - 1;
+    return pi;
 }
 
-void BytecodeGenerator::visit(const Statement* stmt) {
-    // This is a simple dispatching visitor. A more robust solution
-    // might use dynamic_cast or a virtual accept method on the AST nodes.
-    if (auto s = dynamic_cast<const ExprStatement*>(stmt)) return visitExprStatement(s);
-    if (auto s = dynamic_cast<const LocalStatement*>(stmt)) return visitLocalStatement(s);
-    if (auto s = dynamic_cast<const ReturnStatement*>(stmt)) return visitReturnStatement(s);
-    // Add other statement types here
-    throw std::runtime_error("Unsupported statement type in bytecode generator.");
+// Points the TESTSET controlling `node` at `reg`, or turns it into a TEST
+// when no value is needed. Returns false if the jump has no TESTSET.
+bool BytecodeGenerator::patchTestReg(int node, int reg) {
+    Instruction* i = getJumpControl(node);
+    if (GET_OPCODE(*i) != OpCode::TESTSET) return false;
+    if (reg != NO_REG && reg != static_cast<int>(GETARG_B(*i))) {
+        SETARG_A(*i, reg);
+    } else {
+        *i = create_abck(OpCode::TEST, GETARG_B(*i), 0, 0, GETARG_k(*i));
+    }
+    return true;
 }
 
-void BytecodeGenerator::visit(const Expression* expr) {
-    if (auto e = dynamic_cast<const NilLiteral*>(expr)) return visitNilLiteral(e);
-    if (auto e = dynamic_cast<const BoolLiteral*>(expr)) return visitBoolLiteral(e);
-    if (auto e = dynamic_cast<const NumberLiteral*>(expr)) return visitNumberLiteral(e);
-    if (auto e = dynamic_cast<const StringLiteral*>(expr)) return visitStringLiteral(e);
-    if (auto e = dynamic_cast<const BinaryExpr*>(expr)) return visitBinaryExpr(e);
-    if (auto e = dynamic_cast<const UnaryExpr*>(expr)) return visitUnaryExpr(e);
-    if (auto e = dynamic_cast<const Identifier*>(expr)) return visitIdentifier(e);
-    // Add other expression types here
-    throw std::runtime_error("Unsupported expression type in bytecode generator.");
+void BytecodeGenerator::removeValues(int list) {
+    for (; list != NO_JUMP; list = getJump(list)) {
+        patchTestReg(list, NO_REG);
+    }
 }
 
-void BytecodeGenerator::visitBlock(const Block* node) {
-    for (const auto& stmt : node->statements_) {
-        visit(stmt.get());
+// Jumps whose TESTSET produces a value go to vtarget with the value in
+// `reg`; the others go to dtarget.
+void BytecodeGenerator::patchListAux(int list, int vtarget, int reg, int dtarget) {
+    while (list != NO_JUMP) {
+        int next = getJump(list);
+        if (patchTestReg(list, reg)) {
+            fixJump(list, vtarget);
+        } else {
+            fixJump(list, dtarget);
+        }
+        list = next;
     }
 }
 
-void BytecodeGenerator::visitExprStatement(const ExprStatement* node) {
-    visit(node->expr_.get());
-    // Result of expression is left on the stack, pop it.
-    // For now, we assume expressions leave one result on the stack.
-    current_function_->stack_top--;
+void BytecodeGenerator::patchList(int list, int target) {
+    patchListAux(list, target, NO_REG, target);
+}
+
+void BytecodeGenerator::patchToHere(int list) {
+    int hr = getLabel();
+    patchList(list, hr);
 }
 
-void BytecodeGenerator::visitLocalStatement(const LocalStatement* node) {
-    for (const auto& val : node->values_) {
-        visit(val.get());
+// --- Registers ---
+
+void BytecodeGenerator::checkStack(int n) {
+    int newstack = fs_->freereg + n;
+    if (newstack > fs_->maxstacksize) {
+        if (newstack >= LUAI_MAXREGS) {
+            error("function or expression needs too many registers");
+        }
+        fs_->maxstacksize = newstack;
     }
-    for (const auto& name : node->names_) {
-        newLocal(name->name_);
+}
+
+void BytecodeGenerator::reserveRegs(int n) {
+    checkStack(n);
+    fs_->freereg += n;
+}
+
+// frees a temporary; registers of active locals are never freed
+void BytecodeGenerator::freeReg(int reg) {
+    if (reg >= nvarStack()) {
+        fs_->freereg--;
     }
 }
 
-void BytecodeGenerator::visitReturnStatement(const ReturnStatement* node) {
-    if (node->exprs_.empty()) {
-        emit(create_iABC(OpCode::RETURN0, 0, 0, 0));
+// temporaries are freed in stack order
+void BytecodeGenerator::freeRegs(int r1, int r2) {
+    if (r1 > r2) {
+        freeReg(r1);
+        freeReg(r2);
     } else {
-        int first_reg = current_function_->stack_top;
-        for(const auto& expr : node->exprs_) {
-            visit(expr.get());
+        freeReg(r2);
+        freeReg(r1);
+    }
+}
+
+void BytecodeGenerator::freeExp(const ExpDesc& e) {
+    if (e.k == VNONRELOC) freeReg(e.info);
+}
+
+void BytecodeGenerator::freeExps(const ExpDesc& e1, const ExpDesc& e2) {
+    int r1 = (e1.k == VNONRELOC) ? e1.info : -1;
+    int r2 = (e2.k == VNONRELOC) ? e2.info : -1;
+    freeRegs(r1, r2);
+}
+
+// --- Constants ---
+
+// `key` identifies the constant by type and value
+int BytecodeGenerator::addK(const std::string& key, const LuaValue& v) {
+    auto it = fs_->kcache.find(key);
+    if (it != fs_->kcache.end()) return it->second;
+    int idx = static_cast<int>(fs_->k.size());
+    fs_->k.push_back(v);
+    fs_->kcache.emplace(key, idx);
+    return idx;
+}
+
+int BytecodeGenerator::stringK(const std::string& s) {
+    return addK("s" + s, LuaValue(std::make_shared<LuaString>(s), LuaType::STRING));
+}
+
+int BytecodeGenerator::intK(luaInt n) {
+    return addK("i" + std::to_string(n), LuaValue(std::make_shared<LuaInteger>(n), LuaType::NUMBER));
+}
+
+int BytecodeGenerator::numberK(luaNumber r) {
+    char bits[sizeof(luaNumber)];
+    std::memcpy(bits, &r, sizeof(r));
+    return addK("f" + std::string(bits, sizeof(bits)), LuaValue(std::make_shared<LuaNumber>(r), LuaType::NUMBER));
+}
+
+int BytecodeGenerator::boolK(bool b) {
+    return addK(b ? "T" : "F", LuaValue(std::make_shared<LuaBool>(b), LuaType::BOOLEAN));
+}
+
+int BytecodeGenerator::nilK() {
+    return addK("N", LuaValue());
+}
+
+// Sets `n` registers from `from` to nil, merging with a directly preceding
+// LOADNIL over an adjacent range.
+void BytecodeGenerator::loadNil(int from, int n) {
+    int l = from + n - 1; // last register to set nil
+    Instruction* previous = previousInstruction();
+    if (GET_OPCODE(*previous) == OpCode::LOADNIL) {
+        int pfrom = GETARG_A(*previous);
+        int pl = pfrom + GETARG_B(*previous);
+        if ((pfrom <= from && from <= pl + 1) || (from <= pfrom && pfrom <= l + 1)) {
+            if (pfrom < from) from = pfrom;
+            if (pl > l) l = pl;
+            SETARG_A(*previous, from);
+            SETARG_B(*previous, l - from);
+            return;
         }
-        int n_returns = node->exprs_.size();
-        emit(create_iABC(OpCode::RETURN, first_reg, n_returns + 1, 0));
+    }
+    codeABC(OpCode::LOADNIL, from, n - 1, 0);
+}
+
+void BytecodeGenerator::loadInt(int reg, luaInt i) {
+    if (fits_bx(i)) {
+        codeAsBx(OpCode::LOADI, reg, static_cast<int>(i));
+    } else {
+        codeK(reg, intK(i));
     }
 }
 
-// --- Expression Visitors ---
+void BytecodeGenerator::loadFloat(int reg, luaNumber f) {
+    luaInt fi;
+    if (float_to_int(f, fi) && fits_bx(fi) && !(f == 0 && std::signbit(f))) {
+        codeAsBx(OpCode::LOADF, reg, static_cast<int>(fi));
+    } else {
+        codeK(reg, numberK(f));
+    }
+}
+
+void BytecodeGenerator::str2K(ExpDesc& e) {
+    e.info = stringK(e.strval);
+    e.k = VK;
+}
+
+// --- Expression descriptors ---
+
+// Fixes an open call or vararg to produce `nresults` values (-1 for all).
+void BytecodeGenerator::setReturns(ExpDesc& e, int nresults) {
+    Instruction& pc = getInstruction(e);
+    SETARG_C(pc, nresults + 1);
+    if (e.k == VVARARG) {
+        SETARG_A(pc, fs_->freereg);
+        reserveRegs(1);
+    }
+}
 
-void BytecodeGenerator::visitNilLiteral(const NilLiteral* node) {
-    emit(create_iABC(OpCode::LOADNIL, current_function_->stack_top, 1, 0));
-    current_function_->stack_top++;
+void BytecodeGenerator::setOneRet(ExpDesc& e) {
+    if (e.k == VCALL) { // already returns one value
+        e.k = VNONRELOC;
+        e.info = GETARG_A(getInstruction(e));
+    } else if (e.k == VVARARG) {
+        SETARG_C(getInstruction(e), 2);
+        e.k = VRELOC;
+    }
 }
 
-void BytecodeGenerator::visitBoolLiteral(const BoolLiteral* node) {
-    emit(create_iABC(node->value_ ? OpCode::LOADTRUE : OpCode::LOADFALSE, current_function_->stack_top, 0, 0));
-    current_function_->stack_top++;
+// Emits the load for a variable; the result is VNONRELOC or VRELOC.
+void BytecodeGenerator::dischargeVars(ExpDesc& e) {
+    switch (e.k) {
+        case VCONST:
+            e = constVar(e).k;
+            break;
+        case VLOCAL:
+            e.info = e.ridx;
+            e.k = VNONRELOC;
+            break;
+        case VUPVAL:
+            e.info = codeABC(OpCode::GETUPVAL, 0, e.info, 0);
+            e.k = VRELOC;
+            break;
+        case VINDEXUP:
+            e.info = codeABC(OpCode::GETTABUP, 0, e.ind_t, e.ind_idx);
+            e.k = VRELOC;
+            break;
+        case VINDEXI:
+            freeReg(e.ind_t);
+            e.info = codeABC(OpCode::GETI, 0, e.ind_t, e.ind_idx);
+            e.k = VRELOC;
+            break;
+        case VINDEXSTR:
+            freeReg(e.ind_t);
+            e.info = codeABC(e.known_table ? OpCode::GETFIELDT : OpCode::GETFIELD, 0, e.ind_t, e.ind_idx);
+            e.k = VRELOC;
+            break;
+        case VINDEXED:
+            freeRegs(e.ind_t, e.ind_idx);
+            e.info = codeABC(OpCode::GETTABLE, 0, e.ind_t, e.ind_idx);
+            e.k = VRELOC;
+            break;
+        case VVARARG:
+        case VCALL:
+            setOneRet(e);
+            break;
+        default:
+            break;
+    }
 }
 
-void BytecodeGenerator::visitNumberLiteral(const NumberLiteral* node) {
-    // For simplicity, we'll try to fit it into LOADI, otherwise use LOADK
-    try {
-        int val = std::stoi(node->value_);
-        if (val >= -131071 && val <= 131071) {
-            emit(create_iAsBx(OpCode::LOADI, current_function_->stack_top, val));
-            current_function_->stack_top++;
+void BytecodeGenerator::discharge2Reg(ExpDesc& e, int reg) {
+    dischargeVars(e);
+    switch (e.k) {
+        case VNIL: loadNil(reg, 1); break;
+        case VFALSE: codeABC(OpCode::LOADFALSE, reg, 0, 0); break;
+        case VTRUE: codeABC(OpCode::LOADTRUE, reg, 0, 0); break;
+        case VKSTR: str2K(e); [[fallthrough]];
+        case VK: codeK(reg, e.info); break;
+        case VKFLT: loadFloat(reg, e.nval); break;
+        case VKINT: loadInt(reg, e.ival); break;
+        case VRELOC: SETARG_A(getInstruction(e), reg); break;
+        case VNONRELOC:
+            if (reg != e.info) codeABC(OpCode::MOVE, reg, e.info, 0);
+            break;
+        default: // VJMP: nothing to do yet
             return;
+    }
+    e.info = reg;
+    e.k = VNONRELOC;
+}
+
+void BytecodeGenerator::discharge2AnyReg(ExpDesc& e) {
+    if (e.k != VNONRELOC) {
+        reserveRegs(1);
+        discharge2Reg(e, fs_->freereg - 1);
+    }
+}
+
+int BytecodeGenerator::codeLoadBool(int a, OpCode op) {
+    getLabel(); // these are jump targets
+    return codeABC(op, a, 0, 0);
+}
+
+// whether some jump in the list needs a boolean value (has no TESTSET)
+bool BytecodeGenerator::needValue(int list) {
+    for (; list != NO_JUMP; list = getJump(list)) {
+        if (GET_OPCODE(*getJumpControl(list)) != OpCode::TESTSET) return true;
+    }
+    return false;
+}
+
+// Puts the final value of `e` (including its jump lists) in `reg`.
+void BytecodeGenerator::exp2Reg(ExpDesc& e, int reg) {
+    discharge2Reg(e, reg);
+    if (e.k == VJMP) {
+        concatJumps(e.t, e.info); // the expression itself is a test
+    }
+    if (hasjumps(e)) {
+        int p_f = NO_JUMP; // position of an eventual LOAD false
+        int p_t = NO_JUMP; // position of an eventual LOAD true
+        if (needValue(e.t) || needValue(e.f)) {
+            int fj = (e.k == VJMP) ? NO_JUMP : jump();
+            p_f = codeLoadBool(reg, OpCode::LFALSESKIP);
+            p_t = codeLoadBool(reg, OpCode::LOADTRUE);
+            patchToHere(fj);
         }
-    } catch (...) {
-        // Not an integer or out of range, fall through to constant pool
+        int final = getLabel(); // position after the whole expression
+        patchListAux(e.f, final, reg, p_f);
+        patchListAux(e.t, final, reg, p_t);
     }
+    e.f = e.t = NO_JUMP;
+    e.info = reg;
+    e.k = VNONRELOC;
+}
 
-    int k_idx = addConstant(std::stod(node->value_));
-    emit(create_iABx(OpCode::LOADK, current_function_->stack_top, k_idx));
-    current_function_->stack_top++;
+void BytecodeGenerator::exp2NextReg(ExpDesc& e) {
+    dischargeVars(e);
+    freeExp(e);
+    reserveRegs(1);
+    exp2Reg(e, fs_->freereg - 1);
 }
 
-void BytecodeGenerator::visitStringLiteral(const StringLiteral* node) {
-    int k_idx = addConstant(node->value_);
-    emit(create_iABx(OpCode::LOADK, current_function_->stack_top, k_idx));
-    current_function_->stack_top++;
+int BytecodeGenerator::exp2AnyReg(ExpDesc& e) {
+    dischargeVars(e);
+    if (e.k == VNONRELOC) {
+        if (!hasjumps(e)) return e.info;
+        if (e.info >= nvarStack()) { // a temporary can hold the jump values
+            exp2Reg(e, e.info);
+            return e.info;
+        }
+        // a local cannot; fall through to a new register
+    }
+    exp2NextReg(e);
+    return e.info;
+}
+
+// upvalues can be indexed in place (GETTABUP)
+void BytecodeGenerator::exp2AnyRegUp(ExpDesc& e) {
+    if (e.k != VUPVAL || hasjumps(e)) exp2AnyReg(e);
 }
 
-void BytecodeGenerator::visitIdentifier(const Identifier* node) {
-    int reg = resolveLocal(node->name_);
-    if (reg != -1) {
-        emit(create_iABC(OpCode::MOVE, current_function_->stack_top, reg, 0));
-        current_function_->stack_top++;
+void BytecodeGenerator::exp2Val(ExpDesc& e) {
+    if (hasjumps(e)) {
+        exp2AnyReg(e);
     } else {
-        // Assume global for now
-        // This requires GETTABUP, which is more complex
-        throw std::runtime_error("Global variables not yet supported.");
+        dischargeVars(e);
     }
 }
 
-void BytecodeGenerator::visitUnaryExpr(const UnaryExpr* node) {
-    visit(node->operand_.get());
-    OpCode op;
-    switch(node->op_.type) {
-        case Token::MINUS: op = OpCode::UNM; break;
-        case Token::NOT: op = OpCode::NOT; break;
-        case Token::LEN: op = OpCode::LEN; break;
-        case Token::BNOT: op = OpCode::BNOT; break;
-        default: throw std::runtime_error("Unsupported unary operator.");
+// turns a constant expression into a K operand if its index fits an RK slot
+bool BytecodeGenerator::exp2K(ExpDesc& e) {
+    if (hasjumps(e)) return false;
+    int info;
+    switch (e.k) {
+        case VTRUE: info = boolK(true); break;
+        case VFALSE: info = boolK(false); break;
+        case VNIL: info = nilK(); break;
+        case VKINT: info = intK(e.ival); break;
+        case VKFLT: info = numberK(e.nval); break;
+        case VKSTR: info = stringK(e.strval); break;
+        case VK: info = e.info; break;
+        default: return false;
     }
-    // Unary ops are usually in-place, so they modify the top of the stack
-    emit(create_iABC(op, current_function_->stack_top - 1, current_function_->stack_top - 1, 0));
+    if (info > MAXINDEXRK) return false;
+    e.k = VK;
+    e.info = info;
+    return true;
 }
 
-void BytecodeGenerator::visitBinaryExpr(const BinaryExpr* node) {
-    visit(node->left_.get());
-    visit(node->right_.get());
+// true when `e` became a K operand, false when it is in a register
+bool BytecodeGenerator::exp2RK(ExpDesc& e) {
+    if (exp2K(e)) return true;
+    exp2AnyReg(e);
+    return false;
+}
 
-    OpCode op;
-    switch(node->op_.type) {
-        case Token::PLUS: op = OpCode::ADD; break;
-        case Token::MINUS: op = OpCode::SUB; break;
-        case Token::MULTIPLY: op = OpCode::MUL; break;
-        case Token::DIVIDE: op = OpCode::DIV; break;
-        // Add other binary ops
-        default: throw std::runtime_error("Unsupported binary operator.");
+void BytecodeGenerator::codeABRK(OpCode o, int a, int b, ExpDesc& ec) {
+    int k = exp2RK(ec) ? 1 : 0;
+    codeABCk(o, a, b, ec.info, k);
+}
+
+void BytecodeGenerator::storeVar(const ExpDesc& var, ExpDesc& ex) {
+    switch (var.k) {
+        case VLOCAL:
+            freeExp(ex);
+            exp2Reg(ex, var.ridx); // compute the value directly into the local
+            return;
+        case VUPVAL: {
+            int e = exp2AnyReg(ex);
+            codeABC(OpCode::SETUPVAL, e, var.info, 0);
+            break;
+        }
+        case VINDEXUP: codeABRK(OpCode::SETTABUP, var.ind_t, var.ind_idx, ex); break;
+        case VINDEXI: codeABRK(OpCode::SETI, var.ind_t, var.ind_idx, ex); break;
+        case VINDEXSTR: codeABRK(var.known_table ? OpCode::SETFIELDT : OpCode::SETFIELD, var.ind_t, var.ind_idx, ex); break;
+        case VINDEXED: codeABRK(OpCode::SETTABLE, var.ind_t, var.ind_idx, ex); break;
+        default: error("syntax error");
+    }
+    freeExp(ex);
+}
+
+// e:key(...) -> SELF puts the method and `e` in two consecutive registers
+void BytecodeGenerator::codeSelf(ExpDesc& e, ExpDesc& key) {
+    exp2AnyReg(e);
+    int ereg = e.info;
+    freeExp(e);
+    e.info = fs_->freereg;
+    e.k = VNONRELOC;
+    reserveRegs(2); // function and 'self'
+    codeABRK(OpCode::SELF, e.info, ereg, key);
+    freeExp(key);
+}
+
+// Turns `t` into the indexed expression t[k], picking the most specific
+// access form the key allows.
+void BytecodeGenerator::indexed(ExpDesc& t, ExpDesc& k) {
+    if (k.k == VKSTR) str2K(k);
+    if (t.k == VUPVAL && !isKstr(k)) { // upvalue indexed by a non-constant
+        exp2AnyReg(t);
+    }
+    if (t.k == VUPVAL) {
+        t.ind_t = t.info;
+        t.ind_idx = k.info;
+        t.k = VINDEXUP;
+    } else {
+        t.ind_t = (t.k == VLOCAL) ? t.ridx : t.info;
+        if (isKstr(k)) {
+            t.ind_idx = k.info;
+            t.k = VINDEXSTR;
+        } else if (isCint(k)) {
+            t.ind_idx = static_cast<int>(k.ival);
+            t.k = VINDEXI;
+        } else {
+            t.ind_idx = exp2AnyReg(k);
+            t.k = VINDEXED;
+        }
+    }
+}
+
+bool BytecodeGenerator::isKstr(const ExpDesc& e) const {
+    return e.k == VK && !hasjumps(e) && e.info <= MAXARG_B && fs_->k[e.info].getType() == LuaType::STRING;
+}
+
+bool BytecodeGenerator::isNumeral(const ExpDesc& e) const {
+    return !hasjumps(e) && (e.k == VKINT || e.k == VKFLT);
+}
+
+bool BytecodeGenerator::isCint(const ExpDesc& e) const {
+    return e.k == VKINT && !hasjumps(e) && e.ival >= 0 && e.ival <= MAXARG_C;
+}
+
+bool BytecodeGenerator::isSCint(const ExpDesc& e) const {
+    return e.k == VKINT && !hasjumps(e) && fits_c(e.ival);
+}
+
+// Copies a compile-time constant value of `e` (nil, booleans, numerals and
+// short-lived string constants) into `k`.
+bool BytecodeGenerator::exp2Const(const ExpDesc& e, ExpDesc& k) const {
+    if (hasjumps(e)) return false;
+    switch (e.k) {
+        case VNIL: case VTRUE: case VFALSE: case VKINT: case VKFLT: case VKSTR:
+            k = e;
+            return true;
+        case VCONST:
+            k = constVar(e).k;
+            return true;
+        default:
+            return false;
+    }
+}
+
+// integral numeral fitting an sB/sC operand
+bool BytecodeGenerator::isSCnumber(const ExpDesc& e, int& pi) const {
+    luaInt i;
+    if (e.k == VKINT) i = e.ival;
+    else if (e.k == VKFLT && float_to_int(e.nval, i)) {}
+    else return false;
+    if (hasjumps(e) || !fits_c(i)) return false;
+    pi = int2sc(i);
+    return true;
+}
+
+// --- Conditions ---
+
+void BytecodeGenerator::negateCondition(ExpDesc& e) {
+    Instruction* pc = getJumpControl(e.info);
+    SETARG_k(*pc, GETARG_k(*pc) ^ 1);
+}
+
+// Emits a jump taken when `e` is `cond`. A `not x` just emitted is undone
+// and x tested with the opposite condition.
+int BytecodeGenerator::jumpOnCond(ExpDesc& e, bool cond) {
+    if (e.k == VRELOC) {
+        Instruction ie = getInstruction(e);
+        if (GET_OPCODE(ie) == OpCode::NOT) {
+            removeLastInstruction();
+            return condJump(OpCode::TEST, GETARG_B(ie), 0, 0, !cond);
+        }
+    }
+    discharge2AnyReg(e);
+    freeExp(e);
+    return condJump(OpCode::TESTSET, NO_REG, e.info, 0, cond);
+}
+
+// falls through when `e` is true, jumps (e.f) when false
+void BytecodeGenerator::goIfTrue(ExpDesc& e) {
+    int pc;
+    dischargeVars(e);
+    switch (e.k) {
+        case VJMP:
+            negateCondition(e);
+            pc = e.info;
+            break;
+        case VK: case VKFLT: case VKINT: case VKSTR: case VTRUE:
+            pc = NO_JUMP; // always true
+            break;
+        default:
+            pc = jumpOnCond(e, false);
+            break;
+    }
+    concatJumps(e.f, pc);
+    patchToHere(e.t); // true list jumps to here
+    e.t = NO_JUMP;
+}
+
+// falls through when `e` is false, jumps (e.t) when true
+void BytecodeGenerator::goIfFalse(ExpDesc& e) {
+    int pc;
+    dischargeVars(e);
+    switch (e.k) {
+        case VJMP:
+            pc = e.info;
+            break;
+        case VNIL: case VFALSE:
+            pc = NO_JUMP; // always false
+            break;
+        default:
+            pc = jumpOnCond(e, true);
+            break;
+    }
+    concatJumps(e.t, pc);
+    patchToHere(e.f);
+    e.f = NO_JUMP;
+}
+
+void BytecodeGenerator::codeNot(ExpDesc& e) {
+    switch (e.k) {
+        case VNIL: case VFALSE:
+            e.k = VTRUE;
+            break;
+        case VK: case VKFLT: case VKINT: case VKSTR: case VTRUE:
+            e.k = VFALSE;
+            break;
+        case VJMP:
+            negateCondition(e);
+            break;
+        case VRELOC:
+        case VNONRELOC: {
+            discharge2AnyReg(e);
+            freeExp(e);
+            e.info = codeABC(OpCode::NOT, 0, e.info, 0);
+            e.k = VRELOC;
+            break;
+        }
+        default:
+            error("cannot negate expression");
+    }
+    std::swap(e.f, e.t);
+    removeValues(e.f); // values are useless when negated
+    removeValues(e.t);
+}
+
+// --- Constant folding ---
+
+// Folds `e1 op e2` into e1 when both are numerals. Results that are NaN or
+// zero floats stay at run time, as in the reference compiler, so -0.0 and
+// NaN never become constants.
+bool BytecodeGenerator::constFolding(OpCode op, ExpDesc& e1, const ExpDesc& e2) {
+    if (!isNumeral(e1) || !isNumeral(e2)) return false;
+    Numeral a{e1.k == VKINT, e1.ival, e1.nval};
+    Numeral b{e2.k == VKINT, e2.ival, e2.nval};
+    Numeral r{};
+    if (!fold_arith(op, a, b, r)) return false;
+    if (r.isint) {
+        e1.k = VKINT;
+        e1.ival = r.i;
+    } else {
+        if (std::isnan(r.n) || r.n == 0) return false;
+        e1.k = VKFLT;
+        e1.nval = r.n;
     }
+    return true;
+}
 
-    // Binary ops take top two stack items, pop them, and push one result.
-    // The result is stored in the first register.
-    int dest_reg = current_function_->stack_top - 2;
-    int left_reg = current_function_->stack_top - 2;
-    int right_reg = current_function_->stack_top - 1;
-    emit(create_iABC(op, dest_reg, left_reg, right_reg));
-    current_function_->stack_top--;
+// Folds comparisons between constants into true/false. Equality is decided
+// for any pair of constants; ordering only for two numerals or two strings,
+// anything else being a run-time error or a metamethod call.
+bool BytecodeGenerator::foldComparison(Token op, ExpDesc& e1, const ExpDesc& e2) {
+    ExpDesc a, b;
+    if (!exp2Const(e1, a) || !exp2Const(e2, b)) return false;
+    bool numerals = isNumeral(a) && isNumeral(b);
+    int c; // -1, 0, 1, or 2 when unordered
+    if (numerals) {
+        c = numeral_compare(Numeral{a.k == VKINT, a.ival, a.nval}, Numeral{b.k == VKINT, b.ival, b.nval});
+    } else if (a.k == VKSTR && b.k == VKSTR) {
+        int r = a.strval.compare(b.strval);
+        c = (r < 0) ? -1 : (r > 0);
+    } else if (op == Token::EQ || op == Token::NE) {
+        c = (a.k == b.k) ? 0 : 2; // nil, true, false, or values of different types
+    } else {
+        return false;
+    }
+    bool result;
+    switch (op) {
+        case Token::EQ: result = c == 0; break;
+        case Token::NE: result = c != 0; break;
+        case Token::LT: result = c == -1; break;
+        case Token::LE: result = c == -1 || c == 0; break;
+        case Token::GT: result = c == 1; break;
+        default: result = c == 1 || c == 0; break; // GE
+    }
+    e1 = ExpDesc();
+    e1.k = result ? VTRUE : VFALSE;
+    return true;
 }
 
+// Evaluates a concatenation of string and numeral constants without
+// emitting code. Runs before the operands are compiled, since CONCAT needs
+// its operands in consecutive registers once the first one is placed.
+bool BytecodeGenerator::constString(const Expression* expr, std::string& s) {
+    if (auto lit = ast_cast<StringLiteral>(expr)) {
+        s = lit->value_;
+        return true;
+    }
+    ExpDesc k;
+    if (auto lit = ast_cast<NumberLiteral>(expr)) {
+        compileNumber(lit, k);
+    } else if (auto id = ast_cast<Identifier>(expr)) {
+        if (!findConstant(id->name_, k)) return false;
+    } else if (auto paren = ast_cast<ParenExpr>(expr)) {
+        return constString(paren->expr_, s);
+    } else if (auto bin = ast_cast<BinaryExpr>(expr)) {
+        std::string rhs;
+        if (bin->op_.type != Token::CONCAT || !constString(bin->left_, s) || !constString(bin->right_, rhs)) {
+            return false;
+        }
+        s += rhs;
+        return true;
+    } else {
+        return false;
+    }
+    switch (k.k) {
+        case VKSTR: s = k.strval; return true;
+        case VKINT: s = std::to_string(k.ival); return true;
+        case VKFLT: s = LuaNumber(k.nval).toString(); return true;
+        default: return false;
+    }
+}
 
-// --- Helpers ---
+// --- Operators ---
 
-int BytecodeGenerator::emit(Instruction i) {
-    current_function_->proto->code.push_back(i);
-    return current_function_->proto->code.size() - 1;
+void BytecodeGenerator::prefix(Token op, ExpDesc& e, int line) {
+    ExpDesc zero; // second operand of unary folding
+    zero.k = VKINT;
+    dischargeVars(e);
+    switch (op) {
+        case Token::MINUS:
+            if (!constFolding(OpCode::UNM, e, zero)) codeUnExpVal(OpCode::UNM, e, line);
+            break;
+        case Token::BNOT:
+            if (!constFolding(OpCode::BNOT, e, zero)) codeUnExpVal(OpCode::BNOT, e, line);
+            break;
+        case Token::LEN: codeUnExpVal(OpCode::LEN, e, line); break;
+        case Token::NOT: codeNot(e); break;
+        default: error("unknown unary operator");
+    }
 }
 
-int BytecodeGenerator::addConstant(const Value& v) {
-    auto& constants = current_function_->proto->constants;
-    for (size_t i = 0; i < constants.size(); ++i) {
-        if (constants[i] == v) {
-            return i;
+// Prepares the first operand before the second one is compiled. Numerals
+// are kept as they are, as they may become immediate or K operands.
+void BytecodeGenerator::infix(Token op, ExpDesc& v) {
+    dischargeVars(v);
+    switch (op) {
+        case Token::AND:
+            goIfTrue(v);
+            break;
+        case Token::OR:
+            goIfFalse(v);
+            break;
+        case Token::CONCAT:
+            exp2NextReg(v); // operands must be consecutive
+            break;
+        case Token::PLUS: case Token::MINUS: case Token::MULTIPLY: case Token::DIVIDE:
+        case Token::IDIV: case Token::MODULO: case Token::POW:
+        case Token::BAND: case Token::BOR: case Token::BXOR: case Token::SHL: case Token::SHR:
+            if (!isNumeral(v)) exp2AnyReg(v);
+            break;
+        case Token::EQ: case Token::NE: {
+            ExpDesc k;
+            if (!exp2Const(v, k)) exp2RK(v); // constants wait for a possible fold
+            break;
         }
+        case Token::LT: case Token::LE: case Token::GT: case Token::GE:
+            if (!isNumeral(v) && v.k != VKSTR) exp2AnyReg(v);
+            break;
+        default:
+            error("unknown binary operator");
+    }
+}
+
+void BytecodeGenerator::posfix(Token op, ExpDesc& e1, ExpDesc& e2, int line) {
+    dischargeVars(e2);
+    switch (op) {
+        case Token::PLUS: case Token::MINUS: case Token::MULTIPLY: case Token::DIVIDE:
+        case Token::IDIV: case Token::MODULO: case Token::POW:
+        case Token::BAND: case Token::BOR: case Token::BXOR: case Token::SHL: case Token::SHR:
+            if (constFolding(arith_op(op), e1, e2)) return;
+            break;
+        case Token::EQ: case Token::NE: case Token::LT: case Token::LE: case Token::GT: case Token::GE:
+            if (foldComparison(op, e1, e2)) return;
+            break;
+        default:
+            break;
+    }
+    switch (op) {
+        case Token::AND:
+            concatJumps(e2.f, e1.f);
+            e1 = e2;
+            break;
+        case Token::OR:
+            concatJumps(e2.t, e1.t);
+            e1 = e2;
+            break;
+        case Token::CONCAT:
+            exp2NextReg(e2);
+            codeConcat(e1, e2, line);
+            break;
+        case Token::PLUS: case Token::MULTIPLY:
+            codeCommutative(op, e1, e2, line);
+            break;
+        case Token::MINUS: case Token::DIVIDE: case Token::IDIV: case Token::MODULO: case Token::POW:
+            codeArith(op, e1, e2, false, line);
+            break;
+        case Token::BAND: case Token::BOR: case Token::BXOR:
+            codeBitwise(op, e1, e2, line);
+            break;
+        case Token::SHL:
+            if (isSCint(e1)) { // I << r2
+                std::swap(e1, e2);
+                codeBinI(OpCode::SHLI, e1, e2, false, line);
+            } else {
+                codeBinExpVal(op, e1, e2, line);
+            }
+            break;
+        case Token::SHR:
+            if (isSCint(e2)) { // r1 >> I
+                codeBinI(OpCode::SHRI, e1, e2, false, line);
+            } else {
+                codeBinExpVal(op, e1, e2, line);
+            }
+            break;
+        case Token::EQ: case Token::NE:
+            codeEq(op, e1, e2);
+            break;
+        case Token::GT: case Token::GE:
+            // (a > b) is (b < a), (a >= b) is (b <= a)
+            std::swap(e1, e2);
+            codeOrder(op == Token::GT ? Token::LT : Token::LE, e1, e2);
+            break;
+        case Token::LT: case Token::LE:
+            codeOrder(op, e1, e2);
+            break;
+        default:
+            error("unknown binary operator");
+    }
+}
+
+void BytecodeGenerator::codeUnExpVal(OpCode op, ExpDesc& e, int line) {
+    int r = exp2AnyReg(e);
+    freeExp(e);
+    e.info = codeABC(op, 0, r, 0);
+    e.k = VRELOC;
+    fixLine(line);
+}
+
+// Emits `op` over e1 (put in a register) and the operand v2. A set k bit
+// tells the VM the operands were swapped, so metamethods see them in source
+// order; arithmetic resolves metamethods itself, so no MMBIN follows.
+void BytecodeGenerator::finishBinExpVal(ExpDesc& e1, ExpDesc& e2, OpCode op, int v2, bool flip, int line) {
+    int v1 = exp2AnyReg(e1);
+    int pc = codeABCk(op, 0, v1, v2, flip ? 1 : 0);
+    freeExps(e1, e2);
+    e1.info = pc;
+    e1.k = VRELOC;
+    fixLine(line);
+}
+
+void BytecodeGenerator::codeBinExpVal(Token opr, ExpDesc& e1, ExpDesc& e2, int line) {
+    int v2 = exp2AnyReg(e2);
+    finishBinExpVal(e1, e2, arith_op(opr), v2, false, line);
+}
+
+void BytecodeGenerator::codeBinI(OpCode op, ExpDesc& e1, ExpDesc& e2, bool flip, int line) {
+    int v2 = int2sc(e2.ival);
+    finishBinExpVal(e1, e2, op, v2, flip, line);
+}
+
+void BytecodeGenerator::codeBinK(Token opr, ExpDesc& e1, ExpDesc& e2, bool flip, int line) {
+    finishBinExpVal(e1, e2, arith_k_op(opr), e2.info, flip, line);
+}
+
+void BytecodeGenerator::codeBinNoK(Token opr, ExpDesc& e1, ExpDesc& e2, bool flip, int line) {
+    if (flip) std::swap(e1, e2); // back to the original order
+    codeBinExpVal(opr, e1, e2, line);
+}
+
+void BytecodeGenerator::codeArith(Token opr, ExpDesc& e1, ExpDesc& e2, bool flip, int line) {
+    if (isNumeral(e2) && exp2K(e2)) {
+        codeBinK(opr, e1, e2, flip, line);
+    } else {
+        codeBinNoK(opr, e1, e2, flip, line);
+    }
+}
+
+// constant operands of + and * go second, with k recording the swap
+void BytecodeGenerator::codeCommutative(Token opr, ExpDesc& e1, ExpDesc& e2, int line) {
+    bool flip = false;
+    if (isNumeral(e1)) {
+        std::swap(e1, e2);
+        flip = true;
+    }
+    if (opr == Token::PLUS && isSCint(e2)) {
+        codeBinI(OpCode::ADDI, e1, e2, flip, line);
+    } else {
+        codeArith(opr, e1, e2, flip, line);
+    }
+}
+
+void BytecodeGenerator::codeBitwise(Token opr, ExpDesc& e1, ExpDesc& e2, int line) {
+    bool flip = false;
+    if (e1.k == VKINT) {
+        std::swap(e1, e2);
+        flip = true;
+    }
+    if (e2.k == VKINT && exp2K(e2)) {
+        codeBinK(opr, e1, e2, flip, line);
+    } else {
+        codeBinNoK(opr, e1, e2, flip, line);
     }
-    constants.push_back(v);
-    return constants.size() - 1;
 }
 
-int BytecodeGenerator::resolveLocal(const std::string& name) {
-    if (current_function_->locals.count(name)) {
-        return current_function_->locals[name];
+// `<` and `<=`; an immediate on the left becomes GTI/GEI on the right operand
+void BytecodeGenerator::codeOrder(Token opr, ExpDesc& e1, ExpDesc& e2) {
+    int r1, r2, im;
+    OpCode op;
+    if (isSCnumber(e2, im)) {
+        r1 = exp2AnyReg(e1);
+        r2 = im;
+        op = opr == Token::LT ? OpCode::LTI : OpCode::LEI;
+    } else if (isSCnumber(e1, im)) {
+        r1 = exp2AnyReg(e2);
+        r2 = im;
+        op = opr == Token::LT ? OpCode::GTI : OpCode::GEI;
+    } else {
+        r1 = exp2AnyReg(e1);
+        r2 = exp2AnyReg(e2);
+        op = opr == Token::LT ? OpCode::LT : OpCode::LE;
     }
-    return -1; // Not found
+    freeExps(e1, e2);
+    e1.info = condJump(op, r1, r2, 0, 1);
+    e1.k = VJMP;
 }
 
-int BytecodeGenerator::newLocal(const std::string& name) {
-    int reg = current_function_->stack_top -1;
-    current_function_->locals[name] = reg;
-    return reg;
+void BytecodeGenerator::codeEq(Token opr, ExpDesc& e1, ExpDesc& e2) {
+    int r1, r2, im;
+    OpCode op;
+    if (e1.k != VNONRELOC) { // e1 is a constant; use it as the second operand
+        std::swap(e1, e2);
+    }
+    r1 = exp2AnyReg(e1);
+    if (isSCnumber(e2, im)) {
+        op = OpCode::EQI;
+        r2 = im;
+    } else if (exp2RK(e2)) {
+        op = OpCode::EQK;
+        r2 = e2.info;
+    } else {
+        op = OpCode::EQ;
+        r2 = exp2AnyReg(e2);
+    }
+    freeExps(e1, e2);
+    e1.info = condJump(op, r1, r2, 0, opr == Token::EQ ? 1 : 0);
+    e1.k = VJMP;
 }
 
-// Stubs for unimplemented visitors
-void BytecodeGenerator::visitIfStatement(const IfStatement* node) { throw std::runtime_error("unimplemented"); }
-void BytecodeGenerator::visitWhileStatement(const WhileStatement* node) { throw std::runtime_error("unimplemented"); }
-void BytecodeGenerator::visitFunctionCall(const FunctionCall* node) { throw std::runtime_error("unimplemented"); }
+// a .. b .. c is a single CONCAT over consecutive registers
+void BytecodeGenerator::codeConcat(ExpDesc& e1, ExpDesc& e2, int line) {
+    Instruction* ie2 = previousInstruction();
+    if (GET_OPCODE(*ie2) == OpCode::CONCAT) { // e2 is a concatenation
+        int n = GETARG_B(*ie2);
+        freeExp(e2);
+        SETARG_A(*ie2, e1.info);
+        SETARG_B(*ie2, n + 1);
+    } else {
+        codeABC(OpCode::CONCAT, e1.info, 2, 0);
+        freeExp(e2);
+        fixLine(line);
+    }
+}
 
-} // namespace luao
\ No newline at end of file
+} // namespace luao
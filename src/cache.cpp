@@ -0,0 +1,119 @@
+#include "cache.hpp"
+#include "chunk.hpp"
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <random>
+#include <stdexcept>
+
+namespace luao {
+
+namespace {
+
+constexpr uint64_t FNV_OFFSET = 0xcbf29ce484222325ull;
+constexpr uint64_t FNV_PRIME = 0x100000001b3ull;
+
+uint64_t fnv1a(uint64_t h, std::string_view bytes) {
+    for (unsigned char c : bytes) {
+        h ^= c;
+        h *= FNV_PRIME;
+    }
+    return h;
+}
+
+// everything an entry depends on: the compiler version, the options and
+// the chunk name, each ending with a NUL so adjacent fields cannot run
+// together, then the source text
+std::string cache_key(std::string_view source, const std::string& chunkname, int optlevel, bool inline_globals) {
+    std::string key = LUAO_VERSION;
+    key += '\0';
+    key += "-O" + std::to_string(optlevel) + (inline_globals ? " --inline-globals" : "");
+    key += '\0';
+    key += chunkname;
+    key += '\0';
+    key += source;
+    return key;
+}
+
+// an entry is the key's length, the key, zero padding and the chunk; the
+// padding keeps the chunk's code aligned so it still runs in place
+constexpr size_t KEY_ALIGN = alignof(uint64_t) > alignof(Instruction) ? alignof(uint64_t) : alignof(Instruction);
+
+size_t chunk_offset(size_t key_size) {
+    size_t end = sizeof(uint64_t) + key_size;
+    return (end + KEY_ALIGN - 1) / KEY_ALIGN * KEY_ALIGN;
+}
+
+} // namespace
+
+std::filesystem::path CompileCache::entry(std::string_view source, const std::string& chunkname, int optlevel,
+                                          bool inline_globals) const {
+    uint64_t h = fnv1a(FNV_OFFSET, cache_key(source, chunkname, optlevel, inline_globals));
+    char name[32];
+    std::snprintf(name, sizeof(name), "%016llx.luac", static_cast<unsigned long long>(h));
+    return dir_ / name;
+}
+
+std::shared_ptr<LuaFunction> CompileCache::load(std::string_view source, const std::string& chunkname, int optlevel,
+                                                bool inline_globals) const {
+    std::filesystem::path path = entry(source, chunkname, optlevel, inline_globals);
+    std::error_code ec;
+    if (!std::filesystem::is_regular_file(path, ec)) return nullptr;
+    try {
+        auto file = MappedFile::open(path.string());
+        // the file name is only a hash: a hit needs the stored key to match
+        std::string key = cache_key(source, chunkname, optlevel, inline_globals);
+        std::string_view data = file->data();
+        uint64_t key_size;
+        if (data.size() < sizeof(key_size)) return nullptr;
+        std::memcpy(&key_size, data.data(), sizeof(key_size));
+        if (key_size != key.size() || chunk_offset(key.size()) > data.size()
+            || data.substr(sizeof(key_size), key.size()) != key) {
+            return nullptr;
+        }
+        return load_function(std::move(file), chunkname, chunk_offset(key.size()));
+    } catch (const std::runtime_error&) {
+        return nullptr;
+    }
+}
+
+bool CompileCache::store(std::string_view source, const std::string& chunkname, int optlevel, const LuaFunction& f,
+                         bool inline_globals) const {
+    std::error_code ec;
+    std::filesystem::create_directories(dir_, ec);
+    if (ec) return false;
+
+    std::filesystem::path path = entry(source, chunkname, optlevel, inline_globals);
+    // a name no other writer picks, in the same directory so the rename
+    // cannot cross file systems
+    std::filesystem::path tmp = path;
+    tmp += "." + std::to_string(std::random_device{}()) + ".tmp";
+
+    std::string key = cache_key(source, chunkname, optlevel, inline_globals);
+    uint64_t key_size = key.size();
+    std::string chunk(chunk_offset(key.size()), '\0');
+    std::memcpy(chunk.data(), &key_size, sizeof(key_size));
+    std::memcpy(chunk.data() + sizeof(key_size), key.data(), key.size());
+    try {
+        chunk += dump_function(f);
+    } catch (const std::runtime_error&) {
+        return false;
+    }
+    {
+        std::ofstream out(tmp, std::ios::binary);
+        if (!out.write(chunk.data(), static_cast<std::streamsize>(chunk.size())) || !out.flush()) {
+            out.close();
+            std::filesystem::remove(tmp, ec);
+            return false;
+        }
+    }
+    std::filesystem::rename(tmp, path, ec);
+    if (ec) {
+        std::filesystem::remove(tmp, ec);
+        return false;
+    }
+    return true;
+}
+
+} // namespace luao
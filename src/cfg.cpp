@@ -0,0 +1,107 @@
+#include "cfg.hpp"
+#include <algorithm>
+
+namespace luao {
+
+bool is_test_mode(OpCode op) {
+    return (op >= OpCode::EQ && op <= OpCode::TESTSET) || op == OpCode::LTINT || op == OpCode::LEINT;
+}
+
+bool skips_next(OpCode op) {
+    return is_test_mode(op) || op == OpCode::LFALSESKIP || op == OpCode::LOADKX;
+}
+
+int jump_dest(const std::vector<Instruction>& code, int pc) {
+    return pc + 1 + GETARG_sJ(code[pc]);
+}
+
+void successors(const std::vector<Instruction>& code, int pc, std::vector<int>& out) {
+    Instruction i = code[pc];
+    OpCode op = GET_OPCODE(i);
+    switch (op) {
+        case OpCode::JMP:
+            out.push_back(jump_dest(code, pc));
+            break;
+        case OpCode::RETURN:
+        case OpCode::RETURN0:
+        case OpCode::RETURN1:
+            break;
+        case OpCode::LFALSESKIP:
+            out.push_back(pc + 2);
+            break;
+        case OpCode::FORPREP: // skips the loop when it does not run
+            out.push_back(pc + 1);
+            out.push_back(pc + GETARG_Bx(i) + 2);
+            break;
+        case OpCode::FORLOOP:
+        case OpCode::TFORLOOP:
+            out.push_back(pc + 1);
+            out.push_back(pc + 1 - GETARG_Bx(i));
+            break;
+        case OpCode::TFORPREP:
+            out.push_back(pc + 1 + GETARG_Bx(i));
+            break;
+        default:
+            out.push_back(pc + 1);
+            if (is_test_mode(op)) out.push_back(pc + 2);
+            break;
+    }
+}
+
+int branch_target(const std::vector<Instruction>& code, int pc) {
+    Instruction i = code[pc];
+    switch (GET_OPCODE(i)) {
+        case OpCode::JMP: return jump_dest(code, pc);
+        case OpCode::FORPREP: return pc + GETARG_Bx(i) + 2;
+        case OpCode::FORLOOP:
+        case OpCode::TFORLOOP: return pc + 1 - GETARG_Bx(i);
+        case OpCode::TFORPREP: return pc + 1 + GETARG_Bx(i);
+        default: return -1;
+    }
+}
+
+void set_branch_target(Instruction& i, int pc, int target) {
+    switch (GET_OPCODE(i)) {
+        case OpCode::JMP: SETARG_sJ(i, target - pc - 1); break;
+        case OpCode::FORPREP: SETARG_Bx(i, target - pc - 2); break;
+        case OpCode::FORLOOP:
+        case OpCode::TFORLOOP: SETARG_Bx(i, pc + 1 - target); break;
+        case OpCode::TFORPREP: SETARG_Bx(i, target - pc - 1); break;
+        default: break;
+    }
+}
+
+void relayout(std::vector<Instruction>& code, std::vector<Lineinfo>& lineinfo,
+              std::vector<LocalVarinfo>& locvars, const std::vector<Placement>& order) {
+    int n = static_cast<int>(code.size());
+    int count = static_cast<int>(order.size());
+    // newpc[p]: new index of the first instruction anchored at p or later
+    std::vector<int> newpc(n + 1, count);
+    for (int idx = count - 1; idx >= 0; idx--) {
+        newpc[order[idx].anchor] = idx;
+    }
+    for (int p = n - 1; p >= 0; p--) {
+        newpc[p] = std::min(newpc[p], newpc[p + 1]);
+    }
+
+    std::vector<Instruction> out;
+    std::vector<Lineinfo> lines;
+    out.reserve(count);
+    lines.reserve(count);
+    for (int idx = 0; idx < count; idx++) {
+        int pc = order[idx].pc;
+        Instruction i = code[pc];
+        int t = branch_target(code, pc);
+        if (t >= 0) set_branch_target(i, idx, newpc[t]);
+        out.push_back(i);
+        lines.push_back({idx, lineinfo[pc].line});
+    }
+    for (auto& var : locvars) {
+        var.startpc = newpc[std::min(var.startpc, n)];
+        var.endpc = newpc[std::min(var.endpc, n)];
+    }
+    code = std::move(out);
+    lineinfo = std::move(lines);
+}
+
+} // namespace luao
@@ -0,0 +1,417 @@
+#include "chunk.hpp"
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#define LUAO_USE_MMAP
+#endif
+
+namespace luao {
+
+namespace {
+
+constexpr unsigned char CHUNK_FORMAT = 2;          /* this layout */
+constexpr char CHUNK_DATA[] = "\x19\x93\r\n\x1a\n"; /* catches text-mode conversions */
+constexpr luaInt CHUNK_INT = 0x5678;               /* integer and float samples checking */
+constexpr luaNumber CHUNK_NUM = 370.5;             /* the host's encodings */
+
+// constant tags
+enum : unsigned char { K_NIL, K_FALSE, K_TRUE, K_INT, K_FLOAT, K_STRING };
+
+class ChunkWriter {
+public:
+    explicit ChunkWriter(bool strip) : strip_(strip) {}
+
+    std::string take() { return std::move(out_); }
+
+    void byte(unsigned char b) { out_.push_back(static_cast<char>(b)); }
+
+    void size(size_t n) {
+        do {
+            unsigned char b = n & 0x7F;
+            n >>= 7;
+            byte(n ? b | 0x80 : b);
+        } while (n);
+    }
+
+    // zigzag keeps small negative values short
+    void integer(int n) {
+        size((static_cast<size_t>(static_cast<long long>(n)) << 1) ^ (n < 0 ? ~size_t(0) : 0));
+    }
+
+    template <typename T>
+    void raw(const T& v) {
+        out_.append(reinterpret_cast<const char*>(&v), sizeof(v));
+    }
+
+    void string(const std::string& s) {
+        size(s.size());
+        out_ += s;
+    }
+
+    void header() {
+        uint32_t magic = LUAO_BMAGIC;
+        for (int shift = 24; shift >= 0; shift -= 8) byte((magic >> shift) & 0xFF);
+        byte(LUAO_BVERSION);
+        byte(CHUNK_FORMAT);
+        out_.append(CHUNK_DATA, sizeof(CHUNK_DATA) - 1);
+        byte(sizeof(Instruction));
+        byte(sizeof(luaInt));
+        byte(sizeof(luaNumber));
+        raw(CHUNK_INT);
+        raw(CHUNK_NUM);
+    }
+
+    void function(const LuaFunction& f, const std::string& parent_source) {
+        // a nested function's source is only written when it differs
+        string(strip_ || f.getSource() == parent_source ? std::string() : f.getSource());
+        integer(f.getLinedefined());
+        integer(f.getLastlinedefined());
+        byte(static_cast<unsigned char>(f.getNumParams()));
+        byte(f.isVararg());
+        byte(static_cast<unsigned char>(f.getMaxStackSize()));
+
+        size(f.getBytecode().size());
+        while (out_.size() % alignof(Instruction)) byte(0);
+        for (Instruction i : f.getBytecode()) raw(i);
+
+        size(f.getConstants().size());
+        for (const LuaValue& k : f.getConstants()) constant(k);
+
+        size(f.getUpvalDescs().size());
+        for (const UpvalDesc& uv : f.getUpvalDescs()) {
+            byte(uv.inStack);
+            integer(uv.idx);
+        }
+
+        // each nested function is prefixed with its length so a loader can
+        // skip it; the length is patched in once the function is written
+        size(f.getProtos().size());
+        for (const LuaValue& p : f.getProtos()) {
+            size_t at = out_.size();
+            raw(size_t(0));
+            function(*std::static_pointer_cast<LuaFunction>(p.getObject()), f.getSource());
+            size_t length = out_.size() - at - sizeof(size_t);
+            std::memcpy(&out_[at], &length, sizeof(length));
+        }
+
+        debug(f);
+    }
+
+private:
+    std::string out_;
+    bool strip_;
+
+    void constant(const LuaValue& k) {
+        const auto& obj = k.getObject();
+        switch (k.getType()) {
+            case LuaType::NIL:
+                byte(K_NIL);
+                return;
+            case LuaType::BOOLEAN:
+                byte(std::static_pointer_cast<LuaBool>(obj)->getValue() ? K_TRUE : K_FALSE);
+                return;
+            case LuaType::NUMBER:
+                if (auto i = std::dynamic_pointer_cast<LuaInteger>(obj)) {
+                    byte(K_INT);
+                    raw(i->getValue());
+                } else {
+                    byte(K_FLOAT);
+                    raw(std::static_pointer_cast<LuaNumber>(obj)->getValue());
+                }
+                return;
+            case LuaType::STRING:
+                byte(K_STRING);
+                string(std::static_pointer_cast<LuaString>(obj)->getValue());
+                return;
+            default:
+                throw std::runtime_error("cannot dump a constant of type " + k.typeName());
+        }
+    }
+
+    void debug(const LuaFunction& f) {
+        if (strip_) {
+            size(0);
+            size(0);
+            size(0);
+            return;
+        }
+        size(f.getLineinfos().size());
+        for (const Lineinfo& li : f.getLineinfos()) {
+            integer(li.op);
+            integer(li.line);
+        }
+        size(f.getLocalVars().size());
+        for (const LocalVarinfo& var : f.getLocalVars()) {
+            string(var.name);
+            integer(var.startpc);
+            integer(var.endpc);
+        }
+        size(f.getUpvalDescs().size());
+        for (const UpvalDesc& uv : f.getUpvalDescs()) string(uv.name);
+    }
+};
+
+class ChunkReader {
+public:
+    // with an `owner`, code arrays are referenced in place rather than copied
+    // and nested functions are only read when first needed
+    ChunkReader(std::string_view data, const std::string& name, std::shared_ptr<const void> owner = nullptr)
+        : data_(data), name_(name), owner_(std::move(owner)) {}
+
+    [[noreturn]] void error(const std::string& why) const {
+        throw std::runtime_error(name_ + ": bad binary chunk (" + why + ")");
+    }
+
+    unsigned char byte() {
+        need(1);
+        return static_cast<unsigned char>(data_[pos_++]);
+    }
+
+    size_t size() {
+        size_t n = 0;
+        for (int shift = 0;; shift += 7) {
+            if (shift >= 64) error("varint overflow");
+            unsigned char b = byte();
+            n |= static_cast<size_t>(b & 0x7F) << shift;
+            if (!(b & 0x80)) return n;
+        }
+    }
+
+    // a count of items taking at least `min_bytes` each; bounds allocations
+    // by what the rest of the chunk can hold
+    size_t count(size_t min_bytes = 1) {
+        size_t n = size();
+        if (n > (data_.size() - pos_) / min_bytes) error("truncated");
+        return n;
+    }
+
+    int integer() {
+        size_t z = size();
+        return static_cast<int>((z >> 1) ^ (~(z & 1) + 1));
+    }
+
+    template <typename T>
+    T raw() {
+        need(sizeof(T));
+        T v;
+        std::memcpy(&v, data_.data() + pos_, sizeof(T));
+        pos_ += sizeof(T);
+        return v;
+    }
+
+    std::string string() {
+        size_t n = count();
+        std::string s(data_.substr(pos_, n));
+        pos_ += n;
+        return s;
+    }
+
+    void header() {
+        if (!is_binary_chunk(data_)) error("not a binary chunk");
+        pos_ = 4;
+        if (byte() != LUAO_BVERSION) error("version mismatch");
+        if (byte() != CHUNK_FORMAT) error("format mismatch");
+        need(sizeof(CHUNK_DATA) - 1);
+        if (data_.substr(pos_, sizeof(CHUNK_DATA) - 1) != std::string_view(CHUNK_DATA, sizeof(CHUNK_DATA) - 1)) {
+            error("corrupted");
+        }
+        pos_ += sizeof(CHUNK_DATA) - 1;
+        if (byte() != sizeof(Instruction)) error("Instruction size mismatch");
+        if (byte() != sizeof(luaInt)) error("integer size mismatch");
+        if (byte() != sizeof(luaNumber)) error("float size mismatch");
+        if (raw<luaInt>() != CHUNK_INT) error("integer format mismatch");
+        if (raw<luaNumber>() != CHUNK_NUM) error("float format mismatch");
+    }
+
+    std::shared_ptr<LuaFunction> function(const std::string& parent_source) {
+        std::string source = string();
+        if (source.empty()) source = parent_source;
+        int linedefined = integer();
+        int lastlinedefined = integer();
+        int numparams = byte();
+        bool is_vararg = byte() != 0;
+        int maxstacksize = byte();
+
+        size_t ncode = count(sizeof(Instruction));
+        size_t pad = (alignof(Instruction) - pos_ % alignof(Instruction)) % alignof(Instruction);
+        need(pad);
+        pos_ += pad;
+        need(ncode * sizeof(Instruction));
+        const char* at = data_.data() + pos_;
+        std::vector<Instruction> code;
+        bool in_place = owner_ && reinterpret_cast<uintptr_t>(at) % alignof(Instruction) == 0;
+        if (!in_place) {
+            code.resize(ncode);
+            std::memcpy(code.data(), at, ncode * sizeof(Instruction));
+        }
+        pos_ += ncode * sizeof(Instruction);
+
+        std::vector<LuaValue> constants(count());
+        for (LuaValue& k : constants) k = constant();
+
+        std::vector<UpvalDesc> upvals(count(2));
+        for (UpvalDesc& uv : upvals) {
+            uv.inStack = byte() != 0;
+            uv.idx = integer();
+        }
+
+        std::vector<LuaValue> protos(count(sizeof(size_t)));
+        std::vector<std::pair<size_t, size_t>> lazy; // offset and length of each nested function
+        for (LuaValue& p : protos) {
+            size_t length = raw<size_t>();
+            need(length);
+            if (owner_) {
+                lazy.emplace_back(pos_, length);
+                pos_ += length;
+            } else {
+                p = LuaValue(nested(pos_, length, source), LuaType::FUNCTION);
+            }
+        }
+
+        std::vector<Lineinfo> lineinfo(count(2));
+        for (Lineinfo& li : lineinfo) {
+            li.op = integer();
+            li.line = integer();
+        }
+        std::vector<LocalVarinfo> locvars(count(3));
+        for (LocalVarinfo& var : locvars) {
+            var.name = string();
+            var.startpc = integer();
+            var.endpc = integer();
+        }
+        size_t nnames = count();
+        if (nnames != 0 && nnames != upvals.size()) error("upvalue names do not match");
+        for (size_t n = 0; n < nnames; n++) upvals[n].name = string();
+
+        auto f = std::make_shared<LuaFunction>(std::move(code), std::move(constants), std::move(protos),
+                                               std::move(upvals), std::move(locvars), source,
+                                               std::move(lineinfo), linedefined, lastlinedefined);
+        f->setNumParams(numparams);
+        f->setVararg(is_vararg);
+        f->setMaxStackSize(maxstacksize);
+        if (in_place) f->setCode({reinterpret_cast<const Instruction*>(at), ncode}, owner_);
+        if (!lazy.empty()) {
+            f->setProtoLoader([data = data_, name = name_, owner = owner_, source, lazy = std::move(lazy)](size_t n) {
+                ChunkReader reader(data, name, owner);
+                return reader.nested(lazy[n].first, lazy[n].second, source);
+            });
+        }
+        return f;
+    }
+
+    // the nested function stored in [at, at + length)
+    std::shared_ptr<LuaFunction> nested(size_t at, size_t length, const std::string& parent_source) {
+        pos_ = at;
+        auto f = function(parent_source);
+        if (pos_ - at != length) error("bad function length");
+        return f;
+    }
+
+    bool atEnd() const { return pos_ == data_.size(); }
+
+private:
+    std::string_view data_;
+    size_t pos_ = 0;
+    const std::string& name_;
+    std::shared_ptr<const void> owner_;
+
+    void need(size_t n) const {
+        if (data_.size() - pos_ < n) error("truncated");
+    }
+
+    LuaValue constant() {
+        switch (byte()) {
+            case K_NIL: return LuaValue();
+            case K_FALSE: return LuaValue(std::make_shared<LuaBool>(false), LuaType::BOOLEAN);
+            case K_TRUE: return LuaValue(std::make_shared<LuaBool>(true), LuaType::BOOLEAN);
+            case K_INT: return LuaValue(std::make_shared<LuaInteger>(raw<luaInt>()), LuaType::NUMBER);
+            case K_FLOAT: return LuaValue(std::make_shared<LuaNumber>(raw<luaNumber>()), LuaType::NUMBER);
+            case K_STRING: return LuaValue(std::make_shared<LuaString>(string()), LuaType::STRING);
+            default: error("unknown constant tag");
+        }
+    }
+};
+
+} // namespace
+
+std::shared_ptr<const MappedFile> MappedFile::open(const std::string& path) {
+    std::shared_ptr<MappedFile> file(new MappedFile());
+#ifdef LUAO_USE_MMAP
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) throw std::runtime_error("cannot open " + path);
+    struct stat st;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode)) {
+        file->size_ = static_cast<size_t>(st.st_size);
+        if (file->size_ == 0) {
+            ::close(fd);
+            return file;
+        }
+        void* p = mmap(nullptr, file->size_, PROT_READ, MAP_PRIVATE, fd, 0);
+        ::close(fd);
+        if (p == MAP_FAILED) throw std::runtime_error("cannot map " + path);
+        file->data_ = static_cast<const char*>(p);
+        file->mapped_ = true;
+        return file;
+    }
+    ::close(fd); // pipes and devices are read instead
+#endif
+    std::ifstream in(path, std::ios::binary);
+    if (!in) throw std::runtime_error("cannot open " + path);
+    std::stringstream buffer;
+    buffer << in.rdbuf();
+    file->buffer_ = buffer.str();
+    file->data_ = file->buffer_.data();
+    file->size_ = file->buffer_.size();
+    return file;
+}
+
+MappedFile::~MappedFile() {
+#ifdef LUAO_USE_MMAP
+    if (mapped_) munmap(const_cast<char*>(data_), size_);
+#endif
+}
+
+bool is_binary_chunk(std::string_view data) {
+    uint32_t magic = LUAO_BMAGIC;
+    if (data.size() < 4) return false;
+    for (int n = 0; n < 4; n++) {
+        if (static_cast<unsigned char>(data[n]) != ((magic >> (24 - 8 * n)) & 0xFF)) return false;
+    }
+    return true;
+}
+
+std::string dump_function(const LuaFunction& f, bool strip) {
+    ChunkWriter writer(strip);
+    writer.header();
+    writer.function(f, std::string());
+    return writer.take();
+}
+
+std::shared_ptr<LuaFunction> load_function(std::string_view chunk, const std::string& chunkname) {
+    ChunkReader reader(chunk, chunkname);
+    reader.header();
+    auto f = reader.function(chunkname);
+    if (!reader.atEnd()) reader.error("trailing data");
+    return f;
+}
+
+std::shared_ptr<LuaFunction> load_function(std::shared_ptr<const MappedFile> file, const std::string& chunkname,
+                                           size_t offset) {
+    std::string_view chunk = file->data().substr(std::min(offset, file->data().size()));
+    ChunkReader reader(chunk, chunkname, std::move(file));
+    reader.header();
+    auto f = reader.function(chunkname);
+    if (!reader.atEnd()) reader.error("trailing data");
+    return f;
+}
+
+} // namespace luao
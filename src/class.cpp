@@ -0,0 +1,214 @@
+#include <class.hpp>
+#include <vm.hpp>
+#include <atomic>
+#include <sstream>
+
+namespace luao {
+
+static std::atomic<uint64_t> next_shape_id{1};
+static std::atomic<uint64_t> next_class_id{1};
+
+static const std::string& field_name(const LuaValue& key) {
+    if (key.getType() != LuaType::STRING) {
+        throw LuaError("invalid instance field key (a " + key.typeName() + " value)");
+    }
+    return std::static_pointer_cast<LuaString>(key.getObject())->getValue();
+}
+
+// --- Shape ---
+
+Shape::Shape() : id(next_shape_id++) {}
+
+std::shared_ptr<Shape> Shape::makeRoot() {
+    return std::shared_ptr<Shape>(new Shape());
+}
+
+int Shape::lookup(const std::string& name) const {
+    auto it = slots.find(name);
+    return it == slots.end() ? -1 : it->second;
+}
+
+std::shared_ptr<Shape> Shape::addField(const std::string& name) {
+    auto it = transitions.find(name);
+    if (it != transitions.end()) {
+        return it->second;
+    }
+
+    std::shared_ptr<Shape> child(new Shape());
+    child->fields = fields;
+    child->slots = slots;
+    child->slots[name] = static_cast<int>(child->fields.size());
+    child->fields.push_back(name);
+    transitions[name] = child;
+    return child;
+}
+
+// --- LuaClass ---
+
+LuaClass::LuaClass(std::string name, std::shared_ptr<LuaClass> parent)
+    : id(next_class_id++), name(std::move(name)), parent(std::move(parent)), members(std::make_shared<LuaTable>()) {
+    // subclasses extend the parent's layout, so inherited fields keep their slots
+    instance_shape = this->parent ? this->parent->instance_shape : Shape::makeRoot();
+}
+
+void LuaClass::declareField(const std::string& field) {
+    if (instance_shape->lookup(field) >= 0) return;
+    instance_shape = instance_shape->addField(field);
+}
+
+void LuaClass::addInterface(std::shared_ptr<LuaClass> iface) {
+    if (finalized) throw LuaError("class '" + name + "' is already defined");
+    if (!iface->is_interface) {
+        throw LuaError("'" + iface->name + "' is not an interface");
+    }
+    interfaces.push_back(std::move(iface));
+}
+
+void LuaClass::defineMethod(const std::string& method, const LuaValue& fn, MethodKind kind) {
+    if (finalized) throw LuaError("class '" + name + "' is already defined");
+    method_decls.push_back({method, kind == MethodKind::VIRTUAL ? LuaValue() : fn, kind});
+}
+
+void LuaClass::finalize() {
+    if (finalized) return;
+
+    if (parent) {
+        parent->finalize();
+        vtable = parent->vtable;
+        vtable_names = parent->vtable_names;
+        vtable_index = parent->vtable_index;
+        meta_methods = parent->meta_methods;
+    }
+
+    auto add_slot = [this](const std::string& method, const LuaValue& fn) {
+        vtable_index[method] = static_cast<int>(vtable.size());
+        vtable.push_back(fn);
+        vtable_names.push_back(method);
+    };
+
+    for (const auto& iface : interfaces) {
+        iface->finalize();
+        for (size_t slot = 0; slot < iface->vtable.size(); slot++) {
+            if (!vtable_index.count(iface->vtable_names[slot])) {
+                add_slot(iface->vtable_names[slot], iface->vtable[slot]);
+            }
+        }
+    }
+
+    for (const auto& decl : method_decls) {
+        if (decl.kind == MethodKind::META) {
+            meta_methods.emplace_back(decl.name, decl.fn);
+            continue;
+        }
+        auto it = vtable_index.find(decl.name);
+        if (it == vtable_index.end()) {
+            if (decl.kind == MethodKind::IMPL) {
+                throw LuaError("method '" + decl.name + "' of class '" + name + "' is marked <impl> but overrides nothing");
+            }
+            add_slot(decl.name, decl.fn);
+        } else if (decl.kind != MethodKind::VIRTUAL) {
+            vtable[it->second] = decl.fn;
+        }
+    }
+
+    if (!is_abstract && !is_interface) {
+        for (size_t slot = 0; slot < vtable.size(); slot++) {
+            if (vtable[slot].getType() == LuaType::NIL) {
+                throw LuaError("class '" + name + "' does not implement virtual method '" + vtable_names[slot] + "'");
+            }
+        }
+    }
+
+    // instances copy the class metatable, so operators on them find the
+    // <meta> methods through the usual metamethod lookup
+    if (!meta_methods.empty()) {
+        auto mt = std::make_shared<LuaTable>();
+        for (const auto& [event, fn] : meta_methods) {
+            mt->set(LuaValue(std::make_shared<LuaString>(event), LuaType::STRING), fn);
+        }
+        setMetatable(mt);
+    }
+
+    method_decls.clear();
+    finalized = true;
+}
+
+int LuaClass::getMethodSlot(const std::string& method) {
+    finalize();
+    auto it = vtable_index.find(method);
+    return it == vtable_index.end() ? -1 : it->second;
+}
+
+LuaValue LuaClass::getMember(const LuaValue& key) const {
+    if (finalized && key.getType() == LuaType::STRING) {
+        auto it = vtable_index.find(std::static_pointer_cast<LuaString>(key.getObject())->getValue());
+        if (it != vtable_index.end()) return vtable[it->second];
+    }
+    for (const LuaClass* c = this; c; c = c->parent.get()) {
+        LuaValue v = c->members->get(key);
+        if (v.getType() != LuaType::NIL) return v;
+    }
+    return LuaValue();
+}
+
+void LuaClass::setMember(const LuaValue& key, const LuaValue& value) {
+    members->set(key, value);
+}
+
+std::shared_ptr<LuaInstance> LuaClass::newInstance() {
+    if (is_interface || is_abstract) {
+        throw LuaError("cannot instantiate " + std::string(is_interface ? "interface" : "abstract class") + " '" + name + "'");
+    }
+    finalize();
+    return std::make_shared<LuaInstance>(std::static_pointer_cast<LuaClass>(shared_from_this()));
+}
+
+// --- LuaInstance ---
+
+LuaInstance::LuaInstance(std::shared_ptr<LuaClass> klass)
+    : klass(std::move(klass)) {
+    shape = this->klass->getInstanceShape();
+    slots.resize(shape->getSlotCount());
+    setMetatable(this->klass->getMetatable());
+}
+
+std::string LuaInstance::toString() const {
+    std::ostringstream oss;
+    oss << klass->getName() << ": " << this;
+    return oss.str();
+}
+
+LuaValue LuaInstance::getField(const std::string& field) const {
+    int slot = shape->lookup(field);
+    if (slot >= 0) return slots[slot];
+    return klass->getMember(LuaValue(std::make_shared<LuaString>(field), LuaType::STRING));
+}
+
+LuaValue LuaInstance::get(const LuaValue& key) const {
+    if (key.getType() == LuaType::STRING) {
+        int slot = shape->lookup(field_name(key));
+        if (slot >= 0) return slots[slot];
+    }
+    return klass->getMember(key);
+}
+
+int LuaInstance::setField(const std::string& field, const LuaValue& value) {
+    int slot = shape->lookup(field);
+    if (slot >= 0) {
+        slots[slot] = value;
+        return slot;
+    }
+    addSlot(shape->addField(field), value);
+    return static_cast<int>(slots.size()) - 1;
+}
+
+void LuaInstance::set(const LuaValue& key, const LuaValue& value) {
+    setField(field_name(key), value);
+}
+
+void LuaInstance::addSlot(std::shared_ptr<Shape> new_shape, const LuaValue& value) {
+    shape = std::move(new_shape);
+    slots.push_back(value);
+}
+
+} // namespace luao
@@ -0,0 +1,101 @@
+#include <object.hpp>
+#include <function.hpp>
+#include <table.hpp>
+#include <coroutine.hpp>
+#include <vm.hpp>
+#include <libs.hpp>
+#include <auxlib.hpp>
+
+using namespace luao;
+
+/*
+    Native coroutine library. The work is done by VM::resume and VM::yield;
+    these functions check arguments and shape the results.
+*/
+
+static std::shared_ptr<LuaCoroutine> new_coroutine(VM& vm, int base_reg, int num_args, const char* fname) {
+    const LuaValue& f = arg_at(vm, base_reg, num_args, 1);
+    if (f.getType() != LuaType::FUNCTION) {
+        arg_error(1, fname, "function expected, got " + arg_typename(vm, base_reg, num_args, 1));
+    }
+    return std::make_shared<LuaCoroutine>(f);
+}
+
+static std::shared_ptr<LuaCoroutine> check_coroutine(VM& vm, int base_reg, int num_args, const char* fname) {
+    const LuaValue& v = arg_at(vm, base_reg, num_args, 1);
+    if (v.getType() == LuaType::THREAD) {
+        return std::static_pointer_cast<LuaCoroutine>(v.getObject());
+    }
+    arg_error(1, fname, "coroutine expected, got " + arg_typename(vm, base_reg, num_args, 1));
+}
+
+// coroutine.create(f)
+static int corolib_create(VM& vm, int base_reg, int num_args) {
+    *vm.get_stack_mutable()[base_reg] = LuaValue(new_coroutine(vm, base_reg, num_args, "create"), LuaType::THREAD);
+    return 1;
+}
+
+// coroutine.resume(co, ...): true and what co yields or returns, or false
+// and the error message
+static int corolib_resume(VM& vm, int base_reg, int num_args) {
+    auto co = check_coroutine(vm, base_reg, num_args, "resume");
+    try {
+        int n = vm.resume(*co, base_reg + 1, num_args - 1);
+        *vm.get_stack_mutable()[base_reg] = vm.boolean(true);
+        return n + 1;
+    } catch (const LuaError& e) {
+        auto& stack = vm.get_stack_mutable();
+        *stack[base_reg] = vm.boolean(false);
+        *stack[base_reg + 1] = make_string(e.what());
+        return 2;
+    }
+}
+
+// coroutine.yield(...)
+static int corolib_yield(VM& vm, int base_reg, int num_args) {
+    return vm.yield(base_reg, num_args);
+}
+
+// coroutine.status(co)
+static int corolib_status(VM& vm, int base_reg, int num_args) {
+    static const char* const names[] = {"suspended", "running", "normal", "dead"};
+    auto co = check_coroutine(vm, base_reg, num_args, "status");
+    *vm.get_stack_mutable()[base_reg] = make_string(names[static_cast<int>(co->getStatus())]);
+    return 1;
+}
+
+// coroutine.isyieldable()
+static int corolib_isyieldable(VM& vm, int base_reg, int) {
+    *vm.get_stack_mutable()[base_reg] = vm.boolean(vm.is_yieldable());
+    return 1;
+}
+
+// coroutine.wrap(f): a function that resumes a new coroutine running f and
+// returns what it yields or returns; errors propagate to the caller
+static int corolib_wrap(VM& vm, int base_reg, int num_args) {
+    auto co = new_coroutine(vm, base_reg, num_args, "wrap");
+    auto resume = [co](VM& vm, int base_reg, int num_args) {
+        return vm.resume(*co, base_reg, num_args);
+    };
+    *vm.get_stack_mutable()[base_reg] = LuaValue(std::make_shared<LuaNativeFunction>(resume), LuaType::FUNCTION);
+    return 1;
+}
+
+LuaValue opencorolib() {
+    auto table = std::make_shared<LuaTable>();
+    const std::pair<const char*, LuaNativeFunction::CFunc> funcs[] = {
+        {"create", corolib_create},
+        {"resume", corolib_resume},
+        {"yield", corolib_yield},
+        {"status", corolib_status},
+        {"isyieldable", corolib_isyieldable},
+        {"wrap", corolib_wrap},
+    };
+    for (const auto& [name, fn] : funcs) {
+        table->set(
+            LuaValue(std::make_shared<LuaString>(name), LuaType::STRING),
+            LuaValue(std::make_shared<LuaNativeFunction>(fn), LuaType::FUNCTION)
+        );
+    }
+    return LuaValue(table, LuaType::TABLE);
+}
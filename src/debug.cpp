@@ -4,16 +4,7 @@
 
 namespace luao {
 
-// These macros are also defined in vm.cpp. It would be better to move them
-// to a common header, but for now, I will just redefine them here.
-#define GET_OPCODE(i)   (static_cast<OpCode>(((i) >> 0) & 0x7F))
-#define GETARG_A(i)     (((i) >> 7) & 0xFF)
-#define GETARG_B(i)     (((i) >> 16) & 0xFF)
-#define GETARG_C(i)     (((i) >> 24) & 0xFF)
-#define GETARG_Bx(i)    ((i) >> 15)
-#define GETARG_sBx(i)   (static_cast<int>(GETARG_Bx(i)) - 65535)
-
-std::string disassemble_instruction(Instruction i, const std::shared_ptr<LuaFunction> func) {
+std::string disassemble_instruction(Instruction i, const std::shared_ptr<const LuaFunction>& func) {
     std::stringstream ss;
     OpCode op = GET_OPCODE(i);
     ss << to_string(op) << " ";
@@ -29,8 +20,46 @@ std::string disassemble_instruction(Instruction i, const std::shared_ptr<LuaFunc
             ss << GETARG_A(i) << " " << GETARG_B(i) << " " << GETARG_C(i);
             break;
         case OpCode::LOADI:
+        case OpCode::LOADF:
             ss << GETARG_A(i) << " " << GETARG_sBx(i);
             break;
+        case OpCode::JMP:
+            ss << GETARG_sJ(i);
+            break;
+        case OpCode::EXTRAARG:
+            ss << GETARG_Ax(i);
+            break;
+        case OpCode::FORLOOP:
+        case OpCode::FORPREP:
+        case OpCode::TFORPREP:
+        case OpCode::TFORLOOP:
+        case OpCode::CLOSURE:
+            ss << GETARG_A(i) << " " << GETARG_Bx(i);
+            break;
+        case OpCode::ADDI:
+        case OpCode::ADDIINT:
+        case OpCode::SHRI:
+        case OpCode::SHLI:
+            ss << GETARG_A(i) << " " << GETARG_B(i) << " " << static_cast<int>(GETARG_sC(i));
+            if (GETARG_k(i)) ss << " k";
+            break;
+        case OpCode::EQI:
+        case OpCode::LTI:
+        case OpCode::LEI:
+        case OpCode::GTI:
+        case OpCode::GEI:
+            ss << GETARG_A(i) << " " << static_cast<int>(GETARG_sB(i)) << " " << GETARG_k(i);
+            break;
+        case OpCode::EQ:
+        case OpCode::LT:
+        case OpCode::LE:
+        case OpCode::LTINT:
+        case OpCode::LEINT:
+        case OpCode::EQK:
+        case OpCode::TEST:
+        case OpCode::TESTSET:
+            ss << GETARG_A(i) << " " << GETARG_B(i) << " " << GETARG_k(i);
+            break;
         case OpCode::LOADK:
             ss << GETARG_A(i) << " " << GETARG_Bx(i);
             if (func) {
@@ -39,11 +68,13 @@ std::string disassemble_instruction(Instruction i, const std::shared_ptr<LuaFunc
             break;
         case OpCode::RETURN:
         case OpCode::RETURN1:
+        case OpCode::CHECKTYPE:
             ss << GETARG_A(i) << " " << GETARG_B(i);
             break;
         default:
             // For other opcodes, just print A, B, C for now
             ss << GETARG_A(i) << " " << GETARG_B(i) << " " << GETARG_C(i);
+            if (GETARG_k(i)) ss << " k";
             break;
     }
     return ss.str();
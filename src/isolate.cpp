@@ -0,0 +1,91 @@
+#include "isolate.hpp"
+#include <bytecode.hpp>
+#include <chunk.hpp>
+#include <parser.hpp>
+#include <vm.hpp>
+#include <sstream>
+
+namespace luao {
+
+IsolatePool::IsolatePool(unsigned workers, std::shared_ptr<const VMSnapshot> snapshot)
+    : snapshot_(std::move(snapshot)) {
+    workers_.reserve(std::max(workers, 1u));
+    for (unsigned n = 0; n < std::max(workers, 1u); n++) {
+        workers_.emplace_back([this] { work(); });
+    }
+}
+
+IsolatePool::~IsolatePool() {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stopping_ = true;
+    }
+    ready_.notify_all();
+    for (auto& worker : workers_) worker.join();
+}
+
+std::future<IsolateResult> IsolatePool::submit(IsolateJob job) {
+    Task task([this, job = std::move(job)](VM& vm) { return run(vm, job); });
+    auto result = task.get_future();
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        queue_.push_back(std::move(task));
+    }
+    ready_.notify_one();
+    return result;
+}
+
+std::vector<IsolateResult> IsolatePool::run_all(std::vector<IsolateJob> jobs) {
+    std::vector<std::future<IsolateResult>> pending;
+    pending.reserve(jobs.size());
+    for (auto& job : jobs) pending.push_back(submit(std::move(job)));
+
+    std::vector<IsolateResult> results;
+    results.reserve(pending.size());
+    for (auto& result : pending) results.push_back(result.get());
+    return results;
+}
+
+// each worker keeps one VM and reloads it for every job
+void IsolatePool::work() {
+    VM vm;
+    for (;;) {
+        Task task;
+        {
+            std::unique_lock<std::mutex> lock(mutex_);
+            ready_.wait(lock, [this] { return stopping_ || !queue_.empty(); });
+            if (queue_.empty()) return;
+            task = std::move(queue_.front());
+            queue_.pop_front();
+        }
+        task(vm);
+    }
+}
+
+IsolateResult IsolatePool::run(VM& vm, const IsolateJob& job) const {
+    IsolateResult result;
+    std::ostringstream output;
+    vm.set_output(&output);
+    try {
+        std::shared_ptr<const LuaFunction> main = job.function;
+        if (!main && is_binary_chunk(job.source)) {
+            main = load_function(job.source, job.chunkname);
+        } else if (!main) {
+            Parser parser(job.source);
+            auto ast = parser.parse();
+            main = BytecodeGenerator(job.optlevel, job.inline_globals).generate(*ast, job.chunkname);
+        }
+        auto closure = std::make_shared<LuaClosure>(main);
+        if (snapshot_) vm.load(closure, *snapshot_);
+        else vm.load(closure);
+        vm.run();
+        result.ok = true;
+    } catch (const std::exception& e) {
+        result.error = e.what();
+    }
+    vm.set_output(&std::cout);
+    result.output = output.str();
+    return result;
+}
+
+} // namespace luao
@@ -3,8 +3,53 @@
 */
 
 #include <lexer.hpp>
+#include <lexscan.hpp>
+#include <array>
+#include <cstring>
+
+namespace {
+
+struct Keyword {
+    std::string_view word;
+    Token token = Token::IDENTIFIER;
+};
+
+constexpr Keyword keywords[] = {
+    {"and", Token::AND}, {"break", Token::BREAK}, {"do", Token::DO}, {"else", Token::ELSE},
+    {"elseif", Token::ELSEIF}, {"end", Token::END}, {"false", Token::FALSE}, {"for", Token::FOR},
+    {"function", Token::FUNCTION}, {"goto", Token::GOTO}, {"if", Token::IF}, {"in", Token::IN},
+    {"local", Token::LOCAL}, {"nil", Token::NIL}, {"not", Token::NOT}, {"or", Token::OR},
+    {"repeat", Token::REPEAT}, {"return", Token::RETURN}, {"then", Token::THEN}, {"true", Token::TRUE},
+    {"until", Token::UNTIL}, {"while", Token::WHILE},
+};
+
+constexpr size_t KEYWORD_SLOTS = 64;
+
+// perfect hash of the keywords: first and last character and length
+constexpr size_t keyword_hash(std::string_view s) {
+    return (static_cast<unsigned char>(s.front()) + 11u * static_cast<unsigned char>(s.back()) + 4u * s.size()) &
+           (KEYWORD_SLOTS - 1);
+}
+
+constexpr std::array<Keyword, KEYWORD_SLOTS> make_keyword_table() {
+    std::array<Keyword, KEYWORD_SLOTS> table{};
+    for (const Keyword& k : keywords) table[keyword_hash(k.word)] = k;
+    return table;
+}
+
+constexpr auto keyword_table = make_keyword_table();
+
+constexpr bool keywords_collide() {
+    for (const Keyword& k : keywords) {
+        if (keyword_table[keyword_hash(k.word)].word != k.word) return true;
+    }
+    return false;
+}
+static_assert(!keywords_collide(), "keyword_hash must give every keyword a slot of its own");
 
-Lexer::Lexer(const std::string& source) : source_(source), pos_(0), line_(1) {}
+} // namespace
+
+Lexer::Lexer(std::string_view source) : source_(source), pos_(0), line_(1) {}
 
 TokenInfo Lexer::readLongString() {
     int start_line = line_;
@@ -26,8 +71,9 @@ TokenInfo Lexer::readLongString() {
         advance();
     }
 
-    std::string value;
+    size_t start = pos_;
     while (pos_ < source_.size()) {
+        pos_ += luao::find_bracket_or_newline(source_.data() + pos_, source_.size() - pos_);
         if (peekChar() == ']') {
             size_t saved_pos = pos_;
             int saved_line = line_;
@@ -41,14 +87,13 @@ TokenInfo Lexer::readLongString() {
 
             if (peekChar() == ']' && close_level == level) {
                 advance(); // consume final ']'
-                return {Token::STRING, value, start_line};
+                return {Token::STRING, source_.substr(start, saved_pos - start), start_line};
             }
 
             pos_ = saved_pos;
             line_ = saved_line;
         }
 
-        value += peekChar();
         advance();
     }
 
@@ -67,7 +112,10 @@ TokenInfo Lexer::nextToken() {
 
     switch (current) {
         case '+': advance(); return {Token::PLUS, "+", line_};
-        case '-': advance(); return {Token::MINUS, "-", line_};
+        case '-':
+            advance();
+            if (peekChar() == '>') { advance(); return {Token::ARROW, "->", line_}; }
+            return {Token::MINUS, "-", line_};
         case '*': advance(); return {Token::MULTIPLY, "*", line_};
         case '/':
             advance();
@@ -113,6 +161,7 @@ TokenInfo Lexer::nextToken() {
             if (peekChar() == ':') { advance(); return {Token::COLON_DB, "::", line_}; }
             return {Token::COLON, ":", line_};
         case ',': advance(); return {Token::COMMA, ",", line_};
+        case '!': advance(); return {Token::BANG, "!", line_};
         case '.':
             advance();
             if (peekChar() == '.') {
@@ -163,7 +212,9 @@ void Lexer::skipWhitespace() {
     while (pos_ < source_.size()) {
         char c = source_[pos_];
         if (c == ' ' || c == '\t' || c == '\r' || c == '\n' || c == '\f' || c == '\v') {
-            advance();
+            size_t n = luao::span_whitespace(source_.data() + pos_, source_.size() - pos_);
+            line_ += static_cast<int>(luao::count_newlines(source_.data() + pos_, n));
+            pos_ += n;
         } else if (c == '-') {
             if (pos_ + 1 < source_.size() && source_[pos_ + 1] == '-') {
                 skipComment();
@@ -191,6 +242,7 @@ void Lexer::skipComment() {
             advance(); // [
             // Long comment
             while (pos_ < source_.size()) {
+                pos_ += luao::find_bracket_or_newline(source_.data() + pos_, source_.size() - pos_);
                 if (peekChar() == ']') {
                     advance();
                     int close_level = 0;
@@ -211,9 +263,8 @@ void Lexer::skipComment() {
     }
 
     // Short comment
-    while (pos_ < source_.size() && source_[pos_] != '\n') {
-        advance();
-    }
+    const void* eol = std::memchr(source_.data() + pos_, '\n', source_.size() - pos_);
+    pos_ = eol ? static_cast<const char*>(eol) - source_.data() : source_.size();
 }
 
 // This function is now unused, but I'll keep it for reference
@@ -236,56 +287,35 @@ void Lexer::skipLongComment() {
 }
 
 TokenInfo Lexer::readIdentifierOrKeyword() {
-    std::string value;
-    while (pos_ < source_.size() && (isAlpha(source_[pos_]) || isDigit(source_[pos_]) || source_[pos_] == '_')) {
-        value += source_[pos_];
-        advance();
+    size_t start = pos_;
+    pos_ += luao::span_identifier(source_.data() + pos_, source_.size() - pos_);
+    std::string_view value = source_.substr(start, pos_ - start);
+    if (value.size() >= 2 && value.size() <= 8) {
+        const Keyword& k = keyword_table[keyword_hash(value)];
+        if (k.word == value) return {k.token, k.word, line_};
     }
-    if (value == "and") return {Token::AND, value, line_};
-    if (value == "break") return {Token::BREAK, value, line_};
-    if (value == "do") return {Token::DO, value, line_};
-    if (value == "else") return {Token::ELSE, value, line_};
-    if (value == "elseif") return {Token::ELSEIF, value, line_};
-    if (value == "end") return {Token::END, value, line_};
-    if (value == "false") return {Token::FALSE, value, line_};
-    if (value == "for") return {Token::FOR, value, line_};
-    if (value == "function") return {Token::FUNCTION, value, line_};
-    if (value == "goto") return {Token::GOTO, value, line_};
-    if (value == "if") return {Token::IF, value, line_};
-    if (value == "in") return {Token::IN, value, line_};
-    if (value == "local") return {Token::LOCAL, value, line_};
-    if (value == "nil") return {Token::NIL, value, line_};
-    if (value == "not") return {Token::NOT, value, line_};
-    if (value == "or") return {Token::OR, value, line_};
-    if (value == "repeat") return {Token::REPEAT, value, line_};
-    if (value == "return") return {Token::RETURN, value, line_};
-    if (value == "then") return {Token::THEN, value, line_};
-    if (value == "true") return {Token::TRUE, value, line_};
-    if (value == "until") return {Token::UNTIL, value, line_};
-    if (value == "while") return {Token::WHILE, value, line_};
     return {Token::IDENTIFIER, value, line_};
 }
 
 TokenInfo Lexer::readNumber() {
-    std::string value;
+    size_t start = pos_;
     bool isFloat = false;
+    auto text = [&] { return std::string(source_.substr(start, pos_ - start)); };
 
     // Hexadecimal
     if (source_[pos_] == '0' && pos_ + 1 < source_.size() && 
         (source_[pos_ + 1] == 'x' || source_[pos_ + 1] == 'X')) {
-        value += source_[pos_++]; // '0'
-        value += source_[pos_++]; // 'x' or 'X'
+        pos_ += 2; // '0' and 'x' or 'X'
         
         if (pos_ >= source_.size() || !isHexDigit(source_[pos_])) {
-            throwError("malformed number near '" + value + "'");
+            throwError("malformed number near '" + text() + "'");
         }
         
         while (pos_ < source_.size() && isHexDigit(source_[pos_])) {
-            value += source_[pos_];
-            advance();
+            pos_++;
         }
         // TODO: Hex floats with 'p' or 'P'
-        return {Token::INT, value, line_};
+        return {Token::INT, source_.substr(start, pos_ - start), line_};
     }
     
     while (pos_ < source_.size() && (isDigit(source_[pos_]) || source_[pos_] == '.')) {
@@ -296,38 +326,42 @@ TokenInfo Lexer::readNumber() {
             }
             isFloat = true;
         }
-        value += source_[pos_];
-        advance();
+        pos_++;
     }
     if (pos_ < source_.size() && (source_[pos_] == 'e' || source_[pos_] == 'E')) {
         isFloat = true;
-        value += source_[pos_];
-        advance();
+        pos_++;
         
         if (pos_ < source_.size() && (source_[pos_] == '+' || source_[pos_] == '-')) {
-            value += source_[pos_];
-            advance();
+            pos_++;
         }
         
         if (pos_ >= source_.size() || !isDigit(source_[pos_])) {
-            throwError("malformed number near '" + value + "'");
+            throwError("malformed number near '" + text() + "'");
         }
         
         while (pos_ < source_.size() && isDigit(source_[pos_])) {
-            value += source_[pos_];
-            advance();
+            pos_++;
         }
     }
     
-    return {isFloat ? Token::FLOAT : Token::INT, value, line_};
+    return {isFloat ? Token::FLOAT : Token::INT, source_.substr(start, pos_ - start), line_};
 }
 
+// A string without escape sequences is a slice of the source; the first
+// backslash switches to decoding into a string of the lexer's own.
 TokenInfo Lexer::readString() {
-    std::string value;
     char delimiter = source_[pos_];
     advance(); // " or '
     int start_line = line_;
-    
+    size_t start = pos_;
+    pos_ += luao::find_string_stop(source_.data() + pos_, source_.size() - pos_, delimiter);
+    if (pos_ < source_.size() && source_[pos_] == delimiter) {
+        advance();
+        return {Token::STRING, source_.substr(start, pos_ - 1 - start), line_};
+    }
+
+    std::string value(source_.substr(start, pos_ - start));
     while (pos_ < source_.size() && source_[pos_] != delimiter) {
         if (source_[pos_] == '\n') {
             throwError("unfinished string near '" + std::string(1, delimiter) + "'");
@@ -406,7 +440,8 @@ TokenInfo Lexer::readString() {
     }
     
     advance();
-    return {Token::STRING, value, line_};
+    decoded_.push_back(std::move(value));
+    return {Token::STRING, decoded_.back(), line_};
 }
 
 void Lexer::throwError(const std::string& msg) {
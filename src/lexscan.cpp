@@ -0,0 +1,303 @@
+#include "lexscan.hpp"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define LUAO_SCAN_X86 1
+#include <immintrin.h>
+#endif
+
+namespace luao {
+
+namespace {
+
+struct ScanKernels {
+    size_t (*whitespace)(const char*, size_t);
+    size_t (*identifier)(const char*, size_t);
+    size_t (*bracket)(const char*, size_t);
+    size_t (*string_stop)(const char*, size_t, char);
+    size_t (*newlines)(const char*, size_t);
+};
+
+// --- scalar: the fallback, and the tail of every vector scan ---
+
+bool is_space(char c) {
+    return c == ' ' || (c >= '\t' && c <= '\r');
+}
+
+bool is_ident(char c) {
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || c == '_';
+}
+
+size_t whitespace_scalar(const char* p, size_t n) {
+    size_t i = 0;
+    while (i < n && is_space(p[i])) i++;
+    return i;
+}
+
+size_t identifier_scalar(const char* p, size_t n) {
+    size_t i = 0;
+    while (i < n && is_ident(p[i])) i++;
+    return i;
+}
+
+size_t bracket_scalar(const char* p, size_t n) {
+    size_t i = 0;
+    while (i < n && p[i] != ']' && p[i] != '\n') i++;
+    return i;
+}
+
+size_t string_stop_scalar(const char* p, size_t n, char quote) {
+    size_t i = 0;
+    while (i < n && p[i] != quote && p[i] != '\\' && p[i] != '\n') i++;
+    return i;
+}
+
+size_t newlines_scalar(const char* p, size_t n) {
+    size_t count = 0;
+    for (size_t i = 0; i < n; i++) count += p[i] == '\n';
+    return count;
+}
+
+constexpr ScanKernels scalar_kernels = {
+    whitespace_scalar, identifier_scalar, bracket_scalar, string_stop_scalar, newlines_scalar,
+};
+
+#ifdef LUAO_SCAN_X86
+
+// Each kernel builds a mask with one bit per byte that ends the run; a
+// byte is in [lo, lo + span] when (byte - lo) equals its unsigned minimum
+// with span.
+
+// --- SSE2, 16 bytes a step ---
+
+__attribute__((target("sse2"))) inline __m128i in_range16(__m128i v, char lo, char span) {
+    __m128i d = _mm_sub_epi8(v, _mm_set1_epi8(lo));
+    return _mm_cmpeq_epi8(_mm_min_epu8(d, _mm_set1_epi8(span)), d);
+}
+
+__attribute__((target("sse2"))) size_t whitespace_sse2(const char* p, size_t n) {
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p + i));
+        __m128i space = _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8(' ')), in_range16(v, '\t', 4));
+        unsigned stop = ~static_cast<unsigned>(_mm_movemask_epi8(space)) & 0xFFFF;
+        if (stop) return i + __builtin_ctz(stop);
+    }
+    return i + whitespace_scalar(p + i, n - i);
+}
+
+__attribute__((target("sse2"))) size_t identifier_sse2(const char* p, size_t n) {
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p + i));
+        __m128i lower = _mm_or_si128(v, _mm_set1_epi8(0x20));
+        __m128i ident = _mm_or_si128(_mm_or_si128(in_range16(lower, 'a', 25), in_range16(v, '0', 9)),
+                                     _mm_cmpeq_epi8(v, _mm_set1_epi8('_')));
+        unsigned stop = ~static_cast<unsigned>(_mm_movemask_epi8(ident)) & 0xFFFF;
+        if (stop) return i + __builtin_ctz(stop);
+    }
+    return i + identifier_scalar(p + i, n - i);
+}
+
+__attribute__((target("sse2"))) size_t bracket_sse2(const char* p, size_t n) {
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p + i));
+        __m128i hit = _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8(']')), _mm_cmpeq_epi8(v, _mm_set1_epi8('\n')));
+        unsigned stop = static_cast<unsigned>(_mm_movemask_epi8(hit));
+        if (stop) return i + __builtin_ctz(stop);
+    }
+    return i + bracket_scalar(p + i, n - i);
+}
+
+__attribute__((target("sse2"))) size_t string_stop_sse2(const char* p, size_t n, char quote) {
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p + i));
+        __m128i hit = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8(quote)),
+                                                _mm_cmpeq_epi8(v, _mm_set1_epi8('\\'))),
+                                   _mm_cmpeq_epi8(v, _mm_set1_epi8('\n')));
+        unsigned stop = static_cast<unsigned>(_mm_movemask_epi8(hit));
+        if (stop) return i + __builtin_ctz(stop);
+    }
+    return i + string_stop_scalar(p + i, n - i, quote);
+}
+
+__attribute__((target("sse2"))) size_t newlines_sse2(const char* p, size_t n) {
+    size_t i = 0;
+    size_t count = 0;
+    for (; i + 16 <= n; i += 16) {
+        __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p + i));
+        count += __builtin_popcount(static_cast<unsigned>(_mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_set1_epi8('\n')))));
+    }
+    return count + newlines_scalar(p + i, n - i);
+}
+
+constexpr ScanKernels sse2_kernels = {
+    whitespace_sse2, identifier_sse2, bracket_sse2, string_stop_sse2, newlines_sse2,
+};
+
+// --- AVX2, 32 bytes a step ---
+
+__attribute__((target("avx2"))) inline __m256i in_range32(__m256i v, char lo, char span) {
+    __m256i d = _mm256_sub_epi8(v, _mm256_set1_epi8(lo));
+    return _mm256_cmpeq_epi8(_mm256_min_epu8(d, _mm256_set1_epi8(span)), d);
+}
+
+__attribute__((target("avx2"))) size_t whitespace_avx2(const char* p, size_t n) {
+    size_t i = 0;
+    for (; i + 32 <= n; i += 32) {
+        __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p + i));
+        __m256i space = _mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8(' ')), in_range32(v, '\t', 4));
+        unsigned stop = ~static_cast<unsigned>(_mm256_movemask_epi8(space));
+        if (stop) return i + __builtin_ctz(stop);
+    }
+    return i + whitespace_sse2(p + i, n - i);
+}
+
+__attribute__((target("avx2"))) size_t identifier_avx2(const char* p, size_t n) {
+    size_t i = 0;
+    for (; i + 32 <= n; i += 32) {
+        __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p + i));
+        __m256i lower = _mm256_or_si256(v, _mm256_set1_epi8(0x20));
+        __m256i ident = _mm256_or_si256(_mm256_or_si256(in_range32(lower, 'a', 25), in_range32(v, '0', 9)),
+                                        _mm256_cmpeq_epi8(v, _mm256_set1_epi8('_')));
+        unsigned stop = ~static_cast<unsigned>(_mm256_movemask_epi8(ident));
+        if (stop) return i + __builtin_ctz(stop);
+    }
+    return i + identifier_sse2(p + i, n - i);
+}
+
+__attribute__((target("avx2"))) size_t bracket_avx2(const char* p, size_t n) {
+    size_t i = 0;
+    for (; i + 32 <= n; i += 32) {
+        __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p + i));
+        __m256i hit = _mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8(']')),
+                                      _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\n')));
+        unsigned stop = static_cast<unsigned>(_mm256_movemask_epi8(hit));
+        if (stop) return i + __builtin_ctz(stop);
+    }
+    return i + bracket_sse2(p + i, n - i);
+}
+
+__attribute__((target("avx2"))) size_t string_stop_avx2(const char* p, size_t n, char quote) {
+    size_t i = 0;
+    for (; i + 32 <= n; i += 32) {
+        __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p + i));
+        __m256i hit = _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8(quote)),
+                                                      _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\\'))),
+                                      _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\n')));
+        unsigned stop = static_cast<unsigned>(_mm256_movemask_epi8(hit));
+        if (stop) return i + __builtin_ctz(stop);
+    }
+    return i + string_stop_sse2(p + i, n - i, quote);
+}
+
+__attribute__((target("avx2"))) size_t newlines_avx2(const char* p, size_t n) {
+    size_t i = 0;
+    size_t count = 0;
+    for (; i + 32 <= n; i += 32) {
+        __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p + i));
+        count += __builtin_popcount(static_cast<unsigned>(_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, _mm256_set1_epi8('\n')))));
+    }
+    return count + newlines_sse2(p + i, n - i);
+}
+
+constexpr ScanKernels avx2_kernels = {
+    whitespace_avx2, identifier_avx2, bracket_avx2, string_stop_avx2, newlines_avx2,
+};
+
+#endif // LUAO_SCAN_X86
+
+bool supported(ScanIsa isa) {
+#ifdef LUAO_SCAN_X86
+    switch (isa) {
+        case ScanIsa::AVX2: return __builtin_cpu_supports("avx2");
+        case ScanIsa::SSE2: return __builtin_cpu_supports("sse2");
+        default: return true;
+    }
+#else
+    return isa == ScanIsa::SCALAR;
+#endif
+}
+
+const ScanKernels* kernels_for(ScanIsa isa) {
+#ifdef LUAO_SCAN_X86
+    if (isa == ScanIsa::AVX2) return &avx2_kernels;
+    if (isa == ScanIsa::SSE2) return &sse2_kernels;
+#endif
+    return &scalar_kernels;
+}
+
+ScanIsa best_isa() {
+    if (supported(ScanIsa::AVX2)) return ScanIsa::AVX2;
+    if (supported(ScanIsa::SSE2)) return ScanIsa::SSE2;
+    return ScanIsa::SCALAR;
+}
+
+ScanIsa active_isa = best_isa();
+const ScanKernels* active = kernels_for(active_isa);
+
+} // namespace
+
+// Most tokens and gaps are a few bytes long, shorter than one vector step:
+// the first SHORT_RUN bytes are looked at inline and only longer runs go
+// through the dispatched kernel.
+constexpr size_t SHORT_RUN = 16;
+
+size_t span_whitespace(const char* p, size_t n) {
+    size_t m = n < SHORT_RUN ? n : SHORT_RUN;
+    for (size_t i = 0; i < m; i++) {
+        if (!is_space(p[i])) return i;
+    }
+    return m == n ? n : m + active->whitespace(p + m, n - m);
+}
+
+size_t span_identifier(const char* p, size_t n) {
+    size_t m = n < SHORT_RUN ? n : SHORT_RUN;
+    for (size_t i = 0; i < m; i++) {
+        if (!is_ident(p[i])) return i;
+    }
+    return m == n ? n : m + active->identifier(p + m, n - m);
+}
+
+size_t find_bracket_or_newline(const char* p, size_t n) {
+    size_t m = n < SHORT_RUN ? n : SHORT_RUN;
+    for (size_t i = 0; i < m; i++) {
+        if (p[i] == ']' || p[i] == '\n') return i;
+    }
+    return m == n ? n : m + active->bracket(p + m, n - m);
+}
+
+size_t find_string_stop(const char* p, size_t n, char quote) {
+    size_t m = n < SHORT_RUN ? n : SHORT_RUN;
+    for (size_t i = 0; i < m; i++) {
+        if (p[i] == quote || p[i] == '\\' || p[i] == '\n') return i;
+    }
+    return m == n ? n : m + active->string_stop(p + m, n - m, quote);
+}
+
+size_t count_newlines(const char* p, size_t n) {
+    if (n < SHORT_RUN) return newlines_scalar(p, n);
+    return active->newlines(p, n);
+}
+
+ScanIsa scan_isa() {
+    return active_isa;
+}
+
+bool set_scan_isa(ScanIsa isa) {
+    if (!supported(isa)) return false;
+    active_isa = isa;
+    active = kernels_for(isa);
+    return true;
+}
+
+const char* scan_isa_name(ScanIsa isa) {
+    switch (isa) {
+        case ScanIsa::AVX2: return "avx2";
+        case ScanIsa::SSE2: return "sse2";
+        default: return "scalar";
+    }
+}
+
+} // namespace luao
@@ -7,7 +7,24 @@
 #include <function.hpp>
 #include <closure.hpp>
 #include <table.hpp>
+#include <class.hpp>
+#include <libs.hpp>
+#include <bytecode.hpp>
+#include <parser.hpp>
+#include <snapshot.hpp>
+#include <cache.hpp>
+#include <chunk.hpp>
+#include <isolate.hpp>
+#include <lexscan.hpp>
 #include <memory>
+#include <map>
+#include <algorithm>
+#include <filesystem>
+#include <fstream>
+#include <sstream>
+#include <cstring>
+#include <cstdlib>
+#include <chrono>
 
 using namespace luao;
 
@@ -18,6 +35,8 @@ VM vm;
                         | (static_cast<Instruction>(b) << 16) \
                         | (static_cast<Instruction>(c) << 24))
 
+#define CREATE_ABCk(o, a, b, c) (CREATE_ABC(o, a, b, c) | (static_cast<Instruction>(1) << 15))
+
 #define CREATE_ABx(o, a, bx)    ((static_cast<Instruction>(o) << 0) \
                         | (static_cast<Instruction>(a) << 7) \
                         | (static_cast<Instruction>(bx) << 15))
@@ -26,6 +45,29 @@ VM vm;
 #define CREATE_A(o, a)  ((static_cast<Instruction>(o) << 0) \
                         | (static_cast<Instruction>(a) << 7))
 
+// first result of the main chunk, left in the main function's slot
+static std::shared_ptr<LuaValue> main_result() {
+    return vm.get_stack_mutable()[1];
+}
+
+static std::shared_ptr<LuaFunction> compile_source(const std::string& source, const std::string& chunkname, int optlevel = 1,
+                                                   bool inline_globals = false) {
+    Parser parser(source);
+    auto ast = parser.parse();
+    return BytecodeGenerator(optlevel, inline_globals).generate(*ast, chunkname);
+}
+
+static void run_function(const std::shared_ptr<LuaFunction>& main) {
+    vm = VM();
+    vm.load(std::make_shared<LuaClosure>(main));
+    vm.run();
+}
+
+// compiles `source` and runs it as the main chunk
+static void run_source(const std::string& source, const std::string& chunkname, int optlevel = 1) {
+    run_function(compile_source(source, chunkname, optlevel));
+}
+
 void test_cfunction_call() {
     std::cout << "--- Testing CFunction call ---" << std::endl;
     UpvalDesc _ENV; _ENV.name = "_ENV"; _ENV.inStack = true; _ENV.idx = 0;
@@ -55,7 +97,7 @@ void test_cfunction_call() {
     vm.load(main_closure);
     vm.set_trace(true);
     vm.run();
-    auto result = vm.get_stack_mutable()[0];
+    auto result = main_result();
     assert(result.get()->getType() == LuaType::STRING);
     std::cout << "Result: " << result.get()->getObject()->toString() << std::endl;
 }
@@ -72,7 +114,7 @@ void test_metamethod() {
 
     std::shared_ptr<LuaTable> a = std::make_shared<LuaTable>(); 
     std::shared_ptr<LuaTable> a_mt = std::make_shared<LuaTable>();
-    a_mt->set(mm::__add, LuaValue(__add, LuaType::FUNCTION));
+    a_mt->set(tm_name(TM_ADD), LuaValue(__add, LuaType::FUNCTION));
     a->setMetatable(a_mt);
 
     std::vector<Instruction> bytecode = {
@@ -91,10 +133,38 @@ void test_metamethod() {
     vm.load(main_closure);
     vm.set_trace(true);
     vm.run();
-    auto result = vm.get_stack_mutable()[0];
+    auto result = main_result();
     assert(result.get()->getType() == LuaType::NUMBER
         && std::dynamic_pointer_cast<LuaInteger>(result.get()->getObject())->getValue() == 10);
+
+    // absence is cached per event and forgotten when the metatable changes
+    assert(!a->hasMetamethod(TM_SUB) && a_mt->isTMAbsent(TM_SUB) && !a_mt->isTMAbsent(TM_ADD));
+    a_mt->set(tm_name(TM_SUB), LuaValue(__add, LuaType::FUNCTION));
+    assert(!a_mt->isTMAbsent(TM_SUB) && a->hasMetamethod(TM_SUB));
     std::cout << "Result: " << result.get()->getObject()->toString() << std::endl;
+
+    // a nil right operand reaches __add as nil, not as a copy of the left one
+    std::shared_ptr<LuaNativeFunction> __add_nil = std::make_shared<LuaNativeFunction>([](VM& vm, int base_reg, int num_args) -> int {
+        auto& stack = vm.get_stack_mutable();
+        bool rhs_nil = num_args == 2 && stack[base_reg + 1]->getType() == LuaType::NIL;
+        *stack[base_reg] = LuaValue(std::make_shared<LuaInteger>(rhs_nil ? 1 : 0), LuaType::NUMBER);
+        return 1;
+    });
+    a_mt->set(tm_name(TM_ADD), LuaValue(__add_nil, LuaType::FUNCTION));
+
+    std::vector<Instruction> bytecode_nil = {
+        CREATE_ABx(OpCode::LOADK, 0, 0),      /* R0 = K0 (table a) */
+        CREATE_ABC(OpCode::LOADNIL, 1, 0, 0), /* R1 = nil */
+        CREATE_ABC(OpCode::ADD, 2, 0, 1),     /* R2 = a + nil */
+        CREATE_A(OpCode::RETURN1, 2),         /* return R2 */
+    };
+    std::shared_ptr<LuaFunction> nil_func = std::make_shared<LuaFunction>(bytecode_nil, constants, std::vector<LuaValue>{}, std::vector<UpvalDesc>{_ENV}, std::vector<LocalVarinfo>{});
+    vm = VM();
+    vm.load(std::make_shared<LuaClosure>(nil_func));
+    vm.run();
+    result = main_result();
+    assert(result.get()->getType() == LuaType::NUMBER
+        && std::dynamic_pointer_cast<LuaInteger>(result.get()->getObject())->getValue() == 1);
 }
 
 void test_stack_overflow() {
@@ -233,14 +303,1152 @@ void test_baselib() {
     //dump_critical_error(vm, "test");
 }
 
+void test_tablelib() {
+    std::cout << "--- Testing Table Library ---" << std::endl;
+    UpvalDesc _ENV; _ENV.name = "_ENV"; _ENV.inStack = true; _ENV.idx = 0;
+
+    auto str = [](const char* s) { return LuaValue(std::make_shared<LuaString>(s), LuaType::STRING); };
+    auto tablelib = std::dynamic_pointer_cast<LuaTable>(opentablelib().getObject());
+
+    std::shared_ptr<LuaTable> list = std::make_shared<LuaTable>();
+    int values[] = {5, 3, 9, 1, 7};
+    for (int i = 0; i < 5; i++) {
+        list->set(i + 1, LuaValue(std::make_shared<LuaInteger>(values[i]), LuaType::NUMBER));
+    }
+
+    std::vector<Instruction> bytecode = {
+        CREATE_ABx(OpCode::LOADK, 1, 0),      /* R1 = table.sort */
+        CREATE_ABx(OpCode::LOADK, 2, 1),      /* R2 = list */
+        CREATE_ABC(OpCode::CALL, 1, 2, 1),    /* table.sort(list) */
+        CREATE_ABx(OpCode::LOADK, 1, 2),      /* R1 = table.remove */
+        CREATE_ABx(OpCode::LOADK, 2, 1),      /* R2 = list */
+        CREATE_ABx(OpCode::LOADI, 3, CREATE_sBx(2)), /* R3 = 2 */
+        CREATE_ABC(OpCode::CALL, 1, 3, 1),    /* table.remove(list, 2) */
+        CREATE_ABx(OpCode::LOADK, 1, 3),      /* R1 = table.concat */
+        CREATE_ABx(OpCode::LOADK, 2, 1),      /* R2 = list */
+        CREATE_ABx(OpCode::LOADK, 3, 4),      /* R3 = "," */
+        CREATE_ABC(OpCode::CALL, 1, 3, 2),    /* R1 = table.concat(list, ",") */
+        CREATE_A(OpCode::RETURN1, 1),         /* return R1 */
+    };
+
+    std::vector<LuaValue> constants = {
+        tablelib->get(str("sort")),
+        LuaValue(list, LuaType::TABLE),
+        tablelib->get(str("remove")),
+        tablelib->get(str("concat")),
+        str(","),
+    };
+
+    std::shared_ptr<LuaFunction> main_func = std::make_shared<LuaFunction>(bytecode, constants, std::vector<LuaValue>{}, std::vector<UpvalDesc>{_ENV}, std::vector<LocalVarinfo>{});
+    std::shared_ptr<LuaClosure> main_closure = std::make_shared<LuaClosure>(main_func);
+    vm = VM();
+    vm.load(main_closure);
+    vm.set_trace(true);
+    vm.run();
+    auto result = main_result();
+    assert(result.get()->getType() == LuaType::STRING
+        && result.get()->getObject()->toString() == "1,5,7,9");
+    std::cout << "Result: " << result.get()->getObject()->toString() << std::endl;
+
+    // a full hash part grows instead of retrying the insert forever
+    auto fields = std::make_shared<LuaTable>();
+    for (int i = 0; i < 100; i++) {
+        fields->set(str(("k" + std::to_string(i)).c_str()), LuaValue(std::make_shared<LuaInteger>(i), LuaType::NUMBER));
+    }
+    for (int i = 0; i < 100; i++) {
+        assert(fields->get(str(("k" + std::to_string(i)).c_str())).getObject()->toString() == std::to_string(i));
+    }
+
+    // integer keys filled backwards end up in the array part; sparse ones stay in the hash part
+    auto num = [](long long n) { return LuaValue(std::make_shared<LuaInteger>(n), LuaType::NUMBER); };
+    auto reversed = std::make_shared<LuaTable>();
+    for (int i = 20; i >= 1; i--) reversed->set(num(i), num(i));
+    assert(reversed->ilen() == 20 && reversed->getArray().size() >= 16);
+    auto sparse = std::make_shared<LuaTable>();
+    for (int i = 1; i <= 100000; i++) sparse->set(num(i * 2LL), num(i));
+    for (int i = 1; i <= 100000; i++) {
+        assert(sparse->get(num(i * 2LL)).getObject()->toString() == std::to_string(i));
+        assert(sparse->get(num(i * 2LL - 1)).getType() == LuaType::NIL);
+    }
+    // with t[1] set every even key is a border, and # finds one of them
+    sparse->set(num(1), num(0));
+    int border = sparse->ilen();
+    assert(border >= 2 && border % 2 == 0 && border <= 200000);
+    for (int i = 20; i <= 30; i++) reversed->set(num(i + 1), num(i + 1));
+    assert(reversed->ilen() == 31);
+}
+
+void test_class_instance() {
+    std::cout << "--- Testing Class Instance Shapes ---" << std::endl;
+    UpvalDesc _ENV; _ENV.name = "_ENV"; _ENV.inStack = true; _ENV.idx = 0;
+
+    auto str = [](const char* s) { return LuaValue(std::make_shared<LuaString>(s), LuaType::STRING); };
+
+    std::shared_ptr<LuaClass> vec = std::make_shared<LuaClass>("Vec");
+    vec->declareField("x");
+    vec->declareField("y");
+    std::shared_ptr<LuaInstance> a = vec->newInstance();
+    std::shared_ptr<LuaInstance> b = vec->newInstance();
+
+    std::vector<Instruction> bytecode = {
+        CREATE_ABx(OpCode::LOADK, 1, 0),          /* R1 = a */
+        CREATE_ABx(OpCode::LOADK, 2, 1),          /* R2 = b */
+        CREATE_ABx(OpCode::LOADI, 3, CREATE_sBx(1)),
+        CREATE_ABx(OpCode::LOADI, 4, CREATE_sBx(4)),
+        CREATE_ABC(OpCode::SETFIELD, 1, 2, 3),    /* a.x = 1 (declared slot) */
+        CREATE_ABC(OpCode::SETFIELD, 1, 3, 4),    /* a.z = 4 (shape transition) */
+        CREATE_ABC(OpCode::SETFIELD, 2, 3, 4),    /* b.z = 4 (same transition) */
+        CREATE_ABC(OpCode::GETFIELD, 5, 1, 2),    /* R5 = a.x */
+        CREATE_ABC(OpCode::GETFIELD, 6, 2, 3),    /* R6 = b.z */
+        CREATE_ABC(OpCode::ADD, 5, 5, 6),
+        CREATE_A(OpCode::RETURN1, 5),             /* return a.x + b.z */
+    };
+
+    std::vector<LuaValue> constants = {
+        LuaValue(a, LuaType::INSTANCE),
+        LuaValue(b, LuaType::INSTANCE),
+        str("x"),
+        str("z"),
+    };
+
+    std::shared_ptr<LuaFunction> main_func = std::make_shared<LuaFunction>(bytecode, constants, std::vector<LuaValue>{}, std::vector<UpvalDesc>{_ENV}, std::vector<LocalVarinfo>{});
+    std::shared_ptr<LuaClosure> main_closure = std::make_shared<LuaClosure>(main_func);
+    vm = VM();
+    vm.load(main_closure);
+    vm.set_trace(true);
+    vm.run();
+    auto result = main_result();
+    assert(result.get()->getType() == LuaType::NUMBER
+        && std::dynamic_pointer_cast<LuaInteger>(result.get()->getObject())->getValue() == 5);
+    assert(a->getShape() == b->getShape() && a->getShape()->lookup("z") == 2);
+    std::cout << "Result: " << result.get()->getObject()->toString() << std::endl;
+}
+
+void test_class_methods() {
+    std::cout << "--- Testing Class Method Dispatch ---" << std::endl;
+    UpvalDesc _ENV; _ENV.name = "_ENV"; _ENV.inStack = true; _ENV.idx = 0;
+
+    auto str = [](const char* s) { return LuaValue(std::make_shared<LuaString>(s), LuaType::STRING); };
+    auto method = [](long long n) {
+        return LuaValue(std::make_shared<LuaNativeFunction>([n](VM& vm, int base_reg, int num_args) -> int {
+            auto& st = vm.get_stack_mutable();
+            assert(num_args == 1 && st[base_reg]->getType() == LuaType::INSTANCE);
+            *st[base_reg] = LuaValue(std::make_shared<LuaInteger>(n), LuaType::NUMBER);
+            return 1;
+        }), LuaType::FUNCTION);
+    };
+
+    // class Animal<virtual>    function speak<virtual>()
+    // class IPet<interface>    function name<virtual>()
+    // class Dog : Animal       function speak<impl>() return 1
+    // class Cat : Animal, IPet function speak<impl>() return 2, function name<impl>() return 10
+    std::shared_ptr<LuaClass> animal = std::make_shared<LuaClass>("Animal");
+    animal->setAbstract(true);
+    animal->defineMethod("speak", LuaValue(), MethodKind::VIRTUAL);
+    std::shared_ptr<LuaClass> pet = std::make_shared<LuaClass>("IPet");
+    pet->setInterface(true);
+    pet->defineMethod("name", LuaValue(), MethodKind::VIRTUAL);
+    std::shared_ptr<LuaClass> dog = std::make_shared<LuaClass>("Dog", animal);
+    dog->defineMethod("speak", method(1), MethodKind::IMPL);
+    std::shared_ptr<LuaClass> cat = std::make_shared<LuaClass>("Cat", animal);
+    cat->addInterface(pet);
+    cat->defineMethod("speak", method(2), MethodKind::IMPL);
+    cat->defineMethod("name", method(10), MethodKind::IMPL);
+
+    bool rejected = false;
+    try { animal->newInstance(); } catch (const LuaError&) { rejected = true; }
+    assert(rejected);
+
+    std::vector<Instruction> bytecode = {
+        CREATE_ABx(OpCode::LOADK, 1, 0),          /* R1 = dog */
+        CREATE_ABx(OpCode::LOADK, 2, 1),          /* R2 = cat */
+        CREATE_ABCk(OpCode::SELF, 3, 1, 2),       /* R3 = dog:speak() */
+        CREATE_ABC(OpCode::CALL, 3, 2, 2),
+        CREATE_ABCk(OpCode::SELF, 4, 2, 2),       /* R4 = cat:speak() */
+        CREATE_ABC(OpCode::CALL, 4, 2, 2),
+        CREATE_ABCk(OpCode::SELF, 5, 2, 3),       /* R5 = cat:name() */
+        CREATE_ABC(OpCode::CALL, 5, 2, 2),
+        CREATE_ABC(OpCode::ADD, 3, 3, 4),
+        CREATE_ABC(OpCode::ADD, 3, 3, 5),
+        CREATE_A(OpCode::RETURN1, 3),             /* return 1 + 2 + 10 */
+    };
+
+    std::vector<LuaValue> constants = {
+        LuaValue(dog->newInstance(), LuaType::INSTANCE),
+        LuaValue(cat->newInstance(), LuaType::INSTANCE),
+        str("speak"),
+        str("name"),
+    };
+
+    std::shared_ptr<LuaFunction> main_func = std::make_shared<LuaFunction>(bytecode, constants, std::vector<LuaValue>{}, std::vector<UpvalDesc>{_ENV}, std::vector<LocalVarinfo>{});
+    std::shared_ptr<LuaClosure> main_closure = std::make_shared<LuaClosure>(main_func);
+    vm = VM();
+    vm.load(main_closure);
+    vm.set_trace(true);
+    vm.run();
+    auto result = main_result();
+    assert(result.get()->getType() == LuaType::NUMBER
+        && std::dynamic_pointer_cast<LuaInteger>(result.get()->getObject())->getValue() == 13);
+    assert(dog->getMethodSlot("speak") == cat->getMethodSlot("speak"));
+    std::cout << "Result: " << result.get()->getObject()->toString() << std::endl;
+
+    // a field set on the instance shadows the method for `:` as for `.`,
+    // even at a SELF whose cache already holds the method
+    auto rex = dog->newInstance();
+    std::vector<Instruction> shadowed = {
+        CREATE_ABx(OpCode::LOADK, 1, 0),          /* R1 = rex */
+        CREATE_ABCk(OpCode::SELF, 2, 1, 1),       /* R2 = rex:speak() */
+        CREATE_ABC(OpCode::CALL, 2, 2, 2),
+        CREATE_ABC(OpCode::GETFIELD, 3, 1, 1),    /* R3 = rex.speak(rex) */
+        CREATE_ABC(OpCode::MOVE, 4, 1, 0),
+        CREATE_ABC(OpCode::CALL, 3, 2, 2),
+        CREATE_ABC(OpCode::ADD, 2, 2, 3),
+        CREATE_A(OpCode::RETURN1, 2),             /* return R2 + R3 */
+    };
+    auto shadow_closure = std::make_shared<LuaClosure>(std::make_shared<LuaFunction>(
+        shadowed, std::vector<LuaValue>{LuaValue(rex, LuaType::INSTANCE), str("speak")},
+        std::vector<LuaValue>{}, std::vector<UpvalDesc>{_ENV}, std::vector<LocalVarinfo>{}));
+    for (long long expected : {2, 200}) {
+        if (expected == 200) rex->setField("speak", method(100));
+        vm = VM();
+        vm.load(shadow_closure);
+        vm.run();
+        assert(std::dynamic_pointer_cast<LuaInteger>(main_result()->getObject())->getValue() == expected);
+    }
+}
+
+void test_class_operators() {
+    std::cout << "--- Testing Class Operators ---" << std::endl;
+    UpvalDesc _ENV; _ENV.name = "_ENV"; _ENV.inStack = true; _ENV.idx = 0;
+
+    auto str = [](const char* s) { return LuaValue(std::make_shared<LuaString>(s), LuaType::STRING); };
+    auto lua_function = [](std::vector<Instruction> code, std::vector<LuaValue> k, int numparams) {
+        auto proto = std::make_shared<LuaFunction>(code, k, std::vector<LuaValue>{}, std::vector<UpvalDesc>{}, std::vector<LocalVarinfo>{});
+        proto->setNumParams(numparams);
+        return LuaValue(std::make_shared<LuaClosure>(proto), LuaType::FUNCTION);
+    };
+
+    // object Vec3
+    //     function $init(x, y)        self.x = x; self.y = y end
+    //     function __add<meta>(a, b)  return Vec3(a.x + b.x, a.y + b.y) end
+    std::shared_ptr<LuaClass> vec3 = std::make_shared<LuaClass>("Vec3");
+    vec3->declareField("x");
+    vec3->declareField("y");
+    vec3->defineMethod("$init", lua_function({
+        CREATE_ABC(OpCode::SETFIELD, 0, 0, 1),    /* self.x = x */
+        CREATE_ABC(OpCode::SETFIELD, 0, 1, 2),    /* self.y = y */
+        CREATE_A(OpCode::RETURN0, 0),
+    }, {str("x"), str("y")}, 3));
+    vec3->defineMethod("__add", lua_function({
+        CREATE_ABx(OpCode::LOADK, 2, 0),          /* R2 = Vec3 */
+        CREATE_ABC(OpCode::GETFIELD, 3, 0, 1),
+        CREATE_ABC(OpCode::GETFIELD, 5, 1, 1),
+        CREATE_ABC(OpCode::ADD, 3, 3, 5),         /* R3 = a.x + b.x */
+        CREATE_ABC(OpCode::GETFIELD, 4, 0, 2),
+        CREATE_ABC(OpCode::GETFIELD, 5, 1, 2),
+        CREATE_ABC(OpCode::ADD, 4, 4, 5),         /* R4 = a.y + b.y */
+        CREATE_ABC(OpCode::CALL, 2, 3, 2),        /* R2 = Vec3(R3, R4) */
+        CREATE_A(OpCode::RETURN1, 2),
+    }, {LuaValue(vec3, LuaType::OBJECT), str("x"), str("y")}, 2), MethodKind::META);
+
+    std::vector<Instruction> bytecode = {
+        CREATE_ABx(OpCode::LOADK, 0, 0),
+        CREATE_ABx(OpCode::LOADI, 1, CREATE_sBx(1)),
+        CREATE_ABx(OpCode::LOADI, 2, CREATE_sBx(2)),
+        CREATE_ABC(OpCode::CALL, 0, 3, 2),        /* R0 = Vec3(1, 2) */
+        CREATE_ABx(OpCode::LOADK, 1, 0),
+        CREATE_ABx(OpCode::LOADI, 2, CREATE_sBx(10)),
+        CREATE_ABx(OpCode::LOADI, 3, CREATE_sBx(20)),
+        CREATE_ABC(OpCode::CALL, 1, 3, 2),        /* R1 = Vec3(10, 20) */
+        CREATE_ABC(OpCode::ADD, 2, 0, 1),         /* R2 = R0 + R1 (Lua __add) */
+        CREATE_ABC(OpCode::GETFIELD, 3, 2, 1),    /* R3 = R2.y */
+        CREATE_A(OpCode::RETURN1, 3),
+    };
+
+    std::vector<LuaValue> constants = {
+        LuaValue(vec3, LuaType::OBJECT),
+        str("y"),
+    };
+
+    std::shared_ptr<LuaFunction> main_func = std::make_shared<LuaFunction>(bytecode, constants, std::vector<LuaValue>{}, std::vector<UpvalDesc>{_ENV}, std::vector<LocalVarinfo>{});
+    std::shared_ptr<LuaClosure> main_closure = std::make_shared<LuaClosure>(main_func);
+    vm = VM();
+    vm.load(main_closure);
+    vm.set_trace(true);
+    vm.run();
+    auto result = main_result();
+    assert(result.get()->getType() == LuaType::NUMBER
+        && std::dynamic_pointer_cast<LuaInteger>(result.get()->getObject())->getValue() == 22);
+    assert(vm.get_call_stack().empty());
+    std::cout << "Result: " << result.get()->getObject()->toString() << std::endl;
+}
+
+void test_lexer() {
+    std::cout << "--- Testing Lexer ---" << std::endl;
+    std::string source = "local elseif_ = 'plain' .. \"tab\\there\" -- comment\nwhile x2 >= 0x1F do end";
+    Lexer lexer(source);
+    std::vector<TokenInfo> tokens;
+    for (TokenInfo t = lexer.nextToken(); t.type != Token::EOS; t = lexer.nextToken()) tokens.push_back(t);
+    auto in_source = [&](std::string_view v) {
+        return v.data() >= source.data() && v.data() + v.size() <= source.data() + source.size();
+    };
+    assert(tokens.size() == 12);
+    assert(tokens[0].type == Token::LOCAL);
+    assert(tokens[1].type == Token::IDENTIFIER && tokens[1].value == "elseif_" && in_source(tokens[1].value));
+    assert(tokens[3].type == Token::STRING && tokens[3].value == "plain" && in_source(tokens[3].value));
+    // only the string with an escape is copied
+    assert(tokens[5].type == Token::STRING && tokens[5].value == "tab\there" && !in_source(tokens[5].value));
+    assert(tokens[6].type == Token::WHILE && tokens[6].line == 2);
+    assert(tokens[9].type == Token::INT && tokens[9].value == "0x1F" && in_source(tokens[9].value));
+    assert(tokens[11].type == Token::END);
+}
+
+void test_parser() {
+    std::cout << "--- Testing Parser ---" << std::endl;
+    std::string source = "local t: !int = f(1, 'a')\nfor i = 1, 2 do t.x = -i end";
+    Parser parser(source);
+    Block* chunk = parser.parse();
+    assert(chunk->statements_.size() == 2 && parser.arena().bytesUsed() > 0);
+    auto local = ast_cast<LocalStatement>(chunk->statements_[0]);
+    assert(local && local->names_[0]->name_ == "t" && local->names_[0]->type_ == "!int");
+    auto call = ast_cast<FunctionCall>(local->values_[0]);
+    assert(call && call->args_.size() == 2 && call->args_[1]->kind_ == NodeKind::StringLiteral);
+    assert(!ast_cast<ExprStatement>(chunk->statements_[1]));
+    auto loop = ast_cast<NumericForStatement>(chunk->statements_[1]);
+    assert(loop && loop->step_ == nullptr && loop->body_->statements_[0]->line_ == 2);
+}
+
+void test_compiler() {
+    std::cout << "--- Testing Compiler ---" << std::endl;
+    run_source(R"(
+        local sum = 0
+        for i = 1, 10 do
+            if i % 2 == 0 then sum = sum + i elseif i > 8 then sum = sum + 100 end
+        end                                             -- sum = 130
+        local n = 0
+        while n < 5 do n = n + 1 end                    -- n = 5
+        repeat n = n - 2 until n < 0                    -- n = -1
+
+        local function counter()
+            local c = 0
+            return function() c = c + 1; return c end
+        end
+        local next_id = counter()
+        next_id(); next_id()
+
+        local t = {10, 20, 30, x = 1, ["y"] = 2}
+        function t:total(...)
+            local s = self.x + self.y
+            local args = {...}
+            for i = 1, #args do s = s + args[i] end
+            return s
+        end
+
+        local function range(limit)
+            local i = 0
+            return function() i = i + 1; if i <= limit then return i end end
+        end
+        local acc = 0
+        for v in range(4) do acc = acc + v end          -- acc = 10
+
+        local a, b = 1, 2
+        a, b = b, a
+        local s = "a" .. 1 .. "b"
+        do
+            local k = 0
+            ::top::
+            k = k + 1
+            if k < 3 then goto top end
+            acc = acc + k                               -- acc = 13
+        end
+        local flag = not nil and (a > b) or false
+
+        return sum + n + next_id() + t:total(4, 5) + #t + acc + a * 10 + #s + (flag and 1000 or 0) + (7 // 2) + (1 << 4)
+    )", "test");
+    // 130 - 1 + 3 + 12 + 3 + 13 + 20 + 3 + 1000 + 3 + 16
+    auto result = main_result();
+    assert(result->getType() == LuaType::NUMBER
+        && std::dynamic_pointer_cast<LuaInteger>(result->getObject())->getValue() == 1202);
+    assert(vm.get_call_stack().empty());
+    std::cout << "Result: " << result->getObject()->toString() << std::endl;
+}
+
+void test_constant_folding() {
+    std::cout << "--- Testing Constant Folding ---" << std::endl;
+    Parser parser(R"(
+        local scale <const> = 4
+        local x = 3
+        return (2 * 3 + scale) * 10 // 3, "v" .. 1 .. "." .. scale, x * (1 << 4), 7 // 0 == nil
+    )");
+    auto ast = parser.parse();
+    auto proto = BytecodeGenerator().generate(*ast, "fold");
+    int arith = 0;
+    for (Instruction i : proto->getBytecode()) {
+        OpCode op = GET_OPCODE(i);
+        if ((op >= OpCode::ADDI && op <= OpCode::SHR) || op == OpCode::CONCAT) arith++;
+    }
+    // only x * 16 (MULK) and the division by zero (IDIVK) are left
+    assert(arith == 2);
+    assert(proto->getConstants().size() == 4); // "v1.4", 16, 0, nil
+}
+
+// instructions in `proto` and all of its nested functions
+static size_t count_instructions(const std::shared_ptr<LuaFunction>& proto) {
+    size_t n = proto->getBytecode().size();
+    for (const auto& p : proto->getProtos()) {
+        n += count_instructions(std::static_pointer_cast<LuaFunction>(p.getObject()));
+    }
+    return n;
+}
+
+void test_peephole() {
+    std::cout << "--- Testing Peephole Optimizer ---" << std::endl;
+    const char* source = R"(
+        local function sign(x)
+            if x < 0 then return -1 elseif x > 0 then return 1 else return 0 end
+        end
+        local function pick(a, b)
+            if not a then return 3 end
+            local r
+            if b then r = 1 else r = 2 end
+            return r
+        end
+        local function call(f, ...) return f(...) end
+        local t = 0
+        for i = 1, 4 do
+            while true do
+                if i > 2 then break end
+                t = t + i
+                break
+            end
+        end
+        return sign(-5) + sign(7) * 10 + pick(true, false) * 100 + call(pick, false) * 1000 + t * 10000
+    )";
+    Parser parser(source);
+    auto ast = parser.parse();
+    size_t plain = count_instructions(BytecodeGenerator(0).generate(*ast, "peephole"));
+    size_t optimized = count_instructions(BytecodeGenerator(1).generate(*ast, "peephole"));
+    // dead returns after `return`, the jumps over else branches that end
+    // in `return`, and the jump left behind each `break`
+    assert(optimized < plain);
+
+    for (int level = 0; level <= 1; level++) {
+        run_source(source, "peephole", level);
+        auto result = main_result();
+        assert(result->getType() == LuaType::NUMBER);
+        assert(std::static_pointer_cast<LuaInteger>(result->getObject())->getValue() == 33209);
+    }
+}
+
+// true when `op` occurs in `proto` or one of its nested functions
+static bool has_opcode(const std::shared_ptr<LuaFunction>& proto, OpCode op) {
+    for (Instruction i : proto->getBytecode()) {
+        if (GET_OPCODE(i) == op) return true;
+    }
+    for (const auto& p : proto->getProtos()) {
+        if (has_opcode(std::static_pointer_cast<LuaFunction>(p.getObject()), op)) return true;
+    }
+    return false;
+}
+
+void test_typed_code() {
+    std::cout << "--- Testing Typed Code ---" << std::endl;
+    const char* source = R"(
+        local function fib(n: int) -> int
+            if n < 2 then return n end
+            return fib(n - 1) + fib(n - 2)
+        end
+        local function max(a: int, b: int) -> int
+            if a < b then return b end
+            return a
+        end
+        local function scale(x: float, f: float) -> float
+            return x * f
+        end
+        local p = {x = 1}
+        p.x = p.x + 1
+        local s: int = 0
+        for i = 1, 10 do s = s + i end
+        return fib(15) + max(s, 3) + p.x + scale(2, 0.5)
+    )";
+    Parser parser(source);
+    auto ast = parser.parse();
+    auto proto = BytecodeGenerator().generate(*ast, "typed");
+    assert(has_opcode(proto, OpCode::ADDINT));
+    assert(has_opcode(proto, OpCode::LTINT));
+    assert(has_opcode(proto, OpCode::MULFLT));
+    assert(has_opcode(proto, OpCode::GETFIELDT));
+    assert(has_opcode(proto, OpCode::CHECKTYPE)); // typed parameters are guarded on entry
+
+    run_source(source, "typed");
+    auto result = main_result();
+    assert(result->getType() == LuaType::NUMBER);
+    assert(std::static_pointer_cast<LuaNumber>(result->getObject())->getValue() == 610 + 55 + 2 + 1.0);
+
+    // proven mismatches are compile errors
+    bool rejected = false;
+    try {
+        Parser bad("local n: int = 'ten'");
+        auto bad_ast = bad.parse();
+        BytecodeGenerator().generate(*bad_ast, "typed");
+    } catch (const std::runtime_error&) {
+        rejected = true;
+    }
+    assert(rejected);
+
+    // unproven values are checked when they reach a typed variable
+    bool guarded = false;
+    try {
+        run_source("local function id(v) return v end local n: int = id('ten')", "typed");
+    } catch (const LuaError&) {
+        guarded = true;
+    }
+    assert(guarded);
+}
+
+// CALL instructions in `proto` and all of its nested functions
+static int count_calls(const std::shared_ptr<LuaFunction>& proto) {
+    int n = 0;
+    for (Instruction i : proto->getBytecode()) {
+        if (GET_OPCODE(i) == OpCode::CALL) n++;
+    }
+    for (const auto& p : proto->getProtos()) {
+        n += count_calls(std::static_pointer_cast<LuaFunction>(p.getObject()));
+    }
+    return n;
+}
+
+void test_inlining() {
+    std::cout << "--- Testing Inlining ---" << std::endl;
+    const char* source = R"(
+        local count = 0
+        local function bump(n) count = count + (n or 1) end
+        local function get(t) return t.x end
+        local function sq(v) return v * v end
+        function gcube(v) return sq(v) * v end
+        local x = 1
+        local function fx() return x end
+        local x = 2 -- fx still sees the first x
+        local t = {x = 3}
+        local s = 0
+        for i = 1, 10 do
+            bump()
+            s = s + get(t) + sq(i) + gcube(i)
+        end
+        return s + count * 1000 + fx() * 100000 + x * 1000000
+    )";
+    Parser parser(source);
+    auto ast = parser.parse();
+    int plain = count_calls(BytecodeGenerator(0).generate(*ast, "inline"));
+    int locals = count_calls(BytecodeGenerator(1).generate(*ast, "inline"));
+    int globals = count_calls(BytecodeGenerator(1, true).generate(*ast, "inline"));
+    assert(locals == plain - 4); // bump, get, sq, and sq inside gcube
+    assert(globals == locals - 1); // gcube
+    assert(count_calls(BytecodeGenerator(3).generate(*ast, "inline")) == locals);
+
+    for (int level = 0; level <= 3; level++) {
+        run_function(compile_source(source, "inline", level, level == 3));
+        auto result = main_result();
+        assert(result->getType() == LuaType::NUMBER);
+        assert(std::static_pointer_cast<LuaInteger>(result->getObject())->getValue() == 2113440);
+    }
+
+    // globals replaced where the compiler cannot see it are called at every level
+    const char* replaced = R"(
+        function g(x) return x + 1 end
+        function h(x) return x + 2 end
+        local function p() _G.g = function(x) return x * 100 end end
+        p()
+        local e = _ENV
+        e.h = function(x) return x * 1000 end
+        return g(2) + h(3)
+    )";
+    for (int level = 0; level <= 3; level++) {
+        run_source(replaced, "replaced", level);
+        assert(std::static_pointer_cast<LuaInteger>(main_result()->getObject())->getValue() == 3200);
+    }
+}
+
+// instructions inside numeric `for` loops, in `proto` and nested functions
+static int loop_body_size(const std::shared_ptr<LuaFunction>& proto) {
+    int n = 0;
+    for (Instruction i : proto->getBytecode()) {
+        if (GET_OPCODE(i) == OpCode::FORPREP) n += GETARG_Bx(i);
+    }
+    for (const auto& p : proto->getProtos()) {
+        n += loop_body_size(std::static_pointer_cast<LuaFunction>(p.getObject()));
+    }
+    return n;
+}
+
+void test_ssa() {
+    std::cout << "--- Testing SSA Passes ---" << std::endl;
+    const char* source = R"(
+        local function norm(x, y)
+            local p = {}
+            p.x = x
+            p.y = y
+            return p.x * p.x + p.y * p.y
+        end
+        local function scaled(n: int, m: int)
+            local s = 0
+            for i = 1, n do
+                local k: int = n * m
+                s = s + k + i
+            end
+            return s
+        end
+        local function total(n)
+            local acc = {sum = 0}
+            for i = 1, n do acc.sum = acc.sum + i end
+            return acc.sum
+        end
+        local kept = {}
+        kept.v = 7
+        local function get() return kept.v end
+        return norm(3, 4) + scaled(10, 2) + get() * 1000 + total(10) * 10000
+    )";
+    Parser parser(source);
+    auto ast = parser.parse();
+    auto plain = BytecodeGenerator(1).generate(*ast, "ssa");
+    auto optimized = BytecodeGenerator(2).generate(*ast, "ssa");
+    // the loads of p.x and p.y read the stored arguments; the stores and
+    // the table go with them, while `kept` escapes into get()
+    assert(count_instructions(optimized) < count_instructions(plain));
+    assert(has_opcode(optimized, OpCode::NEWTABLE));
+    assert(std::static_pointer_cast<LuaFunction>(optimized->getProtos()[0].getObject())->getBytecode().size() == 8);
+    // acc.sum changes in the loop: the field lives in a register instead
+    auto total = [](const std::shared_ptr<LuaFunction>& proto) {
+        return std::static_pointer_cast<LuaFunction>(proto->getProtos()[2].getObject());
+    };
+    assert(has_opcode(total(plain), OpCode::NEWTABLE));
+    assert(!has_opcode(total(optimized), OpCode::NEWTABLE));
+    // n * m moves out of the loop
+    assert(loop_body_size(optimized) < loop_body_size(plain));
+
+    for (int level = 0; level <= 2; level++) {
+        run_source(source, "ssa", level);
+        auto result = main_result();
+        assert(result->getType() == LuaType::NUMBER);
+        assert(std::static_pointer_cast<LuaInteger>(result->getObject())->getValue() == 557280);
+    }
+}
+
+// same code, constants and nesting
+static bool same_function(const LuaFunction& a, const LuaFunction& b) {
+    if (!std::ranges::equal(a.getBytecode(), b.getBytecode()) || a.getConstants().size() != b.getConstants().size() ||
+        a.getProtos().size() != b.getProtos().size() || a.getMaxStackSize() != b.getMaxStackSize()) {
+        return false;
+    }
+    for (size_t n = 0; n < a.getConstants().size(); n++) {
+        if (a.getConstants()[n].toString() != b.getConstants()[n].toString()) return false;
+    }
+    for (size_t n = 0; n < a.getProtos().size(); n++) {
+        if (!same_function(*std::static_pointer_cast<LuaFunction>(a.getProtos()[n].getObject()),
+                           *std::static_pointer_cast<LuaFunction>(b.getProtos()[n].getObject()))) {
+            return false;
+        }
+    }
+    return true;
+}
+
+void test_binary_chunk() {
+    std::cout << "--- Testing Binary Chunks ---" << std::endl;
+    auto proto = compile_source(R"(
+        local scale <const> = 2.5
+        local function area(w, h) return w * h * scale end
+        local names = {"a", "b"}
+        local total = 0
+        for i = 1, #names do total = total + area(i, -3) end
+        return total, names[2] .. "!", true, nil
+    )", "chunk");
+    std::string chunk = dump_function(*proto);
+    std::string stripped = dump_function(*proto, true);
+    assert(is_binary_chunk(chunk) && stripped.size() < chunk.size());
+
+    auto loaded = load_function(chunk, "chunk.out");
+    assert(same_function(*proto, *loaded));
+    assert(loaded->getSource() == "chunk" && loaded->getLineinfos().size() == proto->getLineinfos().size());
+    auto bare = load_function(stripped, "stripped.out");
+    assert(same_function(*proto, *bare) && bare->getLineinfos().empty() && bare->getLocalVars().empty());
+    run_function(bare);
+    assert(std::static_pointer_cast<LuaNumber>(main_result()->getObject())->getValue() == -22.5);
+
+    // a mapped chunk runs its code in place and outlives the caller's handle
+    auto path = std::filesystem::temp_directory_path() / "luao_test_chunk.out";
+    std::ofstream(path, std::ios::binary) << chunk;
+    auto file = MappedFile::open(path.string());
+    auto mapped = load_function(file, path.string());
+    const char* code = reinterpret_cast<const char*>(mapped->getBytecode().data());
+    assert(code > file->data().data() && code < file->data().data() + file->data().size());
+    file.reset();
+    std::filesystem::remove(path);
+    run_function(mapped);
+    assert(std::static_pointer_cast<LuaNumber>(main_result()->getObject())->getValue() == -22.5);
+    // nested functions built on demand match the eagerly loaded ones
+    assert(same_function(*proto, *mapped) && dump_function(*mapped) == chunk);
+
+    bool rejected = false;
+    try {
+        load_function(std::string_view(chunk).substr(0, chunk.size() - 1), "cut.out");
+    } catch (const std::runtime_error&) {
+        rejected = true;
+    }
+    assert(rejected);
+}
+
+void test_compile_cache() {
+    std::cout << "--- Testing Compile Cache ---" << std::endl;
+    auto dir = std::filesystem::temp_directory_path() / "luao_test_cache";
+    std::filesystem::remove_all(dir);
+    CompileCache cache(dir);
+    std::string source = "local function twice(x) return x * 2 end return twice(21)";
+
+    assert(!cache.load(source, "cached", 1));
+    bool stored = cache.store(source, "cached", 1, *compile_source(source, "cached", 1));
+    assert(stored);
+    auto hit = cache.load(source, "cached", 1);
+    assert(hit && hit->getSource() == "cached");
+    run_function(hit);
+    assert(main_result()->getObject()->toString() == "42");
+
+    // any change to the source, the name or the options is a different entry
+    assert(!cache.load(source + " ", "cached", 1));
+    assert(!cache.load(source, "other", 1));
+    assert(!cache.load(source, "cached", 2));
+    assert(!cache.load(source, "cached", 1, true));
+    // a store leaves only the entry behind, no temporary files
+    assert(std::distance(std::filesystem::directory_iterator(dir), std::filesystem::directory_iterator()) == 1);
+
+    // an entry found under another key's name, as after a hash collision, is a miss
+    std::string other = "return 'other'";
+    std::filesystem::copy_file(cache.entry(source, "cached", 1), cache.entry(other, "cached", 1));
+    assert(!cache.load(other, "cached", 1));
+    hit.reset();
+    std::filesystem::remove_all(dir);
+}
+
+void test_lazy_modules() {
+    std::cout << "--- Testing Lazy Modules ---" << std::endl;
+    auto env = [] { return std::static_pointer_cast<LuaTable>(vm.get_stack()[0]->getObject()); };
+    LuaValue name(std::make_shared<LuaString>("table"), LuaType::STRING);
+
+    run_source("print('no libraries needed')", "lazy");
+    assert(env()->get(name).getType() == LuaType::NIL);
+
+    run_source("return table.concat({1, 2}, '-') .. _G.table.concat({3}, '')", "lazy");
+    assert(main_result()->getObject()->toString() == "1-23");
+    assert(env()->get(name).getType() == LuaType::TABLE);
+
+    // once opened, the module is an ordinary global
+    run_source("local t = table table = nil if table == nil and t then return 'gone' end", "lazy");
+    assert(main_result()->getObject()->toString() == "gone");
+}
+
+void test_coroutines() {
+    std::cout << "--- Testing Coroutines ---" << std::endl;
+    auto result = [] { return main_result()->getObject()->toString(); };
+
+    // a generator yielding from inside nested Lua calls
+    run_source(R"(
+        local function walk(n)
+            if n > 0 then walk(n - 1) coroutine.yield(n) end
+        end
+        local s = ''
+        for v in coroutine.wrap(function() walk(5) end) do s = s .. v end
+        return s
+    )", "coroutines");
+    assert(result() == "12345");
+
+    // values passed both ways, statuses, and a resumer that is 'normal'
+    run_source(R"(
+        local co
+        co = coroutine.create(function(a)
+            local inner = coroutine.wrap(function() return coroutine.status(co) end)
+            local b = coroutine.yield(a + 1, inner())
+            return b * 2
+        end)
+        local ok1, x, st = coroutine.resume(co, 1)
+        local mid = coroutine.status(co)
+        local ok2, y = coroutine.resume(co, 10)
+        local ok3, err = coroutine.resume(co)
+        return table.concat({x, st, mid, y, coroutine.status(co), err}, ',')
+    )", "coroutines");
+    assert(result() == "2,normal,suspended,20,dead,cannot resume dead coroutine");
+
+    // errors kill the coroutine; yields across native calls are refused
+    run_source(R"(
+        local co = coroutine.create(function() local t = nil return t.x end)
+        local ok = coroutine.resume(co)
+        local sorter = coroutine.create(function()
+            table.sort({2, 1}, function(a, b) coroutine.yield() return a < b end)
+        end)
+        local _, err = coroutine.resume(sorter)
+        if not ok and coroutine.status(co) == 'dead' and not coroutine.isyieldable() then return err end
+    )", "coroutines");
+    assert(result() == "attempt to yield across a C-call boundary");
+
+    // a generic-for iterator written in Lua may yield
+    run_source(R"(
+        local co = coroutine.wrap(function()
+            local function step(_, last)
+                coroutine.yield(last)
+                if last < 3 then return last + 1 end
+            end
+            for v in step, nil, 0 do end
+            return 'done'
+        end)
+        return co() .. co() .. co() .. co() .. co()
+    )", "coroutines");
+    assert(result() == "0123done");
+
+    // many live coroutines, each with its own stack
+    run_source(R"(
+        local gens = {}
+        for i = 1, 2000 do
+            gens[i] = coroutine.wrap(function() local k = i while true do coroutine.yield(k) k = k + i end end)
+        end
+        local s = 0
+        for round = 1, 3 do for i = 1, 2000 do s = s + gens[i]() end end
+        return s
+    )", "coroutines");
+    assert(result() == std::to_string(6 * 2000 * 2001 / 2));
+}
+
+void test_scheduler() {
+    std::cout << "--- Testing Scheduler ---" << std::endl;
+#ifdef LUAO_USE_EPOLL
+    run_source(R"(
+        local log = {}
+        local function note(s) log[#log + 1] = s end
+
+        -- sleepers wake in deadline order, whatever order they started in
+        sched.spawn(function() sched.sleep(0.06) note('late') end)
+        sched.spawn(function() sched.sleep(0.03) note('early') end)
+
+        -- a pipe reader waits for its writer; closing the pipe ends it
+        local r, w = sched.pipe()
+        sched.spawn(function()
+            note(sched.read(r))
+            local data, err = sched.read(r)
+            note(err)
+        end)
+        sched.spawn(function() sched.sleep(0.005) sched.write(w, 'piped') sched.close(w) end)
+
+        -- waits time out
+        local r2, w2 = sched.pipe()
+        sched.spawn(function() local ok, err = sched.readable(r2, 0.001) note(err) end)
+
+        -- echo over a socketpair
+        local a, b = sched.socketpair()
+        local echoed = 0
+        sched.spawn(function()
+            for msg in function() return sched.read(b) end do sched.write(b, msg .. '!') end
+            sched.close(b)
+        end)
+        sched.spawn(function()
+            local n = 0
+            for i = 1, 50 do sched.write(a, 'x') n = n + #sched.read(a) end
+            sched.close(a)
+            echoed = n
+        end)
+
+        sched.run()
+        sched.close(r) sched.close(r2) sched.close(w2)
+        return table.concat(log, ' ') .. ' ' .. echoed
+    )", "scheduler");
+    assert(main_result()->getObject()->toString() == "timeout piped closed early late 100");
+
+    // waiting needs a task
+    bool refused = false;
+    try {
+        run_source("sched.sleep(1)", "scheduler");
+    } catch (const LuaError& e) {
+        refused = std::string(e.what()) == "attempt to sleep outside a scheduler task";
+    }
+    assert(refused);
+#endif
+}
+
+void test_snapshot() {
+    std::cout << "--- Testing VM Snapshots ---" << std::endl;
+    auto snapshot = VMSnapshot::capture(compile_source(R"(
+        local calls = 0
+        function counter() calls = calls + 1 return calls end
+        config = { name = "service", limits = { 1, 2, 3 } }
+        config.self = config
+    )", "prelude"));
+
+    auto boot = [&](const std::string& source) {
+        vm = VM();
+        vm.load(std::make_shared<LuaClosure>(compile_source(source, "request")), *snapshot);
+        vm.run();
+        return main_result()->getObject()->toString();
+    };
+    // each VM mutates only its own copy of the prelude's state
+    assert(boot("config.name = 'changed' counter() return counter() + #config.self.limits") == "5");
+    assert(boot("return config.name .. counter()") == "service1");
+    assert(boot("if _G == _ENV and print then return 'ok' end return 'bad'") == "ok");
+}
+
+void test_isolates() {
+    std::cout << "--- Testing Isolate Pool ---" << std::endl;
+    auto snapshot = VMSnapshot::capture(compile_source("function square(x) return x * x end", "prelude"));
+    IsolatePool pool(4, snapshot);
+    std::vector<IsolateJob> jobs;
+    for (int n = 0; n < 16; n++) {
+        IsolateJob job;
+        job.chunkname = "job" + std::to_string(n);
+        // every job changes the same global; each VM only sees its own write
+        job.source = "seen = (seen or 0) + " + std::to_string(n) + " local t = {} "
+                     "for i = 1, 1000 do t[i] = square(i) end print(seen, #t, t[" + std::to_string(n + 1) + "])";
+        jobs.push_back(job);
+    }
+    IsolateJob broken;
+    broken.chunkname = "broken";
+    broken.source = "local x = nil + 1";
+    jobs.push_back(broken);
+
+    auto results = pool.run_all(jobs);
+    for (int n = 0; n < 16; n++) {
+        assert(results[n].ok);
+        assert(results[n].output == std::to_string(n) + "\t1000\t" + std::to_string((n + 1) * (n + 1)) + "\t\n");
+    }
+    assert(!results[16].ok && !results[16].error.empty());
+
+    // one prototype for every job; varargs and inline caches are per call
+    // and per closure, so the runs cannot see each other through it
+    std::shared_ptr<const LuaFunction> shared = compile_source(R"(
+        local function f(n, ...)
+            if n == 0 then return 0 end
+            local r = f(n - 1, n * 10)
+            local x = ...
+            return r + x
+        end
+        print(f(3, 1))
+    )", "shared");
+    IsolateJob reused;
+    reused.chunkname = "shared";
+    reused.function = shared;
+    jobs.assign(8, reused);
+    for (const auto& result : pool.run_all(jobs)) {
+        assert(result.ok && result.output == "51\t\n");
+    }
+}
+
+static bool read_file(const char* path, std::string& data) {
+    std::ifstream in(path, std::ios::binary);
+    if (!in) {
+        std::cerr << "luao: cannot open " << path << std::endl;
+        return false;
+    }
+    std::stringstream buffer;
+    buffer << in.rdbuf();
+    data = buffer.str();
+    return true;
+}
+
+// compiles the script at `path`, or loads it in place when it is a binary
+// chunk; with LUAO_CACHE_DIR set, compiled sources are kept there and
+// reused while the script is unchanged
+static std::shared_ptr<LuaFunction> load_script(const char* path, int optlevel, bool inline_globals) {
+    auto file = MappedFile::open(path);
+    if (is_binary_chunk(file->data())) {
+        return load_function(file, path);
+    }
+    if (const char* dir = std::getenv("LUAO_CACHE_DIR"); dir && *dir) {
+        CompileCache cache(dir);
+        auto main = cache.load(file->data(), path, optlevel, inline_globals);
+        if (!main) {
+            main = compile_source(std::string(file->data()), path, optlevel, inline_globals);
+            cache.store(file->data(), path, optlevel, *main, inline_globals);
+        }
+        return main;
+    }
+    return compile_source(std::string(file->data()), path, optlevel, inline_globals);
+}
+
+// luao [-O<level>] [--inline-globals] script: runs a source file or a
+// binary chunk instead of the built-in tests; -O0 turns off inlining and
+// the peephole pass, -O2 also runs the SSA passes. --inline-globals also
+// inlines global functions, for scripts that never replace them.
+static int run_file(const char* path, int optlevel, bool inline_globals) {
+    try {
+        run_function(load_script(path, optlevel, inline_globals));
+    } catch (const std::exception& e) {
+        std::cerr << "luao: " << e.what() << std::endl;
+        return 1;
+    }
+    return 0;
+}
+
+// luao -j<n> [-O<level>] script...: runs the scripts in parallel isolates
+// and prints their output in order. A script named more than once is
+// loaded once and its prototypes are shared by those runs.
+static int run_files(char** paths, int count, int jobs, int optlevel, bool inline_globals) {
+    std::map<std::string, std::shared_ptr<const LuaFunction>> loaded;
+    std::vector<IsolateJob> batch;
+    for (int n = 0; n < count; n++) {
+        auto& main = loaded[paths[n]];
+        try {
+            if (!main) main = load_script(paths[n], optlevel, inline_globals);
+        } catch (const std::exception& e) {
+            std::cerr << "luao: " << e.what() << std::endl;
+            return 1;
+        }
+        IsolateJob job;
+        job.chunkname = paths[n];
+        job.function = main;
+        batch.push_back(std::move(job));
+    }
+    IsolatePool pool(static_cast<unsigned>(jobs));
+    int status = 0;
+    for (const IsolateResult& result : pool.run_all(std::move(batch))) {
+        std::cout << result.output;
+        if (!result.ok) {
+            std::cerr << "luao: " << result.error << std::endl;
+            status = 1;
+        }
+    }
+    return status;
+}
+
+// luao -c [-s] [-O<level>] [-o out] script.lua: writes the compiled script
+// as a binary chunk (luac.out by default); -s strips debug information
+static int compile_file(const char* path, const char* out, int optlevel, bool inline_globals, bool strip) {
+    std::string source;
+    if (!read_file(path, source)) return 1;
+    try {
+        std::string chunk = dump_function(*compile_source(source, path, optlevel, inline_globals), strip);
+        std::ofstream file(out, std::ios::binary);
+        if (!file.write(chunk.data(), static_cast<std::streamsize>(chunk.size()))) {
+            std::cerr << "luao: cannot write " << out << std::endl;
+            return 1;
+        }
+    } catch (const std::exception& e) {
+        std::cerr << "luao: " << e.what() << std::endl;
+        return 1;
+    }
+    return 0;
+}
+
+static std::string lexer_corpus(size_t bytes) {
+    std::string corpus;
+    for (int i = 0; corpus.size() < bytes; i++) {
+        std::string id = std::to_string(i);
+        corpus += "--[[ entry " + id + ": generated configuration record. The fields below are read by the\n"
+                  "     loader at startup; weights are scaled by the global factor and records whose\n"
+                  "     flags are disabled are skipped without being validated. ]]\n";
+        corpus += "local record_" + id + " = {\n";
+        corpus += "    name = \"item_" + id + "\", weight = " + std::to_string(i * 3) + ".25,\n";
+        corpus += "    description = [[multi-line text for record " + id + ", kept verbatim by the loader and shown\n    in the configuration summary next to the record name and its current weight]],\n";
+        corpus += "    flags = { enabled = true, retries = " + std::to_string(i % 7) + " },\n}\n";
+        corpus += "if record_" + id + ".flags.enabled and record_" + id + ".weight >= 10 then\n";
+        corpus += "    total_weight = total_weight + record_" + id + ".weight * scale_factor\nend\n";
+    }
+    return corpus;
+}
+
+// luao --bench-lexer [MB]: lexes a generated corpus with each set of scan
+// kernels the CPU supports and prints the throughput
+static int bench_lexer(int megabytes) {
+    std::string corpus = lexer_corpus(static_cast<size_t>(megabytes) << 20);
+    ScanIsa best = scan_isa();
+    for (ScanIsa isa : {ScanIsa::SCALAR, ScanIsa::SSE2, ScanIsa::AVX2}) {
+        if (!set_scan_isa(isa)) continue;
+        double seconds = 0;
+        size_t tokens = 0;
+        for (int run = 0; run < 10; run++) {
+            auto start = std::chrono::steady_clock::now();
+            Lexer lexer(corpus);
+            tokens = 0;
+            while (lexer.nextToken().type != Token::EOS) tokens++;
+            std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+            if (run == 0 || elapsed.count() < seconds) seconds = elapsed.count();
+        }
+        std::cout << scan_isa_name(isa) << ": " << corpus.size() / seconds / (1 << 20) << " MB/s ("
+                  << tokens << " tokens in " << corpus.size() << " bytes)" << std::endl;
+    }
+    set_scan_isa(best);
+    return 0;
+}
+
 int main(int argc, char **argv)
 {
+    if (argc > 1 && std::strcmp(argv[1], "--bench-lexer") == 0) {
+        return bench_lexer(argc > 2 ? std::atoi(argv[2]) : 64);
+    }
+    if (argc > 1) {
+        int optlevel = 1;
+        bool compile = false, strip = false, inline_globals = false;
+        const char* out = "luac.out";
+        int jobs = 0;
+        int arg = 1;
+        for (; arg < argc && argv[arg][0] == '-'; arg++) {
+            if (std::strncmp(argv[arg], "-O", 2) == 0) optlevel = std::atoi(argv[arg] + 2);
+            else if (std::strncmp(argv[arg], "-j", 2) == 0) jobs = std::max(std::atoi(argv[arg] + 2), 1);
+            else if (std::strcmp(argv[arg], "-c") == 0) compile = true;
+            else if (std::strcmp(argv[arg], "-s") == 0) strip = true;
+            else if (std::strcmp(argv[arg], "--inline-globals") == 0) inline_globals = true;
+            else if (std::strcmp(argv[arg], "-o") == 0 && arg + 1 < argc) out = argv[++arg];
+            else break;
+        }
+        if (jobs && !compile && arg < argc) {
+            return run_files(argv + arg, argc - arg, jobs, optlevel, inline_globals);
+        }
+        if (arg + 1 != argc) {
+            std::cerr << "usage: luao [-O<level>] [--inline-globals] script | luao -j<n> [-O<level>] script... | "
+                         "luao -c [-s] [-O<level>] [-o out] script.lua" << std::endl;
+            return 1;
+        }
+        return compile ? compile_file(argv[arg], out, optlevel, inline_globals, strip)
+                       : run_file(argv[arg], optlevel, inline_globals);
+    }
+
     try {
         std::cout << "Starting tests..." << std::endl;
         test_cfunction_call();
         std::cout << "CFunction test passed." << std::endl;
         test_metamethod();
         std::cout << "Metamethod test passed." << std::endl;
+        test_tablelib();
+        std::cout << "Table library test passed." << std::endl;
+        test_class_instance();
+        std::cout << "Class instance test passed." << std::endl;
+        test_class_methods();
+        std::cout << "Class method test passed." << std::endl;
+        test_class_operators();
+        std::cout << "Class operator test passed." << std::endl;
+        test_lexer();
+        std::cout << "Lexer test passed." << std::endl;
+        test_parser();
+        std::cout << "Parser test passed." << std::endl;
+        test_compiler();
+        std::cout << "Compiler test passed." << std::endl;
+        test_constant_folding();
+        std::cout << "Constant folding test passed." << std::endl;
+        test_peephole();
+        std::cout << "Peephole test passed." << std::endl;
+        test_typed_code();
+        std::cout << "Typed code test passed." << std::endl;
+        test_inlining();
+        std::cout << "Inlining test passed." << std::endl;
+        test_ssa();
+        std::cout << "SSA test passed." << std::endl;
+        test_binary_chunk();
+        std::cout << "Binary chunk test passed." << std::endl;
+        test_compile_cache();
+        std::cout << "Compile cache test passed." << std::endl;
+        test_snapshot();
+        std::cout << "Snapshot test passed." << std::endl;
+        test_lazy_modules();
+        std::cout << "Lazy module test passed." << std::endl;
+        test_isolates();
+        std::cout << "Isolate pool test passed." << std::endl;
+        test_coroutines();
+        std::cout << "Coroutine test passed." << std::endl;
+        test_scheduler();
+        std::cout << "Scheduler test passed." << std::endl;
         //test_stack_overflow();
         //test_vm_dump();
         test_baselib();
@@ -3,9 +3,13 @@
 
 namespace luao {
 
-LuaValue LuaGCObject::getMetamethod(const LuaValue& key) const {
+LuaValue LuaGCObject::getMetamethod(TMS event) const {
     if (!metatable) return LuaValue();
-    return metatable->get(key);
+    return metatable->getTM(event);
+}
+
+bool LuaGCObject::hasMetamethod(TMS event) const {
+    return metatable && metatable->getTM(event).getType() != LuaType::NIL;
 }
 
 } // namespace luao
@@ -16,11 +16,39 @@ static const std::map<Token, std::pair<int, int>> PRECEDENCE_MAP = {
     {Token::MULTIPLY, {11, 11}}, {Token::DIVIDE, {11, 11}}, {Token::IDIV, {11, 11}}, {Token::MODULO, {11, 11}},
     {Token::POW,      {13, 12}}, // Right associative
 };
+// An operator binds while its left precedence is strictly greater than the
+// limit it is parsed under, so equal {left, right} pairs associate left.
 const int UNARY_PRECEDENCE = 12;
 
+// --- Arena ---
+
+static char* align_up(char* p, size_t align) {
+    return reinterpret_cast<char*>((reinterpret_cast<uintptr_t>(p) + align - 1) & ~(align - 1));
+}
+
+void* AstArena::allocate(size_t size, size_t align) {
+    char* p = align_up(next_, align);
+    if (!next_ || p + size > limit_) {
+        // oversized requests get a chunk of their own
+        size_t chunk = size + align > CHUNK_SIZE ? size + align : CHUNK_SIZE;
+        chunks_.push_back(std::make_unique<char[]>(chunk));
+        limit_ = chunks_.back().get() + chunk;
+        p = align_up(chunks_.back().get(), align);
+    }
+    next_ = p + size;
+    used_ += size;
+    return p;
+}
+
+std::string_view AstArena::copy(std::string_view s) {
+    char* p = static_cast<char*>(allocate(s.size(), 1));
+    std::memcpy(p, s.data(), s.size());
+    return {p, s.size()};
+}
+
 // --- Parser Core ---
 
-Parser::Parser(const std::string& source) : lexer_(source) {
+Parser::Parser(std::string_view source) : lexer_(source) {
     advance();
 }
 
@@ -33,7 +61,7 @@ void Parser::consume(Token type) {
         advance();
     } else {
         error("Expected token " + std::string(TokenNames[static_cast<int>(type)]) +
-              " but got " + current_token_.value);
+              " but got " + std::string(current_token_.value));
     }
 }
 
@@ -53,9 +81,9 @@ void Parser::error(const std::string& message) {
     throw std::runtime_error("Parser Error at line " + std::to_string(current_token_.line) + ": " + message);
 }
 
-std::unique_ptr<Block> Parser::parse() {
-    auto block = std::make_unique<Block>();
-    block->statements_ = parseStatementList();
+Block* Parser::parse() {
+    auto block = arena_.make<Block>();
+    parseStatementList(block->statements_);
     if (!check(Token::EOS)) {
         error("Expected <eof> at end of chunk.");
     }
@@ -64,11 +92,13 @@ std::unique_ptr<Block> Parser::parse() {
 
 // --- Statement Parsers ---
 
-std::vector<std::unique_ptr<Statement>> Parser::parseStatementList() {
-    std::vector<std::unique_ptr<Statement>> stmts;
+void Parser::parseStatementList(AstList<Statement*>& stmts) {
     while (!check(Token::END) && !check(Token::ELSE) && !check(Token::ELSEIF) && !check(Token::UNTIL) && !check(Token::EOS)) {
+        if (match(Token::SEMICOLON)) {
+            continue; // empty statement
+        }
         if (check(Token::RETURN)) {
-            stmts.push_back(parseReturnStatement());
+            stmts.push_back(arena_, parseReturnStatement());
             break;
         }
         auto stmt = parseStatement();
@@ -76,83 +106,103 @@ std::vector<std::unique_ptr<Statement>> Parser::parseStatementList() {
             // optional semicolon
         }
         if (stmt) {
-            stmts.push_back(std::move(stmt));
+            stmts.push_back(arena_, stmt);
         }
     }
-    return stmts;
 }
 
-std::unique_ptr<Block> Parser::parseBlock() {
-    auto block = std::make_unique<Block>();
-    block->statements_ = parseStatementList();
+Block* Parser::parseBlock() {
+    auto block = arena_.make<Block>();
+    parseStatementList(block->statements_);
     return block;
 }
 
-std::unique_ptr<Statement> Parser::parseStatement() {
-    if (check(Token::IF)) return parseIfStatement();
-    if (check(Token::WHILE)) return parseWhileStatement();
-    if (check(Token::DO)) return parseDoStatement();
-    if (check(Token::FOR)) return parseForStatement();
-    if (check(Token::REPEAT)) return parseRepeatStatement();
-    if (check(Token::FUNCTION)) return parseFunctionStatement();
-    if (check(Token::LOCAL)) return parseLocalStatement();
-    if (check(Token::GOTO)) return parseGotoStatement();
-    if (check(Token::DBCOLON)) return parseLabelStatement();
-    if (check(Token::BREAK)) return parseBreakStatement();
-    if (check(Token::RETURN)) return parseReturnStatement();
-    return parseAssignOrCallStatement();
+Statement* Parser::parseStatement() {
+    int line = current_token_.line;
+    Statement* stmt;
+    if (check(Token::IF)) stmt = parseIfStatement();
+    else if (check(Token::WHILE)) stmt = parseWhileStatement();
+    else if (check(Token::DO)) stmt = parseDoStatement();
+    else if (check(Token::FOR)) stmt = parseForStatement();
+    else if (check(Token::REPEAT)) stmt = parseRepeatStatement();
+    else if (check(Token::FUNCTION)) stmt = parseFunctionStatement();
+    else if (check(Token::LOCAL)) stmt = parseLocalStatement();
+    else if (check(Token::GOTO)) stmt = parseGotoStatement();
+    else if (check(Token::COLON_DB)) stmt = parseLabelStatement();
+    else if (check(Token::BREAK)) stmt = parseBreakStatement();
+    else if (check(Token::RETURN)) stmt = parseReturnStatement();
+    else stmt = parseAssignOrCallStatement();
+    stmt->line_ = line;
+    return stmt;
 }
 
-std::unique_ptr<Statement> Parser::parseLocalStatement() {
+Statement* Parser::parseLocalStatement() {
     consume(Token::LOCAL);
-    if (match(Token::FUNCTION)) {
-        auto func_stmt = std::make_unique<FunctionStatement>();
+    if (check(Token::FUNCTION)) {
+        int line = current_token_.line;
+        advance();
+        auto func_stmt = arena_.make<FunctionStatement>();
         func_stmt->is_local_ = true;
         func_stmt->name_ = parseIdentifier(false);
-        func_stmt->def_ = parseFunctionDef();
+        func_stmt->def_ = parseFunctionBody(line, false);
         return func_stmt;
     }
 
-    auto local_stmt = std::make_unique<LocalStatement>();
+    // `local a: int, b: str` types each name; `local x, y: int, long`
+    // lists the types of every name after the last one
+    auto local_stmt = arena_.make<LocalStatement>();
+    bool typed = false;
     do {
-        local_stmt->names_.push_back(parseIdentifier(true));
+        local_stmt->names_.push_back(arena_, parseIdentifier(true));
+        if (!match(Token::COLON)) continue;
+        auto& names = local_stmt->names_;
+        if (names.size() == 1 || typed) {
+            names.back()->type_ = parseTypeName();
+            typed = true;
+            continue;
+        }
+        for (size_t n = 0; n < names.size(); n++) {
+            if (n > 0 && !match(Token::COMMA)) error("missing type for local '" + std::string(names[n]->name_) + "'.");
+            names[n]->type_ = parseTypeName();
+        }
+        break;
     } while (match(Token::COMMA));
 
     if (match(Token::ASSIGN)) {
         do {
-            local_stmt->values_.push_back(parseExpression());
+            local_stmt->values_.push_back(arena_, parseExpression());
         } while (match(Token::COMMA));
     }
     return local_stmt;
 }
 
-std::unique_ptr<Statement> Parser::parseAssignOrCallStatement() {
+Statement* Parser::parseAssignOrCallStatement() {
     auto prefix_expr = parseSuffixedExpression();
 
     // If it's a function call, it's a statement
-    if (dynamic_cast<FunctionCall*>(prefix_expr.get())) {
-        return std::make_unique<ExprStatement>(std::move(prefix_expr));
+    if (prefix_expr->kind_ == NodeKind::FunctionCall) {
+        return arena_.make<ExprStatement>(prefix_expr);
     }
 
     // Otherwise, it must be an assignment
-    auto assign_stmt = std::make_unique<AssignStatement>();
-    assign_stmt->targets_.push_back(std::move(prefix_expr));
+    auto assign_stmt = arena_.make<AssignStatement>();
+    assign_stmt->targets_.push_back(arena_, prefix_expr);
 
     while (match(Token::COMMA)) {
-        assign_stmt->targets_.push_back(parseSuffixedExpression());
+        assign_stmt->targets_.push_back(arena_, parseSuffixedExpression());
     }
 
     consume(Token::ASSIGN);
 
     do {
-        assign_stmt->values_.push_back(parseExpression());
+        assign_stmt->values_.push_back(arena_, parseExpression());
     } while (match(Token::COMMA));
 
     return assign_stmt;
 }
 
-std::unique_ptr<Statement> Parser::parseIfStatement() {
-    auto if_stmt = std::make_unique<IfStatement>();
+Statement* Parser::parseIfStatement() {
+    auto if_stmt = arena_.make<IfStatement>();
 
     auto parse_clause = [this]() {
         IfClause clause;
@@ -163,10 +213,10 @@ std::unique_ptr<Statement> Parser::parseIfStatement() {
     };
 
     consume(Token::IF);
-    if_stmt->if_clauses_.push_back(parse_clause());
+    if_stmt->if_clauses_.push_back(arena_, parse_clause());
 
     while (match(Token::ELSEIF)) {
-        if_stmt->if_clauses_.push_back(parse_clause());
+        if_stmt->if_clauses_.push_back(arena_, parse_clause());
     }
 
     if (match(Token::ELSE)) {
@@ -177,26 +227,28 @@ std::unique_ptr<Statement> Parser::parseIfStatement() {
     return if_stmt;
 }
 
-std::unique_ptr<Statement> Parser::parseWhileStatement() {
+Statement* Parser::parseWhileStatement() {
     consume(Token::WHILE);
     auto cond = parseExpression();
     consume(Token::DO);
     auto body = parseBlock();
     consume(Token::END);
-    auto while_stmt = std::make_unique<WhileStatement>();
-    while_stmt->condition_ = std::move(cond);
-    while_stmt->body_ = std::move(body);
+    auto while_stmt = arena_.make<WhileStatement>();
+    while_stmt->condition_ = cond;
+    while_stmt->body_ = body;
     return while_stmt;
 }
 
 // --- Expression Parsers ---
 
-std::unique_ptr<Expression> Parser::parseExpression(int precedence) {
+Expression* Parser::parseExpression(int precedence) {
     auto left = parsePrefixExpression();
 
     while (true) {
+        // the lexer cannot tell unary from binary `~`; here it is binary
+        if (current_token_.type == Token::BNOT) current_token_.type = Token::BXOR;
         auto it = PRECEDENCE_MAP.find(current_token_.type);
-        if (it == PRECEDENCE_MAP.end() || it->second.first < precedence) {
+        if (it == PRECEDENCE_MAP.end() || it->second.first <= precedence) {
             break;
         }
 
@@ -204,94 +256,110 @@ std::unique_ptr<Expression> Parser::parseExpression(int precedence) {
         advance();
 
         auto right = parseExpression(it->second.second);
-        left = std::make_unique<BinaryExpr>(std::move(left), op, std::move(right));
+        left = arena_.make<BinaryExpr>(left, op, right);
+        left->line_ = op.line;
     }
     return left;
 }
 
-std::unique_ptr<Expression> Parser::parsePrefixExpression() {
+Expression* Parser::parsePrefixExpression() {
     if (check(Token::MINUS) || check(Token::NOT) || check(Token::LEN) || check(Token::BNOT)) {
         TokenInfo op = current_token_;
         advance();
         auto operand = parseExpression(UNARY_PRECEDENCE);
-        return std::make_unique<UnaryExpr>(op, std::move(operand));
+        auto unary = arena_.make<UnaryExpr>(op, operand);
+        unary->line_ = op.line;
+        return unary;
     }
     return parseSuffixedExpression();
 }
 
-std::unique_ptr<Expression> Parser::parseSuffixedExpression() {
+Expression* Parser::parseSuffixedExpression() {
     auto expr = parseSimpleExpression();
 
     while (true) {
+        int line = current_token_.line;
         if (match(Token::DOT)) {
             auto field = parseIdentifier(false);
-            expr = std::make_unique<TableAccess>(std::move(expr), std::move(field));
+            expr = arena_.make<TableAccess>(expr, field);
         } else if (match(Token::LBRACKET)) {
             auto index = parseExpression();
             consume(Token::RBRACKET);
-            expr = std::make_unique<IndexAccess>(std::move(expr), std::move(index));
+            expr = arena_.make<IndexAccess>(expr, index);
         } else if (check(Token::LPAREN) || check(Token::LBRACE) || check(Token::STRING)) {
-            auto call_expr = std::make_unique<FunctionCall>(std::move(expr), std::vector<std::unique_ptr<Expression>>{});
+            auto call_expr = arena_.make<FunctionCall>(expr);
             parseFunctionArgs(call_expr->args_);
-            expr = std::move(call_expr);
+            expr = call_expr;
         } else if (match(Token::COLON)) {
-            auto call_expr = std::make_unique<FunctionCall>(std::move(expr), std::vector<std::unique_ptr<Expression>>{});
-            call_expr->method_name_ = std::make_unique<StringLiteral>(parseIdentifier(false)->name_);
+            auto call_expr = arena_.make<FunctionCall>(expr);
+            call_expr->method_name_ = arena_.make<StringLiteral>(parseIdentifier(false)->name_);
             parseFunctionArgs(call_expr->args_);
-            expr = std::move(call_expr);
+            expr = call_expr;
         }
         else {
             break;
         }
+        expr->line_ = line;
     }
     return expr;
 }
 
-std::unique_ptr<Expression> Parser::parseSimpleExpression() {
-    if (match(Token::NIL)) return std::make_unique<NilLiteral>();
-    if (match(Token::TRUE)) return std::make_unique<BoolLiteral>(true);
-    if (match(Token::FALSE)) return std::make_unique<BoolLiteral>(false);
+Expression* Parser::parseSimpleExpression() {
+    int line = current_token_.line;
+    auto expr = parsePrimaryExpression();
+    if (expr->line_ == 0) expr->line_ = line;
+    return expr;
+}
+
+Expression* Parser::parsePrimaryExpression() {
+    if (match(Token::NIL)) return arena_.make<NilLiteral>();
+    if (match(Token::TRUE)) return arena_.make<BoolLiteral>(true);
+    if (match(Token::FALSE)) return arena_.make<BoolLiteral>(false);
     if (check(Token::INT) || check(Token::FLOAT)) {
         auto token = current_token_;
         advance();
-        return std::make_unique<NumberLiteral>(token.value);
+        return arena_.make<NumberLiteral>(token.value);
     }
     if (check(Token::STRING)) {
         auto token = current_token_;
         advance();
-        return std::make_unique<StringLiteral>(token.value);
+        return arena_.make<StringLiteral>(token.value);
     }
-    if (match(Token::VARARG)) return std::make_unique<VarargLiteral>();
+    if (match(Token::VARARG)) return arena_.make<VarargLiteral>();
     if (check(Token::IDENTIFIER)) return parseIdentifier(false);
     if (match(Token::LPAREN)) {
         auto expr = parseExpression();
         consume(Token::RPAREN);
-        return expr;
+        return arena_.make<ParenExpr>(expr);
     }
     if (check(Token::FUNCTION)) return parseFunctionDef();
     if (check(Token::LBRACE)) return parseTableConstructor();
 
-    error("Unexpected token in expression: " + current_token_.value);
+    error("Unexpected token in expression: " + std::string(current_token_.value));
     return nullptr;
 }
 
 
-std::unique_ptr<Identifier> Parser::parseIdentifier(bool can_have_attr) {
+Identifier* Parser::parseIdentifier(bool can_have_attr, bool can_have_type) {
     if (!check(Token::IDENTIFIER)) {
         error("Expected an identifier.");
     }
-    std::string name = current_token_.value;
+    std::string_view name = current_token_.value;
     advance();
 
-    std::string attr = "";
+    std::string_view attr;
     if (can_have_attr && match(Token::LT)) {
         attr = parseAttribute();
     }
-    return std::make_unique<Identifier>(name, attr);
+    auto id = arena_.make<Identifier>(name, attr);
+    if (can_have_type && match(Token::COLON)) {
+        id->type_ = parseTypeName();
+    }
+    return id;
 }
 
-std::string Parser::parseAttribute() {
-    std::string attr_val;
+std::string_view Parser::parseAttribute() {
+    std::string_view attr_val;
     // This is a simplified attribute parser. It just reads identifiers.
     if (check(Token::IDENTIFIER)) {
         attr_val = current_token_.value;
@@ -301,78 +369,113 @@ std::string Parser::parseAttribute() {
     return attr_val;
 }
 
-void Parser::parseFunctionArgs(std::vector<std::unique_ptr<Expression>>& args) {
+// a type name, `!` in front making it nullable
+std::string_view Parser::parseTypeName() {
+    bool nullable = match(Token::BANG);
+    if (check(Token::IDENTIFIER) || check(Token::FUNCTION) || check(Token::NIL)) {
+        std::string_view name = current_token_.value;
+        advance();
+        return nullable ? arena_.copy("!" + std::string(name)) : name;
+    }
+    error("Expected a type name.");
+    return {};
+}
+
+void Parser::parseFunctionArgs(AstList<Expression*>& args) {
     if (match(Token::LPAREN)) {
         if (!check(Token::RPAREN)) {
             do {
-                args.push_back(parseExpression());
+                args.push_back(arena_, parseExpression());
             } while (match(Token::COMMA));
         }
         consume(Token::RPAREN);
     } else if (check(Token::LBRACE)) {
-        args.push_back(parseTableConstructor());
+        args.push_back(arena_, parseTableConstructor());
     } else {
+        auto token = current_token_;
         consume(Token::STRING);
-        args.push_back(std::make_unique<StringLiteral>(current_token_.value));
+        args.push_back(arena_, arena_.make<StringLiteral>(token.value));
+        args.back()->line_ = token.line;
     }
 }
 
-std::unique_ptr<FunctionDef> Parser::parseFunctionDef() {
+FunctionDef* Parser::parseFunctionDef() {
+    int line = current_token_.line;
     consume(Token::FUNCTION);
-    auto def = std::make_unique<FunctionDef>();
+    return parseFunctionBody(line, false);
+}
+
+// parameter list and body, after `function` and any name
+FunctionDef* Parser::parseFunctionBody(int line, bool is_method) {
+    auto def = arena_.make<FunctionDef>();
+    def->line_ = line;
+    if (is_method) {
+        def->params_.push_back(arena_, arena_.make<Identifier>("self"));
+    }
     consume(Token::LPAREN);
     if (!check(Token::RPAREN)) {
         do {
             if (match(Token::VARARG)) {
                 def->is_vararg_ = true;
+                if (match(Token::COLON)) def->vararg_type_ = parseTypeName();
                 break;
             }
-            def->params_.push_back(parseIdentifier(true));
+            def->params_.push_back(arena_, parseIdentifier(true, true));
         } while (match(Token::COMMA));
     }
     consume(Token::RPAREN);
+    if (match(Token::ARROW)) {
+        if (match(Token::LPAREN)) {
+            do {
+                def->return_types_.push_back(arena_, parseTypeName());
+            } while (match(Token::COMMA));
+            consume(Token::RPAREN);
+        } else {
+            def->return_types_.push_back(arena_, parseTypeName());
+        }
+    }
     def->body_ = parseBlock();
+    def->end_line_ = current_token_.line;
     consume(Token::END);
     return def;
 }
 
-std::unique_ptr<Statement> Parser::parseReturnStatement() {
+Statement* Parser::parseReturnStatement() {
+    auto ret_stmt = arena_.make<ReturnStatement>();
+    ret_stmt->line_ = current_token_.line;
     consume(Token::RETURN);
-    auto ret_stmt = std::make_unique<ReturnStatement>();
-    if (!check(Token::END) && !check(Token::SEMICOLON) && !check(Token::EOS)) {
+    if (!check(Token::END) && !check(Token::ELSE) && !check(Token::ELSEIF) && !check(Token::UNTIL) &&
+        !check(Token::SEMICOLON) && !check(Token::EOS)) {
         do {
-            ret_stmt->exprs_.push_back(parseExpression());
+            ret_stmt->exprs_.push_back(arena_, parseExpression());
         } while (match(Token::COMMA));
     }
+    match(Token::SEMICOLON);
     return ret_stmt;
 }
 
-std::unique_ptr<TableConstructor> Parser::parseTableConstructor() {
-    auto table = std::make_unique<TableConstructor>();
+TableConstructor* Parser::parseTableConstructor() {
+    auto table = arena_.make<TableConstructor>();
     consume(Token::LBRACE);
 
-    while (!match(Token::RBRACE)) {
+    while (!check(Token::RBRACE)) {
         TableField field;
         if (match(Token::LBRACKET)) {
             field.key = parseExpression();
             consume(Token::RBRACKET);
             consume(Token::ASSIGN);
             field.value = parseExpression();
-        } else if (check(Token::IDENTIFIER)) {
-            // could be `key = value` or just `value`
-            auto id = parseIdentifier(false);
-            if (match(Token::ASSIGN)) {
-                field.key = std::make_unique<StringLiteral>(id->name_);
-                field.value = parseExpression();
-            } else {
-                field.key = nullptr; // List-style
-                field.value = std::move(id);
-            }
+        } else if (check(Token::IDENTIFIER) && lexer_.peek().type == Token::ASSIGN) {
+            int line = current_token_.line;
+            field.key = arena_.make<StringLiteral>(parseIdentifier(false)->name_);
+            field.key->line_ = line;
+            consume(Token::ASSIGN);
+            field.value = parseExpression();
         } else {
             field.key = nullptr; // List-style
             field.value = parseExpression();
         }
-        table->fields_.push_back(std::move(field));
+        table->fields_.push_back(arena_, field);
 
         if (!match(Token::COMMA) && !match(Token::SEMICOLON)) {
             break;
@@ -383,11 +486,88 @@ std::unique_ptr<TableConstructor> Parser::parseTableConstructor() {
 }
 
 
-// --- Stubs for remaining statements ---
-std::unique_ptr<Statement> Parser::parseDoStatement() { error("unimplemented: parseDoStatement"); return nullptr; }
-std::unique_ptr<Statement> Parser::parseForStatement() { error("unimplemented: parseForStatement"); return nullptr; }
-std::unique_ptr<Statement> Parser::parseRepeatStatement() { error("unimplemented: parseRepeatStatement"); return nullptr; }
-std::unique_ptr<Statement> Parser::parseFunctionStatement() { error("unimplemented: parseFunctionStatement"); return nullptr; }
-std::unique_ptr<Statement> Parser::parseGotoStatement() { error("unimplemented: parseGotoStatement"); return nullptr; }
-std::unique_ptr<Statement> Parser::parseLabelStatement() { error("unimplemented: parseLabelStatement"); return nullptr; }
-std::unique_ptr<Statement> Parser::parseBreakStatement() { consume(Token::BREAK); return std::make_unique<BreakStatement>(); }
\ No newline at end of file
+Statement* Parser::parseDoStatement() {
+    consume(Token::DO);
+    auto do_stmt = arena_.make<DoStatement>();
+    do_stmt->body_ = parseBlock();
+    consume(Token::END);
+    return do_stmt;
+}
+
+Statement* Parser::parseForStatement() {
+    consume(Token::FOR);
+    auto first = parseIdentifier(false);
+
+    if (match(Token::ASSIGN)) {
+        auto for_stmt = arena_.make<NumericForStatement>();
+        for_stmt->var_ = first;
+        for_stmt->start_ = parseExpression();
+        consume(Token::COMMA);
+        for_stmt->end_ = parseExpression();
+        if (match(Token::COMMA)) {
+            for_stmt->step_ = parseExpression();
+        }
+        consume(Token::DO);
+        for_stmt->body_ = parseBlock();
+        consume(Token::END);
+        return for_stmt;
+    }
+
+    auto for_stmt = arena_.make<GenericForStatement>();
+    for_stmt->names_.push_back(arena_, first);
+    while (match(Token::COMMA)) {
+        for_stmt->names_.push_back(arena_, parseIdentifier(false));
+    }
+    consume(Token::IN);
+    do {
+        for_stmt->exprs_.push_back(arena_, parseExpression());
+    } while (match(Token::COMMA));
+    consume(Token::DO);
+    for_stmt->body_ = parseBlock();
+    consume(Token::END);
+    return for_stmt;
+}
+
+Statement* Parser::parseRepeatStatement() {
+    consume(Token::REPEAT);
+    auto repeat_stmt = arena_.make<RepeatUntilStatement>();
+    repeat_stmt->body_ = parseBlock();
+    consume(Token::UNTIL);
+    repeat_stmt->condition_ = parseExpression();
+    return repeat_stmt;
+}
+
+// function a.b.c:m() is a store of the function value into `a.b.c.m`,
+// with `self` added as the first parameter
+Statement* Parser::parseFunctionStatement() {
+    int line = current_token_.line;
+    consume(Token::FUNCTION);
+    auto func_stmt = arena_.make<FunctionStatement>();
+    Expression* name = parseIdentifier(false);
+    name->line_ = line;
+    bool is_method = false;
+    while (check(Token::DOT) || check(Token::COLON)) {
+        is_method = check(Token::COLON);
+        advance();
+        name = arena_.make<TableAccess>(name, parseIdentifier(false));
+        name->line_ = line;
+        if (is_method) break;
+    }
+    func_stmt->name_ = name;
+    func_stmt->def_ = parseFunctionBody(line, is_method);
+    return func_stmt;
+}
+
+Statement* Parser::parseGotoStatement() {
+    consume(Token::GOTO);
+    return arena_.make<GotoStatement>(parseIdentifier(false)->name_);
+}
+
+Statement* Parser::parseLabelStatement() {
+    consume(Token::COLON_DB);
+    auto label = arena_.make<LabelStatement>(parseIdentifier(false)->name_);
+    consume(Token::COLON_DB);
+    return label;
+}
+
+Statement* Parser::parseBreakStatement() { consume(Token::BREAK); return arena_.make<BreakStatement>(); }
\ No newline at end of file
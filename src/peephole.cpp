@@ -0,0 +1,160 @@
+#include "peephole.hpp"
+#include "cfg.hpp"
+#include "object.hpp"
+#include <memory>
+
+namespace luao {
+
+namespace {
+
+constexpr int MAX_JUMP_CHAIN = 100; // bound for chains of jumps (`goto` can build cycles)
+
+// first instruction that is not a JMP along the chain starting at `pc`
+int final_target(const std::vector<Instruction>& code, int pc) {
+    for (int count = 0; count < MAX_JUMP_CHAIN; count++) {
+        if (GET_OPCODE(code[pc]) != OpCode::JMP) break;
+        int dest = jump_dest(code, pc);
+        if (dest == pc) break; // `goto` to itself
+        pc = dest;
+    }
+    return pc;
+}
+
+bool is_integer_constant(const LuaValue& v) {
+    return v.getType() == LuaType::NUMBER &&
+           std::dynamic_pointer_cast<LuaInteger>(v.getObject()) != nullptr;
+}
+
+// `LOADK r, K; OP r, x, r` (or `OP r, r, x` for commutative OP) becomes
+// `OPK r, x, K`: the loaded register is overwritten by the result, so the
+// constant never has to live in it. k marks swapped operands as the
+// compiler does.
+bool fuse_constant(Instruction load, Instruction& arith, const std::vector<LuaValue>& k) {
+    OpCode op = GET_OPCODE(arith);
+    if (op < OpCode::ADD || op > OpCode::BXOR) return false; // no K form for shifts
+    int r = GETARG_A(load);
+    int a = GETARG_A(arith), b = GETARG_B(arith), c = GETARG_C(arith);
+    if (a != r || b == c) return false;
+    bool commutative = op == OpCode::ADD || op == OpCode::MUL || op >= OpCode::BAND;
+    int other;
+    int swapped;
+    if (c == r) { other = b; swapped = 0; }
+    else if (b == r && commutative) { other = c; swapped = 1; }
+    else return false;
+
+    if (GET_OPCODE(load) == OpCode::LOADI) { // integer immediate: only ADDI exists
+        int imm = GETARG_sBx(load);
+        if (op != OpCode::ADD || imm < -128 || imm > 127) return false;
+        arith = static_cast<Instruction>(OpCode::ADDI);
+        SETARG_A(arith, a);
+        SETARG_B(arith, other);
+        SETARG_C(arith, imm);
+        SETARG_k(arith, swapped);
+        return true;
+    }
+    int idx = GETARG_Bx(load);
+    if (idx > MAXARG_C || k[idx].getType() != LuaType::NUMBER) return false;
+    if (op >= OpCode::BAND && !is_integer_constant(k[idx])) return false;
+    OpCode kop = static_cast<OpCode>(static_cast<int>(op) - (static_cast<int>(OpCode::ADD) - static_cast<int>(OpCode::ADDK)));
+    arith = static_cast<Instruction>(kop);
+    SETARG_A(arith, a);
+    SETARG_B(arith, other);
+    SETARG_C(arith, idx);
+    SETARG_k(arith, swapped);
+    return true;
+}
+
+} // namespace
+
+void optimize_code(std::vector<Instruction>& code, std::vector<Lineinfo>& lineinfo,
+                   std::vector<LocalVarinfo>& locvars, const std::vector<LuaValue>& k) {
+    int n = static_cast<int>(code.size());
+    if (n == 0 || static_cast<int>(lineinfo.size()) != n) return;
+
+    // 1. jump threading; an unconditional jump that ends at a return
+    // becomes that return
+    for (int pc = 0; pc < n; pc++) {
+        if (GET_OPCODE(code[pc]) != OpCode::JMP) continue;
+        int target = final_target(code, pc);
+        OpCode top = GET_OPCODE(code[target]);
+        bool conditional = pc > 0 && is_test_mode(GET_OPCODE(code[pc - 1]));
+        if (!conditional && (top == OpCode::RETURN0 || top == OpCode::RETURN1)) {
+            code[pc] = code[target];
+        } else if (target != jump_dest(code, pc)) {
+            SETARG_sJ(code[pc], target - pc - 1);
+        }
+    }
+
+    // 2. reachability from the entry; everything else is dead
+    std::vector<bool> dead(n, true);
+    std::vector<int> work{0};
+    std::vector<int> next;
+    while (!work.empty()) {
+        int pc = work.back();
+        work.pop_back();
+        if (pc < 0 || pc >= n || !dead[pc]) continue;
+        dead[pc] = false;
+        next.clear();
+        successors(code, pc, next);
+        work.insert(work.end(), next.begin(), next.end());
+    }
+
+    // any successor other than the next instruction: jumps, loops and skips
+    std::vector<bool> is_target(n + 2, false);
+    for (int pc = 0; pc < n; pc++) {
+        if (dead[pc]) continue;
+        next.clear();
+        successors(code, pc, next);
+        for (int t : next) {
+            if (t != pc + 1 && t >= 0) is_target[t] = true;
+        }
+    }
+    auto removable = [&](int pc) { return pc == 0 || !skips_next(GET_OPCODE(code[pc - 1])); };
+
+    // 3. pairwise fusions; the second instruction of a pair must not be a
+    // jump target, or the path landing there would lose the first
+    for (int pc = 0; pc < n; pc++) {
+        if (dead[pc]) continue;
+        Instruction& i = code[pc];
+        OpCode op = GET_OPCODE(i);
+        if (op == OpCode::RETURN && (GETARG_B(i) == 1 || GETARG_B(i) == 2)) {
+            SET_OPCODE(i, GETARG_B(i) == 1 ? OpCode::RETURN0 : OpCode::RETURN1);
+            continue;
+        }
+        if (op == OpCode::MOVE && GETARG_A(i) == GETARG_B(i) && removable(pc)) {
+            dead[pc] = true;
+            continue;
+        }
+        if (pc + 1 >= n || dead[pc + 1] || is_target[pc + 1]) continue;
+        Instruction& j = code[pc + 1];
+        OpCode nop = GET_OPCODE(j);
+        switch (op) {
+            case OpCode::MOVE: // MOVE a b; MOVE b a: the second copies a value back
+                if (nop == OpCode::MOVE && GETARG_A(j) == GETARG_B(i) && GETARG_B(j) == GETARG_A(i)) {
+                    dead[pc + 1] = true;
+                }
+                break;
+            case OpCode::LOADK:
+            case OpCode::LOADI:
+                if (removable(pc) && fuse_constant(i, j, k)) dead[pc] = true;
+                break;
+            case OpCode::CALL: // results of the call are returned as they are
+                if (GETARG_C(i) == 0 && nop == OpCode::RETURN &&
+                    GETARG_A(j) == GETARG_A(i) && GETARG_B(j) == 0) {
+                    SET_OPCODE(i, OpCode::TAILCALL);
+                }
+                break;
+            default:
+                break;
+        }
+    }
+
+    // 4. compaction
+    std::vector<Placement> order;
+    for (int pc = 0; pc < n; pc++) {
+        if (!dead[pc]) order.push_back({pc, pc});
+    }
+    if (static_cast<int>(order.size()) < n) relayout(code, lineinfo, locvars, order);
+}
+
+} // namespace luao
@@ -0,0 +1,185 @@
+#include <scheduler.hpp>
+
+#ifdef LUAO_USE_EPOLL
+
+#include <cerrno>
+#include <cstring>
+#include <object.hpp>
+#include <function.hpp>
+#include <table.hpp>
+#include <coroutine.hpp>
+#include <vm.hpp>
+#include <libs.hpp>
+#include <auxlib.hpp>
+#include <sys/socket.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+using namespace luao;
+
+/*
+    Native scheduler library: coroutines run as tasks of the VM's
+    Scheduler, and block on descriptors, timers and sleeps by yielding to
+    it. Waiting functions may only be called from a task; reads and
+    writes that can finish at once also work outside one.
+*/
+
+using IoOp = Scheduler::IoOp;
+
+static constexpr size_t READ_SIZE = 4096; /* default `max` of sched.read */
+
+static luaNumber check_number(VM& vm, int base_reg, int num_args, int n, const char* fname) {
+    const LuaValue& v = arg_at(vm, base_reg, num_args, n);
+    if (auto i = std::dynamic_pointer_cast<const LuaInteger>(v.getObject())) return static_cast<luaNumber>(i->getValue());
+    if (auto f = std::dynamic_pointer_cast<const LuaNumber>(v.getObject())) return f->getValue();
+    arg_error(n, fname, "number expected, got " + arg_typename(vm, base_reg, num_args, n));
+    return 0;
+}
+
+static luaNumber opt_number(VM& vm, int base_reg, int num_args, int n, const char* fname, luaNumber def) {
+    if (arg_at(vm, base_reg, num_args, n).getType() == LuaType::NIL) return def;
+    return check_number(vm, base_reg, num_args, n, fname);
+}
+
+static int check_fd(VM& vm, int base_reg, int num_args, int n, const char* fname) {
+    const LuaValue& v = arg_at(vm, base_reg, num_args, n);
+    auto i = std::dynamic_pointer_cast<const LuaInteger>(v.getObject());
+    if (!i || i->getValue() < 0 || i->getValue() > INT32_MAX) {
+        arg_error(n, fname, "file descriptor expected");
+    }
+    return static_cast<int>(i->getValue());
+}
+
+static int push(VM& vm, int base_reg, const std::vector<LuaValue>& values) {
+    auto& stack = vm.get_stack_mutable();
+    for (size_t j = 0; j < values.size(); j++) *stack[base_reg + j] = values[j];
+    return static_cast<int>(values.size());
+}
+
+// returns the pair of descriptors, or nil and the error
+static int push_fds(VM& vm, int base_reg, int rc, const int fds[2]) {
+    if (rc < 0) return push(vm, base_reg, {LuaValue(), make_string(std::strerror(errno))});
+    return push(vm, base_reg, {make_int(fds[0]), make_int(fds[1])});
+}
+
+// sched.spawn(f, ...): runs f(...) as a task from the next pass of
+// sched.run; returns the task's coroutine
+static int schedlib_spawn(VM& vm, int base_reg, int num_args) {
+    const LuaValue& f = arg_at(vm, base_reg, num_args, 1);
+    if (f.getType() != LuaType::FUNCTION) {
+        arg_error(1, "spawn", "function expected, got " + arg_typename(vm, base_reg, num_args, 1));
+    }
+    auto co = std::make_shared<LuaCoroutine>(f);
+    std::vector<LuaValue> args;
+    for (int j = 1; j < num_args; j++) args.push_back(*vm.get_stack()[base_reg + j]);
+    vm.get_scheduler().spawn(co, std::move(args));
+    *vm.get_stack_mutable()[base_reg] = LuaValue(co, LuaType::THREAD);
+    return 1;
+}
+
+// sched.run(): runs tasks until every one has finished
+static int schedlib_run(VM& vm, int base_reg, int) {
+    vm.get_scheduler().run(vm, base_reg);
+    return 0;
+}
+
+// sched.sleep(seconds)
+static int schedlib_sleep(VM& vm, int base_reg, int num_args) {
+    vm.get_scheduler().sleep(vm, check_number(vm, base_reg, num_args, 1, "sleep"));
+    return vm.yield(base_reg, 0);
+}
+
+// sched.readable(fd [, timeout]) and sched.writable(fd [, timeout])
+template <IoOp op>
+static int schedlib_ready(VM& vm, int base_reg, int num_args) {
+    const char* fname = op == IoOp::READABLE ? "readable" : "writable";
+    int fd = check_fd(vm, base_reg, num_args, 1, fname);
+    vm.get_scheduler().wait(vm, fd, op, opt_number(vm, base_reg, num_args, 2, fname, -1));
+    return vm.yield(base_reg, 0);
+}
+
+// sched.read(fd [, max [, timeout]])
+static int schedlib_read(VM& vm, int base_reg, int num_args) {
+    int fd = check_fd(vm, base_reg, num_args, 1, "read");
+    luaNumber max = opt_number(vm, base_reg, num_args, 2, "read", READ_SIZE);
+    if (!(max >= 1 && max <= INT32_MAX)) arg_error(2, "read", "size out of range");
+    double timeout = opt_number(vm, base_reg, num_args, 3, "read", -1);
+
+    std::string unused;
+    size_t written = 0;
+    std::vector<LuaValue> results;
+    if (Scheduler::attempt(fd, IoOp::READ, static_cast<size_t>(max), unused, written, results)) {
+        return push(vm, base_reg, results);
+    }
+    vm.get_scheduler().wait(vm, fd, IoOp::READ, timeout, static_cast<size_t>(max));
+    return vm.yield(base_reg, 0);
+}
+
+// sched.write(fd, data [, timeout])
+static int schedlib_write(VM& vm, int base_reg, int num_args) {
+    int fd = check_fd(vm, base_reg, num_args, 1, "write");
+    auto str = std::dynamic_pointer_cast<const LuaString>(arg_at(vm, base_reg, num_args, 2).getObject());
+    if (!str) arg_error(2, "write", "string expected");
+    double timeout = opt_number(vm, base_reg, num_args, 3, "write", -1);
+
+    std::string data = str->getValue();
+    size_t written = 0;
+    std::vector<LuaValue> results;
+    if (Scheduler::attempt(fd, IoOp::WRITE, 0, data, written, results)) {
+        return push(vm, base_reg, results);
+    }
+    vm.get_scheduler().wait(vm, fd, IoOp::WRITE, timeout, 0, std::move(data), written);
+    return vm.yield(base_reg, 0);
+}
+
+// sched.close(fd): wakes its waiting tasks with "closed", then closes it
+static int schedlib_close(VM& vm, int base_reg, int num_args) {
+    int fd = check_fd(vm, base_reg, num_args, 1, "close");
+    vm.get_scheduler().forget(vm, fd);
+    ::close(fd);
+    return 0;
+}
+
+// sched.pipe(): read end, write end
+static int schedlib_pipe(VM& vm, int base_reg, int) {
+    int fds[2];
+    return push_fds(vm, base_reg, pipe2(fds, O_NONBLOCK | O_CLOEXEC), fds);
+}
+
+// sched.socketpair(): two connected stream sockets
+static int schedlib_socketpair(VM& vm, int base_reg, int) {
+    int fds[2];
+    return push_fds(vm, base_reg, socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0, fds), fds);
+}
+
+// sched.now(): seconds on a monotonic clock
+static int schedlib_now(VM& vm, int base_reg, int) {
+    *vm.get_stack_mutable()[base_reg] = LuaValue(std::make_shared<LuaNumber>(Scheduler::now()), LuaType::NUMBER);
+    return 1;
+}
+
+LuaValue openschedlib() {
+    auto table = std::make_shared<LuaTable>();
+    const std::pair<const char*, LuaNativeFunction::CFunc> funcs[] = {
+        {"spawn", schedlib_spawn},
+        {"run", schedlib_run},
+        {"sleep", schedlib_sleep},
+        {"readable", schedlib_ready<IoOp::READABLE>},
+        {"writable", schedlib_ready<IoOp::WRITABLE>},
+        {"read", schedlib_read},
+        {"write", schedlib_write},
+        {"close", schedlib_close},
+        {"pipe", schedlib_pipe},
+        {"socketpair", schedlib_socketpair},
+        {"now", schedlib_now},
+    };
+    for (const auto& [name, fn] : funcs) {
+        table->set(
+            LuaValue(std::make_shared<LuaString>(name), LuaType::STRING),
+            LuaValue(std::make_shared<LuaNativeFunction>(fn), LuaType::FUNCTION)
+        );
+    }
+    return LuaValue(table, LuaType::TABLE);
+}
+
+#endif // LUAO_USE_EPOLL
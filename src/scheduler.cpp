@@ -0,0 +1,285 @@
+#include "scheduler.hpp"
+
+#ifdef LUAO_USE_EPOLL
+
+#include <config.hpp>
+#include <vm.hpp>
+#include <auxlib.hpp>
+#include <algorithm>
+#include <cerrno>
+#include <cmath>
+#include <cstring>
+#include <stdexcept>
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <unistd.h>
+
+namespace luao {
+
+namespace {
+
+bool would_block(int err) {
+    return err == EAGAIN || err == EWOULDBLOCK || err == EINTR;
+}
+
+constexpr int MAX_EVENTS = 64; /* descriptors taken from one epoll_wait */
+
+} // namespace
+
+Scheduler::Scheduler() : epfd_(epoll_create1(EPOLL_CLOEXEC)) {
+    if (epfd_ < 0) throw std::runtime_error(std::string("epoll_create1: ") + std::strerror(errno));
+}
+
+Scheduler::~Scheduler() {
+    ::close(epfd_);
+}
+
+double Scheduler::now() {
+    return std::chrono::duration<double>(Clock::now().time_since_epoch()).count();
+}
+
+void Scheduler::spawn(std::shared_ptr<LuaCoroutine> co, std::vector<LuaValue> args) {
+    auto task = std::make_shared<Task>();
+    task->co = std::move(co);
+    task->args = std::move(args);
+    ready_.push_back(std::move(task));
+}
+
+bool Scheduler::in_task(const VM& vm) const {
+    return current_ && vm.running_coroutine() == current_->co.get() && vm.is_yieldable();
+}
+
+const Scheduler::TaskRef& Scheduler::current(VM& vm, const char* what) const {
+    if (!in_task(vm)) throw LuaError(std::string("attempt to ") + what + " outside a scheduler task");
+    return current_;
+}
+
+bool Scheduler::attempt(int fd, IoOp op, size_t max, std::string& data, size_t& written,
+                        std::vector<LuaValue>& results) {
+    int flags = fcntl(fd, F_GETFL);
+    if (flags >= 0 && !(flags & O_NONBLOCK)) fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+
+    if (op == IoOp::READ) {
+        std::string buffer(max, '\0');
+        ssize_t n = ::read(fd, buffer.data(), max);
+        if (n < 0 && would_block(errno)) return false;
+        if (n > 0) {
+            buffer.resize(static_cast<size_t>(n));
+            results = {make_string(std::move(buffer))};
+        } else {
+            results = {LuaValue(), make_string(n == 0 ? "closed" : std::strerror(errno))};
+        }
+        return true;
+    }
+
+    while (!data.empty()) {
+        ssize_t n = ::write(fd, data.data(), data.size());
+        if (n < 0) {
+            if (would_block(errno)) return false;
+            results = {make_int(static_cast<luaInt>(written)), make_string(std::strerror(errno))};
+            return true;
+        }
+        data.erase(0, static_cast<size_t>(n));
+        written += static_cast<size_t>(n);
+    }
+    results = {make_int(static_cast<luaInt>(written))};
+    return true;
+}
+
+void Scheduler::add_timer(const TaskRef& task, double seconds) {
+    auto delay = std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(std::max(seconds, 0.0)));
+    task->timer = timers_.emplace(Clock::now() + delay, task);
+    task->timed = true;
+}
+
+void Scheduler::sleep(VM& vm, double seconds) {
+    const TaskRef& task = current(vm, "sleep");
+    task->waiting = true;
+    task->fd = -1;
+    add_timer(task, seconds);
+}
+
+void Scheduler::wait(VM& vm, int fd, IoOp op, double timeout, size_t max, std::string data, size_t written) {
+    const TaskRef& task = current(vm, "wait");
+    bool reads = op == IoOp::READABLE || op == IoOp::READ;
+    Watch& watch = watches_[fd];
+    TaskRef& slot = reads ? watch.reader : watch.writer;
+    if (slot) {
+        throw LuaError("another task is waiting to " + std::string(reads ? "read" : "write") +
+                       " fd " + std::to_string(fd));
+    }
+    slot = task;
+    try {
+        update_watch(fd);
+    } catch (...) {
+        slot = nullptr;
+        if (watch.events == 0) watches_.erase(fd);
+        throw;
+    }
+    io_waits_++;
+    task->waiting = true;
+    task->fd = fd;
+    task->op = op;
+    task->max = max;
+    task->data = std::move(data);
+    task->written = written;
+    if (timeout >= 0) add_timer(task, timeout);
+}
+
+void Scheduler::update_watch(int fd) {
+    auto it = watches_.find(fd);
+    if (it == watches_.end()) return;
+    Watch& watch = it->second;
+    uint32_t want = 0;
+    if (watch.reader) want |= EPOLLIN;
+    if (watch.writer) want |= EPOLLOUT;
+    if (want != watch.events) {
+        epoll_event ev{};
+        ev.events = want;
+        ev.data.fd = fd;
+        int ctl = EPOLL_CTL_MOD;
+        if (watch.events == 0) {
+            ctl = EPOLL_CTL_ADD;
+        } else if (want == 0) {
+            ctl = EPOLL_CTL_DEL;
+        }
+        // removing a descriptor that was already closed is not an error
+        if (epoll_ctl(epfd_, ctl, fd, &ev) < 0 && ctl != EPOLL_CTL_DEL) {
+            throw LuaError("cannot wait on fd " + std::to_string(fd) + ": " + std::strerror(errno));
+        }
+        watch.events = want;
+    }
+    if (want == 0) watches_.erase(it);
+}
+
+void Scheduler::wake(const TaskRef& task, std::vector<LuaValue> results) {
+    if (task->timed) {
+        timers_.erase(task->timer);
+        task->timed = false;
+    }
+    if (task->fd >= 0) {
+        auto it = watches_.find(task->fd);
+        if (it != watches_.end()) {
+            bool reads = task->op == IoOp::READABLE || task->op == IoOp::READ;
+            (reads ? it->second.reader : it->second.writer) = nullptr;
+            update_watch(task->fd);
+        }
+        io_waits_--;
+        task->fd = -1;
+        task->data.clear();
+    }
+    task->waiting = false;
+    task->args = std::move(results);
+    ready_.push_back(task);
+}
+
+void Scheduler::fail(VM& vm, const TaskRef& task, const char* error) {
+    if (task->fd < 0) {
+        wake(task, {}); // a sleep is over
+        return;
+    }
+    switch (task->op) {
+        case IoOp::READABLE:
+        case IoOp::WRITABLE:
+            wake(task, {vm.boolean(false), make_string(error)});
+            break;
+        case IoOp::READ:
+            wake(task, {LuaValue(), make_string(error)});
+            break;
+        case IoOp::WRITE:
+            wake(task, {make_int(static_cast<luaInt>(task->written)), make_string(error)});
+            break;
+    }
+}
+
+void Scheduler::forget(VM& vm, int fd) {
+    auto it = watches_.find(fd);
+    if (it == watches_.end()) return;
+    TaskRef reader = it->second.reader;
+    TaskRef writer = it->second.writer;
+    if (reader) fail(vm, reader, "closed");
+    if (writer) fail(vm, writer, "closed");
+}
+
+void Scheduler::on_ready(VM& vm, int fd, uint32_t events) {
+    // errors and hang-ups wake both sides; the read or write reports them
+    const uint32_t any = EPOLLERR | EPOLLHUP;
+    for (bool reads : {true, false}) {
+        auto it = watches_.find(fd);
+        if (it == watches_.end()) return;
+        TaskRef task = reads ? it->second.reader : it->second.writer;
+        if (!task || !(events & ((reads ? EPOLLIN : EPOLLOUT) | any))) continue;
+        if (task->op == IoOp::READABLE || task->op == IoOp::WRITABLE) {
+            wake(task, {vm.boolean(true)});
+            continue;
+        }
+        std::vector<LuaValue> results;
+        if (attempt(fd, task->op, task->max, task->data, task->written, results)) {
+            wake(task, std::move(results));
+        }
+    }
+}
+
+void Scheduler::resume(VM& vm, const TaskRef& task, int scratch) {
+    int nargs = static_cast<int>(task->args.size());
+    if (!vm.ensure_stack(scratch + nargs + LUAI_MINSTACK)) throw LuaError("stack overflow");
+    auto& stack = vm.get_stack_mutable();
+    for (int j = 0; j < nargs; j++) *stack[scratch + j] = std::move(task->args[j]);
+    task->args.clear();
+
+    current_ = task;
+    try {
+        vm.resume(*task->co, scratch, nargs);
+    } catch (...) {
+        current_ = nullptr;
+        throw;
+    }
+    current_ = nullptr;
+    // a task that yields without waiting on anything runs again next pass
+    if (task->co->getStatus() != LuaCoroutine::Status::DEAD && !task->waiting) {
+        ready_.push_back(task);
+    }
+}
+
+void Scheduler::run(VM& vm, int scratch) {
+    if (running_) throw LuaError("sched.run is already running");
+    struct RunningGuard {
+        bool& running;
+        explicit RunningGuard(bool& r) : running(r) { running = true; }
+        ~RunningGuard() { running = false; }
+    } guard(running_);
+
+    epoll_event events[MAX_EVENTS];
+    for (;;) {
+        // tasks readied during this pass wait for the next one, after the poll
+        for (size_t n = ready_.size(); n > 0; n--) {
+            TaskRef task = std::move(ready_.front());
+            ready_.pop_front();
+            resume(vm, task, scratch);
+        }
+        if (ready_.empty() && timers_.empty() && io_waits_ == 0) return;
+
+        int timeout_ms = -1;
+        if (!ready_.empty()) {
+            timeout_ms = 0;
+        } else if (!timers_.empty()) {
+            auto left = std::chrono::duration<double, std::milli>(timers_.begin()->first - Clock::now()).count();
+            timeout_ms = static_cast<int>(std::clamp(std::ceil(left), 0.0, 86400000.0));
+        }
+        int n = epoll_wait(epfd_, events, MAX_EVENTS, timeout_ms);
+        if (n < 0 && errno != EINTR) {
+            throw LuaError(std::string("epoll_wait: ") + std::strerror(errno));
+        }
+        for (int i = 0; i < n; i++) on_ready(vm, events[i].data.fd, events[i].events);
+
+        auto now = Clock::now();
+        while (!timers_.empty() && timers_.begin()->first <= now) {
+            TaskRef task = timers_.begin()->second; // wake() erases the timer
+            fail(vm, task, "timeout");
+        }
+    }
+}
+
+} // namespace luao
+
+#endif // LUAO_USE_EPOLL
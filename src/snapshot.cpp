@@ -0,0 +1,94 @@
+#include "snapshot.hpp"
+#include <closure.hpp>
+#include <upvalue.hpp>
+#include <vm.hpp>
+#include <stdexcept>
+#include <unordered_map>
+
+namespace luao {
+
+namespace {
+
+class Copier {
+public:
+    LuaValue copy(const LuaValue& v) {
+        const LuaObject* obj = v.getObject().get();
+        if (v.getType() == LuaType::TABLE) {
+            if (auto it = values_.find(obj); it != values_.end()) return it->second;
+            auto table = std::make_shared<LuaTable>();
+            LuaValue out(table, LuaType::TABLE);
+            values_.emplace(obj, out); // before the entries, which may lead back here
+            table->copyFrom(static_cast<const LuaTable&>(*obj), [this](const LuaValue& x) { return copy(x); });
+            return out;
+        }
+        if (v.getType() == LuaType::FUNCTION) {
+            auto closure = std::dynamic_pointer_cast<LuaClosure>(v.getObject());
+            if (!closure) return v; // native functions are shared
+            if (auto it = values_.find(obj); it != values_.end()) return it->second;
+            auto fresh = std::make_shared<LuaClosure>(closure->getFunction());
+            LuaValue out(fresh, LuaType::FUNCTION);
+            values_.emplace(obj, out);
+            for (const auto& uv : closure->getUpvalues()) {
+                fresh->getUpvalues().push_back(uv ? upvalue(uv) : nullptr);
+            }
+            return out;
+        }
+        switch (v.getType()) {
+            case LuaType::NIL:
+            case LuaType::BOOLEAN:
+            case LuaType::NUMBER:
+            case LuaType::STRING:
+                return v;
+            default:
+                throw std::runtime_error("snapshot cannot hold a " + v.typeName() + " value");
+        }
+    }
+
+private:
+    std::unordered_map<const void*, LuaValue> values_;
+    std::unordered_map<const UpValue*, std::shared_ptr<UpValue>> upvalues_;
+
+    std::shared_ptr<UpValue> upvalue(const std::shared_ptr<UpValue>& uv) {
+        if (auto it = upvalues_.find(uv.get()); it != upvalues_.end()) return it->second;
+        auto fresh = std::make_shared<UpValue>(LuaValue());
+        upvalues_.emplace(uv.get(), fresh);
+        fresh->setValue(copy(uv->getValue()));
+        return fresh;
+    }
+};
+
+} // namespace
+
+std::shared_ptr<const VMSnapshot> VMSnapshot::capture(std::shared_ptr<LuaFunction> prelude) {
+    if (!prelude) {
+        UpvalDesc env;
+        env.name = "_ENV";
+        env.inStack = true;
+        env.idx = 0;
+        prelude = std::make_shared<LuaFunction>(std::vector<Instruction>{static_cast<Instruction>(OpCode::RETURN0)},
+                                                std::vector<LuaValue>{}, std::vector<LuaValue>{},
+                                                std::vector<UpvalDesc>{env}, std::vector<LocalVarinfo>{});
+    }
+
+    VM vm;
+    try {
+        vm.load(std::make_shared<LuaClosure>(prelude));
+        vm.run();
+    } catch (const LuaError& e) {
+        throw std::runtime_error(std::string("snapshot prelude failed: ") + e.what());
+    }
+    // closures made by the prelude must not point into the scratch stack
+    vm.close_upvalues(0);
+
+    auto env = std::static_pointer_cast<LuaTable>(vm.get_stack()[0]->getObject());
+    std::shared_ptr<const VMSnapshot> snapshot(new VMSnapshot(env));
+    snapshot->instantiate(); // throws now rather than in every VM booted from it
+    return snapshot;
+}
+
+std::shared_ptr<LuaTable> VMSnapshot::instantiate() const {
+    Copier copier;
+    return std::static_pointer_cast<LuaTable>(copier.copy(LuaValue(env_, LuaType::TABLE)).getObject());
+}
+
+} // namespace luao
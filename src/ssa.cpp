@@ -0,0 +1,935 @@
+#include "ssa.hpp"
+#include <config.hpp>
+#include <algorithm>
+#include <memory>
+
+namespace luao {
+
+namespace {
+
+constexpr int SSA_MAX_CODE = 20000; // bigger functions are left as generated
+constexpr int HOIST_ROUNDS = 3;     // LICM repeats while something moves
+
+enum class Effect {
+    PURE,  // no side effect, cannot fail
+    LOAD,  // reads a table (first operand); pure on an unescaped one
+    STORE, // writes a table (first operand)
+    OTHER
+};
+
+Effect effect_of(OpCode op) {
+    switch (op) {
+        case OpCode::MOVE: case OpCode::LOADI: case OpCode::LOADF: case OpCode::LOADK:
+        case OpCode::LOADFALSE: case OpCode::LOADTRUE: case OpCode::LOADNIL:
+        case OpCode::GETUPVAL: case OpCode::NEWTABLE: case OpCode::CLOSURE: case OpCode::NOT:
+        case OpCode::ADDINT: case OpCode::ADDIINT: case OpCode::SUBINT: case OpCode::MULINT:
+        case OpCode::ADDFLT: case OpCode::SUBFLT: case OpCode::MULFLT: case OpCode::DIVFLT:
+            return Effect::PURE;
+        case OpCode::GETTABLE: case OpCode::GETI: case OpCode::GETFIELD: case OpCode::GETFIELDT:
+        case OpCode::LEN:
+            return Effect::LOAD;
+        case OpCode::SETTABLE: case OpCode::SETI: case OpCode::SETFIELD: case OpCode::SETFIELDT:
+        case OpCode::SETLIST:
+            return Effect::STORE;
+        default:
+            return Effect::OTHER;
+    }
+}
+
+bool is_typed_arith(OpCode op) {
+    return op >= OpCode::ADDINT && op <= OpCode::DIVFLT;
+}
+
+bool is_field_access(OpCode op) {
+    switch (op) {
+        case OpCode::GETFIELD: case OpCode::GETFIELDT: case OpCode::GETI:
+        case OpCode::SETFIELD: case OpCode::SETFIELDT: case OpCode::SETI:
+            return true;
+        default:
+            return false;
+    }
+}
+
+bool is_field_store(OpCode op) {
+    return op == OpCode::SETFIELD || op == OpCode::SETFIELDT || op == OpCode::SETI;
+}
+
+// field a constant-key access names: integer key, or string constant index
+std::pair<bool, int> field_key(Instruction i) {
+    OpCode op = GET_OPCODE(i);
+    int key = is_field_store(op) ? GETARG_B(i) : GETARG_C(i);
+    return {op == OpCode::GETI || op == OpCode::SETI, key};
+}
+
+// Registers `i` reads and writes. Open ranges (B or C of 0) run to the top
+// of the frame, and a call clobbers every register from its base up.
+// `captures` lists the registers each nested prototype captures.
+void operands(Instruction i, int nregs, const std::vector<std::vector<int>>& captures,
+              std::vector<int>& reads, std::vector<int>& writes) {
+    OpCode op = GET_OPCODE(i);
+    int a = GETARG_A(i), b = GETARG_B(i), c = GETARG_C(i);
+    bool k = GETARG_k(i);
+    auto one = [nregs](std::vector<int>& out, int r) {
+        if (r < nregs) out.push_back(r);
+    };
+    auto range = [nregs](std::vector<int>& out, int from, int to) { // [from, to)
+        for (int r = from; r < to && r < nregs; r++) out.push_back(r);
+    };
+    switch (op) {
+        case OpCode::MOVE: case OpCode::UNM: case OpCode::BNOT: case OpCode::NOT: case OpCode::LEN:
+        case OpCode::GETI: case OpCode::GETFIELD: case OpCode::GETFIELDT:
+        case OpCode::ADDI: case OpCode::SHRI: case OpCode::SHLI: case OpCode::ADDIINT:
+            one(reads, b);
+            one(writes, a);
+            break;
+        case OpCode::LOADI: case OpCode::LOADF: case OpCode::LOADK: case OpCode::LOADKX:
+        case OpCode::LOADFALSE: case OpCode::LFALSESKIP: case OpCode::LOADTRUE:
+        case OpCode::GETUPVAL: case OpCode::GETTABUP: case OpCode::NEWTABLE:
+            one(writes, a);
+            break;
+        case OpCode::LOADNIL:
+            range(writes, a, a + b + 1);
+            break;
+        case OpCode::SETUPVAL: case OpCode::TBC: case OpCode::TEST: case OpCode::CHECKTYPE:
+        case OpCode::EQK: case OpCode::EQI: case OpCode::LTI: case OpCode::LEI:
+        case OpCode::GTI: case OpCode::GEI: case OpCode::RETURN1: case OpCode::MMBINI: case OpCode::MMBINK:
+            one(reads, a);
+            break;
+        case OpCode::SETTABUP:
+            if (!k) one(reads, c);
+            break;
+        case OpCode::GETTABLE:
+            one(reads, b);
+            one(reads, c);
+            one(writes, a);
+            break;
+        case OpCode::SETTABLE:
+            one(reads, a);
+            one(reads, b);
+            if (!k) one(reads, c);
+            break;
+        case OpCode::SETI: case OpCode::SETFIELD: case OpCode::SETFIELDT:
+            one(reads, a);
+            if (!k) one(reads, c);
+            break;
+        case OpCode::SELF:
+            one(reads, b);
+            if (!k) one(reads, c);
+            range(writes, a, a + 2);
+            break;
+        case OpCode::ADDK: case OpCode::SUBK: case OpCode::MULK: case OpCode::MODK: case OpCode::POWK:
+        case OpCode::DIVK: case OpCode::IDIVK: case OpCode::BANDK: case OpCode::BORK: case OpCode::BXORK:
+            one(reads, b);
+            one(writes, a);
+            break;
+        case OpCode::ADD: case OpCode::SUB: case OpCode::MUL: case OpCode::MOD: case OpCode::POW:
+        case OpCode::DIV: case OpCode::IDIV: case OpCode::BAND: case OpCode::BOR: case OpCode::BXOR:
+        case OpCode::SHL: case OpCode::SHR:
+        case OpCode::ADDINT: case OpCode::SUBINT: case OpCode::MULINT:
+        case OpCode::ADDFLT: case OpCode::SUBFLT: case OpCode::MULFLT: case OpCode::DIVFLT:
+            one(reads, b);
+            one(reads, c);
+            one(writes, a);
+            break;
+        case OpCode::MMBIN: case OpCode::EQ: case OpCode::LT: case OpCode::LE:
+        case OpCode::LTINT: case OpCode::LEINT:
+            one(reads, a);
+            one(reads, b);
+            break;
+        case OpCode::CONCAT:
+            range(reads, a, a + b);
+            range(writes, a, a + b);
+            break;
+        case OpCode::TESTSET:
+            one(reads, b);
+            one(reads, a);
+            one(writes, a);
+            break;
+        case OpCode::CALL:
+        case OpCode::TAILCALL:
+            range(reads, a, b != 0 ? a + b : nregs);
+            range(writes, a, nregs);
+            break;
+        case OpCode::RETURN:
+            range(reads, a, b != 0 ? a + b - 1 : nregs);
+            break;
+        case OpCode::FORPREP:
+            range(reads, a, a + 3);
+            range(writes, a, a + 4);
+            break;
+        case OpCode::FORLOOP:
+            range(reads, a, a + 3);
+            one(writes, a);
+            one(writes, a + 1);
+            one(writes, a + 3);
+            break;
+        case OpCode::TFORPREP:
+            range(reads, a, a + 4);
+            break;
+        case OpCode::TFORCALL:
+            range(reads, a, a + 4);
+            range(writes, a + 4, nregs);
+            break;
+        case OpCode::TFORLOOP:
+            one(reads, a + 4);
+            one(reads, a + 2);
+            one(writes, a + 2);
+            break;
+        case OpCode::SETLIST:
+            range(reads, a, b != 0 ? a + b + 1 : nregs);
+            break;
+        case OpCode::CLOSURE: {
+            int idx = GETARG_Bx(i);
+            if (idx < static_cast<int>(captures.size())) {
+                for (int r : captures[idx]) one(reads, r);
+            }
+            one(writes, a);
+            break;
+        }
+        case OpCode::VARARG:
+            range(writes, a, c != 0 ? a + c - 1 : nregs);
+            break;
+        default: // JMP, CLOSE, RETURN0, VARARGPREP, EXTRAARG
+            break;
+    }
+}
+
+} // namespace
+
+SsaFunction::SsaFunction(const std::vector<Instruction>& code, const std::vector<LuaValue>& protos, int nregs)
+    : code_(code), nregs_(std::max(nregs, 1)) {
+    pinned_.assign(nregs_, false);
+    std::vector<std::vector<int>> captures(protos.size());
+    for (size_t n = 0; n < protos.size(); n++) {
+        auto fn = std::dynamic_pointer_cast<LuaFunction>(protos[n].getObject());
+        if (!fn) continue;
+        for (const auto& uv : fn->getUpvalDescs()) {
+            if (uv.inStack && uv.idx < nregs_) {
+                captures[n].push_back(uv.idx);
+                pinned_[uv.idx] = true;
+            }
+        }
+    }
+    insns_.resize(code_.size());
+    for (size_t pc = 0; pc < code_.size(); pc++) {
+        operands(code_[pc], nregs_, captures, insns_[pc].reads, insns_[pc].writes);
+    }
+    buildBlocks();
+    buildDominators();
+    placePhis();
+    std::vector<int> entry(nregs_);
+    for (int r = 0; r < nregs_; r++) {
+        entry[r] = static_cast<int>(values_.size());
+        values_.push_back({.reg = r, .args = {}});
+    }
+    rename(0, std::move(entry));
+    analyzeEscapes();
+}
+
+// Basic blocks end at branches and before branch targets; blocks not
+// reachable from the entry keep block -1 and are never touched.
+void SsaFunction::buildBlocks() {
+    int n = static_cast<int>(code_.size());
+    std::vector<bool> leader(n + 1, false);
+    leader[0] = true;
+    std::vector<int> next;
+    for (int pc = 0; pc < n; pc++) {
+        next.clear();
+        successors(code_, pc, next);
+        if (next.size() == 1 && next[0] == pc + 1) continue;
+        for (int t : next) {
+            if (t >= 0 && t < n) leader[t] = true;
+        }
+        leader[pc + 1] = true;
+    }
+    std::vector<int> block_of(n);
+    for (int pc = 0; pc < n; pc++) {
+        if (leader[pc]) {
+            blocks_.emplace_back();
+            blocks_.back().first = pc;
+        }
+        blocks_.back().last = pc;
+        block_of[pc] = static_cast<int>(blocks_.size()) - 1;
+    }
+    for (auto& b : blocks_) {
+        next.clear();
+        successors(code_, b.last, next);
+        for (int t : next) {
+            if (t < 0 || t >= n) continue;
+            int s = block_of[t];
+            if (std::find(b.succs.begin(), b.succs.end(), s) == b.succs.end()) b.succs.push_back(s);
+        }
+    }
+
+    // depth-first postorder from the entry
+    int nb = static_cast<int>(blocks_.size());
+    std::vector<bool> seen(nb, false);
+    std::vector<std::pair<int, size_t>> stack{{0, 0}};
+    seen[0] = true;
+    while (!stack.empty()) {
+        int b = stack.back().first;
+        size_t idx = stack.back().second;
+        if (idx < blocks_[b].succs.size()) {
+            stack.back().second++;
+            int s = blocks_[b].succs[idx];
+            if (!seen[s]) {
+                seen[s] = true;
+                stack.push_back({s, 0});
+            }
+        } else {
+            rpo_.push_back(b);
+            stack.pop_back();
+        }
+    }
+    std::reverse(rpo_.begin(), rpo_.end());
+    for (int b : rpo_) {
+        for (int s : blocks_[b].succs) blocks_[s].preds.push_back(b);
+        for (int pc = blocks_[b].first; pc <= blocks_[b].last; pc++) insns_[pc].block = b;
+    }
+}
+
+// Cooper, Harvey and Kennedy's iterative algorithm over reverse postorder
+void SsaFunction::buildDominators() {
+    std::vector<int> order(blocks_.size(), -1);
+    for (size_t n = 0; n < rpo_.size(); n++) order[rpo_[n]] = static_cast<int>(n);
+    auto intersect = [&](int a, int b) {
+        while (a != b) {
+            while (order[a] > order[b]) a = blocks_[a].idom;
+            while (order[b] > order[a]) b = blocks_[b].idom;
+        }
+        return a;
+    };
+    blocks_[0].idom = 0;
+    bool changed = true;
+    while (changed) {
+        changed = false;
+        for (int b : rpo_) {
+            if (b == 0) continue;
+            int idom = -1;
+            for (int p : blocks_[b].preds) {
+                if (blocks_[p].idom < 0) continue;
+                idom = idom < 0 ? p : intersect(p, idom);
+            }
+            if (idom != blocks_[b].idom) {
+                blocks_[b].idom = idom;
+                changed = true;
+            }
+        }
+    }
+    for (int b : rpo_) {
+        if (b != 0) blocks_[blocks_[b].idom].children.push_back(b);
+    }
+}
+
+// phis on the iterated dominance frontier of each register's writes
+void SsaFunction::placePhis() {
+    int nb = static_cast<int>(blocks_.size());
+    std::vector<std::vector<int>> frontier(nb);
+    for (int b : rpo_) {
+        if (blocks_[b].preds.size() < 2) continue;
+        for (int p : blocks_[b].preds) {
+            for (int runner = p; runner != blocks_[b].idom; runner = blocks_[runner].idom) {
+                auto& df = frontier[runner];
+                if (std::find(df.begin(), df.end(), b) == df.end()) df.push_back(b);
+            }
+        }
+    }
+
+    std::vector<std::vector<int>> writers(nregs_); // blocks writing each register
+    for (int b : rpo_) {
+        for (int pc = blocks_[b].first; pc <= blocks_[b].last; pc++) {
+            for (int r : insns_[pc].writes) {
+                if (writers[r].empty() || writers[r].back() != b) writers[r].push_back(b);
+            }
+        }
+    }
+    std::vector<int> has_phi(nb, -1);
+    std::vector<int> queued(nb, -1);
+    for (int r = 0; r < nregs_; r++) {
+        std::vector<int> work;
+        for (int b : writers[r]) {
+            if (queued[b] != r) {
+                queued[b] = r;
+                work.push_back(b);
+            }
+        }
+        while (!work.empty()) {
+            int b = work.back();
+            work.pop_back();
+            for (int f : frontier[b]) {
+                if (has_phi[f] == r) continue;
+                has_phi[f] = r;
+                Value phi{.reg = r, .block = f, .phi = true, .args = std::vector<int>(blocks_[f].preds.size(), -1)};
+                blocks_[f].phis.push_back(static_cast<int>(values_.size()));
+                values_.push_back(std::move(phi));
+                if (queued[f] != r) {
+                    queued[f] = r;
+                    work.push_back(f);
+                }
+            }
+        }
+    }
+}
+
+// `current` holds the value of each register on entry to block `b`
+void SsaFunction::rename(int b, std::vector<int> current) {
+    for (int phi : blocks_[b].phis) current[values_[phi].reg] = phi;
+    blocks_[b].entry = current;
+    for (int pc = blocks_[b].first; pc <= blocks_[b].last; pc++) {
+        Insn& in = insns_[pc];
+        for (int r : in.reads) in.uses.push_back(current[r]);
+        for (int r : in.writes) {
+            Value v{.reg = r, .def = pc, .block = b, .args = {}};
+            current[r] = static_cast<int>(values_.size());
+            in.defs.push_back(current[r]);
+            values_.push_back(std::move(v));
+        }
+    }
+    for (int s : blocks_[b].succs) {
+        const auto& preds = blocks_[s].preds;
+        size_t idx = std::find(preds.begin(), preds.end(), b) - preds.begin();
+        for (int phi : blocks_[s].phis) values_[phi].args[idx] = current[values_[phi].reg];
+    }
+    for (int c : blocks_[b].children) rename(c, current);
+}
+
+// A table escapes when a value holding it is used other than as the table
+// operand of a load or store, copied by MOVE, or tested for truth: as an
+// argument, result, stored value, upvalue, operand of a phi something
+// reads, or in a register a closure captures.
+void SsaFunction::analyzeEscapes() {
+    int nv = static_cast<int>(values_.size());
+    alloc_.assign(nv, -1);
+    escapes_.assign(nv, false);
+    stores_.assign(nv, {});
+    loads_.assign(nv, {});
+    for (int b : rpo_) { // definitions come before their uses, except through phis
+        for (int pc = blocks_[b].first; pc <= blocks_[b].last; pc++) {
+            const Insn& in = insns_[pc];
+            OpCode op = GET_OPCODE(code_[pc]);
+            if (op == OpCode::NEWTABLE && !in.defs.empty()) alloc_[in.defs[0]] = in.defs[0];
+            if (op == OpCode::MOVE && !in.uses.empty() && !in.defs.empty()) alloc_[in.defs[0]] = alloc_[in.uses[0]];
+        }
+    }
+
+    // phis are placed without liveness; only those something reads count
+    std::vector<bool> used(nv, false);
+    std::vector<int> work;
+    for (int b : rpo_) {
+        for (int pc = blocks_[b].first; pc <= blocks_[b].last; pc++) {
+            for (int u : insns_[pc].uses) {
+                if (values_[u].phi && !used[u]) {
+                    used[u] = true;
+                    work.push_back(u);
+                }
+            }
+        }
+    }
+    while (!work.empty()) {
+        int v = work.back();
+        work.pop_back();
+        for (int a : values_[v].args) {
+            if (alloc_[a] >= 0) escapes_[alloc_[a]] = true;
+            if (values_[a].phi && !used[a]) {
+                used[a] = true;
+                work.push_back(a);
+            }
+        }
+    }
+
+    for (int v = 0; v < nv; v++) {
+        if (alloc_[v] >= 0 && pinned_[values_[v].reg]) escapes_[alloc_[v]] = true;
+    }
+    for (int b : rpo_) {
+        for (int pc = blocks_[b].first; pc <= blocks_[b].last; pc++) {
+            const Insn& in = insns_[pc];
+            OpCode op = GET_OPCODE(code_[pc]);
+            Effect effect = effect_of(op);
+            for (size_t n = 0; n < in.uses.size(); n++) {
+                int x = alloc_[in.uses[n]];
+                if (x < 0) continue;
+                if (n == 0 && effect == Effect::LOAD) {
+                    loads_[x].push_back(pc);
+                } else if (n == 0 && effect == Effect::STORE) {
+                    stores_[x].push_back(pc);
+                } else if (op != OpCode::MOVE && op != OpCode::TEST && op != OpCode::CHECKTYPE) {
+                    escapes_[x] = true;
+                }
+            }
+        }
+    }
+}
+
+// value register `reg` holds right before `pc` runs
+int SsaFunction::valueBefore(int pc, int reg) const {
+    const Block& b = blocks_[insns_[pc].block];
+    for (int p = pc - 1; p >= b.first; p--) {
+        const auto& writes = insns_[p].writes;
+        for (size_t n = 0; n < writes.size(); n++) {
+            if (writes[n] == reg) return insns_[p].defs[n];
+        }
+    }
+    return b.entry[reg];
+}
+
+// the NEWTABLE value `value` holds if that table does not escape, else -1
+int SsaFunction::unescaped(int value) const {
+    int x = alloc_[value];
+    return x >= 0 && !escapes_[x] ? x : -1;
+}
+
+int SsaFunction::forwardFields(std::vector<Instruction>& code) const {
+    // a fact: field `key` of table `alloc` holds `value` (or constant `constant`)
+    struct Fact {
+        int alloc;
+        bool integer; // GETI/SETI key, else a string constant
+        int key;
+        int value;
+        int constant;
+    };
+    int n = static_cast<int>(code_.size());
+    std::vector<Fact> facts;
+    std::vector<int> fact_at(n, -1);
+    for (int b : rpo_) {
+        for (int pc = blocks_[b].first; pc <= blocks_[b].last; pc++) {
+            Instruction i = code_[pc];
+            const Insn& in = insns_[pc];
+            OpCode op = GET_OPCODE(i);
+            int b_arg = GETARG_B(i), c_arg = GETARG_C(i);
+            if (in.uses.empty()) continue;
+            int x = unescaped(in.uses[0]);
+            if (x < 0) continue;
+            switch (op) {
+                case OpCode::GETFIELD: case OpCode::GETFIELDT: case OpCode::GETI:
+                    fact_at[pc] = static_cast<int>(facts.size());
+                    facts.push_back({x, op == OpCode::GETI, c_arg, in.defs[0], -1});
+                    break;
+                case OpCode::SETFIELD: case OpCode::SETFIELDT: case OpCode::SETI:
+                    if (!GETARG_k(i) && in.uses.size() < 2) break;
+                    fact_at[pc] = static_cast<int>(facts.size());
+                    if (GETARG_k(i)) facts.push_back({x, op == OpCode::SETI, b_arg, -1, c_arg});
+                    else facts.push_back({x, op == OpCode::SETI, b_arg, in.uses[1], -1});
+                    break;
+                default:
+                    break;
+            }
+        }
+    }
+    int nf = static_cast<int>(facts.size());
+    if (nf == 0) return 0;
+
+    auto same_field = [&](int f, int g) {
+        return facts[f].alloc == facts[g].alloc && facts[f].integer == facts[g].integer && facts[f].key == facts[g].key;
+    };
+    // only stores into the same unescaped table kill its facts
+    auto transfer = [&](int pc, std::vector<char>& set) {
+        int f = fact_at[pc];
+        if (effect_of(GET_OPCODE(code_[pc])) != Effect::STORE) {
+            if (f >= 0) set[f] = 1;
+            return;
+        }
+        int x = insns_[pc].uses.empty() ? -1 : unescaped(insns_[pc].uses[0]);
+        if (x < 0) return;
+        for (int g = 0; g < nf; g++) {
+            if (facts[g].alloc == x && (f < 0 || same_field(f, g))) set[g] = 0;
+        }
+        if (f >= 0) set[f] = 1;
+    };
+
+    // facts holding on every path into each block
+    int nb = static_cast<int>(blocks_.size());
+    std::vector<std::vector<char>> in(nb), out(nb, std::vector<char>(nf, 1));
+    bool changed = true;
+    while (changed) {
+        changed = false;
+        for (int b : rpo_) {
+            std::vector<char> set(nf, b == 0 ? 0 : 1);
+            if (b != 0) {
+                for (int p : blocks_[b].preds) {
+                    for (int f = 0; f < nf; f++) set[f] &= out[p][f];
+                }
+            }
+            in[b] = set;
+            for (int pc = blocks_[b].first; pc <= blocks_[b].last; pc++) transfer(pc, set);
+            if (set != out[b]) {
+                out[b] = std::move(set);
+                changed = true;
+            }
+        }
+    }
+
+    int replaced = 0;
+    for (int b : rpo_) {
+        std::vector<char> set = in[b];
+        for (int pc = blocks_[b].first; pc <= blocks_[b].last; pc++) {
+            int f = fact_at[pc];
+            if (f >= 0 && effect_of(GET_OPCODE(code_[pc])) == Effect::LOAD) {
+                int a = GETARG_A(code_[pc]);
+                for (int g = 0; g < nf; g++) {
+                    if (g == f || !set[g] || !same_field(f, g)) continue;
+                    Instruction load;
+                    if (facts[g].constant >= 0) {
+                        load = static_cast<Instruction>(OpCode::LOADK);
+                        SETARG_A(load, a);
+                        SETARG_Bx(load, facts[g].constant);
+                    } else {
+                        int r = values_[facts[g].value].reg;
+                        if (pinned_[r] || valueBefore(pc, r) != facts[g].value) continue;
+                        load = static_cast<Instruction>(OpCode::MOVE);
+                        SETARG_A(load, a);
+                        SETARG_B(load, r);
+                    }
+                    code[pc] = load;
+                    replaced++;
+                    break;
+                }
+            }
+            transfer(pc, set);
+        }
+    }
+    return replaced;
+}
+
+std::vector<bool> SsaFunction::deadStores() const {
+    int n = static_cast<int>(code_.size());
+    int nv = static_cast<int>(values_.size());
+    std::vector<bool> live(n, false);
+    std::vector<bool> live_value(nv, false);
+    std::vector<int> work;
+    std::vector<int> value_work;
+    auto mark = [&](int pc) {
+        if (live[pc]) return;
+        live[pc] = true;
+        work.push_back(pc);
+        if (pc + 1 < n && GET_OPCODE(code_[pc + 1]) == OpCode::EXTRAARG) live[pc + 1] = true;
+    };
+
+    for (int pc = 0; pc < n; pc++) {
+        const Insn& in = insns_[pc];
+        OpCode op = GET_OPCODE(code_[pc]);
+        if (in.block < 0 || op == OpCode::EXTRAARG) continue;
+        Effect effect = effect_of(op);
+        bool essential = effect == Effect::OTHER ||
+                         (effect != Effect::PURE && (in.uses.empty() || unescaped(in.uses[0]) < 0)) ||
+                         (pc > 0 && skips_next(GET_OPCODE(code_[pc - 1])));
+        for (int r : in.writes) essential = essential || pinned_[r];
+        if (essential) mark(pc);
+    }
+    while (!work.empty() || !value_work.empty()) {
+        if (!value_work.empty()) {
+            int v = value_work.back();
+            value_work.pop_back();
+            if (values_[v].phi) {
+                for (int a : values_[v].args) {
+                    if (!live_value[a]) {
+                        live_value[a] = true;
+                        value_work.push_back(a);
+                    }
+                }
+            } else if (values_[v].def >= 0) {
+                mark(values_[v].def);
+            }
+            continue;
+        }
+        int pc = work.back();
+        work.pop_back();
+        const Insn& in = insns_[pc];
+        for (int u : in.uses) {
+            if (!live_value[u]) {
+                live_value[u] = true;
+                value_work.push_back(u);
+            }
+        }
+        if (effect_of(GET_OPCODE(code_[pc])) == Effect::LOAD && !in.uses.empty()) {
+            int x = unescaped(in.uses[0]);
+            if (x >= 0) {
+                for (int store : stores_[x]) mark(store);
+            }
+        }
+    }
+
+    std::vector<bool> dead(n, false);
+    for (int pc = 0; pc < n; pc++) dead[pc] = insns_[pc].block >= 0 && !live[pc];
+    return dead;
+}
+
+std::vector<Placement> SsaFunction::hoistInvariants() const {
+    int n = static_cast<int>(code_.size());
+    int nv = static_cast<int>(values_.size());
+    std::vector<int> target(n, -1); // FORPREP an instruction moves in front of
+    std::vector<std::vector<int>> hoisted(n);
+    bool moved = false;
+
+    // `seed` and the phis it reaches, transitively
+    auto merged = [&](int seed) {
+        std::vector<bool> set(nv, false);
+        set[seed] = true;
+        bool grew = true;
+        while (grew) {
+            grew = false;
+            for (int v = 0; v < nv; v++) {
+                if (!values_[v].phi || set[v]) continue;
+                for (int a : values_[v].args) {
+                    if (set[a]) {
+                        set[v] = true;
+                        grew = true;
+                        break;
+                    }
+                }
+            }
+        }
+        return set;
+    };
+
+    for (int p = 0; p < n; p++) {
+        if (GET_OPCODE(code_[p]) != OpCode::FORPREP || insns_[p].block < 0) continue;
+        int q = p + GETARG_Bx(code_[p]) + 1;
+        int base = GETARG_A(code_[p]);
+        if (q >= n || GET_OPCODE(code_[q]) != OpCode::FORLOOP) continue;
+        auto in_loop = [&](int v) {
+            int pc = values_[v].phi ? blocks_[values_[v].block].first : values_[v].def;
+            return pc > p && pc <= q;
+        };
+
+        // blocks control can reach once the loop is entered
+        std::vector<bool> after(blocks_.size(), false);
+        std::vector<int> work(blocks_[insns_[p].block].succs);
+        while (!work.empty()) {
+            int b = work.back();
+            work.pop_back();
+            if (after[b]) continue;
+            after[b] = true;
+            work.insert(work.end(), blocks_[b].succs.begin(), blocks_[b].succs.end());
+        }
+
+        for (int c = p + 1; c < q; c++) {
+            const Insn& in = insns_[c];
+            OpCode op = GET_OPCODE(code_[c]);
+            if (target[c] >= 0 || in.block < 0 || in.writes.size() != 1) continue;
+            if (skips_next(GET_OPCODE(code_[c - 1])) || GET_OPCODE(code_[c + 1]) == OpCode::EXTRAARG) continue;
+            switch (effect_of(op)) {
+                case Effect::PURE:
+                    if (op == OpCode::LOADNIL || op == OpCode::GETUPVAL ||
+                        op == OpCode::NEWTABLE || op == OpCode::CLOSURE) continue;
+                    break;
+                case Effect::LOAD: { // a table nothing in the loop writes
+                    int x = in.uses.empty() ? -1 : unescaped(in.uses[0]);
+                    if (x < 0 || std::any_of(stores_[x].begin(), stores_[x].end(),
+                                             [&](int s) { return s > p && s <= q; })) continue;
+                    break;
+                }
+                default:
+                    continue;
+            }
+
+            // operands: computed before the loop (still in place at FORPREP),
+            // or by an instruction already moved in front of it
+            bool ok = true;
+            for (size_t k = 0; k < in.uses.size() && ok; k++) {
+                int u = in.uses[k];
+                int r = in.reads[k];
+                if (pinned_[r]) ok = false;
+                else if (in_loop(u)) ok = !values_[u].phi && target[values_[u].def] >= 0;
+                else ok = valueBefore(p, r) == u;
+            }
+            if (!ok) continue;
+            if (is_typed_arith(op)) { // the operand types may be checked inside the loop
+                for (int pc = p + 1; pc < q && ok; pc++) {
+                    if (GET_OPCODE(code_[pc]) != OpCode::CHECKTYPE || insns_[pc].uses.empty()) continue;
+                    ok = std::find(in.uses.begin(), in.uses.end(), insns_[pc].uses[0]) == in.uses.end();
+                }
+                if (!ok) continue;
+            }
+
+            // the destination: written only here in the loop and read there
+            // only as this value
+            int r = in.writes[0];
+            int d = in.defs[0];
+            if (pinned_[r] || (r >= base && r <= base + 3)) continue;
+            for (int pc = p + 1; pc <= q && ok; pc++) {
+                const Insn& other = insns_[pc];
+                if (pc != c && std::find(other.writes.begin(), other.writes.end(), r) != other.writes.end()) ok = false;
+                for (size_t k = 0; k < other.reads.size() && ok; k++) {
+                    if (other.reads[k] == r && other.uses[k] != d) ok = false;
+                }
+            }
+            if (!ok) continue;
+            // nothing outside the loop sees the new value, and nothing once
+            // the loop is entered needs the value it replaces
+            std::vector<bool> from_def = merged(d);
+            std::vector<bool> from_old = merged(valueBefore(p, r));
+            for (int pc = 0; pc < n && ok; pc++) {
+                const Insn& other = insns_[pc];
+                if (other.block < 0) continue;
+                for (int u : other.uses) {
+                    if ((from_def[u] && (pc <= p || pc > q)) || (from_old[u] && after[other.block])) ok = false;
+                }
+            }
+            if (!ok) continue;
+            target[c] = p;
+            hoisted[p].push_back(c);
+            moved = true;
+        }
+    }
+    if (!moved) return {};
+
+    std::vector<Placement> order;
+    for (int pc = 0; pc < n; pc++) {
+        if (target[pc] >= 0) continue;
+        for (int c : hoisted[pc]) order.push_back({c, pc});
+        order.push_back({pc, pc});
+    }
+    return order;
+}
+
+std::vector<int> SsaFunction::replaceableTables() const {
+    std::vector<bool> plain(values_.size(), true);
+    for (int b : rpo_) {
+        for (int pc = blocks_[b].first; pc <= blocks_[b].last; pc++) {
+            const Insn& in = insns_[pc];
+            OpCode op = GET_OPCODE(code_[pc]);
+            for (size_t n = 0; n < in.uses.size(); n++) {
+                int x = alloc_[in.uses[n]];
+                if (x >= 0 && op != OpCode::MOVE && !(n == 0 && is_field_access(op))) plain[x] = false;
+            }
+        }
+    }
+    std::vector<int> tables;
+    for (int b : rpo_) {
+        for (int pc = blocks_[b].first; pc <= blocks_[b].last; pc++) {
+            if (GET_OPCODE(code_[pc]) != OpCode::NEWTABLE || insns_[pc].defs.empty()) continue;
+            int x = insns_[pc].defs[0];
+            if (!escapes_[x] && plain[x]) tables.push_back(pc);
+        }
+    }
+    std::sort(tables.begin(), tables.end());
+    return tables;
+}
+
+std::vector<int> SsaFunction::tableAccesses(int pc) const {
+    int x = insns_[pc].defs[0];
+    std::vector<int> accesses(loads_[x]);
+    accesses.insert(accesses.end(), stores_[x].begin(), stores_[x].end());
+    std::sort(accesses.begin(), accesses.end());
+    return accesses;
+}
+
+std::vector<int> SsaFunction::reachingDefs(int pc, int reg) const {
+    std::vector<int> defs;
+    std::vector<bool> seen(values_.size(), false);
+    std::vector<int> work{valueBefore(pc, reg)};
+    while (!work.empty()) {
+        int v = work.back();
+        work.pop_back();
+        if (seen[v]) continue;
+        seen[v] = true;
+        if (values_[v].phi) work.insert(work.end(), values_[v].args.begin(), values_[v].args.end());
+        else defs.push_back(values_[v].def);
+    }
+    return defs;
+}
+
+namespace {
+
+// Scalar replacement. A call clobbers every register above its base, so a
+// table is kept when anything but its own stores can reach the field
+// registers its loads read; the rewritten code is checked in SSA form and
+// retried without such tables. Returns the new frame size.
+int replace_scalars(std::vector<Instruction>& code, const std::vector<LuaValue>& protos, int nregs) {
+    SsaFunction ssa(code, protos, nregs);
+    std::vector<int> tables = ssa.replaceableTables();
+    while (!tables.empty()) {
+        std::vector<Instruction> out = code;
+        int top = nregs;
+        std::vector<int> owner(code.size(), -1); // table whose fields an instruction writes
+        struct Load {
+            int pc;
+            int reg;
+            int table;
+        };
+        std::vector<Load> loads;
+        for (int t : tables) {
+            std::vector<int> accesses = ssa.tableAccesses(t);
+            std::vector<std::pair<bool, int>> fields;
+            for (int pc : accesses) {
+                auto key = field_key(code[pc]);
+                if (std::find(fields.begin(), fields.end(), key) == fields.end()) fields.push_back(key);
+            }
+            if (fields.empty()) continue; // never indexed: dead-store elimination drops it
+            int nfields = static_cast<int>(fields.size());
+            if (top + nfields >= LUAI_MAXREGS) break;
+
+            Instruction nil = static_cast<Instruction>(OpCode::LOADNIL); // a new table has no fields
+            SETARG_A(nil, top);
+            SETARG_B(nil, nfields - 1);
+            out[t] = nil;
+            owner[t] = t;
+            for (int pc : accesses) {
+                Instruction i = code[pc];
+                int r = top + static_cast<int>(std::find(fields.begin(), fields.end(), field_key(i)) - fields.begin());
+                Instruction move;
+                if (!is_field_store(GET_OPCODE(i))) {
+                    move = static_cast<Instruction>(OpCode::MOVE);
+                    SETARG_A(move, GETARG_A(i));
+                    SETARG_B(move, r);
+                    loads.push_back({pc, r, t});
+                } else if (GETARG_k(i)) {
+                    move = static_cast<Instruction>(OpCode::LOADK);
+                    SETARG_A(move, r);
+                    SETARG_Bx(move, GETARG_C(i));
+                    owner[pc] = t;
+                } else {
+                    move = static_cast<Instruction>(OpCode::MOVE);
+                    SETARG_A(move, r);
+                    SETARG_B(move, GETARG_C(i));
+                    owner[pc] = t;
+                }
+                out[pc] = move;
+            }
+            top += nfields;
+        }
+        if (top == nregs) break;
+
+        SsaFunction check(out, protos, top);
+        std::vector<int> failed;
+        for (const Load& load : loads) {
+            for (int d : check.reachingDefs(load.pc, load.reg)) {
+                if (d < 0 || owner[d] != load.table) failed.push_back(load.table);
+            }
+        }
+        if (failed.empty()) {
+            code = std::move(out);
+            return top;
+        }
+        tables.erase(std::remove_if(tables.begin(), tables.end(), [&](int t) {
+            return std::find(failed.begin(), failed.end(), t) != failed.end();
+        }), tables.end());
+    }
+    return nregs;
+}
+
+} // namespace
+
+void optimize_ssa(std::vector<Instruction>& code, std::vector<Lineinfo>& lineinfo,
+                  std::vector<LocalVarinfo>& locvars, const std::vector<LuaValue>& protos, int& nregs) {
+    int n = static_cast<int>(code.size());
+    if (n == 0 || n > SSA_MAX_CODE || static_cast<int>(lineinfo.size()) != n) return;
+
+    SsaFunction(code, protos, nregs).forwardFields(code);
+    nregs = replace_scalars(code, protos, nregs);
+
+    std::vector<bool> dead = SsaFunction(code, protos, nregs).deadStores();
+    std::vector<Placement> order;
+    for (int pc = 0; pc < n; pc++) {
+        if (!dead[pc]) order.push_back({pc, pc});
+    }
+    if (static_cast<int>(order.size()) < n) relayout(code, lineinfo, locvars, order);
+
+    for (int round = 0; round < HOIST_ROUNDS; round++) {
+        order = SsaFunction(code, protos, nregs).hoistInvariants();
+        if (order.empty()) break;
+        relayout(code, lineinfo, locvars, order);
+    }
+}
+
+} // namespace luao
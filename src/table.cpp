@@ -4,6 +4,7 @@
 #include <cmath>
 #include <vector>
 #include <algorithm>
+#include <limits>
 #include <luao.hpp>
 #ifdef _MSC_VER
 #include <intrin.h>
@@ -13,6 +14,21 @@ namespace luao {
 
 // --- Helper Functions ---
 
+// integer keys above 2^MAX_ARRAY_BITS always live in the hash part
+constexpr int MAX_ARRAY_BITS = 31;
+
+// ceil(log2(k)) for k >= 1
+static int ceil_log2(unsigned long long k) {
+    if (k <= 1) return 0;
+#ifdef _MSC_VER
+    unsigned long index;
+    _BitScanReverse64(&index, k - 1);
+    return static_cast<int>(index) + 1;
+#else
+    return 64 - __builtin_clzll(k - 1);
+#endif
+}
+
 static luaNumber get_number_from_value(const LuaValue& val) {
     if (auto num = std::dynamic_pointer_cast<const LuaNumber>(val.getObject())) {
         return num->getValue();
@@ -97,7 +113,7 @@ void LuaTable::raw_insert(const LuaValue& key, const LuaValue& value) {
 }
 
 // ltable.c -> computesizes + rehash
-void LuaTable::rehash() {
+void LuaTable::rehash(const LuaValue& extra) {
     // 1. Collect all nodes into a temporary vector.
     // Note on memory management:
     // The `LuaValue` class uses RAII for reference counting. When a Node is
@@ -122,53 +138,43 @@ void LuaTable::rehash() {
         }
     }
 
-    // 2. Count integer keys in logarithmic bins
-    constexpr int MAX_LOG_2 = sizeof(luaInt) * 8;
-    std::vector<int> nums(MAX_LOG_2, 0);
-    int total_hash_keys = 0;
-    for (const auto& node : all_nodes) {
-        if (node.key.getType() == LuaType::NUMBER) {
-            if (auto integer = std::dynamic_pointer_cast<LuaInteger>(node.key.getObject())) {
+    // 2. Count candidate array keys: nums[i] is the number of keys k with
+    // 2^(i-1) < k <= 2^i
+    size_t nums[MAX_ARRAY_BITS + 1] = {};
+    size_t total_int_keys = 0;
+    size_t total_hash_keys = 0;
+    auto count_key = [&](const LuaValue& key) {
+        if (key.getType() == LuaType::NUMBER) {
+            if (auto integer = std::dynamic_pointer_cast<const LuaInteger>(key.getObject())) {
                 luaInt k = integer->getValue();
-                if (k > 0) {
-                    int log2_k = 0;
-                    if (k > 0) { // Calculate floor(log2(k))
-                        unsigned long temp_k = k;
-                        #ifdef _MSC_VER
-                        unsigned long index;
-                        _BitScanReverse(&index, temp_k);
-                        log2_k = index;
-                        #else
-                        log2_k = (sizeof(unsigned long)*8 - 1) - __builtin_clzl(temp_k);
-                        #endif
-                    }
-                    if (log2_k < MAX_LOG_2) {
-                        nums[log2_k]++;
-                    }
-                    continue;
+                if (k > 0 && static_cast<unsigned long long>(k) <= (1ull << MAX_ARRAY_BITS)) {
+                    nums[ceil_log2(static_cast<unsigned long long>(k))]++;
+                    total_int_keys++;
+                    return;
                 }
             }
         }
         total_hash_keys++;
-    }
+    };
+    for (const auto& node : all_nodes) count_key(node.key);
+    count_key(extra);
 
-    // 3. Compute optimal array size
+    // 3. The array part gets the largest power of two n such that more
+    // than half of the slots 1..n would be in use
     size_t new_array_size = 0;
-    int num_array_values = 0;
-    int cumulative_int_keys = 0;
-    for (int i = 0; i < MAX_LOG_2; ++i) {
-        cumulative_int_keys += nums[i];
-        if (cumulative_int_keys > (1 << (i - 1))) {
-            new_array_size = (1 << i);
-            num_array_values = cumulative_int_keys;
+    size_t num_array_values = 0;
+    size_t cumulative = 0;
+    for (int i = 0; i <= MAX_ARRAY_BITS && total_int_keys > (size_t(1) << i) / 2; i++) {
+        cumulative += nums[i];
+        if (cumulative > (size_t(1) << i) / 2) {
+            new_array_size = size_t(1) << i;
+            num_array_values = cumulative;
         }
     }
+    // integer keys left out of the array part go to the hash part
+    total_hash_keys += total_int_keys - num_array_values;
 
-    // Keys that are integers but do not fit in the array part must go to the hash part.
-    int total_integer_keys = cumulative_int_keys;
-    total_hash_keys += (total_integer_keys - num_array_values);
-
-    // 4. Resize and re-populate
+    // 4. Resize and re-populate; `extra` is counted, so its insert finds room
     m_array.assign(new_array_size, LuaValue());
     size_t new_hash_size = 8;
     while (new_hash_size < total_hash_keys) {
@@ -178,24 +184,40 @@ void LuaTable::rehash() {
     m_last_free_hint = new_hash_size;
 
     for (const auto& node : all_nodes) {
-        if (node.key.getType() == LuaType::NUMBER) {
-            if (auto integer = std::dynamic_pointer_cast<LuaInteger>(node.key.getObject())) {
-                luaInt k = integer->getValue();
-                if (k > 0 && k <= new_array_size) {
-                    m_array[k - 1] = node.value;
-                    continue;
-                }
-            }
+        if (LuaValue* slot = array_slot(node.key)) {
+            *slot = node.value;
+        } else {
+            raw_insert(node.key, node.value);
         }
-        raw_insert(node.key, node.value);
     }
 }
 
+LuaValue* LuaTable::array_slot(const LuaValue& key) {
+    if (key.getType() == LuaType::NUMBER) {
+        if (auto integer = std::dynamic_pointer_cast<const LuaInteger>(key.getObject())) {
+            luaInt k = integer->getValue();
+            if (k >= 1 && static_cast<unsigned long long>(k) <= m_array.size()) return &m_array[k - 1];
+        }
+    }
+    return nullptr;
+}
+
 // --- Public Methods ---
 
 LuaTable::LuaTable() = default;
 LuaTable::~LuaTable() = default;
 
+LuaValue LuaTable::getTM(TMS event) const {
+    if (isTMAbsent(event)) {
+        return LuaValue();
+    }
+    LuaValue tm = get(tm_name(event));
+    if (tm.getType() == LuaType::NIL) {
+        tm_absent |= 1u << event;
+    }
+    return tm;
+}
+
 LuaValue LuaTable::get(const LuaValue& key) const {
     if (key.getType() == LuaType::NUMBER) {
         if (auto integer = std::dynamic_pointer_cast<const LuaInteger>(key.getObject())) {
@@ -246,7 +268,11 @@ void LuaTable::set(const LuaValue& key, const LuaValue& value) {
         return; // Deleting from empty hash part
     }
     if (m_nodes.empty()) {
-        rehash();
+        rehash(key);
+        if (LuaValue* slot = array_slot(key)) { *slot = value; return; }
+    }
+    if (key.getType() == LuaType::STRING) {
+        tm_absent = 0; // a "__xxx" key may have appeared
     }
 
     // Find node and its predecessor
@@ -297,17 +323,18 @@ void LuaTable::set(const LuaValue& key, const LuaValue& value) {
         return;
     }
 
-    Node* free_node = get_free_node();
-    if (free_node == nullptr) {
-        rehash();
-        set(key, value); // Retry insertion after rehashing
-        return;
-    }
-
     if (mp->key.getType() == LuaType::NIL) { // Main position is free
         mp->key = key;
         mp->value = value;
     } else { // Collision, add to end of chain
+        Node* free_node = get_free_node();
+        if (free_node == nullptr) {
+            // the key is counted by rehash, so it has a place afterwards
+            rehash(key);
+            if (LuaValue* slot = array_slot(key)) *slot = value;
+            else raw_insert(key, value);
+            return;
+        }
         Node* chain_end = mp;
         while (chain_end->next != -1) {
             chain_end = &m_nodes[chain_end->next];
@@ -337,12 +364,85 @@ void LuaTable::set(int index, const LuaValue& value) {
     set(key, value);
 }
 
+void LuaTable::copyFrom(const LuaTable& from, const std::function<LuaValue(const LuaValue&)>& map) {
+    m_array.reserve(from.m_array.size());
+    for (const LuaValue& v : from.m_array) {
+        m_array.push_back(map(v));
+    }
+    // `map` hands back booleans, numbers and strings unchanged, so with
+    // only those as keys every node stays where it is; other keys hash by
+    // address and their copies have to be inserted again
+    bool same_hashes = true;
+    for (const Node& node : from.m_nodes) {
+        LuaType t = node.key.getType();
+        if (t != LuaType::NIL && t != LuaType::BOOLEAN && t != LuaType::NUMBER && t != LuaType::STRING) {
+            same_hashes = false;
+            break;
+        }
+    }
+    if (same_hashes) {
+        m_nodes = from.m_nodes;
+        m_last_free_hint = from.m_last_free_hint;
+        for (Node& node : m_nodes) {
+            if (node.key.getType() != LuaType::NIL) node.value = map(node.value);
+        }
+        tm_absent = from.tm_absent;
+    } else {
+        for (const Node& node : from.m_nodes) {
+            if (node.key.getType() != LuaType::NIL) set(map(node.key), map(node.value));
+        }
+    }
+    if (auto mt = from.getMetatable()) {
+        setMetatable(std::static_pointer_cast<LuaTable>(map(LuaValue(mt, LuaType::TABLE)).getObject()));
+    }
+}
+
 LuaValue LuaTable::vlen() const {
-    return LuaValue(std::make_shared<LuaInteger>(m_array.size()), LuaType::NUMBER);
+    return LuaValue(std::make_shared<LuaInteger>(ilen()), LuaType::NUMBER);
 }
 
+// ltable.c -> luaH_getn
 int LuaTable::ilen() const {
-    return m_array.size();
+    size_t n = m_array.size();
+    if (n > 0 && m_array[n - 1].getType() == LuaType::NIL) {
+        // there is a border inside the array part, binary search for it
+        size_t i = 0, j = n;
+        while (j - i > 1) {
+            size_t m = (i + j) / 2;
+            if (m_array[m - 1].getType() == LuaType::NIL) j = m;
+            else i = m;
+        }
+        return static_cast<int>(i);
+    }
+    if (m_nodes.empty()) return static_cast<int>(n);
+    // array part is full, continue into the hash part (ltable.c ->
+    // hash_search): double j until t[j] is nil, then binary search back
+    // for the border, probing through one reused key
+    auto probe = std::make_shared<LuaInteger>(0);
+    LuaValue key(probe, LuaType::NUMBER);
+    auto present = [&](int64_t k) {
+        probe->setValue(k);
+        return get(key).getType() != LuaType::NIL;
+    };
+    constexpr int64_t limit = std::numeric_limits<int>::max();
+    int64_t i = static_cast<int64_t>(n), j = i + 1;
+    if (!present(j)) return static_cast<int>(i);
+    do {
+        i = j;
+        if (j > limit / 2) {
+            j = limit;
+            if (present(j)) return static_cast<int>(j);
+            break;
+        }
+        j *= 2;
+    } while (present(j));
+    // t[i] is present and t[j] is nil
+    while (j - i > 1) {
+        int64_t m = (i + j) / 2;
+        if (present(m)) i = m;
+        else j = m;
+    }
+    return static_cast<int>(i);
 }
 
 } // namespace luao
@@ -0,0 +1,485 @@
+#include <map>
+#include <limits>
+#include <utility>
+#include <functional>
+#include <algorithm>
+#include <object.hpp>
+#include <function.hpp>
+#include <closure.hpp>
+#include <table.hpp>
+#include <vm.hpp>
+#include <libs.hpp>
+#include <auxlib.hpp>
+
+using namespace luao;
+
+/*
+    Native table library.
+    Every function works directly on LuaTable's array part when the sequence
+    [1, #t] is stored there, and falls back to generic get/set otherwise.
+*/
+
+static std::shared_ptr<LuaTable> check_table(VM& vm, int base_reg, int num_args, int n, const char* fname) {
+    const LuaValue& v = arg_at(vm, base_reg, num_args, n);
+    if (v.getType() == LuaType::TABLE) {
+        if (auto table = std::dynamic_pointer_cast<LuaTable>(v.getObject())) {
+            return table;
+        }
+    }
+    arg_error(n, fname, "table expected, got " + arg_typename(vm, base_reg, num_args, n));
+    return nullptr;
+}
+
+static luaInt check_integer(VM& vm, int base_reg, int num_args, int n, const char* fname) {
+    const LuaValue& v = arg_at(vm, base_reg, num_args, n);
+    if (v.getType() == LuaType::NUMBER) {
+        if (auto i = std::dynamic_pointer_cast<const LuaInteger>(v.getObject())) {
+            return i->getValue();
+        }
+        if (auto f = std::dynamic_pointer_cast<const LuaNumber>(v.getObject())) {
+            luaNumber d = f->getValue();
+            if (d == static_cast<luaNumber>(static_cast<luaInt>(d))) {
+                return static_cast<luaInt>(d);
+            }
+            arg_error(n, fname, "number has no integer representation");
+        }
+    }
+    arg_error(n, fname, "number expected, got " + arg_typename(vm, base_reg, num_args, n));
+    return 0;
+}
+
+static luaInt opt_integer(VM& vm, int base_reg, int num_args, int n, const char* fname, luaInt def) {
+    if (arg_at(vm, base_reg, num_args, n).getType() == LuaType::NIL) return def;
+    return check_integer(vm, base_reg, num_args, n, fname);
+}
+
+static LuaValue geti(const std::shared_ptr<LuaTable>& t, luaInt i) {
+    auto& arr = t->getArray();
+    if (i >= 1 && static_cast<size_t>(i) <= arr.size()) return arr[i - 1];
+    return t->get(make_int(i));
+}
+
+static void seti(const std::shared_ptr<LuaTable>& t, luaInt i, const LuaValue& v) {
+    auto& arr = t->getArray();
+    if (i >= 1 && static_cast<size_t>(i) <= arr.size()) {
+        arr[i - 1] = v;
+        return;
+    }
+    t->set(make_int(i), v);
+}
+
+// table.insert(list, [pos,] value)
+static int tablelib_insert(VM& vm, int base_reg, int num_args) {
+    auto t = check_table(vm, base_reg, num_args, 1, "insert");
+    luaInt n = t->ilen();
+    luaInt pos;
+    LuaValue value;
+
+    switch (num_args) {
+        case 2:
+            pos = n + 1;
+            value = arg_at(vm, base_reg, num_args, 2);
+            break;
+        case 3:
+            pos = check_integer(vm, base_reg, num_args, 2, "insert");
+            if (pos < 1 || pos > n + 1) {
+                arg_error(2, "insert", "position out of bounds");
+            }
+            value = arg_at(vm, base_reg, num_args, 3);
+            break;
+        default:
+            throw LuaError("wrong number of arguments to 'insert'");
+    }
+
+    auto& arr = t->getArray();
+    if (static_cast<size_t>(n) <= arr.size()) {
+        // the whole sequence lives in the array part: shift it in place
+        if (static_cast<size_t>(n) == arr.size()) {
+            if (pos == n + 1 && value.getType() == LuaType::NIL) return 0;
+            arr.insert(arr.begin() + (pos - 1), std::move(value));
+        } else {
+            // arr[n] is the nil border, so there is room to shift into
+            std::move_backward(arr.begin() + (pos - 1), arr.begin() + n, arr.begin() + n + 1);
+            arr[pos - 1] = std::move(value);
+        }
+        return 0;
+    }
+
+    for (luaInt i = n; i >= pos; i--) {
+        seti(t, i + 1, geti(t, i));
+    }
+    seti(t, pos, value);
+    return 0;
+}
+
+// table.remove(list [, pos])
+static int tablelib_remove(VM& vm, int base_reg, int num_args) {
+    auto t = check_table(vm, base_reg, num_args, 1, "remove");
+    luaInt n = t->ilen();
+    luaInt pos = opt_integer(vm, base_reg, num_args, 2, "remove", n);
+    if (num_args >= 2 && pos != n && (pos < 1 || pos > n + 1)) {
+        arg_error(2, "remove", "position out of bounds");
+    }
+
+    auto& stack = vm.get_stack_mutable();
+    auto& arr = t->getArray();
+    if (pos >= 1 && pos <= n && static_cast<size_t>(n) <= arr.size()) {
+        LuaValue result = std::move(arr[pos - 1]);
+        std::move(arr.begin() + pos, arr.begin() + n, arr.begin() + (pos - 1));
+        if (static_cast<size_t>(n) == arr.size()) {
+            arr.pop_back();
+        } else {
+            arr[n - 1] = LuaValue();
+        }
+        *stack[base_reg] = result;
+        return 1;
+    }
+
+    LuaValue result = geti(t, pos);
+    for (; pos < n; pos++) {
+        seti(t, pos, geti(t, pos + 1));
+    }
+    seti(t, pos, LuaValue());
+    *stack[base_reg] = result;
+    return 1;
+}
+
+// table.concat(list [, sep [, i [, j]]])
+static int tablelib_concat(VM& vm, int base_reg, int num_args) {
+    auto t = check_table(vm, base_reg, num_args, 1, "concat");
+    std::string sep;
+    const LuaValue& sep_v = arg_at(vm, base_reg, num_args, 2);
+    if (sep_v.getType() == LuaType::STRING) {
+        sep = std::dynamic_pointer_cast<const LuaString>(sep_v.getObject())->getValue();
+    } else if (sep_v.getType() == LuaType::NUMBER) {
+        sep = sep_v.toString();
+    } else if (sep_v.getType() != LuaType::NIL) {
+        arg_error(2, "concat", "string expected, got " + sep_v.typeName());
+    }
+    luaInt i = opt_integer(vm, base_reg, num_args, 3, "concat", 1);
+    luaInt j = opt_integer(vm, base_reg, num_args, 4, "concat", t->ilen());
+
+    std::string result;
+    if (i <= j) {
+        // first pass: validate and measure, so the result is allocated once
+        std::vector<std::string> numbers;
+        size_t total = sep.size() * static_cast<size_t>(j - i);
+        for (luaInt k = i; k <= j; k++) {
+            LuaValue v = geti(t, k);
+            if (v.getType() == LuaType::STRING) {
+                total += std::dynamic_pointer_cast<const LuaString>(v.getObject())->getValue().size();
+            } else if (v.getType() == LuaType::NUMBER) {
+                numbers.push_back(v.toString());
+                total += numbers.back().size();
+            } else {
+                throw LuaError("invalid value (at index " + std::to_string(k) + ") in table for 'concat'");
+            }
+        }
+
+        result.reserve(total);
+        size_t next_number = 0;
+        for (luaInt k = i; k <= j; k++) {
+            LuaValue v = geti(t, k);
+            if (v.getType() == LuaType::STRING) {
+                result += std::dynamic_pointer_cast<const LuaString>(v.getObject())->getValue();
+            } else {
+                result += numbers[next_number++];
+            }
+            if (k != j) result += sep;
+        }
+    }
+
+    *vm.get_stack_mutable()[base_reg] = LuaValue(std::make_shared<LuaString>(std::move(result)), LuaType::STRING);
+    return 1;
+}
+
+// table.unpack(list [, i [, j]])
+static int tablelib_unpack(VM& vm, int base_reg, int num_args) {
+    auto t = check_table(vm, base_reg, num_args, 1, "unpack");
+    luaInt i = opt_integer(vm, base_reg, num_args, 2, "unpack", 1);
+    luaInt j = opt_integer(vm, base_reg, num_args, 3, "unpack", t->ilen());
+    if (i > j) return 0;
+
+    unsigned long long n = static_cast<unsigned long long>(j) - static_cast<unsigned long long>(i);
+    if (n >= static_cast<unsigned long long>(MAX_STACK_SLOTS)
+        || !vm.ensure_stack(base_reg + static_cast<int>(n) + 1)) {
+        throw LuaError("too many results to unpack");
+    }
+    auto& stack = vm.get_stack_mutable();
+
+    // results are written straight into the caller's registers
+    auto& arr = t->getArray();
+    int count = static_cast<int>(n) + 1;
+    if (i >= 1 && static_cast<size_t>(j) <= arr.size()) {
+        for (int k = 0; k < count; k++) {
+            *stack[base_reg + k] = arr[i - 1 + k];
+        }
+    } else {
+        for (int k = 0; k < count; k++) {
+            *stack[base_reg + k] = geti(t, i + k);
+        }
+    }
+    return count;
+}
+
+// table.move(a1, f, e, t [, a2])
+static int tablelib_move(VM& vm, int base_reg, int num_args) {
+    auto a1 = check_table(vm, base_reg, num_args, 1, "move");
+    luaInt f = check_integer(vm, base_reg, num_args, 2, "move");
+    luaInt e = check_integer(vm, base_reg, num_args, 3, "move");
+    luaInt t = check_integer(vm, base_reg, num_args, 4, "move");
+    auto a2 = num_args >= 5 && arg_at(vm, base_reg, num_args, 5).getType() != LuaType::NIL
+        ? check_table(vm, base_reg, num_args, 5, "move")
+        : a1;
+
+    if (e >= f) {
+        constexpr luaInt maxint = std::numeric_limits<luaInt>::max();
+        if (!(f > 0 || e < maxint + f)) arg_error(3, "move", "too many elements to move");
+        luaInt n = e - f + 1;
+        if (t > maxint - n + 1) arg_error(4, "move", "destination wrap around");
+
+        // overlapping ranges in the same table must be copied back to front
+        bool backward = a1 == a2 && t > f && t <= e;
+        auto& src = a1->getArray();
+        auto& dst = a2->getArray();
+        bool in_array = f >= 1 && static_cast<size_t>(e) <= src.size()
+                     && t >= 1 && static_cast<size_t>(t + n - 1) <= dst.size();
+
+        if (in_array) {
+            if (backward) {
+                std::copy_backward(src.begin() + (f - 1), src.begin() + e, dst.begin() + (t - 1 + n));
+            } else {
+                std::copy(src.begin() + (f - 1), src.begin() + e, dst.begin() + (t - 1));
+            }
+        } else if (backward) {
+            for (luaInt i = n - 1; i >= 0; i--) {
+                seti(a2, t + i, geti(a1, f + i));
+            }
+        } else {
+            for (luaInt i = 0; i < n; i++) {
+                seti(a2, t + i, geti(a1, f + i));
+            }
+        }
+    }
+
+    *vm.get_stack_mutable()[base_reg] = LuaValue(a2, LuaType::TABLE);
+    return 1;
+}
+
+// --- table.sort ---
+
+[[noreturn]] static void invalid_order() {
+    throw LuaError("invalid order function for sorting");
+}
+
+template <typename T, typename Less>
+static void insertion_sort(T* lo, T* hi, Less& less) {
+    for (T* i = lo + 1; i < hi; ++i) {
+        T v = std::move(*i);
+        T* j = i;
+        while (j > lo && less(v, *(j - 1))) {
+            *j = std::move(*(j - 1));
+            --j;
+        }
+        *j = std::move(v);
+    }
+}
+
+template <typename T, typename Less>
+static void sift_down(T* base, size_t start, size_t n, Less& less) {
+    size_t root = start;
+    while (2 * root + 1 < n) {
+        size_t child = 2 * root + 1;
+        if (child + 1 < n && less(base[child], base[child + 1])) child++;
+        if (!less(base[root], base[child])) return;
+        std::swap(base[root], base[child]);
+        root = child;
+    }
+}
+
+template <typename T, typename Less>
+static void heap_sort(T* lo, T* hi, Less& less) {
+    size_t n = hi - lo;
+    for (size_t i = n / 2; i-- > 0;) {
+        sift_down(lo, i, n, less);
+    }
+    for (size_t end = n - 1; end > 0; --end) {
+        std::swap(lo[0], lo[end]);
+        sift_down(lo, 0, end, less);
+    }
+}
+
+// introsort: median-of-three quicksort, heapsort once the depth budget runs
+// out, insertion sort for small ranges. Scans are bounds checked so that an
+// inconsistent comparison function raises an error instead of running off
+// the end of the array.
+template <typename T, typename Less>
+static void intro_sort(T* lo, T* hi, int depth, Less& less) {
+    while (hi - lo > 16) {
+        if (depth-- == 0) {
+            heap_sort(lo, hi, less);
+            return;
+        }
+
+        T* mid = lo + (hi - lo) / 2;
+        if (less(*mid, *lo)) std::swap(*mid, *lo);
+        if (less(*(hi - 1), *mid)) {
+            std::swap(*(hi - 1), *mid);
+            if (less(*mid, *lo)) std::swap(*mid, *lo);
+        }
+        T pivot = *mid;
+
+        T* i = lo - 1;
+        T* j = hi;
+        for (;;) {
+            do { if (++i >= hi) invalid_order(); } while (less(*i, pivot));
+            do { if (--j < lo) invalid_order(); } while (less(pivot, *j));
+            if (i >= j) break;
+            std::swap(*i, *j);
+        }
+        T* split = j + 1;
+        if (split >= hi) invalid_order();
+
+        // recurse into the smaller half, loop on the larger one
+        if (split - lo < hi - split) {
+            intro_sort(lo, split, depth, less);
+            lo = split;
+        } else {
+            intro_sort(split, hi, depth, less);
+            hi = split;
+        }
+    }
+    insertion_sort(lo, hi, less);
+}
+
+template <typename T, typename Less>
+static void sort_range(std::vector<T>& v, Less less) {
+    if (v.size() < 2) return;
+    int depth = 0;
+    for (size_t n = v.size(); n > 1; n >>= 1) depth += 2;
+    intro_sort(v.data(), v.data() + v.size(), depth, less);
+}
+
+// sorts by a precomputed key, so homogeneous arrays never go through VM::lt
+template <typename Key, typename KeyLess = std::less<Key>>
+static void sort_by_key(std::vector<LuaValue>& values, std::vector<Key> keys, KeyLess key_less = KeyLess()) {
+    std::vector<std::pair<Key, LuaValue>> items;
+    items.reserve(values.size());
+    for (size_t k = 0; k < values.size(); k++) {
+        items.emplace_back(std::move(keys[k]), std::move(values[k]));
+    }
+    sort_range(items, [&key_less](const std::pair<Key, LuaValue>& a, const std::pair<Key, LuaValue>& b) {
+        return key_less(a.first, b.first);
+    });
+    for (size_t k = 0; k < values.size(); k++) {
+        values[k] = std::move(items[k].second);
+    }
+}
+
+static void sort_values(VM& vm, std::vector<LuaValue>& values, const LuaValue& comp, int scratch_reg) {
+    if (comp.getType() == LuaType::NIL) {
+        bool all_int = true, all_num = true, all_str = true;
+        for (const auto& v : values) {
+            if (v.getType() == LuaType::NUMBER) {
+                all_str = false;
+                if (!std::dynamic_pointer_cast<const LuaInteger>(v.getObject())) all_int = false;
+            } else if (v.getType() == LuaType::STRING) {
+                all_int = all_num = false;
+            } else {
+                all_int = all_num = all_str = false;
+                break;
+            }
+        }
+
+        if (all_int) {
+            std::vector<luaInt> keys;
+            keys.reserve(values.size());
+            for (const auto& v : values) {
+                keys.push_back(std::static_pointer_cast<const LuaInteger>(v.getObject())->getValue());
+            }
+            sort_by_key(values, std::move(keys));
+        } else if (all_num) {
+            std::vector<luaNumber> keys;
+            keys.reserve(values.size());
+            for (const auto& v : values) {
+                if (auto i = std::dynamic_pointer_cast<const LuaInteger>(v.getObject())) {
+                    keys.push_back(static_cast<luaNumber>(i->getValue()));
+                } else {
+                    luaNumber d = std::static_pointer_cast<const LuaNumber>(v.getObject())->getValue();
+                    if (d != d) throw LuaError("invalid order function for sorting"); // NaN
+                    keys.push_back(d);
+                }
+            }
+            sort_by_key(values, std::move(keys));
+        } else if (all_str) {
+            std::vector<const std::string*> keys;
+            keys.reserve(values.size());
+            for (const auto& v : values) {
+                keys.push_back(&std::static_pointer_cast<const LuaString>(v.getObject())->getValue());
+            }
+            // the strings stay alive through the LuaValues moved alongside them
+            sort_by_key(values, std::move(keys), [](const std::string* a, const std::string* b) { return *a < *b; });
+        } else {
+            sort_range(values, [&vm](const LuaValue& a, const LuaValue& b) { return vm.lt(a, b); });
+        }
+        return;
+    }
+
+    auto& stack = vm.get_stack_mutable();
+    sort_range(values, [&](const LuaValue& a, const LuaValue& b) {
+        *stack[scratch_reg] = comp;
+        *stack[scratch_reg + 1] = a;
+        *stack[scratch_reg + 2] = b;
+        vm.call(scratch_reg, 2, 1);
+        return vm.as_bool(*stack[scratch_reg]);
+    });
+}
+
+// table.sort(list [, comp])
+static int tablelib_sort(VM& vm, int base_reg, int num_args) {
+    auto t = check_table(vm, base_reg, num_args, 1, "sort");
+    luaInt n = t->ilen();
+    if (n < 2) return 0;
+    if (n >= std::numeric_limits<int>::max()) arg_error(1, "sort", "array too big");
+
+    LuaValue comp = arg_at(vm, base_reg, num_args, 2);
+    if (comp.getType() != LuaType::NIL && comp.getType() != LuaType::FUNCTION) {
+        arg_error(2, "sort", "function expected, got " + comp.typeName());
+    }
+
+    // sort a private copy: a comparison function may resize the table
+    std::vector<LuaValue> values;
+    auto& arr = t->getArray();
+    if (static_cast<size_t>(n) <= arr.size()) {
+        values.assign(arr.begin(), arr.begin() + n);
+    } else {
+        values.reserve(n);
+        for (luaInt i = 1; i <= n; i++) values.push_back(geti(t, i));
+    }
+
+    sort_values(vm, values, comp, vm.get_frame_top());
+
+    for (luaInt i = 1; i <= n; i++) {
+        seti(t, i, values[i - 1]);
+    }
+    return 0;
+}
+
+LuaValue opentablelib() {
+    auto table = std::make_shared<LuaTable>();
+    const std::pair<const char*, LuaNativeFunction::CFunc> funcs[] = {
+        {"insert", tablelib_insert},
+        {"remove", tablelib_remove},
+        {"concat", tablelib_concat},
+        {"unpack", tablelib_unpack},
+        {"move", tablelib_move},
+        {"sort", tablelib_sort},
+    };
+    for (const auto& [name, fn] : funcs) {
+        table->set(
+            LuaValue(std::make_shared<LuaString>(name), LuaType::STRING),
+            LuaValue(std::make_shared<LuaNativeFunction>(fn), LuaType::FUNCTION)
+        );
+    }
+    return LuaValue(table, LuaType::TABLE);
+}
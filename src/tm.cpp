@@ -0,0 +1,30 @@
+#include <tm.hpp>
+#include <object.hpp>
+
+namespace luao {
+
+static const char* const tm_names[TM_N] = {
+    "__index", "__newindex",
+    "__gc", "__mode", "__len", "__eq",
+    "__add", "__sub", "__mul", "__mod", "__pow",
+    "__div", "__idiv",
+    "__band", "__bor", "__bxor", "__shl", "__shr",
+    "__unm", "__bnot", "__lt", "__le",
+    "__concat", "__call", "__close",
+    "__tostring", "__metatable", "__name", "__pairs",
+    "__iterator", "__newinstance",
+};
+
+// per thread, so VMs running in parallel do not share the keys' reference counts
+const LuaValue& tm_name(TMS event) {
+    static thread_local const auto keys = [] {
+        std::vector<LuaValue> v;
+        for (const char* name : tm_names) {
+            v.emplace_back(std::make_shared<LuaString>(name), LuaType::STRING);
+        }
+        return v;
+    }();
+    return keys[event];
+}
+
+} // namespace luao
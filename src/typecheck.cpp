@@ -0,0 +1,496 @@
+#include "typecheck.hpp"
+#include <stdexcept>
+#include <cerrno>
+#include <cstdlib>
+#include <cstdint>
+
+namespace luao {
+
+namespace {
+
+bool is_integer(StaticType t) {
+    return t == StaticType::Int || t == StaticType::Long;
+}
+
+bool is_numeric(StaticType t) {
+    return is_integer(t) || t == StaticType::Float;
+}
+
+const char* type_name(StaticType t) {
+    switch (t) {
+        case StaticType::Nil: return "nil";
+        case StaticType::Boolean: return "bool";
+        case StaticType::Int: return "int";
+        case StaticType::Long: return "long";
+        case StaticType::Float: return "float";
+        case StaticType::String: return "str";
+        case StaticType::Table: return "table";
+        case StaticType::Function: return "function";
+        default: return "any";
+    }
+}
+
+// result kind of integer arithmetic: long as soon as one operand is long
+StaticType widen(StaticType a, StaticType b) {
+    return (a == StaticType::Int && b == StaticType::Int) ? StaticType::Int : StaticType::Long;
+}
+
+// values of these types are never nil or false
+bool always_true(StaticType t) {
+    return is_numeric(t) || t == StaticType::String || t == StaticType::Table || t == StaticType::Function;
+}
+
+// calls and `...` supply every value left when they end a list
+bool is_multi(const Expression* e) {
+    return e->kind_ == NodeKind::FunctionCall || e->kind_ == NodeKind::VarargLiteral;
+}
+
+// same split as BytecodeGenerator::compileNumber: hex wraps, decimal
+// integers that overflow become floats
+StaticType numeral_type(std::string_view text) {
+    std::string s(text);
+    long long v;
+    if (s.size() > 2 && s[0] == '0' && (s[1] == 'x' || s[1] == 'X')) {
+        unsigned long long u = std::strtoull(s.c_str() + 2, nullptr, 16);
+        v = static_cast<long long>(u);
+    } else if (s.find_first_of(".eE") == std::string::npos) {
+        errno = 0;
+        v = std::strtoll(s.c_str(), nullptr, 10);
+        if (errno == ERANGE) return StaticType::Float;
+    } else {
+        return StaticType::Float;
+    }
+    return (v >= INT32_MIN && v <= INT32_MAX) ? StaticType::Int : StaticType::Long;
+}
+
+// an integer literal (possibly negated or parenthesized) retyped as float
+bool coerce_literal(Expression* e) {
+    if (!is_integer(e->static_type_)) return false;
+    bool ok = false;
+    if (e->kind_ == NodeKind::NumberLiteral) {
+        ok = true;
+    } else if (auto un = ast_cast<UnaryExpr>(e)) {
+        ok = un->op_.type == Token::MINUS && coerce_literal(un->operand_);
+    } else if (auto paren = ast_cast<ParenExpr>(e)) {
+        ok = coerce_literal(paren->expr_);
+    }
+    if (ok) e->static_type_ = StaticType::Float;
+    return ok;
+}
+
+// a block no path leaves without `return`
+bool always_returns(const Block& block) {
+    if (block.statements_.empty()) return false;
+    const Statement* last = block.statements_.back();
+    if (last->kind_ == NodeKind::ReturnStatement) return true;
+    if (auto stmt = ast_cast<DoStatement>(last)) return always_returns(*stmt->body_);
+    if (auto stmt = ast_cast<IfStatement>(last)) {
+        if (!stmt->else_body_ || !always_returns(*stmt->else_body_)) return false;
+        for (const auto& clause : stmt->if_clauses_) {
+            if (!always_returns(*clause.body)) return false;
+        }
+        return true;
+    }
+    return false;
+}
+
+} // namespace
+
+StaticType declared_static_type(std::string_view type) {
+    if (type == "int") return StaticType::Int;
+    if (type == "long") return StaticType::Long;
+    if (type == "float" || type == "double") return StaticType::Float;
+    if (type == "str" || type == "string") return StaticType::String;
+    if (type == "bool" || type == "boolean") return StaticType::Boolean;
+    if (type == "table") return StaticType::Table;
+    if (type == "function") return StaticType::Function;
+    return StaticType::Any;
+}
+
+bool static_type_proven(StaticType declared, StaticType actual) {
+    return declared == StaticType::Any || declared == actual ||
+           (is_integer(declared) && is_integer(actual));
+}
+
+void TypeChecker::error(const std::string& message, int line) {
+    throw std::runtime_error("luaoc: " + source_ + ":" + std::to_string(line) + ": " + message);
+}
+
+void TypeChecker::check(Block& chunk) {
+    reassigned_.clear();
+    globals_.clear();
+    global_stores_.clear();
+    for (int pass = 0; pass < 2; pass++) {
+        second_pass_ = pass == 1;
+        functions_.push_back({nullptr, false});
+        checkBlock(chunk);
+        functions_.pop_back();
+    }
+}
+
+// --- Scopes ---
+
+TypeChecker::Symbol* TypeChecker::findLocal(std::string_view name) {
+    for (auto scope = scopes_.rbegin(); scope != scopes_.rend(); ++scope) {
+        for (auto sym = scope->rbegin(); sym != scope->rend(); ++sym) {
+            if (sym->decl->name_ == name) return &*sym;
+        }
+    }
+    return nullptr;
+}
+
+// Untyped locals keep the type of their initialiser only when nothing
+// assigns them later, which is known from the second pass on.
+void TypeChecker::declare(const Identifier* id, StaticType inferred, const FunctionDef* fn) {
+    StaticType type = StaticType::Any;
+    if (!id->type_.empty()) {
+        type = declared_static_type(id->type_);
+    } else if (second_pass_ && !reassigned_.count(id)) {
+        type = inferred;
+    }
+    scopes_.back().push_back({id, type, fn});
+}
+
+// --- Statements ---
+
+void TypeChecker::checkBlock(Block& block) {
+    openScope();
+    for (auto stmt : block.statements_) {
+        checkStatement(stmt);
+    }
+    closeScope();
+}
+
+void TypeChecker::checkStatement(Statement* stmt) {
+    switch (stmt->kind_) {
+        case NodeKind::LocalStatement:
+            checkLocal(static_cast<LocalStatement*>(stmt));
+            break;
+        case NodeKind::AssignStatement:
+            checkAssign(static_cast<AssignStatement*>(stmt));
+            break;
+        case NodeKind::ExprStatement:
+            infer(static_cast<ExprStatement*>(stmt)->expr_);
+            break;
+        case NodeKind::FunctionStatement:
+            checkFunctionStatement(static_cast<FunctionStatement*>(stmt));
+            break;
+        case NodeKind::ReturnStatement:
+            checkReturn(static_cast<ReturnStatement*>(stmt));
+            break;
+        case NodeKind::IfStatement: {
+            auto s = static_cast<IfStatement*>(stmt);
+            for (auto& clause : s->if_clauses_) {
+                infer(clause.condition);
+                checkBlock(*clause.body);
+            }
+            if (s->else_body_) checkBlock(*s->else_body_);
+            break;
+        }
+        case NodeKind::WhileStatement: {
+            auto s = static_cast<WhileStatement*>(stmt);
+            infer(s->condition_);
+            checkBlock(*s->body_);
+            break;
+        }
+        case NodeKind::DoStatement:
+            checkBlock(*static_cast<DoStatement*>(stmt)->body_);
+            break;
+        case NodeKind::RepeatUntilStatement: {
+            auto s = static_cast<RepeatUntilStatement*>(stmt);
+            openScope(); // the condition sees the body's locals
+            for (auto inner : s->body_->statements_) {
+                checkStatement(inner);
+            }
+            infer(s->condition_);
+            closeScope();
+            break;
+        }
+        case NodeKind::NumericForStatement: {
+            auto s = static_cast<NumericForStatement*>(stmt);
+            StaticType start = infer(s->start_);
+            infer(s->end_);
+            StaticType step = s->step_ ? infer(s->step_) : StaticType::Int;
+            // integer start and step make an integer loop whatever the limit is
+            StaticType var = is_integer(start) && is_integer(step) ? widen(start, step) : StaticType::Any;
+            openScope();
+            declare(s->var_, var);
+            checkBlock(*s->body_);
+            closeScope();
+            break;
+        }
+        case NodeKind::GenericForStatement: {
+            auto s = static_cast<GenericForStatement*>(stmt);
+            for (auto e : s->exprs_) infer(e);
+            openScope();
+            for (auto name : s->names_) declare(name, StaticType::Any);
+            checkBlock(*s->body_);
+            closeScope();
+            break;
+        }
+        default:
+            break;
+    }
+}
+
+void TypeChecker::checkLocal(LocalStatement* stmt) {
+    for (auto value : stmt->values_) infer(value);
+    size_t nvals = stmt->values_.size();
+    bool multi = nvals > 0 && is_multi(stmt->values_.back());
+    std::vector<StaticType> types;
+    for (size_t n = 0; n < stmt->names_.size(); n++) {
+        Expression* value = n < nvals ? stmt->values_[n] : nullptr;
+        bool extra = !value && multi;
+        const Identifier& name = *stmt->names_[n];
+        expect(name.type_, value, extra, stmt->line_, "local '" + std::string(name.name_) + "'");
+        types.push_back(value ? value->static_type_ : extra ? StaticType::Any : StaticType::Nil);
+    }
+    for (size_t n = 0; n < stmt->names_.size(); n++) {
+        declare(stmt->names_[n], types[n]);
+        if (n < nvals) {
+            if (auto def = ast_cast<FunctionDef>(stmt->values_[n])) {
+                def->stable_ = second_pass_ && !reassigned_.count(stmt->names_[n]);
+            }
+        }
+    }
+}
+
+void TypeChecker::checkAssign(AssignStatement* stmt) {
+    for (auto target : stmt->targets_) infer(target);
+    for (auto value : stmt->values_) infer(value);
+    size_t nvals = stmt->values_.size();
+    bool multi = nvals > 0 && is_multi(stmt->values_.back());
+    for (size_t n = 0; n < stmt->targets_.size(); n++) {
+        auto id = ast_cast<Identifier>(stmt->targets_[n]);
+        Symbol* sym = id ? findLocal(id->name_) : nullptr;
+        if (!sym) {
+            if (id && !second_pass_) global_stores_[id->name_]++;
+            continue;
+        }
+        reassigned_[sym->decl] = true;
+        Expression* value = n < nvals ? stmt->values_[n] : nullptr;
+        expect(sym->decl->type_, value, !value && multi, stmt->line_, "variable '" + std::string(id->name_) + "'");
+    }
+}
+
+void TypeChecker::checkFunctionStatement(FunctionStatement* stmt) {
+    auto id = ast_cast<Identifier>(stmt->name_);
+    if (stmt->is_local_) { // in scope inside its own body
+        declare(id, StaticType::Function, stmt->def_);
+        checkFunction(*stmt->def_);
+        stmt->def_->stable_ = second_pass_ && !reassigned_.count(id);
+        return;
+    }
+    infer(stmt->name_);
+    checkFunction(*stmt->def_);
+    if (!id) return;
+    if (Symbol* sym = findLocal(id->name_)) {
+        reassigned_[sym->decl] = true;
+        expect(sym->decl->type_, stmt->def_, false, stmt->line_, "variable '" + std::string(id->name_) + "'");
+    } else {
+        globals_[id->name_] = stmt->def_;
+        if (!second_pass_) global_stores_[id->name_]++;
+        stmt->def_->stable_ = second_pass_ && global_stores_[id->name_] == 1;
+    }
+}
+
+void TypeChecker::checkReturn(ReturnStatement* stmt) {
+    for (auto e : stmt->exprs_) infer(e);
+    FunctionScope& fn = functions_.back();
+    if (!fn.def || fn.def->return_types_.empty()) return;
+    const auto& types = fn.def->return_types_;
+    size_t nexps = stmt->exprs_.size();
+    bool multi = nexps > 0 && is_multi(stmt->exprs_.back());
+    for (size_t n = 0; n < types.size(); n++) {
+        Expression* value = n < nexps ? stmt->exprs_[n] : nullptr;
+        expect(types[n], value, !value && multi, stmt->line_, "return value " + std::to_string(n + 1));
+    }
+    if (nexps == 0 || !static_type_proven(declared_static_type(types[0]), stmt->exprs_[0]->static_type_)) {
+        fn.returns_proven = false;
+    }
+}
+
+void TypeChecker::checkFunction(FunctionDef& def) {
+    functions_.push_back({&def, true});
+    openScope();
+    for (auto param : def.params_) {
+        declare(param, StaticType::Any);
+    }
+    checkBlock(*def.body_);
+    closeScope();
+    bool proven = functions_.back().returns_proven;
+    functions_.pop_back();
+    def.returns_proven_ = proven && !def.return_types_.empty() &&
+                          declared_static_type(def.return_types_[0]) != StaticType::Any &&
+                          always_returns(*def.body_);
+    def.static_type_ = StaticType::Function;
+}
+
+// --- Expressions ---
+
+StaticType TypeChecker::infer(Expression* expr) {
+    StaticType t = StaticType::Any;
+    switch (expr->kind_) {
+        case NodeKind::NilLiteral:
+            t = StaticType::Nil;
+            break;
+        case NodeKind::BoolLiteral:
+            t = StaticType::Boolean;
+            break;
+        case NodeKind::NumberLiteral:
+            t = numeral_type(static_cast<NumberLiteral*>(expr)->value_);
+            break;
+        case NodeKind::StringLiteral:
+            t = StaticType::String;
+            break;
+        case NodeKind::Identifier:
+            if (Symbol* sym = findLocal(static_cast<Identifier*>(expr)->name_)) t = sym->type;
+            break;
+        case NodeKind::ParenExpr:
+            t = infer(static_cast<ParenExpr*>(expr)->expr_);
+            break;
+        case NodeKind::TableAccess:
+            infer(static_cast<TableAccess*>(expr)->prefix_expr_);
+            break;
+        case NodeKind::IndexAccess: {
+            auto access = static_cast<IndexAccess*>(expr);
+            infer(access->prefix_expr_);
+            infer(access->index_expr_);
+            break;
+        }
+        case NodeKind::FunctionCall:
+            t = inferCall(static_cast<FunctionCall*>(expr));
+            break;
+        case NodeKind::FunctionDef:
+            checkFunction(*static_cast<FunctionDef*>(expr));
+            t = StaticType::Function;
+            break;
+        case NodeKind::TableConstructor:
+            for (auto& field : static_cast<TableConstructor*>(expr)->fields_) {
+                if (field.key) infer(field.key);
+                infer(field.value);
+            }
+            t = StaticType::Table;
+            break;
+        case NodeKind::BinaryExpr:
+            t = inferBinary(static_cast<BinaryExpr*>(expr));
+            break;
+        case NodeKind::UnaryExpr:
+            t = inferUnary(static_cast<UnaryExpr*>(expr));
+            break;
+        default:
+            break;
+    }
+    expr->static_type_ = t;
+    return t;
+}
+
+StaticType TypeChecker::inferBinary(BinaryExpr* bin) {
+    StaticType l = infer(bin->left_);
+    StaticType r = infer(bin->right_);
+    switch (bin->op_.type) {
+        case Token::PLUS: case Token::MINUS: case Token::MULTIPLY:
+        case Token::IDIV: case Token::MODULO:
+            if (is_integer(l) && is_integer(r)) return widen(l, r);
+            if (is_numeric(l) && is_numeric(r)) return StaticType::Float;
+            return StaticType::Any;
+        case Token::DIVIDE: case Token::POW:
+            return is_numeric(l) && is_numeric(r) ? StaticType::Float : StaticType::Any;
+        case Token::BAND: case Token::BOR: case Token::BXOR: case Token::SHL: case Token::SHR:
+            return is_integer(l) && is_integer(r) ? widen(l, r) : StaticType::Any;
+        case Token::EQ: case Token::NE: case Token::LT: case Token::LE: case Token::GT: case Token::GE:
+            return StaticType::Boolean;
+        case Token::CONCAT:
+            return (l == StaticType::String || is_numeric(l)) && (r == StaticType::String || is_numeric(r))
+                       ? StaticType::String : StaticType::Any;
+        case Token::AND:
+            if (always_true(l)) return r;
+            return l == r ? l : StaticType::Any;
+        case Token::OR:
+            if (always_true(l)) return l;
+            return l == r ? l : StaticType::Any;
+        default:
+            return StaticType::Any;
+    }
+}
+
+StaticType TypeChecker::inferUnary(UnaryExpr* un) {
+    StaticType t = infer(un->operand_);
+    switch (un->op_.type) {
+        case Token::MINUS: return is_numeric(t) ? t : StaticType::Any;
+        case Token::NOT: return StaticType::Boolean;
+        case Token::LEN: return t == StaticType::String ? StaticType::Int : StaticType::Any;
+        case Token::BNOT: return is_integer(t) ? t : StaticType::Any;
+        default: return StaticType::Any;
+    }
+}
+
+StaticType TypeChecker::inferCall(FunctionCall* call) {
+    auto callee = ast_cast<Identifier>(call->prefix_expr_);
+    call->cast_type_ = {};
+
+    // cast(value, type): a checked conversion, not a call
+    if (callee && !call->method_name_ && callee->name_ == "cast" && !findLocal("cast") &&
+        call->args_.size() == 2 && call->args_[1]->kind_ == NodeKind::Identifier) {
+        std::string_view type = static_cast<Identifier*>(call->args_[1])->name_;
+        StaticType from = infer(call->args_[0]);
+        StaticType to = declared_static_type(type);
+        if (from != StaticType::Any && to != StaticType::Any && !static_type_proven(to, from)) {
+            error(std::string("cannot cast '") + type_name(from) + "' to '" + std::string(type) + "'", call->line_);
+        }
+        call->cast_type_ = type;
+        return to;
+    }
+
+    infer(call->prefix_expr_);
+    for (auto arg : call->args_) infer(arg);
+    if (!callee || call->method_name_) return StaticType::Any;
+
+    if (Symbol* sym = findLocal(callee->name_)) {
+        if (!sym->fn) return StaticType::Any;
+        checkArguments(*sym->fn, call, callee->name_);
+        if (second_pass_ && !reassigned_.count(sym->decl) && sym->fn->returns_proven_) {
+            return declared_static_type(sym->fn->return_types_[0]);
+        }
+    } else {
+        auto global = globals_.find(callee->name_);
+        if (global != globals_.end()) checkArguments(*global->second, call, callee->name_);
+    }
+    return StaticType::Any;
+}
+
+void TypeChecker::checkArguments(const FunctionDef& def, FunctionCall* call, std::string_view name) {
+    size_t nargs = call->args_.size();
+    bool multi = nargs > 0 && is_multi(call->args_.back());
+    for (size_t n = 0; n < def.params_.size(); n++) {
+        Expression* arg = n < nargs ? call->args_[n] : nullptr;
+        expect(def.params_[n]->type_, arg, !arg && multi, call->line_,
+               "argument " + std::to_string(n + 1) + " of '" + std::string(name) + "'");
+    }
+}
+
+void TypeChecker::expect(std::string_view declared, Expression* value, bool multi, int line, const std::string& what) {
+    if (declared.empty()) return;
+    bool nullable = declared[0] == '!';
+    std::string_view base = nullable ? declared.substr(1) : declared;
+    StaticType want = declared_static_type(base);
+    StaticType have = value ? value->static_type_ : multi ? StaticType::Any : StaticType::Nil;
+    if (have == StaticType::Any) return; // checked at run time
+    if (base == "number") {
+        if (is_numeric(have) || (have == StaticType::Nil && nullable)) return;
+    } else if (want == StaticType::Any) {
+        return; // obj and class types are not checked
+    } else if (have == StaticType::Nil) {
+        if (nullable) return;
+        error("cannot assign nil to " + what + " of type '" + std::string(declared) + "'", line);
+    } else if (want == StaticType::Float && value && coerce_literal(value)) {
+        return;
+    } else if (want == StaticType::Int && have == StaticType::Long) {
+        error("cannot convert 'long' to 'int' for " + what + " (use cast)", line);
+    } else if (static_type_proven(want, have)) {
+        return;
+    }
+    error("type mismatch for " + what + ": '" + std::string(declared) + "' expected, got '" + type_name(have) + "'", line);
+}
+
+} // namespace luao
@@ -1,65 +1,26 @@
 #include "vm.hpp"
 #include "debug.hpp"
 #include <table.hpp>
+#include <class.hpp>
 #include <iostream>
 #include <sstream>
 #include <iomanip>
 #include <cmath>
 #include <cstring>
+#include <climits>
 #include <opcodes.hpp>
 #include <config.hpp>
 #include <upvalue.hpp>
+#include <coroutine.hpp>
+#include <scheduler.hpp>
 #include <memory>
 #include <map>
+#include <algorithm>
 #include <libs.hpp>
-
-namespace mm {
-    const luao::LuaValue __add         = luao::LuaValue(std::make_shared<luao::LuaString>("__add"),         LuaType::STRING);
-    const luao::LuaValue __sub         = luao::LuaValue(std::make_shared<luao::LuaString>("__sub"),         LuaType::STRING);
-    const luao::LuaValue __mul         = luao::LuaValue(std::make_shared<luao::LuaString>("__mul"),         LuaType::STRING);
-    const luao::LuaValue __div         = luao::LuaValue(std::make_shared<luao::LuaString>("__div"),         LuaType::STRING);
-    const luao::LuaValue __unm         = luao::LuaValue(std::make_shared<luao::LuaString>("__unm"),         LuaType::STRING);
-    const luao::LuaValue __mod         = luao::LuaValue(std::make_shared<luao::LuaString>("__mod"),         LuaType::STRING);
-    const luao::LuaValue __pow         = luao::LuaValue(std::make_shared<luao::LuaString>("__pow"),         LuaType::STRING);
-    const luao::LuaValue __idiv        = luao::LuaValue(std::make_shared<luao::LuaString>("__idiv"),        LuaType::STRING);
-    const luao::LuaValue __band        = luao::LuaValue(std::make_shared<luao::LuaString>("__band"),        LuaType::STRING);
-    const luao::LuaValue __bor         = luao::LuaValue(std::make_shared<luao::LuaString>("__bor"),         LuaType::STRING);
-    const luao::LuaValue __bxor        = luao::LuaValue(std::make_shared<luao::LuaString>("__bxor"),        LuaType::STRING);
-    const luao::LuaValue __bnot        = luao::LuaValue(std::make_shared<luao::LuaString>("__bnot"),        LuaType::STRING);
-    const luao::LuaValue __shl         = luao::LuaValue(std::make_shared<luao::LuaString>("__shl"),         LuaType::STRING);
-    const luao::LuaValue __shr         = luao::LuaValue(std::make_shared<luao::LuaString>("__shr"),         LuaType::STRING);
-    const luao::LuaValue __eq          = luao::LuaValue(std::make_shared<luao::LuaString>("__eq"),          LuaType::STRING);
-    const luao::LuaValue __lt          = luao::LuaValue(std::make_shared<luao::LuaString>("__lt"),          LuaType::STRING);
-    const luao::LuaValue __le          = luao::LuaValue(std::make_shared<luao::LuaString>("__le"),          LuaType::STRING);
-    const luao::LuaValue __concat      = luao::LuaValue(std::make_shared<luao::LuaString>("__concat"),      LuaType::STRING);
-    const luao::LuaValue __len         = luao::LuaValue(std::make_shared<luao::LuaString>("__len"),         LuaType::STRING);
-    const luao::LuaValue __tostring    = luao::LuaValue(std::make_shared<luao::LuaString>("__tostring"),    LuaType::STRING);
-    const luao::LuaValue __metatable   = luao::LuaValue(std::make_shared<luao::LuaString>("__metatable"),   LuaType::STRING);
-    const luao::LuaValue __name        = luao::LuaValue(std::make_shared<luao::LuaString>("__name"),        LuaType::STRING);
-    const luao::LuaValue __pairs       = luao::LuaValue(std::make_shared<luao::LuaString>("__pairs"),       LuaType::STRING);
-    const luao::LuaValue __ipairs      = luao::LuaValue(std::make_shared<luao::LuaString>("__ipairs"),      LuaType::STRING); 
-    const luao::LuaValue __index       = luao::LuaValue(std::make_shared<luao::LuaString>("__index"),       LuaType::STRING);
-    const luao::LuaValue __newindex    = luao::LuaValue(std::make_shared<luao::LuaString>("__newindex"),    LuaType::STRING);
-    const luao::LuaValue __call        = luao::LuaValue(std::make_shared<luao::LuaString>("__call"),        LuaType::STRING);
-    const luao::LuaValue __mode        = luao::LuaValue(std::make_shared<luao::LuaString>("__mode"),        LuaType::STRING);
-    const luao::LuaValue __close       = luao::LuaValue(std::make_shared<luao::LuaString>("__close"),       LuaType::STRING);
-    const luao::LuaValue __gc          = luao::LuaValue(std::make_shared<luao::LuaString>("__gc"),          LuaType::STRING);
-    const luao::LuaValue __iterator    = luao::LuaValue(std::make_shared<luao::LuaString>("__iterator"),    LuaType::STRING);
-    const luao::LuaValue __newinstance = luao::LuaValue(std::make_shared<luao::LuaString>("__newinstance"), LuaType::STRING);
-}
+#include <snapshot.hpp>
 
 namespace luao {
 
-#define GET_OPCODE(i)   (static_cast<OpCode>(((i) >> 0) & 0x7F))
-#define GETARG_A(i)     (((i) >> 7) & 0xFF)
-#define GETARG_sA(i)    (static_cast<int8_t>(GETARG_A(i)))
-#define GETARG_B(i)     (((i) >> 16) & 0xFF)
-#define GETARG_sB(i)    (static_cast<int8_t>(GETARG_B(i)))
-#define GETARG_C(i)     (((i) >> 24) & 0xFF)
-#define GETARG_sC(i)    (static_cast<int8_t>(GETARG_C(i)))
-#define GETARG_Bx(i)    ((i) >> 15)
-#define GETARG_sBx(i)   (static_cast<int>(GETARG_Bx(i)) - 65535)
-
 void dump_critical_error(VM& vm, std::string err) {
     CallInfo* frame = &vm.get_call_stack_mutable().back();
     std::cerr << "#\n";
@@ -68,7 +29,6 @@ void dump_critical_error(VM& vm, std::string err) {
     std::cerr << "# VM Fatal Error: " << err << "\n";
     std::cerr << "#\n";
     if (frame && frame->closure) {
-        std::shared_ptr<LuaFunction> func = frame->closure->getFunction();
         const Instruction* inst = vm.last_instruction;
         std::cerr << "# Faulting instruction:\n";
         std::cerr << "#  "
@@ -120,7 +80,7 @@ static void setup_closure(std::shared_ptr<LuaClosure> closure, VM& vm) {
         if (desc.inStack) {
             uv = vm.find_upvalue(desc.idx);
             if (uv == nullptr) {
-                uv = std::make_shared<UpValue>(&vm, stack[desc.idx]);
+                uv = std::make_shared<UpValue>(&vm, stack[desc.idx], desc.idx);
                 open_upvalues.push_front(uv);
                 uv->setIterator(open_upvalues.begin());
             }
@@ -141,86 +101,101 @@ static void setup_closure(std::shared_ptr<LuaClosure> closure, VM& vm) {
 
 void UpValue::close() {
     if (!open_) return;
-    if (auto loc = location_.lock()) closed_ = *loc;
-    location_.reset();
-    open_ = false;
+    detach();
     vm->open_upvalues.erase(open_upval_iter);
 }
 
 std::shared_ptr<UpValue> VM::find_upvalue(int stack_index) {
-    for (auto it = open_upvalues.begin(); it != open_upvalues.end(); ++it) {
-        auto& upvalue = *it;
-        if (upvalue->isOpen() && !upvalue->getLocation().expired()) {
-            if (upvalue->getLocation().lock().get() == stack[stack_index].get()) {
-                return upvalue;
-            }
+    for (auto& upvalue : open_upvalues) {
+        if (upvalue->isOpen() && upvalue->getIndex() == stack_index) {
+            return upvalue;
         }
     }
     return nullptr;
 }
 
+// Closes every open upvalue on stack[stack_index] or above.
 void VM::close_upvalues(int stack_index) {
     auto it = open_upvalues.begin();
     while (it != open_upvalues.end()) {
-        auto& upvalue = *it;
-        if (upvalue->isOpen() && !upvalue->getLocation().expired()) {
-            // Check if the upvalue points to a stack slot at or above the given index
-            // This is a bit tricky since we only have the pointer, not the index.
-            // A possible solution is to calculate the index from the pointer.
-            auto* p = upvalue->getLocation().lock().get();
-            auto* base = &(*stack[0]);
-            if (p >= &(*stack[stack_index])) {
-                upvalue->close();
-                it = open_upvalues.begin(); // a bit inefficient, but safe
-            } else {
-                ++it;
-            }
-        } else {
-            ++it;
+        auto upvalue = *it++; // close() unlinks the current node
+        if (upvalue->isOpen() && upvalue->getIndex() >= stack_index) {
+            upvalue->close();
         }
     }
 }
 
 VM::VM() : top(0) {
-    stack.resize(20000);
-    for (int i = 0; i < 20000; i++) {
-        stack[i] = std::make_shared<LuaValue>();
-    }
+    reset_stack();
 }
 
-void VM::load(std::shared_ptr<LuaClosure> main_closure) {
-    call_stack.clear();
+// The stack starts small and grows on demand up to MAX_STACK_SLOTS. Every
+// slot has its own shared_ptr, since upvalues hold on to single slots, but
+// each growth step allocates its slots as one block.
+void VM::reset_stack() {
     stack.clear();
-    stack.resize(20000);
-    for (int i = 0; i < 20000; i++) {
-        stack[i] = std::make_shared<LuaValue>();
-    }
+    ensure_stack(BASIC_STACK_SLOTS);
     top = 0;
+}
 
+bool VM::ensure_stack(int size) {
+    int old_size = static_cast<int>(stack.size());
+    if (size <= old_size) return true;
+    if (size > MAX_STACK_SLOTS) return false;
+    int new_size = std::min(std::max(size, 2 * old_size), MAX_STACK_SLOTS);
+    std::shared_ptr<LuaValue[]> block(new LuaValue[new_size - old_size]);
+    stack.reserve(new_size);
+    for (int i = 0; i < new_size - old_size; i++) {
+        stack.emplace_back(block, &block[i]);
+    }
+    return true;
+}
+
+void VM::load(std::shared_ptr<LuaClosure> main_closure) {
     auto env_table = std::make_shared<LuaTable>();
-    auto env_value = LuaValue(env_table, LuaType::TABLE);
-    *stack[0] = env_value;
-    top = 1;
+    env_table->set(LuaValue(std::make_shared<LuaString>("_G"), LuaType::STRING), LuaValue(env_table, LuaType::TABLE));
 
-    env_table->set(LuaValue(std::make_shared<LuaString>("_G"), LuaType::STRING), env_value);
+    for (const auto& [name, value] : getbaselib()) {
+        env_table->set(LuaValue(std::make_shared<LuaString>(name), LuaType::STRING), value);
+    }
+    // library modules are opened by open_module when first looked up
+    start(std::move(main_closure), std::move(env_table));
+}
 
-    std::vector<std::map<LuaString, LuaValue>> libs_list = {
-        getbaselib()
-    };
+void VM::load(std::shared_ptr<LuaClosure> main_closure, const VMSnapshot& snapshot) {
+    start(std::move(main_closure), snapshot.instantiate());
+}
 
-    for (auto& lib  : libs_list) {
-        for (const auto& [name, value] : lib) {
-            env_table->set(LuaValue(std::make_shared<LuaString>(name), LuaType::STRING), value);
-        }
+void VM::start(std::shared_ptr<LuaClosure> main_closure, std::shared_ptr<LuaTable> env_table) {
+    // a fresh VM already has a clean stack
+    if (top != 0 || !call_stack.empty() || !open_upvalues.empty()) {
+        call_stack.clear();
+        open_upvalues.clear();
+        reset_stack();
     }
 
+    globals = env_table.get();
+#ifdef LUAO_USE_EPOLL
+    scheduler.reset(); // tasks left by the previous chunk
+#endif
+    unopened_modules = (1u << std::size(LUA_MODULES)) - 1;
+
+    // stack[0] holds _ENV for the main chunk's upvalue, stack[1] the main
+    // function itself; its registers start at stack[2]
+    *stack[0] = LuaValue(std::move(env_table), LuaType::TABLE);
+    top = 1;
+
     if (main_closure) {
         setup_closure(main_closure, *this);
     } else {
         throw std::runtime_error("main_closure are null");
     }
 
-    call_stack.emplace_back(main_closure, &main_closure->getFunction()->getBytecode()[0], 0);
+    *stack[1] = LuaValue(main_closure, LuaType::FUNCTION);
+    top = 2;
+    if (!precall(1, 0, -1)) {
+        throw std::runtime_error("main_closure is not a Lua function");
+    }
 }
 
 void VM::set_top(int new_top) {
@@ -250,11 +225,11 @@ const CallInfo& VM::get_call_stack_top() const {
     return call_stack.back();
 }
 
-const std::vector<CallInfo>& VM::get_call_stack() const {
+const std::deque<CallInfo>& VM::get_call_stack() const {
     return call_stack;
 }
 
-std::vector<CallInfo>& VM::get_call_stack_mutable() {
+std::deque<CallInfo>& VM::get_call_stack_mutable() {
     return call_stack;
 }
 
@@ -278,23 +253,7 @@ static luaNumber get_number_from_value(const LuaValue& val) {
     return 0.0;
 }
 
-static const LuaValue& mm_key_from_C(int c) {
-    switch (c) {
-        case 0: return mm::__add;
-        case 1: return mm::__sub;
-        case 2: return mm::__mul;
-        case 3: return mm::__div;
-        case 4: return mm::__mod;
-        case 5: return mm::__pow;
-        case 6: return mm::__unm;
-        case 7: return mm::__len;
-        case 8: return mm::__eq;
-        case 9: return mm::__lt;
-        case 10: return mm::__le;
-        case 11: return mm::__concat;
-        default: return mm::__add;
-    }
-}
+static LuaValue index_tm(VM& vm, LuaValue t, const LuaValue& k);
 
 LuaValue VM::get_upval_table(int upval_index, const LuaValue& key) {
     CallInfo* frame = &call_stack.back();
@@ -304,107 +263,257 @@ LuaValue VM::get_upval_table(int upval_index, const LuaValue& key) {
         throw std::runtime_error("GETTABUP: invalid upvalue index");
     }
 
-    auto loc = upvals[upval_index]->getLocation().lock();
-    if (!loc) {
-        throw std::runtime_error("GETTABUP: upvalue is closed");
+    LuaValue t = upvals[upval_index]->getValue();
+    LuaValue res;
+    if (auto table = std::dynamic_pointer_cast<LuaTable>(t.getObject())) {
+        res = table->get(key);
     }
-
-    if (auto table = std::dynamic_pointer_cast<LuaTable>(loc->getObject())) {
-        return table->get(key);
-    } else {
-        throw std::runtime_error("GETTABUP: non-table upvalue");
+    if (res.getType() == LuaType::NIL) {
+        res = index_tm(*this, t, key);
     }
+    return res;
 }
 
-static void vreturn(VM& vm, CallInfo* frame, int base, int nresults) {
-    if (nresults == 0) {
-        vm.set_top(frame->stack_base);
-    } else {
-        auto& stack = vm.get_stack_mutable();
-        for (int i = 0; i < nresults; i++) {
-            stack[frame->stack_base + i] = stack[frame->stack_base + base + i];
+LuaValue VM::open_module(const LuaValue& t, const LuaValue& key) {
+    if (!unopened_modules || t.getObject().get() != globals || key.getType() != LuaType::STRING) {
+        return LuaValue();
+    }
+    const std::string& name = static_cast<const LuaString&>(*key.getObject()).getValue();
+    for (size_t n = 0; n < std::size(LUA_MODULES); n++) {
+        if (((unopened_modules >> n) & 1) && name == LUA_MODULES[n].name) {
+            unopened_modules &= ~(1u << n);
+            LuaValue module = LUA_MODULES[n].open();
+            globals->set(key, module);
+            return module;
         }
-        vm.set_top(frame->stack_base + nresults);
     }
+    return LuaValue();
 }
 
-static void vcall(VM& vm, CallInfo* frame, const LuaValue& fn, int base, int num_args, int num_results) {
-    auto& stack = vm.get_stack_mutable();
-    auto& call_stack = vm.get_call_stack_mutable();
+int VM::get_frame_top() const {
+    if (call_stack.empty()) return top;
+    return std::max(top, call_stack.back().top);
+}
 
-    if (call_stack.size() >= LUAI_MAXCALLS) {
-        throw LuaError("call stack overflow");
+// Moves `n` results from stack[first_result] down to the function slot and
+// adjusts them to the `nresults` the caller asked for.
+void VM::poscall(int func, int first_result, int n, int nresults) {
+    int wanted = nresults < 0 ? n : nresults;
+    for (int j = 0; j < wanted; j++) {
+        *stack[func + j] = j < n ? *stack[first_result + j] : LuaValue();
     }
+    top = func + wanted;
+}
+
+// Prepares a call to stack[func]. Native functions run immediately and
+// their results are in place on return; for a Lua closure a new frame is
+// pushed and true is returned, leaving the interpreter to run it.
+bool VM::precall(int func, int nargs, int nresults) {
+    const LuaValue& fn = *stack[func];
 
     if (fn.getType() == LuaType::FUNCTION) {
-        // Lua 関数 (LuaClosure)
-        if (auto closure = std::dynamic_pointer_cast<LuaClosure>(fn.getObject())) {
-            int new_stack_base = base;
+        if (auto* closure = dynamic_cast<LuaClosure*>(fn.getObject().get())) {
+            if (call_stack.size() >= LUAI_MAXCALLS) {
+                throw LuaError("stack overflow");
+            }
+            const auto& proto = closure->getFunction();
+            int base = func + 1;
+            int frame_size = proto->getMaxStackSize() > 0 ? proto->getMaxStackSize() : LUAI_MAXREGS;
+            if (!ensure_stack(base + frame_size + LUAI_MINSTACK + 1)) {
+                throw LuaError("stack overflow");
+            }
 
-            //std::cout << "trying to call function " << closure->getFunction()->getSource() << std::endl;
+            int numparams = proto->getNumParams();
+            std::vector<LuaValue> varargs;
+            if (proto->isVararg()) {
+                for (int j = numparams; j < nargs; j++) {
+                    varargs.push_back(*stack[base + j]);
+                }
+            }
+            for (int j = nargs; j < numparams; j++) {
+                *stack[base + j] = LuaValue();
+            }
 
-            // 引数を新フレームにコピー
-            for (int j = 0; j < num_args; ++j)
-                stack[new_stack_base + 1 + j] = stack[base + 1 + j];
+            call_stack.emplace_back(std::static_pointer_cast<LuaClosure>(fn.getObject()),
+                                    &proto->getBytecode()[0], base, base + frame_size, nresults);
+            call_stack.back().varargs = std::move(varargs);
+            top = base + std::min(nargs, numparams);
+            return true;
+        }
 
-            // 新しい CallInfo 作成してスタックに追加
-            call_stack.emplace_back(closure, &closure->getFunction()->getBytecode()[0], new_stack_base);
-            return;
+        if (auto* cfunc = dynamic_cast<LuaNativeFunction*>(fn.getObject().get())) {
+            top = func + 1 + nargs;
+            int n = cfunc->call(*this, func + 1, nargs);
+            if (yielding) {
+                // coroutine.yield: the next resume completes this call
+                running->pending_func_ = func;
+                running->pending_results_ = nresults;
+                return false;
+            }
+            poscall(func, func + 1, n, nresults);
+            return false;
         }
+    }
 
-        // C 関数 (LuaNativeFunction)
-        if (auto cfunc = std::dynamic_pointer_cast<LuaNativeFunction>(fn.getObject())) {
-            int nret = cfunc->call(vm, base + 1, num_args);
+    // calling a class creates an instance and runs its $init method
+    if (fn.getType() == LuaType::OBJECT) {
+        auto klass = std::static_pointer_cast<LuaClass>(fn.getObject());
+        LuaValue instance(klass->newInstance(), LuaType::INSTANCE);
+        int init = klass->getMethodSlot("$init");
+        if (init >= 0) {
+            for (int j = nargs; j > 0; j--) {
+                *stack[func + 1 + j] = *stack[func + j];
+            }
+            *stack[func] = klass->getMethod(init);
+            *stack[func + 1] = instance;
+            call(func, nargs + 1, 0);
+        }
+        *stack[func] = instance;
+        poscall(func, func, 1, nresults);
+        return false;
+    }
 
-            int ret_count = (num_results < 0) ? nret : num_results;
+    // __call metamethod: the callee becomes the first argument
+    LuaValue tm;
+    if (auto* gc = dynamic_cast<LuaGCObject*>(fn.getObject().get())) {
+        tm = gc->getMetamethod(TM_CALL);
+    }
+    if (tm.getType() != LuaType::NIL) {
+        for (int j = nargs; j > 0; j--) {
+            *stack[func + 1 + j] = *stack[func + j];
+        }
+        *stack[func + 1] = fn;
+        *stack[func] = tm;
+        return precall(func, nargs + 1, nresults);
+    }
 
-            for (int j = 0; j < ret_count; ++j)
-                *stack[base + j] = (j < nret) ? *stack[base + 1 + j] : LuaValue();
+    throw LuaError("attempt to call a " + fn.typeName() + " value");
+}
 
-            vm.set_top(base + ret_count);
-            return;
+int VM::call(int func, int nargs, int nresults) {
+    struct NativeCallGuard {
+        int& depth;
+        explicit NativeCallGuard(int& d) : depth(d) {
+            if (++depth > LUAI_MAXCCALLS) {
+                --depth;
+                throw LuaError("C stack overflow");
+            }
         }
+        ~NativeCallGuard() { --depth; }
+    } guard(native_calls);
+
+    size_t depth = call_stack.size();
+    if (precall(func, nargs, nresults)) {
+        execute(depth);
     }
+    return top - func;
+}
 
-    // __call metamethod
-    if (auto gc = std::dynamic_pointer_cast<LuaGCObject>(fn.getObject())) {
-        LuaValue mmf = gc->getMetamethod(mm::__call);
-        if (mmf.getType() == LuaType::FUNCTION) {
-            int call_base = base;
+static bool checkluaint(const LuaValue& value) {
+    if (auto luaint = std::dynamic_pointer_cast<const LuaInteger>(value.getObject())) {
+        return true;
+    } else {
+        return false;
+    }
+}
 
-            // metamethod を関数位置に置く
-            *stack[call_base] = mmf;
+// operands of the type-specialized opcodes: the compiler proved the type,
+// so there is nothing to check
+static luaInt raw_integer(const LuaValue& value) {
+    return std::static_pointer_cast<LuaInteger>(value.getObject())->getValue();
+}
 
-            // self を先頭引数に
-            for (int j = num_args; j > 0; --j)
-                stack[call_base + j] = stack[base + j];
-            *stack[call_base + 1] = fn;
+static luaNumber raw_float(const LuaValue& value) {
+    return std::static_pointer_cast<LuaNumber>(value.getObject())->getValue();
+}
 
-            int new_num_args = num_args + 1;
+static LuaValue make_integer(unsigned long long v) { // wraps around like Lua
+    return LuaValue(std::make_shared<LuaInteger>(static_cast<luaInt>(v)), LuaType::NUMBER);
+}
 
-            // 再帰呼び出し
-            vcall(vm, frame, *stack[call_base], call_base, new_num_args, num_results);
-            return;
-        }
+static bool has_check_tag(const LuaValue& value, CheckTag tag) {
+    switch (tag) {
+        case CheckTag::INTEGER: return value.getType() == LuaType::NUMBER && checkluaint(value);
+        case CheckTag::FLOAT: return value.getType() == LuaType::NUMBER && !checkluaint(value);
+        case CheckTag::STRING: return value.getType() == LuaType::STRING;
+        case CheckTag::BOOLEAN: return value.getType() == LuaType::BOOLEAN;
+        case CheckTag::TABLE: return value.getType() == LuaType::TABLE;
+        case CheckTag::FUNCTION: return value.getType() == LuaType::FUNCTION;
     }
+    return false;
+}
 
-    if (fn.getObject()) {
-        try {
-            throw LuaError("Attempt to call a " + fn.typeName() + " value");
-        } catch (...) {
-            throw std::runtime_error("vcall: detected corrupted LuaValue");
-        }
-    } else {
-        throw LuaError("Attempt to call a nil value");
+static std::string check_tag_name(CheckTag tag) {
+    switch (tag) {
+        case CheckTag::INTEGER: return "integer";
+        case CheckTag::FLOAT: return "float";
+        case CheckTag::STRING: return "string";
+        case CheckTag::BOOLEAN: return "boolean";
+        case CheckTag::TABLE: return "table";
+        case CheckTag::FUNCTION: return "function";
     }
+    return "?";
 }
 
-static bool checkluaint(const LuaValue& value) {
-    if (auto luaint = std::dynamic_pointer_cast<const LuaInteger>(value.getObject())) {
+static luaInt get_integer_from_value(const LuaValue& val) {
+    return std::static_pointer_cast<const LuaInteger>(val.getObject())->getValue();
+}
+
+// Integer loops precompute their iteration count into R[A+1] so FORLOOP
+// never overflows the control variable; float loops keep the limit.
+// R[A+3] receives the visible copy of the control variable.
+bool VM::forprep(int ra) {
+    LuaValue& init = *stack[ra];
+    LuaValue& limit = *stack[ra + 1];
+    LuaValue& step = *stack[ra + 2];
+    if (init.getType() != LuaType::NUMBER) throw LuaError("'for' initial value must be a number");
+    if (limit.getType() != LuaType::NUMBER) throw LuaError("'for' limit must be a number");
+    if (step.getType() != LuaType::NUMBER) throw LuaError("'for' step must be a number");
+
+    if (checkluaint(init) && checkluaint(step)) {
+        luaInt i0 = get_integer_from_value(init);
+        luaInt st = get_integer_from_value(step);
+        if (st == 0) throw LuaError("'for' step is zero");
+        luaInt lim;
+        if (checkluaint(limit)) {
+            lim = get_integer_from_value(limit);
+        } else { // clip a float limit to the integer range
+            luaNumber fl = get_number_from_value(limit);
+            fl = st < 0 ? std::ceil(fl) : std::floor(fl);
+            if (fl >= -9223372036854775808.0 && fl < 9223372036854775808.0) {
+                lim = static_cast<luaInt>(fl);
+            } else if (fl > 0) {
+                if (st < 0) return false;
+                lim = LLONG_MAX;
+            } else {
+                if (st > 0) return false;
+                lim = LLONG_MIN;
+            }
+        }
+        if (st > 0 ? i0 > lim : i0 < lim) return false;
+        uint64_t count;
+        if (st > 0) {
+            count = static_cast<uint64_t>(lim) - static_cast<uint64_t>(i0);
+            if (st != 1) count /= static_cast<uint64_t>(st);
+        } else {
+            count = static_cast<uint64_t>(i0) - static_cast<uint64_t>(lim);
+            count /= static_cast<uint64_t>(-(st + 1)) + 1u;
+        }
+        limit = LuaValue(std::make_shared<LuaInteger>(static_cast<luaInt>(count)), LuaType::NUMBER);
+        *stack[ra + 3] = init;
         return true;
-    } else {
-        return false;
     }
+
+    luaNumber i0 = get_number_from_value(init);
+    luaNumber lim = get_number_from_value(limit);
+    luaNumber st = get_number_from_value(step);
+    if (st == 0) throw LuaError("'for' step is zero");
+    if (st > 0 ? lim < i0 : i0 < lim) return false;
+    init = LuaValue(std::make_shared<LuaNumber>(i0), LuaType::NUMBER);
+    limit = LuaValue(std::make_shared<LuaNumber>(lim), LuaType::NUMBER);
+    step = LuaValue(std::make_shared<LuaNumber>(st), LuaType::NUMBER);
+    *stack[ra + 3] = init;
+    return true;
 }
 
 bool VM::as_bool(const LuaValue& value) {
@@ -419,107 +528,151 @@ bool VM::as_bool(const LuaValue& value) {
     return true;
 }
 
-static std::shared_ptr<LuaValue> try_arithmetic_metamethod(VM& vm, const LuaValue& mt_key, const LuaValue& a, const LuaValue& b) {
+// metamethod for `event` on v, or nil. With a metatable that lacks the
+// handler this is a single flag test.
+static LuaValue get_tm(const LuaValue& v, TMS event) {
+    auto* gc = dynamic_cast<LuaGCObject*>(v.getObject().get());
+    return gc ? gc->getMetamethod(event) : LuaValue();
+}
+
+// Calls metamethod `tm` as tm(a, b) and returns its first result. The call
+// is set up in the scratch space above the running frame, so dispatch
+// itself allocates nothing.
+static LuaValue call_tm(VM& vm, const LuaValue& tm, const LuaValue& a, const LuaValue& b) {
     auto& stack = vm.get_stack_mutable();
-    auto& call_stack = vm.get_call_stack_mutable();
+    int func = vm.get_frame_top();
+    *stack[func] = tm;
+    *stack[func + 1] = a;
+    *stack[func + 2] = b;
+    vm.call(func, 2, 1);
+    return *stack[func];
+}
 
-    LuaValue mm;
-    if (auto gc = std::dynamic_pointer_cast<LuaGCObject>(a.getObject())) {
-        mm = gc->getMetamethod(mt_key);
+static LuaValue try_arithmetic_metamethod(VM& vm, TMS event, const LuaValue& a, const LuaValue& b) {
+    LuaValue tm = get_tm(a, event);
+    if (tm.getType() == LuaType::NIL) {
+        tm = get_tm(b, event);
     }
-    if (!mm.getObject() && std::dynamic_pointer_cast<LuaGCObject>(b.getObject())) {
-        mm = std::dynamic_pointer_cast<LuaGCObject>(b.getObject())->getMetamethod(mt_key);
+    if (tm.getType() == LuaType::NIL) {
+        const LuaValue& bad = (a.getType() == LuaType::NUMBER || (event == TM_CONCAT && a.getType() == LuaType::STRING)) ? b : a;
+        throw LuaError("attempt to perform " + std::string(event == TM_CONCAT ? "concatenate" : "arithmetic") + " on a " + bad.typeName() + " value");
     }
+    return call_tm(vm, tm, a, b);
+}
 
-    if (!mm.getObject()) {
-        throw LuaError("attempt to perform " + std::string(mt_key.getObject() == mm::__concat.getObject() ? "concatenate" : "arithmetic") + " on a " + a.typeName() + " value");
+// stack[frame->stack_base + a] に結果を返す
+static bool try_call_bin_metamethod(VM& vm, CallInfo* frame, TMS event, const LuaValue& v1, const LuaValue& v2, int dest_reg) {
+    LuaValue tm = get_tm(v1, event);
+    if (tm.getType() != LuaType::FUNCTION) {
+        return false;
     }
+    LuaValue result = call_tm(vm, tm, v1, v2);
+    *vm.get_stack_mutable()[frame->stack_base + dest_reg] = result;
+    return true;
+}
 
-    // vcall を使って __add を呼ぶ
-    int stack_base = vm.get_top();
-    stack.push_back(std::make_shared<LuaValue>(mm)); // metamethod を関数位置に
-    stack.push_back(std::make_shared<LuaValue>(a));  // self
-    stack.push_back(std::make_shared<LuaValue>(b));  // 引数
-    int num_args = 2;
-    int num_results = 1;
-
-    CallInfo* frame = &call_stack.back();
-    vcall(vm, frame, mm, stack_base, num_args, num_results);
+#define MAXTAGLOOP 2000
 
-    auto result = stack[stack_base]; // shared_ptr でそのまま取得
-    vm.set_top(stack_base + 1);
-    return result;
+// t[k] after a raw miss: follows __index tables and calls __index functions
+static LuaValue index_tm(VM& vm, LuaValue t, const LuaValue& k) {
+    for (int loop = 0; loop < MAXTAGLOOP; loop++) {
+        LuaValue tm = get_tm(t, TM_INDEX);
+        if (tm.getType() == LuaType::NIL) {
+            if (t.getType() == LuaType::TABLE) {
+                return vm.open_module(t, k);
+            }
+            if (t.getType() == LuaType::INSTANCE) {
+                return LuaValue();
+            }
+            throw LuaError("attempt to index a " + t.typeName() + " value");
+        }
+        if (tm.getType() == LuaType::FUNCTION) {
+            return call_tm(vm, tm, t, k);
+        }
+        t = tm;
+        LuaValue v;
+        if (t.getType() == LuaType::TABLE) {
+            v = std::static_pointer_cast<LuaTable>(t.getObject())->get(k);
+        } else if (t.getType() == LuaType::INSTANCE) {
+            v = std::static_pointer_cast<LuaInstance>(t.getObject())->get(k);
+        }
+        if (v.getType() != LuaType::NIL) {
+            return v;
+        }
+    }
+    throw LuaError("'__index' chain too long; possible loop");
 }
 
-// stack[frame->stack_base + a] に結果を返す
-static bool try_call_bin_metamethod(VM& vm, CallInfo* frame, const LuaValue& key, const LuaValue& v1, const LuaValue& v2, int dest_reg) {
-    auto& stack = vm.get_stack_mutable();
-    int top_before = vm.get_top();
-
-    if (auto gc = std::dynamic_pointer_cast<LuaGCObject>(v1.getObject())) {
-        LuaValue mmf = gc->getMetamethod(key);
-        if (mmf.getType() == LuaType::FUNCTION) {
-            // vcall で metamethod を呼ぶ
-            int stack_base = top_before;
-            stack.push_back(std::make_shared<LuaValue>(mmf));
-            stack.push_back(std::make_shared<LuaValue>(v1));
-            stack.push_back(std::make_shared<LuaValue>(v2));
-            int num_args = 2;
-            int num_results = 1;
-
-            vcall(vm, frame, mmf, stack_base, num_args, num_results);
-
-            // 結果を目的レジスタにセット
-            stack[frame->stack_base + dest_reg] = stack[stack_base];
-            vm.set_top(stack_base + 1);
-            return true;
+// Shape-guarded slot load for GETFIELD on an instance. A miss looks the
+// field up in the shape and refills the cache; methods are never cached here.
+static LuaValue instance_getfield(LuaInstance& inst, const LuaValue& key, FieldCache& ic) {
+    const auto& shape = inst.getShape();
+    if (ic.shape_id == shape->getId() && !ic.transition) {
+        return inst.getSlot(ic.slot);
+    }
+    if (key.getType() == LuaType::STRING) {
+        int slot = shape->lookup(std::static_pointer_cast<LuaString>(key.getObject())->getValue());
+        if (slot >= 0) {
+            ic.shape_id = shape->getId();
+            ic.slot = slot;
+            ic.transition = nullptr;
+            return inst.getSlot(slot);
         }
     }
-
-    return false;
+    return inst.get(key);
 }
 
-// 汎用的に metamethod を呼び出す
-LuaValue call_metamethod(VM& vm, const LuaValue& mt_key, const std::vector<LuaValue>& args) {
-    auto& stack = vm.get_stack_mutable();
-    auto& call_stack = vm.get_call_stack_mutable();
-
-    LuaValue mm;
-
-    // args[0] と args[1]（存在すれば）から metamethod を探す
-    if (!args.empty()) {
-        if (auto gc = std::dynamic_pointer_cast<LuaGCObject>(args[0].getObject())) {
-            mm = gc->getMetamethod(mt_key);
+// Shape-guarded store for SETFIELD on an instance. Stores that add a field
+// cache the transition, so constructors building the same layout skip the
+// shape lookup entirely.
+static void instance_setfield(LuaInstance& inst, const LuaValue& key, const LuaValue& value, FieldCache& ic) {
+    uint64_t shape_id = inst.getShape()->getId();
+    if (ic.shape_id == shape_id) {
+        if (ic.transition) {
+            inst.addSlot(ic.transition, value);
+        } else {
+            inst.getSlot(ic.slot) = value;
         }
+        return;
     }
-    if (!mm.getObject() && args.size() > 1) {
-        if (auto gc = std::dynamic_pointer_cast<LuaGCObject>(args[1].getObject())) {
-            mm = gc->getMetamethod(mt_key);
-        }
+    if (key.getType() != LuaType::STRING) {
+        inst.set(key, value);
+        return;
     }
+    int slot = inst.setField(std::static_pointer_cast<LuaString>(key.getObject())->getValue(), value);
+    ic.shape_id = shape_id;
+    ic.slot = slot;
+    ic.transition = inst.getShape()->getId() != shape_id ? inst.getShape() : nullptr;
+}
 
-    if (!mm.getObject()) {
-        // 見つからなければ nil
-        return LuaValue();
+// Method lookup for SELF on an instance. Class vtables are flattened when the
+// class is defined, so a hit is two id compares and one indexed load no
+// matter how deep the hierarchy is. As in LuaInstance::get, a field of the
+// instance shadows a method of the same name, so entries are also keyed on
+// the shape that was found not to have one.
+static LuaValue instance_method(LuaInstance& inst, const LuaValue& key, MethodCache& ic) {
+    LuaClass& klass = *inst.getClass();
+    uint64_t class_id = klass.getId();
+    uint64_t shape_id = inst.getShape()->getId();
+    for (int n = 0; n < ic.count; n++) {
+        if (ic.entries[n].class_id == class_id && ic.entries[n].shape_id == shape_id) {
+            return klass.getMethod(ic.entries[n].slot);
+        }
     }
-
-    // スタックに metamethod と引数を配置
-    int stack_base = vm.get_top();
-    stack.push_back(std::make_shared<LuaValue>(mm));
-    for (const auto& arg : args) {
-        stack.push_back(std::make_shared<LuaValue>(arg));
+    if (key.getType() == LuaType::STRING) {
+        const std::string& name = std::static_pointer_cast<LuaString>(key.getObject())->getValue();
+        int field = inst.getShape()->lookup(name);
+        if (field >= 0) return inst.getSlot(field);
+        int slot = klass.getMethodSlot(name);
+        if (slot >= 0) {
+            int n = ic.count < MethodCache::MAX_ENTRIES ? ic.count++ : ic.next++ % MethodCache::MAX_ENTRIES;
+            ic.entries[n].class_id = class_id;
+            ic.entries[n].shape_id = shape_id;
+            ic.entries[n].slot = slot;
+            return klass.getMethod(slot);
+        }
     }
-
-    int num_args = static_cast<int>(args.size());
-    int num_results = 1;
-
-    CallInfo* frame = &call_stack.back();
-    vcall(vm, frame, mm, stack_base, num_args, num_results);
-
-    LuaValue& result = *stack[stack_base]; // 戻り値
-    vm.set_top(stack_base + 1);
-
-    return result;
+    return inst.get(key);
 }
 
 // Arithmetic operations with metamethod support
@@ -538,7 +691,7 @@ LuaValue VM::add(const LuaValue& a, const LuaValue& b) {
             return LuaValue(std::make_shared<LuaNumber>(na + nb), LuaType::NUMBER);
         }
     } else {
-        return try_arithmetic_metamethod(*this, mm::__add, a, b);
+        return try_arithmetic_metamethod(*this, TM_ADD, a, b);
     }
 }
 
@@ -557,7 +710,7 @@ LuaValue VM::sub(const LuaValue& a, const LuaValue& b) {
             return LuaValue(std::make_shared<LuaNumber>(na - nb), LuaType::NUMBER);
         }
     } else {
-        return try_arithmetic_metamethod(*this, mm::__sub, a, b);
+        return try_arithmetic_metamethod(*this, TM_SUB, a, b);
     }
 }
 
@@ -576,7 +729,7 @@ LuaValue VM::mul(const LuaValue& a, const LuaValue& b) {
             return LuaValue(std::make_shared<LuaNumber>(na * nb), LuaType::NUMBER);
         }
     } else {
-        return try_arithmetic_metamethod(*this, mm::__mul, a, b);
+        return try_arithmetic_metamethod(*this, TM_MUL, a, b);
     }
 }
 
@@ -586,11 +739,20 @@ LuaValue VM::div(const LuaValue& a, const LuaValue& b) {
         luaNumber nb = get_number_from_value(b);
         return LuaValue(std::make_shared<LuaNumber>(na / nb), LuaType::NUMBER);
     } else {
-        return try_arithmetic_metamethod(*this, mm::__div, a, b);
+        return try_arithmetic_metamethod(*this, TM_DIV, a, b);
     }
 }
 
 LuaValue VM::mod(const LuaValue& a, const LuaValue& b) {
+    if (checkluaint(a) && checkluaint(b)) {
+        luaInt ia = get_integer_from_value(a);
+        luaInt ib = get_integer_from_value(b);
+        if (ib == 0) throw LuaError("attempt to perform 'n%0'");
+        if (ib == -1) return LuaValue(std::make_shared<LuaInteger>(0), LuaType::NUMBER);
+        luaInt res = ia % ib;
+        if (res != 0 && (res ^ ib) < 0) res += ib;
+        return LuaValue(std::make_shared<LuaInteger>(res), LuaType::NUMBER);
+    }
     if (a.getType() == LuaType::NUMBER && b.getType() == LuaType::NUMBER) {
         luaNumber na = get_number_from_value(a);
         luaNumber nb = get_number_from_value(b);
@@ -598,7 +760,7 @@ LuaValue VM::mod(const LuaValue& a, const LuaValue& b) {
         if (res < 0) res += nb;
         return LuaValue(std::make_shared<LuaNumber>(res), LuaType::NUMBER);
     } else {
-        return try_arithmetic_metamethod(*this, mm::__mod, a, b);
+        return try_arithmetic_metamethod(*this, TM_MOD, a, b);
     }
 }
 
@@ -608,7 +770,7 @@ LuaValue VM::pow(const LuaValue& a, const LuaValue& b) {
         luaNumber nb = get_number_from_value(b);
         return LuaValue(std::make_shared<LuaNumber>(std::pow(na, nb)), LuaType::NUMBER);
     } else {
-        return try_arithmetic_metamethod(*this, mm::__pow, a, b);
+        return try_arithmetic_metamethod(*this, TM_POW, a, b);
     }
 }
 
@@ -632,7 +794,7 @@ LuaValue VM::idiv(const LuaValue& a, const LuaValue& b) {
         luaNumber result = std::floor(na / nb);
         return LuaValue(std::make_shared<LuaNumber>(result), LuaType::NUMBER);
     } else {
-        return try_arithmetic_metamethod(*this, mm::__idiv, a, b);
+        return try_arithmetic_metamethod(*this, TM_IDIV, a, b);
     }
 }
 
@@ -646,7 +808,8 @@ LuaValue VM::unm(const LuaValue& a) {
             throw std::runtime_error("LuaValue type NUMBER has unknown internal object");
         }
     } else {
-        return try_arithmetic_metamethod(*this, mm::__unm, a, LuaValue());
+        // unary events get the operand twice, like Lua
+        return try_arithmetic_metamethod(*this, TM_UNM, a, a);
     }
 }
 
@@ -656,28 +819,37 @@ LuaValue VM::len(const LuaValue& a) {
         return LuaValue(std::make_shared<LuaInteger>(str->getValue().size()), LuaType::NUMBER);
     } else if (a.getType() == LuaType::TABLE) {
         auto table = std::dynamic_pointer_cast<LuaTable>(a.getObject());
-        LuaValue mm = table->getMetamethod(mm::__len);
-        if (mm.getObject()) {
-            return call_metamethod(*this, mm::__len, {LuaValue(table, LuaType::TABLE)});
-        } else {
-            return table->vlen();
+        LuaValue tm = table->getMetamethod(TM_LEN);
+        if (tm.getType() != LuaType::NIL) {
+            return call_tm(*this, tm, a, a);
         }
-    } else {
-        return call_metamethod(*this, mm::__len, {a});
+        return table->vlen();
+    }
+    LuaValue tm = get_tm(a, TM_LEN);
+    if (tm.getType() == LuaType::NIL) {
+        throw LuaError("attempt to get length of a " + a.typeName() + " value");
     }
-    throw LuaError("attempt to get length of a " + a.typeName() + " value");
+    return call_tm(*this, tm, a, a);
 }
 
 LuaValue VM::concat(const LuaValue& a, const LuaValue& b) {
-    if (a.getType() == LuaType::STRING && b.getType() == LuaType::STRING) {
-        auto str_a = std::dynamic_pointer_cast<LuaString>(a.getObject());
-        auto str_b = std::dynamic_pointer_cast<LuaString>(b.getObject());
-        return LuaValue(std::make_shared<LuaString>(str_a->getValue() + str_b->getValue()), LuaType::STRING);
+    auto is_concatable = [](const LuaValue& v) {
+        return v.getType() == LuaType::STRING || v.getType() == LuaType::NUMBER;
+    };
+    if (is_concatable(a) && is_concatable(b)) {
+        return LuaValue(std::make_shared<LuaString>(a.toString() + b.toString()), LuaType::STRING);
     } else {
-        return try_arithmetic_metamethod(*this, mm::__concat, a, b);
+        return try_arithmetic_metamethod(*this, TM_CONCAT, a, b);
     }
 }
 
+// Logical shift; shifts of 64 or more bits give 0, negative ones go right.
+static luaInt shift_left(luaInt x, luaInt y) {
+    if (y <= -64 || y >= 64) return 0;
+    if (y < 0) return static_cast<luaInt>(static_cast<uint64_t>(x) >> -y);
+    return static_cast<luaInt>(static_cast<uint64_t>(x) << y);
+}
+
 // Bitwise operations with metamethod support
 LuaValue VM::band(const LuaValue& a, const LuaValue& b) {
     if (a.getType() == LuaType::NUMBER && b.getType() == LuaType::NUMBER) {
@@ -685,7 +857,7 @@ LuaValue VM::band(const LuaValue& a, const LuaValue& b) {
         luaInt ib = static_cast<luaInt>(get_number_from_value(b));
         return LuaValue(std::make_shared<LuaInteger>(ia & ib), LuaType::NUMBER);
     } else {
-        return try_arithmetic_metamethod(*this, mm::__band, a, b);
+        return try_arithmetic_metamethod(*this, TM_BAND, a, b);
     }
 }
 
@@ -695,7 +867,7 @@ LuaValue VM::bor(const LuaValue& a, const LuaValue& b) {
         luaInt ib = static_cast<luaInt>(get_number_from_value(b));
         return LuaValue(std::make_shared<LuaInteger>(ia | ib), LuaType::NUMBER);
     } else {
-        return try_arithmetic_metamethod(*this, mm::__bor, a, b);
+        return try_arithmetic_metamethod(*this, TM_BOR, a, b);
     }
 }
 
@@ -705,7 +877,7 @@ LuaValue VM::bxor(const LuaValue& a, const LuaValue& b) {
         luaInt ib = static_cast<luaInt>(get_number_from_value(b));
         return LuaValue(std::make_shared<LuaInteger>(ia ^ ib), LuaType::NUMBER);
     } else {
-        return try_arithmetic_metamethod(*this, mm::__bxor, a, b);
+        return try_arithmetic_metamethod(*this, TM_BXOR, a, b);
     }
 }
 
@@ -714,7 +886,8 @@ LuaValue VM::bnot(const LuaValue& a) {
         luaInt ia = static_cast<luaInt>(get_number_from_value(a));
         return LuaValue(std::make_shared<LuaInteger>(~ia), LuaType::NUMBER);
     } else {
-        return try_arithmetic_metamethod(*this, mm::__bnot, a, LuaValue());
+        // unary events get the operand twice, like Lua
+        return try_arithmetic_metamethod(*this, TM_BNOT, a, a);
     }
 }
 
@@ -722,9 +895,9 @@ LuaValue VM::shl(const LuaValue& a, const LuaValue& b) {
     if (a.getType() == LuaType::NUMBER && b.getType() == LuaType::NUMBER) {
         luaInt ia = static_cast<luaInt>(get_number_from_value(a));
         luaInt ib = static_cast<luaInt>(get_number_from_value(b));
-        return LuaValue(std::make_shared<LuaInteger>(ia << ib), LuaType::NUMBER);
+        return LuaValue(std::make_shared<LuaInteger>(shift_left(ia, ib)), LuaType::NUMBER);
     } else {
-        return try_arithmetic_metamethod(*this, mm::__shl, a, b);
+        return try_arithmetic_metamethod(*this, TM_SHL, a, b);
     }
 }
 
@@ -732,9 +905,9 @@ LuaValue VM::shr(const LuaValue& a, const LuaValue& b) {
     if (a.getType() == LuaType::NUMBER && b.getType() == LuaType::NUMBER) {
         luaInt ia = static_cast<luaInt>(get_number_from_value(a));
         luaInt ib = static_cast<luaInt>(get_number_from_value(b));
-        return LuaValue(std::make_shared<LuaInteger>(ia >> ib), LuaType::NUMBER);
+        return LuaValue(std::make_shared<LuaInteger>(shift_left(ia, ib == LLONG_MIN ? LLONG_MAX : -ib)), LuaType::NUMBER);
     } else {
-        return try_arithmetic_metamethod(*this, mm::__shr, a, b);
+        return try_arithmetic_metamethod(*this, TM_SHR, a, b);
     }
 }
 
@@ -767,7 +940,31 @@ bool VM::eq(const LuaValue& a, const LuaValue& b) {
     }
     
     // For other types, compare object pointers
-    return a.getObject() == b.getObject();
+    if (a.getObject() == b.getObject()) {
+        return true;
+    }
+    if (a.getType() != LuaType::TABLE && a.getType() != LuaType::INSTANCE && a.getType() != LuaType::USERDATA) {
+        return false;
+    }
+    LuaValue tm = get_tm(a, TM_EQ);
+    if (tm.getType() == LuaType::NIL) {
+        tm = get_tm(b, TM_EQ);
+    }
+    return tm.getType() != LuaType::NIL && as_bool(call_tm(*this, tm, a, b));
+}
+
+static bool compare_tm(VM& vm, TMS event, const LuaValue& a, const LuaValue& b) {
+    LuaValue tm = get_tm(a, event);
+    if (tm.getType() == LuaType::NIL) {
+        tm = get_tm(b, event);
+    }
+    if (tm.getType() == LuaType::NIL) {
+        if (a.typeName() == b.typeName()) {
+            throw LuaError("attempt to compare two " + a.typeName() + " values");
+        }
+        throw LuaError("attempt to compare " + a.typeName() + " with " + b.typeName());
+    }
+    return vm.as_bool(call_tm(vm, tm, a, b));
 }
 
 bool VM::lt(const LuaValue& a, const LuaValue& b) {
@@ -780,8 +977,7 @@ bool VM::lt(const LuaValue& a, const LuaValue& b) {
         auto str_b = std::dynamic_pointer_cast<LuaString>(b.getObject());
         return str_a->getValue() < str_b->getValue();
     } else {
-        // Metamethod handling would go here
-        return false;
+        return compare_tm(*this, TM_LT, a, b);
     }
 }
 
@@ -795,22 +991,130 @@ bool VM::le(const LuaValue& a, const LuaValue& b) {
         auto str_b = std::dynamic_pointer_cast<LuaString>(b.getObject());
         return str_a->getValue() <= str_b->getValue();
     } else {
-        // Metamethod handling would go here
-        return false;
+        return compare_tm(*this, TM_LE, a, b);
     }
 }
 
 void VM::run() {
-    while (!call_stack.empty()) {
+    execute(0);
+}
+
+void VM::swap_state(LuaCoroutine& co) {
+    stack.swap(co.stack_);
+    if (!co.call_stack_) co.call_stack_.emplace();
+    call_stack.swap(*co.call_stack_);
+    std::swap(top, co.top_);
+    open_upvalues.swap(co.open_upvalues_);
+}
+
+// While `co` runs, its fields hold the resumer's state, so arguments are
+// read from and results written to co.stack_ on the resumer's side.
+int VM::resume(LuaCoroutine& co, int first_arg, int nargs) {
+    using Status = LuaCoroutine::Status;
+    if (co.status_ == Status::DEAD) throw LuaError("cannot resume dead coroutine");
+    if (co.status_ != Status::SUSPENDED) throw LuaError("cannot resume non-suspended coroutine");
+    if (native_calls >= LUAI_MAXCCALLS) throw LuaError("C stack overflow");
+
+    LuaCoroutine* resumer = running;
+    if (resumer) resumer->status_ = Status::NORMAL;
+    running = &co;
+    co.status_ = Status::RUNNING;
+    co.native_calls_ = ++native_calls;
+    swap_state(co);
+
+    auto finish = [&] {
+        swap_state(co);
+        native_calls--;
+        running = resumer;
+        if (resumer) resumer->status_ = Status::RUNNING;
+    };
+    auto release = [&] {
+        co.stack_ = {};
+        co.call_stack_.reset();
+        co.top_ = 0;
+    };
+
+    int first, n;
+    try {
+        if (co.function_.getType() != LuaType::NIL) {
+            // first resume: call the function with the arguments
+            if (!ensure_stack(nargs + 1 + LUAI_MINSTACK)) throw LuaError("stack overflow");
+            *stack[0] = std::move(co.function_);
+            co.function_ = LuaValue();
+            for (int j = 0; j < nargs; j++) *stack[1 + j] = *co.stack_[first_arg + j];
+            top = 1 + nargs;
+            if (precall(0, nargs, -1)) execute(0);
+        } else {
+            // the arguments become the results of the pending yield
+            int func = co.pending_func_;
+            int wanted = co.pending_results_ < 0 ? nargs : co.pending_results_;
+            if (!ensure_stack(func + wanted + LUAI_MINSTACK)) throw LuaError("stack overflow");
+            for (int j = 0; j < wanted; j++) {
+                *stack[func + j] = j < nargs ? *co.stack_[first_arg + j] : LuaValue();
+            }
+            top = func + wanted;
+            execute(0);
+        }
+        if (yielding) {
+            yielding = false;
+            co.status_ = Status::SUSPENDED;
+            first = co.yield_first_;
+            n = co.yield_count_;
+        } else {
+            // the function returned; its results start in its own slot
+            co.status_ = Status::DEAD;
+            first = 0;
+            n = top;
+        }
+    } catch (...) {
+        yielding = false;
+        close_upvalues(0);
+        finish();
+        co.status_ = Status::DEAD;
+        release();
+        throw;
+    }
+
+    finish();
+    if (!ensure_stack(first_arg + n + LUAI_MINSTACK)) {
+        if (co.status_ == Status::DEAD) release();
+        throw LuaError("stack overflow");
+    }
+    for (int j = 0; j < n; j++) *stack[first_arg + j] = *co.stack_[first + j];
+    if (co.status_ == Status::DEAD) release();
+    return n;
+}
+
+int VM::yield(int first, int n) {
+    if (!running) throw LuaError("attempt to yield from outside a coroutine");
+    if (!is_yieldable()) throw LuaError("attempt to yield across a C-call boundary");
+    running->yield_first_ = first;
+    running->yield_count_ = n;
+    yielding = true;
+    return 0;
+}
+
+bool VM::is_yieldable() const {
+    return running && native_calls == running->native_calls_;
+}
+
+#ifdef LUAO_USE_EPOLL
+Scheduler& VM::get_scheduler() {
+    if (!scheduler) scheduler = std::make_shared<Scheduler>();
+    return *scheduler;
+}
+#endif
+
+// Runs frames until the call stack unwinds back to `base_depth` entries.
+// VM::call re-enters here for functions called from native code and
+// metamethods; Lua-to-Lua calls stay within one activation.
+void VM::execute(size_t base_depth) {
+    while (call_stack.size() > base_depth && !yielding) {
         CallInfo* frame = &call_stack.back();
         const Instruction* pc = frame->pc;
-        std::shared_ptr<LuaFunction> func = frame->closure->getFunction();
+        const std::shared_ptr<const LuaFunction>& func = frame->closure->getFunction();
 
         for (;;) {
-            if (stack.size() >= LUAI_MAXSTACK) {
-                throw LuaError("stack overflow");
-            }
-
             Instruction i = *pc++;
             last_instruction = &i;
             if (trace_execution) {
@@ -824,7 +1128,7 @@ void VM::run() {
                 case OpCode::MOVE: {
                     int a = GETARG_A(i); /* args are 'A B' */
                     int b = GETARG_B(i);
-                    stack[frame->stack_base + a] = stack[frame->stack_base + b];
+                    *stack[frame->stack_base + a] = *stack[frame->stack_base + b];
                     break;
                 }
                 case OpCode::LOADI: {
@@ -852,27 +1156,27 @@ void VM::run() {
                     int a = GETARG_A(i);
                     // LOADKX uses the next instruction as extra argument
                     Instruction extra = *pc++;
-                    int bx = GETARG_Bx(extra);
+                    int bx = GETARG_Ax(extra);
                     *stack[frame->stack_base + a] = func->getConstants()[bx];
                     top = frame->stack_base + a + 1;
                     break;
                 }
                 case OpCode::LOADFALSE: {
                     int a = GETARG_A(i); /* args are 'A' */
-                    *stack[frame->stack_base + a] = LuaValue(FALSE_OBJ, LuaType::BOOLEAN);
+                    *stack[frame->stack_base + a] = false_value;
                     top = frame->stack_base + a + 1;
                     break;
                 }
                 case OpCode::LFALSESKIP: {
                     int a = GETARG_A(i); /* args are 'A' */
-                    *stack[frame->stack_base + a] = LuaValue(FALSE_OBJ, LuaType::BOOLEAN);
+                    *stack[frame->stack_base + a] = false_value;
                     top = frame->stack_base + a + 1;
                     pc++; // skip next instruction
                     break;
                 }
                 case OpCode::LOADTRUE: {
                     int a = GETARG_A(i); /* args are 'A' */
-                    *stack[frame->stack_base + a] = LuaValue(TRUE_OBJ, LuaType::BOOLEAN);
+                    *stack[frame->stack_base + a] = true_value;
                     top = frame->stack_base + a + 1;
                     break;
                 }
@@ -915,21 +1219,23 @@ void VM::run() {
                     
                     LuaValue res = LuaValue();
 
-                    if (t.getType() == LuaType::TABLE) {
+                    if (t.getType() == LuaType::INSTANCE) {
+                        auto inst = std::static_pointer_cast<LuaInstance>(t.getObject());
+                        if (op == OpCode::GETFIELD) {
+                            FieldCache& ic = frame->closure->getFieldCache(static_cast<int>(pc - 1 - &func->getBytecode()[0]));
+                            res = instance_getfield(*inst, k, ic);
+                        } else {
+                            res = inst->get(k);
+                        }
+                    } else if (t.getType() == LuaType::TABLE) {
                         if (auto table = std::dynamic_pointer_cast<LuaTable>(t.getObject())) {
                             res = table->get(k);
                         }
-                        if (!res.getObject()) {
-                            res = call_metamethod(*this, mm::__index, {t, k});
+                        if (res.getType() == LuaType::NIL) {
+                            res = index_tm(*this, t, k);
                         }
                     } else {
-                        if (auto gc = std::dynamic_pointer_cast<LuaGCObject>(t.getObject())) {
-                            if (gc->getMetamethod(mm::__index).getObject()) {
-                                res = call_metamethod(*this, mm::__index, {t, k});
-                            } else {
-                                throw LuaError("Attempt to index a " + t.typeName() + " value");
-                            }
-                        }
+                        res = index_tm(*this, t, k);
                     }
 
                     *stack[frame->stack_base + a] = res;
@@ -944,17 +1250,13 @@ void VM::run() {
                     if (a < 0 || a >= static_cast<int>(upvals.size())) {
                         throw std::runtime_error("SETTABUP: invalid upvalue index");
                     }
-                    auto loc = upvals[a]->getLocation().lock();
-                    if (!loc) {
-                        throw std::runtime_error("SETTABUP: upvalue is closed");
-                    }
-
-                    if (auto table = std::dynamic_pointer_cast<LuaTable>(loc->getObject())) {
+                    LuaValue t = upvals[a]->getValue();
+                    if (auto table = std::dynamic_pointer_cast<LuaTable>(t.getObject())) {
                         LuaValue k = func->getConstants()[b];
-                        LuaValue v = *stack[frame->stack_base + c];
+                        LuaValue v = GETARG_k(i) ? func->getConstants()[c] : *stack[frame->stack_base + c];
                         table->set(k, v);
                     } else {
-                        throw std::runtime_error("SETTABUP on non-table upvalue");
+                        throw LuaError("attempt to index a " + t.typeName() + " value");
                     }
                     break;
                 }
@@ -965,9 +1267,11 @@ void VM::run() {
 
                     LuaValue t = *stack[frame->stack_base + a];
                     LuaValue k = *stack[frame->stack_base + b];
-                    LuaValue v = *stack[frame->stack_base + c];
+                    LuaValue v = GETARG_k(i) ? func->getConstants()[c] : *stack[frame->stack_base + c];
 
-                    if (t.getType() == LuaType::TABLE) {
+                    if (t.getType() == LuaType::INSTANCE) {
+                        std::static_pointer_cast<LuaInstance>(t.getObject())->set(k, v);
+                    } else if (t.getType() == LuaType::TABLE) {
                         if (auto table = std::dynamic_pointer_cast<LuaTable>(t.getObject())) {
                             table->set(k, v);
                         } else {
@@ -989,7 +1293,7 @@ void VM::run() {
                     int c = GETARG_C(i);
 
                     LuaValue t = *stack[frame->stack_base + a];
-                    LuaValue v = *stack[frame->stack_base + c];
+                    LuaValue v = GETARG_k(i) ? func->getConstants()[c] : *stack[frame->stack_base + c];
 
                     if (t.getType() == LuaType::TABLE) {
                         if (auto table = std::dynamic_pointer_cast<LuaTable>(t.getObject())) {
@@ -1014,9 +1318,12 @@ void VM::run() {
 
                     LuaValue t = *stack[frame->stack_base + a];
                     LuaValue k = func->getConstants()[b];
-                    LuaValue v = *stack[frame->stack_base + c];
+                    LuaValue v = GETARG_k(i) ? func->getConstants()[c] : *stack[frame->stack_base + c];
 
-                    if (t.getType() == LuaType::TABLE) {
+                    if (t.getType() == LuaType::INSTANCE) {
+                        FieldCache& ic = frame->closure->getFieldCache(static_cast<int>(pc - 1 - &func->getBytecode()[0]));
+                        instance_setfield(*std::static_pointer_cast<LuaInstance>(t.getObject()), k, v, ic);
+                    } else if (t.getType() == LuaType::TABLE) {
                         if (auto table = std::dynamic_pointer_cast<LuaTable>(t.getObject())) {
                             table->set(k, v);
                         } else {
@@ -1044,26 +1351,28 @@ void VM::run() {
                     int b = GETARG_B(i);
                     int c = GETARG_C(i);
                     
-                    LuaValue& self = *stack[frame->stack_base + b];
-                    LuaValue& method_key = *stack[frame->stack_base + c];
-                    
-                    // R[A+1] := R[B] (self)
-                    *stack[frame->stack_base + a + 1] = self;
+                    LuaValue self = *stack[frame->stack_base + b];
+                    const LuaValue& method_key = GETARG_k(i) ? func->getConstants()[c] : *stack[frame->stack_base + c];
+                    LuaValue method;
                     
                     // R[A] := R[B][RK(C):string] (method)
-                    if (self.getType() == LuaType::TABLE) {
+                    if (self.getType() == LuaType::INSTANCE) {
+                        MethodCache& ic = frame->closure->getMethodCache(static_cast<int>(pc - 1 - &func->getBytecode()[0]));
+                        method = instance_method(*std::static_pointer_cast<LuaInstance>(self.getObject()), method_key, ic);
+                    } else if (self.getType() == LuaType::TABLE) {
                         if (auto table = std::dynamic_pointer_cast<LuaTable>(self.getObject())) {
-                            *stack[frame->stack_base + a] = table->get(method_key);
-                        } else {
-                            // metamethod handling would go here
+                            method = table->get(method_key);
                         }
-                    } else {
-                        if (auto gc = std::dynamic_pointer_cast<LuaGCObject>(self.getObject())) {
-                            // metamethod handling would go here
-                        } else {
-                            throw LuaError("attempt to index a " + self.typeName() + " value");
+                        if (method.getType() == LuaType::NIL) {
+                            method = index_tm(*this, self, method_key);
                         }
+                    } else {
+                        method = index_tm(*this, self, method_key);
                     }
+
+                    // R[A+1] := R[B] (self)
+                    *stack[frame->stack_base + a + 1] = self;
+                    *stack[frame->stack_base + a] = method;
                     top = frame->stack_base + a + 2;
                     break;
                 }
@@ -1074,7 +1383,7 @@ void VM::run() {
                     LuaValue rb = *stack[frame->stack_base + b];
                     LuaValue imm(std::make_shared<LuaInteger>(sc), LuaType::NUMBER);
 
-                    *stack[frame->stack_base + a] = add(rb, imm);
+                    *stack[frame->stack_base + a] = GETARG_k(i) ? add(imm, rb) : add(rb, imm);
 
                     top = frame->stack_base + a + 1;
                     break;
@@ -1086,7 +1395,7 @@ void VM::run() {
                     LuaValue rb = *stack[frame->stack_base + b];
                     LuaValue kc = func->getConstants()[c];
                                 
-                    *stack[frame->stack_base + a] = add(rb, kc);
+                    *stack[frame->stack_base + a] = GETARG_k(i) ? add(kc, rb) : add(rb, kc);
                                 
                     top = frame->stack_base + a + 1;
                     break;
@@ -1110,7 +1419,7 @@ void VM::run() {
                     LuaValue rb = *stack[frame->stack_base + b];
                     LuaValue kc = func->getConstants()[c];
                     
-                    *stack[frame->stack_base + a] = mul(rb, kc);
+                    *stack[frame->stack_base + a] = GETARG_k(i) ? mul(kc, rb) : mul(rb, kc);
 
                     top = frame->stack_base + a + 1;
                     break;
@@ -1290,7 +1599,7 @@ void VM::run() {
                     LuaValue rb = *stack[frame->stack_base + b];
                     LuaValue kc = func->getConstants()[c];
                     
-                    *stack[frame->stack_base + a] = band(rb, kc);
+                    *stack[frame->stack_base + a] = GETARG_k(i) ? band(kc, rb) : band(rb, kc);
                     top = frame->stack_base + a + 1;
                     break;
                 }
@@ -1301,7 +1610,7 @@ void VM::run() {
                     LuaValue rb = *stack[frame->stack_base + b];
                     LuaValue kc = func->getConstants()[c];
                     
-                    *stack[frame->stack_base + a] = bor(rb, kc);
+                    *stack[frame->stack_base + a] = GETARG_k(i) ? bor(kc, rb) : bor(rb, kc);
                     top = frame->stack_base + a + 1;
                     break;
                 }
@@ -1312,7 +1621,7 @@ void VM::run() {
                     LuaValue rb = *stack[frame->stack_base + b];
                     LuaValue kc = func->getConstants()[c];
                     
-                   * stack[frame->stack_base + a] = bxor(rb, kc);
+                    *stack[frame->stack_base + a] = GETARG_k(i) ? bxor(kc, rb) : bxor(rb, kc);
                     top = frame->stack_base + a + 1;
                     break;
                 }
@@ -1334,7 +1643,7 @@ void VM::run() {
                     LuaValue rb = *stack[frame->stack_base + b];
                     LuaValue imm(std::make_shared<LuaInteger>(sc), LuaType::NUMBER);
                     
-                   * stack[frame->stack_base + a] = shl(rb, imm);
+                    *stack[frame->stack_base + a] = shl(imm, rb);
                     top = frame->stack_base + a + 1;
                     break;
                 }
@@ -1357,7 +1666,7 @@ void VM::run() {
                 case OpCode::NOT: {
                     int a = GETARG_A(i); /* args are 'A B' */
                     int b = GETARG_B(i);
-                    *stack[frame->stack_base + a] = LuaValue(as_bool(*stack[frame->stack_base + b]) ? FALSE_OBJ : TRUE_OBJ, LuaType::BOOLEAN);
+                    *stack[frame->stack_base + a] = as_bool(*stack[frame->stack_base + b]) ? false_value : true_value;
                     top = frame->stack_base + a + 1;
                     break;
                 }
@@ -1371,26 +1680,20 @@ void VM::run() {
                 }
                 case OpCode::CONCAT: {
                     int a = GETARG_A(i);
-                    int b = GETARG_B(i);
-                    int c = GETARG_C(i);
-                    if (b > c) {
-                        *stack[frame->stack_base + a] = LuaValue(std::make_shared<LuaString>(""), LuaType::STRING);
-                    } else {
-                        LuaValue& result = *stack[frame->stack_base + b];
-                        for (int j = b + 1; j <= c; j++) {
-                            result = concat(result, *stack[frame->stack_base + j]);
-                        }
-                        *stack[frame->stack_base + a] = result;
+                    int n = GETARG_B(i);
+                    // R[A] := R[A].. ... ..R[A + B - 1], right to left like Lua
+                    int first = frame->stack_base + a;
+                    LuaValue result = *stack[first + n - 1];
+                    for (int j = n - 2; j >= 0; j--) {
+                        result = concat(*stack[first + j], result);
                     }
-                    top = frame->stack_base + a + 1;
+                    *stack[first] = result;
+                    top = first + 1;
                     break;
                 }
                 case OpCode::CLOSE: {
                     int a = GETARG_A(i);
-                    // Close all upvalues >= R[A]
-                    // This is a simplified implementation
-                    // In a full implementation, we would need to track which upvalues are open
-                    // and close them when they go out of scope
+                    close_upvalues(frame->stack_base + a);
                     break;
                 }
                 case OpCode::TBC: {
@@ -1404,7 +1707,7 @@ void VM::run() {
                 case OpCode::EQ: {
                     int a = GETARG_A(i);
                     int b = GETARG_B(i);
-                    int k = GETARG_C(i);
+                    int k = GETARG_k(i);
                     LuaValue ra = *stack[frame->stack_base + a];
                     LuaValue rb = *stack[frame->stack_base + b];
                     
@@ -1416,7 +1719,7 @@ void VM::run() {
                 case OpCode::LT: {
                     int a = GETARG_A(i);
                     int b = GETARG_B(i);
-                    int k = GETARG_C(i);
+                    int k = GETARG_k(i);
                     LuaValue ra = *stack[frame->stack_base + a];
                     LuaValue rb = *stack[frame->stack_base + b];
                     
@@ -1428,7 +1731,7 @@ void VM::run() {
                 case OpCode::LE: {
                     int a = GETARG_A(i);
                     int b = GETARG_B(i);
-                    int k = GETARG_C(i);
+                    int k = GETARG_k(i);
                     LuaValue ra = *stack[frame->stack_base + a];
                     LuaValue rb = *stack[frame->stack_base + b];
                     
@@ -1440,7 +1743,7 @@ void VM::run() {
                 case OpCode::EQK: {
                     int a = GETARG_A(i);
                     int b = GETARG_B(i);
-                    int k = GETARG_C(i);
+                    int k = GETARG_k(i);
                     LuaValue ra = *stack[frame->stack_base + a];
                     LuaValue kb = func->getConstants()[b];
                     
@@ -1452,7 +1755,7 @@ void VM::run() {
                 case OpCode::EQI: {
                     int a = GETARG_A(i);
                     int sb = GETARG_sB(i);
-                    int k = GETARG_C(i);
+                    int k = GETARG_k(i);
                     LuaValue ra = *stack[frame->stack_base + a];
                     LuaValue ib(std::make_shared<LuaInteger>(sb), LuaType::NUMBER);
                     
@@ -1464,7 +1767,7 @@ void VM::run() {
                 case OpCode::LTI: {
                     int a = GETARG_A(i);
                     int sb = GETARG_sB(i);
-                    int k = GETARG_C(i);
+                    int k = GETARG_k(i);
                     LuaValue ra = *stack[frame->stack_base + a];
                     LuaValue ib(std::make_shared<LuaInteger>(sb), LuaType::NUMBER);
                     
@@ -1476,7 +1779,7 @@ void VM::run() {
                 case OpCode::LEI: {
                     int a = GETARG_A(i);
                     int sb = GETARG_sB(i);
-                    int k = GETARG_C(i);
+                    int k = GETARG_k(i);
                     LuaValue ra = *stack[frame->stack_base + a];
                     LuaValue ib(std::make_shared<LuaInteger>(sb), LuaType::NUMBER);
                     
@@ -1488,7 +1791,7 @@ void VM::run() {
                 case OpCode::GTI: {
                     int a = GETARG_A(i);
                     int sb = GETARG_sB(i);
-                    int k = GETARG_C(i);
+                    int k = GETARG_k(i);
                     LuaValue ra = *stack[frame->stack_base + a];
                     LuaValue ib(std::make_shared<LuaInteger>(sb), LuaType::NUMBER);
                     
@@ -1500,7 +1803,7 @@ void VM::run() {
                 case OpCode::GEI: {
                     int a = GETARG_A(i);
                     int sb = GETARG_sB(i);
-                    int k = GETARG_C(i);
+                    int k = GETARG_k(i);
                     LuaValue ra = *stack[frame->stack_base + a];
                     LuaValue ib(std::make_shared<LuaInteger>(sb), LuaType::NUMBER);
                     
@@ -1511,7 +1814,7 @@ void VM::run() {
                 }
                 case OpCode::TEST: {
                     int a = GETARG_A(i);
-                    int k = GETARG_C(i);
+                    int k = GETARG_k(i);
                     LuaValue ra = *stack[frame->stack_base + a];
                     
                     bool result = as_bool(ra);
@@ -1522,7 +1825,7 @@ void VM::run() {
                 case OpCode::TESTSET: {
                     int a = GETARG_A(i);
                     int b = GETARG_B(i);
-                    int k = GETARG_C(i);
+                    int k = GETARG_k(i);
                     LuaValue& rb = *stack[frame->stack_base + b];
                     
                     bool result = as_bool(rb);
@@ -1535,50 +1838,40 @@ void VM::run() {
                     break;
                 }
                 case OpCode::JMP: {
-                    int sJ = GETARG_sA(i);
-                    pc += sJ - 1;
+                    pc += GETARG_sJ(i);
                     break;
                 }
                 case OpCode::CALL: {
                     int a = GETARG_A(i);
                     int b = GETARG_B(i);
                     int c = GETARG_C(i);
-                    LuaValue& func_val = *stack[frame->stack_base + a];
 
                     int num_args = (b == 0) ? (top - (frame->stack_base + a + 1)) : (b - 1);
                     int num_results = (c == 0) ? -1 : (c - 1);
 
                     frame->pc = pc;
-
-                    vcall(*this, frame, func_val, frame->stack_base + a, num_args, num_results);
-                                
+                    precall(frame->stack_base + a, num_args, num_results);
                     break;
                 }
                 case OpCode::TAILCALL: {
                     int a = GETARG_A(i);
                     int b = GETARG_B(i);
-                    int c = GETARG_C(i);
-                    LuaValue& func_val = *stack[frame->stack_base + a];
-                    
-                    if (func_val.getType() == LuaType::FUNCTION) {
-                        if (auto closure_ptr = std::dynamic_pointer_cast<LuaClosure>(func_val.getObject())) {
-                            // For tail call, we replace the current frame instead of adding a new one
-                            frame->closure = closure_ptr;
-                            frame->pc = &closure_ptr->getFunction()->getBytecode()[0];
-                            frame->stack_base = frame->stack_base + a; // Adjust stack base
-                            break;
-                        }
-                        // native cfunction support for tail call
-                        if (auto cfunc_ptr = std::dynamic_pointer_cast<LuaNativeFunction>(func_val.getObject())) {
-                            int num_args = b > 0 ? b - 1 : 0;
-                            int base_reg = frame->stack_base + a + 1;
-                            int nret = cfunc_ptr->call(*this, base_reg, num_args);
-                            // For tail call, we return directly
-                            call_stack.pop_back();
-                            break;
-                        }
+                    int func_slot = frame->stack_base + a;
+                    int num_args = (b == 0) ? (top - (func_slot + 1)) : (b - 1);
+
+                    close_upvalues(frame->stack_base);
+
+                    // reuse the caller's slot: move the callee and its arguments down
+                    int dest = frame->stack_base - 1;
+                    int nresults = frame->nresults;
+                    for (int j = 0; j <= num_args; j++) {
+                        *stack[dest + j] = *stack[func_slot + j];
                     }
-                    throw std::runtime_error("TAILCALL: attempt to call a non-closure or native function (a " + func_val.typeName() + ") value");
+                    call_stack.pop_back();
+                    // a Lua callee takes over the popped frame's depth; a native
+                    // one has already left its results in the caller's slot
+                    precall(dest, num_args, nresults);
+                    break;
                 }
                 case OpCode::RETURN:
                 case OpCode::RETURN0:
@@ -1587,52 +1880,36 @@ void VM::run() {
                     int b = GETARG_B(i);
                     int n_results = (op == OpCode::RETURN0) ? 0 : (op == OpCode::RETURN1) ? 1 : (b > 0 ? b - 1 : top - (frame->stack_base + a));
 
-                    // Handle variable arguments for RETURN
-                    if (b == 0 && op == OpCode::RETURN) {
-                        n_results = top - (frame->stack_base + a);
-                    }
-                
                     close_upvalues(frame->stack_base);
-                
-                    // Call vreturn to handle return values
-                    vreturn(*this, frame, a, n_results);
-                
-                    // Pop the current frame
-                    call_stack.pop_back();
 
-                    // If call stack is not empty, update caller's top
-                    if (!call_stack.empty()) {
-                        CallInfo& caller_frame = call_stack.back();
-                        Instruction call_i = *(caller_frame.pc - 1);
-                        int result_reg = GETARG_A(call_i);
-                        top = caller_frame.stack_base + result_reg + n_results;
-                    } else {
-                        // Returning from top-level
-                        top = n_results;
-                    }
+                    int base = frame->stack_base;
+                    int nresults = frame->nresults;
+                    call_stack.pop_back();
+                    poscall(base - 1, base + a, n_results, nresults);
                     break;
                 }
                 case OpCode::FORLOOP: {
                     int a = GETARG_A(i);
                     int bx = GETARG_Bx(i);
-                    
-                    // R[A] += R[A+2]
-                    LuaValue step = *stack[frame->stack_base + a + 2];
-                    LuaValue index = *stack[frame->stack_base + a];
-                    
-                    if (index.getType() == LuaType::NUMBER && step.getType() == LuaType::NUMBER) {
-                        luaNumber idx = get_number_from_value(index);
-                        luaNumber stp = get_number_from_value(step);
-                        luaNumber new_idx = idx + stp;
-                        *stack[frame->stack_base + a] = LuaValue(std::make_shared<LuaNumber>(new_idx), LuaType::NUMBER);
-                        
-                        // Check if loop should continue
-                        LuaValue limit = *stack[frame->stack_base + a + 1];
-                        if (limit.getType() == LuaType::NUMBER) {
-                            luaNumber lim = get_number_from_value(limit);
-                            if ((stp > 0 && new_idx <= lim) || (stp < 0 && new_idx >= lim)) {
-                                pc -= bx; // Jump back
-                            }
+                    LuaValue& ctl = *stack[frame->stack_base + a];
+                    if (checkluaint(ctl)) { // integer loop: R[A+1] holds the remaining iterations
+                        auto count = std::static_pointer_cast<LuaInteger>(stack[frame->stack_base + a + 1]->getObject())->getValue();
+                        if (count > 0) {
+                            luaInt step = std::static_pointer_cast<LuaInteger>(stack[frame->stack_base + a + 2]->getObject())->getValue();
+                            luaInt idx = static_cast<luaInt>(static_cast<uint64_t>(std::static_pointer_cast<LuaInteger>(ctl.getObject())->getValue()) + static_cast<uint64_t>(step));
+                            *stack[frame->stack_base + a + 1] = LuaValue(std::make_shared<LuaInteger>(count - 1), LuaType::NUMBER);
+                            ctl = LuaValue(std::make_shared<LuaInteger>(idx), LuaType::NUMBER);
+                            *stack[frame->stack_base + a + 3] = ctl;
+                            pc -= bx;
+                        }
+                    } else {
+                        luaNumber step = get_number_from_value(*stack[frame->stack_base + a + 2]);
+                        luaNumber limit = get_number_from_value(*stack[frame->stack_base + a + 1]);
+                        luaNumber idx = get_number_from_value(ctl) + step;
+                        if (step > 0 ? idx <= limit : limit <= idx) {
+                            ctl = LuaValue(std::make_shared<LuaNumber>(idx), LuaType::NUMBER);
+                            *stack[frame->stack_base + a + 3] = ctl;
+                            pc -= bx;
                         }
                     }
                     break;
@@ -1640,42 +1917,15 @@ void VM::run() {
                 case OpCode::FORPREP: {
                     int a = GETARG_A(i);
                     int bx = GETARG_Bx(i);
-                    
-                    // Check values and prepare counters
-                    LuaValue init = *stack[frame->stack_base + a];
-                    LuaValue limit = *stack[frame->stack_base + a + 1];
-                    LuaValue step = *stack[frame->stack_base + a + 2];
-                    
-                    if (init.getType() == LuaType::NUMBER && 
-                        limit.getType() == LuaType::NUMBER && 
-                        step.getType() == LuaType::NUMBER) {
-                        
-                        luaNumber init_val = get_number_from_value(init);
-                        luaNumber limit_val = get_number_from_value(limit);
-                        luaNumber step_val = get_number_from_value(step);
-                        
-                        // Check if loop should run
-                        bool should_run = false;
-                        if (step_val > 0) {
-                            should_run = init_val <= limit_val;
-                        } else if (step_val < 0) {
-                            should_run = init_val >= limit_val;
-                        } else {
-                            should_run = false; // step == 0, infinite loop
-                        }
-                        
-                        if (!should_run) {
-                            pc += bx + 1; // Skip the loop
-                        }
-                    } else {
-                        pc += bx + 1; // Skip the loop if values are not numbers
+                    if (!forprep(frame->stack_base + a)) {
+                        pc += bx + 1; // skip the loop
                     }
                     break;
                 }
                 case OpCode::CLOSURE: {
                     int a = GETARG_A(i);
                     int bx = GETARG_Bx(i);
-                    LuaValue proto_val = func->getProtos()[bx];
+                    const LuaValue& proto_val = func->getProto(bx);
                     if (proto_val.getType() == LuaType::FUNCTION) {
                         auto proto = std::dynamic_pointer_cast<LuaFunction>(proto_val.getObject());
                         std::shared_ptr<LuaClosure> new_closure = std::make_shared<LuaClosure>(proto);
@@ -1691,7 +1941,7 @@ void VM::run() {
                                 // This upvalue is in the current function's stack frame.
                                 uv = find_upvalue(frame->stack_base + desc.idx);
                                 if (uv == nullptr) {
-                                    uv = std::make_shared<UpValue>(this, stack[frame->stack_base + desc.idx]);
+                                    uv = std::make_shared<UpValue>(this, stack[frame->stack_base + desc.idx], frame->stack_base + desc.idx);
                                     open_upvalues.push_front(uv);
                                     uv->setIterator(open_upvalues.begin());
                                 }
@@ -1715,7 +1965,7 @@ void VM::run() {
                     if (b < 0 || b >= static_cast<int>(upvals.size())) {
                         throw std::runtime_error("GETUPVAL: invalid upvalue index");
                     }
-                    stack[frame->stack_base + a] = upvals[b]->getLocation().lock();
+                    *stack[frame->stack_base + a] = upvals[b]->getValue();
                     top = frame->stack_base + a + 1;
                     break;
                 }
@@ -1733,7 +1983,10 @@ void VM::run() {
                     int a = GETARG_A(i);
                     int b = GETARG_B(i);
                     int c = GETARG_C(i);
-                    const LuaValue& key = mm_key_from_C(c);
+                    if (c >= TM_N) {
+                        throw std::runtime_error("MMBIN: invalid metamethod event");
+                    }
+                    TMS key = static_cast<TMS>(c);
                                 
                     LuaValue va = *stack[frame->stack_base + a];
                     LuaValue vb = *stack[frame->stack_base + b];
@@ -1750,7 +2003,10 @@ void VM::run() {
                     int a = GETARG_A(i);
                     int sb = GETARG_sB(i);
                     int c = GETARG_C(i);
-                    const LuaValue& key = mm_key_from_C(c);
+                    if (c >= TM_N) {
+                        throw std::runtime_error("MMBIN: invalid metamethod event");
+                    }
+                    TMS key = static_cast<TMS>(c);
                 
                     LuaValue va = *stack[frame->stack_base + a];
                     LuaValue vb(std::make_shared<LuaInteger>(sb), LuaType::NUMBER);
@@ -1767,7 +2023,10 @@ void VM::run() {
                     int a = GETARG_A(i);
                     int b = GETARG_B(i);
                     int c = GETARG_C(i);
-                    const LuaValue& key = mm_key_from_C(c);
+                    if (c >= TM_N) {
+                        throw std::runtime_error("MMBIN: invalid metamethod event");
+                    }
+                    TMS key = static_cast<TMS>(c);
                 
                     LuaValue va = *stack[frame->stack_base + a];
                     LuaValue vb = func->getConstants()[b];
@@ -1780,76 +2039,69 @@ void VM::run() {
                     break;
                 }
                 case OpCode::TFORPREP: {
-                    int a = GETARG_A(i);
                     int bx = GETARG_Bx(i);
-                    // Create upvalue for R[A + 3]
-                    // This is a simplified implementation
-                    // In a full implementation, we would create an upvalue for the iterator state
                     pc += bx;
                     break;
                 }
                 case OpCode::TFORCALL: {
                     int a = GETARG_A(i);
                     int c = GETARG_C(i);
-                    // R[A+4], ... ,R[A+3+C] := R[A](R[A+1], R[A+2])
-                    LuaValue iterator = *stack[frame->stack_base + a];
-                    LuaValue state = *stack[frame->stack_base + a + 1];
-                    LuaValue control = *stack[frame->stack_base + a + 2];
-                    
-                    if (iterator.getType() == LuaType::FUNCTION) {
-                        // Call the iterator function
-                        // This is a simplified implementation
-                        // In a full implementation, we would call the iterator and store results
-                        for (int j = 0; j < c; j++) {
-                            *stack[frame->stack_base + a + 4 + j] = LuaValue(); // nil for now
-                        }
+                    // R[A+4], ... ,R[A+3+C] := R[A](R[A+1], R[A+2]), called on a copy
+                    int cb = frame->stack_base + a + 4;
+                    for (int j = 0; j < 3; j++) {
+                        *stack[cb + j] = *stack[frame->stack_base + a + j];
                     }
+                    frame->pc = pc;
+                    top = cb + 3;
+                    // a Lua iterator runs as a frame of this loop, so it may yield
+                    precall(cb, 2, c);
                     break;
                 }
                 case OpCode::TFORLOOP: {
                     int a = GETARG_A(i);
                     int bx = GETARG_Bx(i);
-                    // if R[A+2] ~= nil then { R[A]=R[A+2]; pc -= Bx }
-                    LuaValue& control = *stack[frame->stack_base + a + 2];
+                    // if R[A+4] ~= nil then { R[A+2]=R[A+4]; pc -= Bx }
+                    const LuaValue& control = *stack[frame->stack_base + a + 4];
                     if (control.getType() != LuaType::NIL) {
-                        *stack[frame->stack_base + a] = control;
+                        *stack[frame->stack_base + a + 2] = control;
                         pc -= bx;
                     }
                     break;
                 }
                 case OpCode::SETLIST: {
                     int a = GETARG_A(i);
-                    int b = GETARG_B(i);
-                    int c = GETARG_C(i);
-                    // R[A][C+i] := R[A+i], 1 <= i <= B
-                    LuaValue table = *stack[frame->stack_base + a];
-                    if (table.getType() == LuaType::TABLE) {
-                        if (auto tbl = std::dynamic_pointer_cast<LuaTable>(table.getObject())) {
-                            for (int j = 1; j <= b; j++) {
-                                LuaValue value = *stack[frame->stack_base + a + j];
-                                tbl->set(c + j, value);
-                            }
-                        }
+                    int n = GETARG_B(i);
+                    int last = GETARG_C(i);
+                    // R[A][C+i] := R[A+i], 1 <= i <= B; B == 0 stores up to top
+                    if (n == 0) {
+                        n = top - (frame->stack_base + a) - 1;
+                    }
+                    if (GETARG_k(i)) {
+                        last += GETARG_Ax(*pc++) * (MAXARG_C + 1);
+                    }
+                    auto tbl = std::static_pointer_cast<LuaTable>(stack[frame->stack_base + a]->getObject());
+                    for (int j = 1; j <= n; j++) {
+                        tbl->set(last + j, *stack[frame->stack_base + a + j]);
                     }
+                    top = frame->stack_base + a + 1;
                     break;
                 }
                 case OpCode::VARARG: {
                     int a = GETARG_A(i);
-                    int c = GETARG_C(i);
-                    // R[A], R[A+1], ..., R[A+C-2] = vararg
-                    // Get vararg values from the function's vararg list
-                    std::shared_ptr<LuaFunction> func = frame->closure->getFunction();
-                    const auto& varargs = func->getVarargs();
-                    int num_vars = std::min(c - 1, static_cast<int>(varargs.size()));
-                    
-                    for (int j = 0; j < num_vars; j++) {
-                        *stack[frame->stack_base + a + j] = varargs[j];
+                    int n = GETARG_C(i) - 1;
+                    // R[A], R[A+1], ..., R[A+C-2] = vararg; C == 0 copies all of them
+                    const auto& varargs = frame->varargs;
+                    int nvar = static_cast<int>(varargs.size());
+                    if (n < 0) {
+                        n = nvar;
                     }
-                    // Fill remaining with nil if needed
-                    for (int j = num_vars; j < c - 1; j++) {
-                        *stack[frame->stack_base + a + j] = LuaValue(); // nil
+                    if (!ensure_stack(frame->stack_base + a + n + 1)) {
+                        throw LuaError("stack overflow");
                     }
-                    top = frame->stack_base + a + c - 1;
+                    for (int j = 0; j < n; j++) {
+                        *stack[frame->stack_base + a + j] = j < nvar ? varargs[j] : LuaValue();
+                    }
+                    top = frame->stack_base + a + n;
                     break;
                 }
                 case OpCode::VARARGPREP: {
@@ -1865,6 +2117,74 @@ void VM::run() {
                     // This is handled by the previous opcode
                     break;
                 }
+                case OpCode::ADDINT:
+                case OpCode::SUBINT:
+                case OpCode::MULINT: {
+                    int a = GETARG_A(i);
+                    unsigned long long x = raw_integer(*stack[frame->stack_base + GETARG_B(i)]);
+                    unsigned long long y = raw_integer(*stack[frame->stack_base + GETARG_C(i)]);
+                    unsigned long long r = op == OpCode::ADDINT ? x + y : op == OpCode::SUBINT ? x - y : x * y;
+                    *stack[frame->stack_base + a] = make_integer(r);
+                    top = frame->stack_base + a + 1;
+                    break;
+                }
+                case OpCode::ADDIINT: {
+                    int a = GETARG_A(i);
+                    unsigned long long x = raw_integer(*stack[frame->stack_base + GETARG_B(i)]);
+                    *stack[frame->stack_base + a] = make_integer(x + static_cast<unsigned long long>(GETARG_sC(i)));
+                    top = frame->stack_base + a + 1;
+                    break;
+                }
+                case OpCode::ADDFLT:
+                case OpCode::SUBFLT:
+                case OpCode::MULFLT:
+                case OpCode::DIVFLT: {
+                    int a = GETARG_A(i);
+                    luaNumber x = raw_float(*stack[frame->stack_base + GETARG_B(i)]);
+                    luaNumber y = raw_float(*stack[frame->stack_base + GETARG_C(i)]);
+                    luaNumber r = op == OpCode::ADDFLT ? x + y : op == OpCode::SUBFLT ? x - y :
+                                  op == OpCode::MULFLT ? x * y : x / y;
+                    *stack[frame->stack_base + a] = LuaValue(std::make_shared<LuaNumber>(r), LuaType::NUMBER);
+                    top = frame->stack_base + a + 1;
+                    break;
+                }
+                case OpCode::LTINT:
+                case OpCode::LEINT: {
+                    luaInt x = raw_integer(*stack[frame->stack_base + GETARG_A(i)]);
+                    luaInt y = raw_integer(*stack[frame->stack_base + GETARG_B(i)]);
+                    bool result = op == OpCode::LTINT ? x < y : x <= y;
+                    if (result != static_cast<bool>(GETARG_k(i))) pc++;
+                    break;
+                }
+                case OpCode::GETFIELDT: {
+                    int a = GETARG_A(i);
+                    LuaValue& t = *stack[frame->stack_base + GETARG_B(i)];
+                    const LuaValue& k = func->getConstants()[GETARG_C(i)];
+                    LuaValue res = std::static_pointer_cast<LuaTable>(t.getObject())->get(k);
+                    if (res.getType() == LuaType::NIL) {
+                        res = index_tm(*this, t, k);
+                    }
+                    *stack[frame->stack_base + a] = res;
+                    top = frame->stack_base + a + 1;
+                    break;
+                }
+                case OpCode::SETFIELDT: {
+                    LuaValue& t = *stack[frame->stack_base + GETARG_A(i)];
+                    const LuaValue& k = func->getConstants()[GETARG_B(i)];
+                    int c = GETARG_C(i);
+                    const LuaValue& v = GETARG_k(i) ? func->getConstants()[c] : *stack[frame->stack_base + c];
+                    std::static_pointer_cast<LuaTable>(t.getObject())->set(k, v);
+                    break;
+                }
+                case OpCode::CHECKTYPE: {
+                    const LuaValue& v = *stack[frame->stack_base + GETARG_A(i)];
+                    CheckTag tag = static_cast<CheckTag>(GETARG_B(i));
+                    if (!has_check_tag(v, tag)) {
+                        std::string got = v.getType() == LuaType::NUMBER ? (checkluaint(v) ? "integer" : "float") : v.typeName();
+                        throw LuaError("type error: " + check_tag_name(tag) + " expected, got " + got);
+                    }
+                    break;
+                }
                 default: {
                     std::stringstream ss;
                     ss << "VM Detected Illegal opcode in bytecode. op: 0x"
@@ -1874,7 +2194,7 @@ void VM::run() {
             }
             // If we are here, it means we have returned from a function or called one.
             // so break from the inner loop to get the new frame.
-            if (op == OpCode::CALL || op == OpCode::TAILCALL || op == OpCode::RETURN || op == OpCode::RETURN0 || op == OpCode::RETURN1) {
+            if (op == OpCode::CALL || op == OpCode::TAILCALL || op == OpCode::TFORCALL || op == OpCode::RETURN || op == OpCode::RETURN0 || op == OpCode::RETURN1) {
                 break;
             }
         }